@@ -0,0 +1,556 @@
+//Copyright (c) 2014-2020 Assaf Stoler <assaf.stoler@gmail.com>
+//All rights reserved.
+//see LICENSE for more info
+
+// rdb_bench: throughput of the basic pool operations, per key type, pool
+// size and index count. Results are printed as JSON, one entry per
+// operation, best of -r runs.
+//
+//   rdb_bench [-k u32,u64,str,pstr,cf,fifo,lifo,lifo_lf] [-n 1000,100000]
+//             [-i indexes] [-r runs]
+//
+// With -T, threads share one pool instead, see bench_threads():
+//
+//   rdb_bench -T 1,2,4,8 [-m lock,threadsafe] [-D uniform,zipf] [-z theta]
+//             [-w write %] [-d ms] [-n records] [-i indexes]
+//
+// Records come from one array and are never freed by rDB, so the numbers
+// are those of the index code, not of malloc.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <time.h>
+#include <math.h>
+#include <pthread.h>
+#include "rdb.h"
+
+#define BENCH_MAX_IDX   8
+
+// Key area, following the pointer packs of each record. Index 0 uses the
+// key of the type under test, any further index j a uint64_t of its own
+typedef struct bench_key_s {
+    uint64_t    u64;            // RDB_KUINT64 / RDB_KCF, low half RDB_KUINT32
+    char        *pstr;          // RDB_KPSTR, points at str
+    char        str[24];        // RDB_KSTR
+    uint64_t    alt[BENCH_MAX_IDX - 1];
+} bench_key_t;
+
+typedef struct bench_type_s {
+    const char  *name;
+    uint32_t    flags;          // of index 0
+    size_t      offset;         // of its key in bench_key_t
+} bench_type_t;
+
+static const bench_type_t bench_types[] = {
+    { "u32",     RDB_KUINT32 | RDB_KASC | RDB_BTREE,
+                                        offsetof (bench_key_t, u64) },
+    { "u64",     RDB_KUINT64 | RDB_KASC | RDB_BTREE,
+                                        offsetof (bench_key_t, u64) },
+    { "str",     RDB_KSTR | RDB_KASC | RDB_BTREE,
+                                        offsetof (bench_key_t, str) },
+    { "pstr",    RDB_KPSTR | RDB_KASC | RDB_BTREE,
+                                        offsetof (bench_key_t, pstr) },
+    { "cf",      RDB_KCF | RDB_KASC | RDB_BTREE,
+                                        offsetof (bench_key_t, u64) },
+    { "fifo",    RDB_KFIFO | RDB_NO_IDX | RDB_BTREE,    0 },
+    { "lifo",    RDB_KLIFO | RDB_NO_IDX | RDB_BTREE,    0 },
+    { "lifo_lf", RDB_KLIFO | RDB_NO_IDX | RDB_BTREE | RDB_LOCKFREE, 0 },
+    { NULL, 0, 0 }
+};
+
+static char     *recs;          // n records of stride bytes
+static size_t   stride;
+static int      indexes;
+static int      runs = 1;
+static int      first = 1;
+
+#define REC(i)  ((void *) (recs + (size_t) (i) * stride))
+#define KEY(i)  ((bench_key_t *) (recs + (size_t) (i) * stride + \
+                                        indexes * sizeof (rdb_bpp_t)))
+
+static uint64_t now_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// A bijection on 64 (and, masked, 32) bits: keys arrive in no order, and
+// odd inputs never collide with even ones, which gives the misses
+static uint64_t mix (uint64_t v)
+{
+    v *= 0x9e3779b97f4a7c15ull;
+    return v ^ (v >> 32);
+}
+
+static uint64_t mix32 (uint64_t v)
+{
+    return (uint32_t) (v * 0x9e3779b9u);
+}
+
+static int cmp_u64 (void *old, void *new)
+{
+    uint64_t a = *(uint64_t *) old, b = *(uint64_t *) new;
+
+    return (b > a) - (b < a);
+}
+
+static int count_cb (void *data, void *arg)
+{
+    (*(long *) arg)++;
+    return RDB_CB_OK;
+}
+
+static int delete_cb (void *data, void *arg)
+{
+    return RDB_CB_DELETE_NODE;
+}
+
+// records stay in our array
+static void keep_cb (void *data, void *arg)
+{
+}
+
+// Fill the key of record i, odd i keys are the ones never inserted
+static void set_key (bench_key_t *k, const bench_type_t *t, long i)
+{
+    int j;
+
+    k->u64 = (t->flags & RDB_KUINT32) ? mix32 (i) : mix (i);
+    snprintf (k->str, sizeof (k->str), "%016" PRIx64, mix (i));
+    k->pstr = k->str;
+    for (j = 0; j < indexes - 1; j++)
+        k->alt[j] = mix (i + ((uint64_t) (j + 1) << 40));
+}
+
+// the key rdb_get() and friends take for record i
+static void *lookup (bench_key_t *k, const bench_type_t *t)
+{
+    if (t->flags & (RDB_KSTR | RDB_KPSTR))
+        return k->str;
+    return &k->u64;
+}
+
+static void report (const bench_type_t *t, long n, const char *op, long ops,
+        uint64_t ns)
+{
+    printf ("%s  {\"key\": \"%s\", \"records\": %ld, \"indexes\": %d, "
+            "\"op\": \"%s\", \"ops\": %ld, \"ns_per_op\": %.1f, "
+            "\"ops_per_sec\": %.0f}", first ? "" : ",\n", t->name, n,
+            t->flags & RDB_NOKEYS ? 1 : indexes, op, ops,
+            ops ? (double) ns / ops : 0.0, ns ? ops * 1e9 / ns : 0.0);
+    first = 0;
+}
+
+static rdb_pool_t *bench_pool (const bench_type_t *t, char *name)
+{
+    rdb_pool_t  *pool;
+    int         j;
+
+    pool = rdb_register_um_pool (name, indexes, t->offset, t->flags,
+                            (t->flags & RDB_KCF) ? cmp_u64 : NULL);
+    if (pool == NULL)
+        rdb_fatal ("rdb_bench: can not register pool\n");
+    for (j = 1; j < indexes; j++)
+        if (rdb_register_um_idx (pool, j,
+                    offsetof (bench_key_t, alt) + (j - 1) * sizeof (uint64_t),
+                    RDB_KUINT64 | RDB_KASC | RDB_BTREE, NULL) == -1)
+            rdb_fatal ("rdb_bench: can not register index\n");
+    return pool;
+}
+
+#define TIME(best, body) \
+    do { \
+        uint64_t _t0 = now_ns (), _d; \
+        body; \
+        _d = now_ns () - _t0; \
+        if (best == 0 || _d < best) best = _d; \
+    } while (0)
+
+// insert, get hit / miss, iterate, move, delete and iterate with delete
+// on a keyed pool of n records
+static void bench_keyed (const bench_type_t *t, long n)
+{
+    rdb_pool_t  *pool, *other;
+    uint64_t    ns[8] = { 0 };
+    bench_key_t miss;
+    long        i, cnt;
+    int         r;
+
+    pool = bench_pool (t, "bench");
+    other = bench_pool (t, "bench_other");
+    for (i = 0; i < n; i++)
+        set_key (KEY (i), t, 2 * i);
+
+    for (r = 0; r < runs; r++) {
+        TIME (ns[0], for (i = 0; i < n; i++)
+            if (rdb_insert (pool, REC (i)) != indexes)
+                rdb_fatal ("rdb_bench: insert failed\n"));
+        TIME (ns[1], for (i = 0; i < n; i++)
+            if (rdb_get (pool, 0, lookup (KEY (i), t)) == NULL)
+                rdb_fatal ("rdb_bench: get failed\n"));
+        set_key (&miss, t, 1);
+        TIME (ns[2], for (i = 0; i < n; i++) {
+            miss.u64 = (t->flags & RDB_KUINT32) ? mix32 (2 * i + 1) :
+                                                        mix (2 * i + 1);
+            if (t->flags & (RDB_KSTR | RDB_KPSTR))
+                snprintf (miss.str, sizeof (miss.str), "%016" PRIx64,
+                                                        mix (2 * i + 1));
+            if (rdb_get (pool, 0, lookup (&miss, t)) != NULL)
+                rdb_fatal ("rdb_bench: miss found\n");
+        });
+        cnt = 0;
+        TIME (ns[3], rdb_iterate (pool, 0, count_cb, &cnt, NULL, NULL));
+        if (cnt != n)
+            rdb_fatal ("rdb_bench: iterate count\n");
+        TIME (ns[4], for (i = 0; i < n; i++)
+            if (rdb_move (other, pool, 0, lookup (KEY (i), t)) == NULL)
+                rdb_fatal ("rdb_bench: move failed\n"));
+        // every other record by key, then the rest from rdb_iterate
+        TIME (ns[5], for (i = 0; i < n; i += 2)
+            if (rdb_delete (other, 0, lookup (KEY (i), t)) == NULL)
+                rdb_fatal ("rdb_bench: delete failed\n"));
+        TIME (ns[6], rdb_iterate (other, 0, delete_cb, NULL, keep_cb, NULL));
+    }
+    report (t, n, "insert", n, ns[0]);
+    report (t, n, "get_hit", n, ns[1]);
+    report (t, n, "get_miss", n, ns[2]);
+    report (t, n, "iterate", n, ns[3]);
+    report (t, n, "move", n, ns[4]);
+    report (t, n, "delete", (n + 1) / 2, ns[5]);
+    report (t, n, "iterate_delete", n / 2, ns[6]);
+    rdb_drop_pool (other);
+    rdb_drop_pool (pool);
+}
+
+// push n records, then pop them all
+static void bench_list (const bench_type_t *t, long n)
+{
+    rdb_pool_t  *pool;
+    uint64_t    ns[2] = { 0 };
+    long        i;
+    int         r, lf = t->flags & RDB_LOCKFREE;
+
+    pool = rdb_register_um_pool ("bench", 1, 0, t->flags, NULL);
+    if (pool == NULL)
+        rdb_fatal ("rdb_bench: can not register pool\n");
+    for (r = 0; r < runs; r++) {
+        TIME (ns[0], for (i = 0; i < n; i++)
+            if ((lf ? rdb_lifo_push (pool, REC (i)) :
+                                        rdb_insert (pool, REC (i))) != 1)
+                rdb_fatal ("rdb_bench: push failed\n"));
+        TIME (ns[1], for (i = 0; i < n; i++)
+            if ((lf ? rdb_lifo_pop (pool) : rdb_delete (pool, 0, NULL))
+                                                                    == NULL)
+                rdb_fatal ("rdb_bench: pop failed\n"));
+    }
+    report (t, n, "push", n, ns[0]);
+    report (t, n, "pop", n, ns[1]);
+    rdb_drop_pool (pool);
+}
+
+/* Contention: threads run a read / write mix against one shared u64 pool
+ * for -d ms per thread count. A read is an rdb_get(); a write (-w percent
+ * of operations) deletes or reinserts one of the thread's own records, so
+ * no two threads ever link the same record. Keys are drawn uniformly or
+ * from a Zipf distribution of skew -z, hot records scattered over the
+ * tree. Each locking mode is a row in bench_modes.
+ */
+typedef struct bench_mode_s {
+    const char  *name;
+    uint32_t    flags;          // added to the pool flags
+    int         caller_lock;    // wrap every operation in rdb_lock()
+} bench_mode_t;
+
+static const bench_mode_t bench_modes[] = {
+    { "lock",       0,                      1 },
+    { "threadsafe", RDB_POOL_THREADSAFE,    0 },
+    { NULL, 0, 0 }
+};
+
+typedef struct bench_thread_s {
+    pthread_t   tid;
+    int         id;
+    uint64_t    rng;
+    uint64_t    ops;
+} __attribute__ ((aligned (64))) bench_thread_t;
+
+static rdb_pool_t           *mt_pool;
+static const bench_mode_t   *mt_mode;
+static long                 mt_n;
+static int                  mt_threads;
+static int                  mt_write = 10;
+static int                  mt_ms = 500;
+static int                  mt_zipf;
+static double               mt_theta = 0.99;
+static double               mt_zetan, mt_eta, mt_alpha;
+static char                 *mt_linked;     // per record, owner writes
+static int                  mt_stop;
+static pthread_barrier_t    mt_start;
+
+static uint64_t rnd (bench_thread_t *th)
+{
+    th->rng ^= th->rng >> 12;
+    th->rng ^= th->rng << 25;
+    th->rng ^= th->rng >> 27;
+    return th->rng * 0x2545f4914f6cdd1dull;
+}
+
+// Zipf constants for mt_n items (Gray et al., as used by YCSB)
+static void zipf_init (void)
+{
+    double  zeta2 = 1 + pow (0.5, mt_theta);
+    long    i;
+
+    mt_zetan = 0;
+    for (i = 1; i <= mt_n; i++)
+        mt_zetan += 1 / pow (i, mt_theta);
+    mt_alpha = 1 / (1 - mt_theta);
+    mt_eta = (1 - pow (2.0 / mt_n, 1 - mt_theta)) / (1 - zeta2 / mt_zetan);
+}
+
+// a record, rank 0 the hottest under Zipf
+static long pick (bench_thread_t *th)
+{
+    double  u, uz;
+    long    i;
+
+    if (!mt_zipf)
+        return rnd (th) % mt_n;
+    u = (rnd (th) >> 11) * 0x1.0p-53;
+    uz = u * mt_zetan;
+    if (uz < 1)
+        return 0;
+    if (uz < 1 + pow (0.5, mt_theta))
+        return 1;
+    i = mt_n * pow (mt_eta * u - mt_eta + 1, mt_alpha);
+    return i < mt_n ? i : mt_n - 1;
+}
+
+static void *mt_worker (void *arg)
+{
+    bench_thread_t  *th = arg;
+    uint64_t        key;
+    long            i;
+    int             write;
+
+    pthread_barrier_wait (&mt_start);
+    while (!__atomic_load_n (&mt_stop, __ATOMIC_RELAXED)) {
+        i = pick (th);
+        write = rnd (th) % 100 < mt_write;
+        if (write) {
+            // the nearest record this thread owns
+            i = i - i % mt_threads + th->id;
+            if (i >= mt_n)
+                i -= mt_threads;
+        }
+        key = KEY (i)->u64;
+        if (mt_mode->caller_lock)
+            rdb_lock (mt_pool, __FUNCTION__);
+        if (!write)
+            rdb_get (mt_pool, 0, &key);
+        else if (mt_linked[i])
+            rdb_delete (mt_pool, 0, &key);
+        else
+            rdb_insert (mt_pool, REC (i));
+        if (mt_mode->caller_lock)
+            rdb_unlock (mt_pool, __FUNCTION__);
+        if (write)
+            mt_linked[i] ^= 1;
+        th->ops++;
+    }
+    return NULL;
+}
+
+// one run of mt_threads threads, reported with its speedup over base
+static double mt_run (double base)
+{
+    bench_thread_t  *th;
+    uint64_t        ops = 0, min = UINT64_MAX, max = 0, t0, ns;
+    double          sq = 0, rate;
+    int             i;
+
+    th = calloc (mt_threads, sizeof (bench_thread_t));
+    if (th == NULL)
+        rdb_fatal ("rdb_bench: out of memory\n");
+    pthread_barrier_init (&mt_start, NULL, mt_threads + 1);
+    __atomic_store_n (&mt_stop, 0, __ATOMIC_RELAXED);
+    for (i = 0; i < mt_threads; i++) {
+        th[i].id = i;
+        th[i].rng = mix (i + 1);
+        pthread_create (&th[i].tid, NULL, mt_worker, &th[i]);
+    }
+    pthread_barrier_wait (&mt_start);
+    t0 = now_ns ();
+    usleep (mt_ms * 1000);
+    __atomic_store_n (&mt_stop, 1, __ATOMIC_RELAXED);
+    for (i = 0; i < mt_threads; i++)
+        pthread_join (th[i].tid, NULL);
+    ns = now_ns () - t0;
+    pthread_barrier_destroy (&mt_start);
+
+    for (i = 0; i < mt_threads; i++) {
+        ops += th[i].ops;
+        sq += (double) th[i].ops * th[i].ops;
+        if (th[i].ops < min)
+            min = th[i].ops;
+        if (th[i].ops > max)
+            max = th[i].ops;
+    }
+    rate = ops * 1e9 / ns;
+    // fairness is Jain's index: 1 when all threads got as much done
+    printf ("%s  {\"mode\": \"%s\", \"dist\": \"%s\", \"theta\": %.2f, "
+            "\"records\": %ld, \"indexes\": %d, \"write_pct\": %d, "
+            "\"threads\": %d, \"ops\": %" PRIu64 ", \"ops_per_sec\": %.0f, "
+            "\"ns_per_op\": %.1f, \"speedup\": %.2f, "
+            "\"thread_ops_min\": %" PRIu64 ", \"thread_ops_max\": %" PRIu64
+            ", \"fairness\": %.3f}", first ? "" : ",\n", mt_mode->name,
+            mt_zipf ? "zipf" : "uniform", mt_zipf ? mt_theta : 0.0, mt_n,
+            indexes, mt_write, mt_threads, ops, rate,
+            ops ? (double) ns * mt_threads / ops : 0.0,
+            base ? rate / base : 1.0, min, max,
+            sq ? (double) ops * ops / (mt_threads * sq) : 0.0);
+    fflush (stdout);
+    first = 0;
+    free (th);
+    return rate;
+}
+
+// Does the comma separated list have name in it
+static int listed (const char *list, const char *name)
+{
+    size_t      n = strlen (name);
+    const char  *s;
+
+    for (s = list; (s = strstr (s, name)) != NULL; s += n)
+        if ((s == list || s[-1] == ',') && (s[n] == ',' || !s[n]))
+            return 1;
+    return 0;
+}
+
+// every mode and distribution listed, at each thread count, on n records
+static void bench_threads (char *threads, char *modes, char *dists, long n)
+{
+    bench_type_t    t = bench_types[1];
+    double          base;
+    char            *s, *end;
+    long            i;
+    int             d;
+
+    mt_n = n;
+    mt_linked = malloc (n);
+    if (mt_linked == NULL)
+        rdb_fatal ("rdb_bench: out of memory\n");
+    for (i = 0; i < n; i++)
+        set_key (KEY (i), &t, 2 * i);
+    for (mt_mode = bench_modes; mt_mode->name; mt_mode++) {
+        if (!listed (modes, mt_mode->name))
+            continue;
+        for (d = 0; d < 2; d++) {
+            if (!listed (dists, d ? "zipf" : "uniform"))
+                continue;
+            if ((mt_zipf = d))
+                zipf_init ();
+            t.flags = bench_types[1].flags | mt_mode->flags;
+            mt_pool = bench_pool (&t, "bench_mt");
+            for (i = 0; i < n; i++)
+                if (rdb_insert (mt_pool, REC (i)) != indexes)
+                    rdb_fatal ("rdb_bench: insert failed\n");
+            memset (mt_linked, 1, n);
+            base = 0;
+            for (s = threads; *s; s = *end ? end + 1 : end) {
+                mt_threads = strtol (s, &end, 10);
+                if (mt_threads < 1 || mt_threads > n)
+                    continue;
+                if (base == 0)
+                    base = mt_run (0);
+                else
+                    mt_run (base);
+            }
+            rdb_iterate (mt_pool, 0, delete_cb, NULL, keep_cb, NULL);
+            rdb_drop_pool (mt_pool);
+        }
+    }
+    free (mt_linked);
+}
+
+static void usage (void)
+{
+    fprintf (stderr, "usage: rdb_bench [-k u32,u64,str,pstr,cf,fifo,lifo,"
+            "lifo_lf] [-n records,...] [-i indexes (1-%d)] [-r runs]\n"
+            "       rdb_bench -T threads,... [-m lock,threadsafe] "
+            "[-D uniform,zipf] [-z theta]\n"
+            "                 [-w write %%] [-d ms] [-n records,...] "
+            "[-i indexes]\n", BENCH_MAX_IDX);
+    exit (1);
+}
+
+int main (int argc, char *argv[])
+{
+    const bench_type_t  *t;
+    char    *keys = "u32,u64,str,pstr,cf,fifo,lifo,lifo_lf";
+    char    *sizes = "1000,100000", *s, *end;
+    char    *threads = NULL, *modes = "lock,threadsafe";
+    char    *dists = "uniform,zipf";
+    long    n, max = 0;
+    int     opt;
+
+    indexes = 1;
+    while ((opt = getopt (argc, argv, "k:n:i:r:T:m:D:z:w:d:")) != -1) {
+        switch (opt) {
+            case 'k': keys = optarg; break;
+            case 'n': sizes = optarg; break;
+            case 'i': indexes = atoi (optarg); break;
+            case 'r': runs = atoi (optarg); break;
+            case 'T': threads = optarg; break;
+            case 'm': modes = optarg; break;
+            case 'D': dists = optarg; break;
+            case 'z': mt_theta = atof (optarg); break;
+            case 'w': mt_write = atoi (optarg); break;
+            case 'd': mt_ms = atoi (optarg); break;
+            default: usage ();
+        }
+    }
+    if (indexes < 1 || indexes > BENCH_MAX_IDX || runs < 1 || 
+            mt_theta <= 0 || mt_theta >= 1 || mt_write < 0 || 
+            mt_write > 100 || mt_ms < 1)
+        usage ();
+    for (s = sizes; *s; s = *end ? end + 1 : end)
+        if ((n = strtol (s, &end, 10)) > max)
+            max = n;
+    if (max < 1)
+        usage ();
+
+    stride = (indexes * sizeof (rdb_bpp_t) + offsetof (bench_key_t, alt) +
+                    (indexes - 1) * sizeof (uint64_t) + 7) & ~(size_t) 7;
+    recs = calloc (max, stride);
+    if (recs == NULL)
+        rdb_fatal ("rdb_bench: out of memory\n");
+
+    rdb_init ();
+    printf ("{\"results\": [\n");
+    for (t = bench_types; t->name && !threads; t++) {
+        if (!listed (keys, t->name))
+            continue;
+        for (s = sizes; *s; s = *end ? end + 1 : end) {
+            if ((n = strtol (s, &end, 10)) < 1)
+                continue;
+            if (t->flags & RDB_NOKEYS)
+                bench_list (t, n);
+            else
+                bench_keyed (t, n);
+        }
+    }
+    for (s = sizes; threads && *s; s = *end ? end + 1 : end)
+        if ((n = strtol (s, &end, 10)) >= 1)
+            bench_threads (threads, modes, dists, n);
+    printf ("\n]}\n");
+    rdb_clean (0);
+    free (recs);
+    return 0;
+}
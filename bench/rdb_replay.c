@@ -0,0 +1,287 @@
+//Copyright (c) 2014-2020 Assaf Stoler <assaf.stoler@gmail.com>
+//All rights reserved.
+//see LICENSE for more info
+
+// rdb_replay: run a trace written by rdb_capture_start() against a fresh
+// pool with the same indexes, at full speed or (-t) at the original pace,
+// and print the latency of each operation type as JSON.
+//
+//   rdb_replay [-t] trace
+//
+// Records are rebuilt from the captured keys alone; other user data is not
+// in the trace. Iterate callbacks are replayed as a plain walk, the records
+// they deleted as deletes. Results that differ from the captured ones are
+// counted as mismatches.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <time.h>
+#include "rdb.h"
+
+static rdb_capture_hdr_t    hdr;
+static rdb_pool_t           *pool;
+static size_t               rec_size;
+static size_t               pp_size;
+
+static uint64_t now_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int count_cb (void *data, void *arg)
+{
+    (*(long *) arg)++;
+    return RDB_CB_OK;
+}
+
+static int delete_cb (void *data, void *arg)
+{
+    return RDB_CB_DELETE_NODE;
+}
+
+// a record and the RDB_KPSTR strings it points to
+static void free_rec (void *rec, void *arg)
+{
+    int i, j;
+
+    for (i = 0; i < hdr.indexCount; i++) {
+        if ((hdr.FLAGS[i] & RDB_KPSTR) == 0)
+            continue;
+        for (j = 0; j < i; j++)
+            if ((hdr.FLAGS[j] & RDB_KPSTR) &&
+                    hdr.key_offset[j] == hdr.key_offset[i])
+                break;
+        if (j == i)
+            free (*(char **) (rec + hdr.key_offset[i]));
+    }
+    free (rec);
+}
+
+// bytes one captured key takes in the trace
+static size_t key_len (int i, const char *p)
+{
+    return hdr.key_size[i] ? hdr.key_size[i] : strlen (p) + 1;
+}
+
+// Split the keys of a whole record event, one per captured index, into
+// keys[]. Returns -1 if they run past len
+static int split_keys (const char *p, uint32_t len, const char **keys)
+{
+    const char  *end = p + len;
+    int         i;
+
+    for (i = 0; i < hdr.indexCount; i++) {
+        keys[i] = NULL;
+        if (hdr.key_size[i] < 0)
+            continue;
+        if (p >= end || p + key_len (i, p) > end)
+            return -1;
+        keys[i] = p;
+        p += key_len (i, p);
+    }
+    return 0;
+}
+
+static void *build_rec (const char **keys)
+{
+    char    *rec = calloc (1, rec_size);
+    int     i;
+
+    if (rec == NULL)
+        rdb_fatal ("rdb_replay: out of memory\n");
+    for (i = 0; i < hdr.indexCount; i++) {
+        if (keys[i] == NULL)
+            continue;
+        if (hdr.FLAGS[i] & RDB_KPSTR)
+            *(char **) (rec + hdr.key_offset[i]) = strdup (keys[i]);
+        else
+            memcpy (rec + hdr.key_offset[i], keys[i], key_len (i, keys[i]));
+    }
+    return rec;
+}
+
+// A lookup key as rdb_get() takes it. Fixed size keys are copied to buf,
+// the trace does not keep them aligned
+static const void *lookup (int i, const char *key, uint64_t *buf)
+{
+    if (key == NULL || hdr.key_size[i] == 0)
+        return key;
+    memcpy (buf, key, hdr.key_size[i]);
+    return buf;
+}
+
+// Register a pool like the captured one, sized for its keys
+static void setup (const char *trace, const char *data, size_t size)
+{
+    const rdb_capture_ev_t  *ev;
+    const char              *keys[RDB_POOL_MAX_IDX];
+    size_t                  pos, end;
+    int                     i;
+
+    pp_size = sizeof (rdb_bpp_t) * hdr.indexCount;
+    rec_size = pp_size;
+    for (i = 0; i < hdr.indexCount; i++) {
+        if ((hdr.FLAGS[i] & RDB_KCF) ||
+                (hdr.key_size[i] < 0 && (hdr.FLAGS[i] & RDB_NOKEYS) == 0)) {
+            fprintf (stderr, "rdb_replay: %s: index %d has no captured "
+                                                    "keys\n", trace, i);
+            exit (1);
+        }
+        end = hdr.key_offset[i] + ((hdr.FLAGS[i] & RDB_KPSTR) ?
+                sizeof (char *) : hdr.key_size[i] > 0 ? hdr.key_size[i] : 0);
+        if (end > rec_size)
+            rec_size = end;
+    }
+    // inline strings: room for the longest one captured
+    for (pos = 0; pos + sizeof (*ev) <= size; pos += sizeof (*ev) + ev->len) {
+        ev = (const void *) (data + pos);
+        if (ev->idx >= 0 || pos + sizeof (*ev) + ev->len > size ||
+                split_keys (data + pos + sizeof (*ev), ev->len, keys))
+            continue;
+        for (i = 0; i < hdr.indexCount; i++)
+            if (keys[i] && (hdr.FLAGS[i] & RDB_KSTR) &&
+                    hdr.key_offset[i] + strlen (keys[i]) + 1 > rec_size)
+                rec_size = hdr.key_offset[i] + strlen (keys[i]) + 1;
+    }
+
+    pool = rdb_register_um_pool ("replay", hdr.indexCount,
+                        hdr.key_offset[0] - pp_size, hdr.FLAGS[0], NULL);
+    if (pool == NULL)
+        rdb_fatal ("rdb_replay: can not register pool\n");
+    for (i = 1; i < hdr.indexCount; i++)
+        if (rdb_register_um_idx (pool, i, hdr.key_offset[i] - pp_size,
+                                            hdr.FLAGS[i], NULL) == -1)
+            rdb_fatal ("rdb_replay: can not register index %d\n", i);
+    if (rdb_latency_enable (pool, 1) == -1)
+        fprintf (stderr, "rdb_replay: no latency histograms (%s)\n",
+                                                        rdb_error_string);
+}
+
+int main (int argc, char *argv[])
+{
+    static const char   *names[RDB_LAT_OPS] = {
+        "insert", "get", "delete", "iterate"
+    };
+    const rdb_capture_ev_t  *ev;
+    const char              *keys[RDB_POOL_MAX_IDX], *p;
+    const void              *key;
+    rdb_latency_t           lat;
+    uint64_t                buf[2], t0, ns;
+    long                    events = 0, mismatches = 0, walked;
+    size_t                  size, pos;
+    char                    *data;
+    FILE                    *fp;
+    void                    *rec;
+    int                     opt, paced = 0, i, found;
+
+    while ((opt = getopt (argc, argv, "t")) != -1) {
+        switch (opt) {
+            case 't': paced = 1; break;
+            default:
+                fprintf (stderr, "usage: rdb_replay [-t] trace\n");
+                return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf (stderr, "usage: rdb_replay [-t] trace\n");
+        return 1;
+    }
+
+    if ((fp = fopen (argv[optind], "rb")) == NULL ||
+            fread (&hdr, sizeof (hdr), 1, fp) != 1 ||
+            hdr.magic != RDB_CAPTURE_MAGIC || hdr.indexCount < 1 ||
+            hdr.indexCount > RDB_POOL_MAX_IDX) {
+        fprintf (stderr, "rdb_replay: %s: not an rDB capture\n", argv[optind]);
+        return 1;
+    }
+    fseek (fp, 0, SEEK_END);
+    size = ftell (fp) - sizeof (hdr);
+    fseek (fp, sizeof (hdr), SEEK_SET);
+    if ((data = malloc (size + 1)) == NULL ||
+            fread (data, 1, size, fp) != size)
+        rdb_fatal ("rdb_replay: can not read %s\n", argv[optind]);
+    fclose (fp);
+
+    rdb_init ();
+    setup (argv[optind], data, size);
+
+    t0 = now_ns ();
+    for (pos = 0; pos + sizeof (*ev) <= size; pos += sizeof (*ev) + ev->len) {
+        ev = (const void *) (data + pos);
+        p = data + pos + sizeof (*ev);
+        if (pos + sizeof (*ev) + ev->len > size || ev->idx >=
+                (int32_t) hdr.indexCount)
+            break;                          // torn tail
+        if (ev->idx < 0 && split_keys (p, ev->len, keys))
+            break;
+        if (paced)
+            while ((ns = now_ns () - t0) < ev->ns)
+                if (ev->ns - ns > 100000)
+                    usleep ((ev->ns - ns) / 1000 - 50);
+
+        switch (ev->op) {
+            case RDB_TRACE_INSERT:
+                rec = build_rec (keys);
+                found = rdb_insert (pool, rec);
+                if (found != hdr.indexCount)
+                    free_rec (rec, NULL);
+                break;
+            case RDB_TRACE_GET:
+                key = lookup (ev->idx, ev->len ? p : NULL, buf);
+                found = rdb_get (pool, ev->idx, key) != NULL;
+                break;
+            case RDB_TRACE_DELETE:
+                i = ev->idx;
+                if (i < 0) {
+                    // deleted by an iterate callback, by its first key
+                    for (i = 0; i < hdr.indexCount && !keys[i]; i++);
+                    if (i == hdr.indexCount)
+                        i = 0;
+                    key = lookup (i, keys[i], buf);
+                } else
+                    key = lookup (i, ev->len ? p : NULL, buf);
+                rec = rdb_delete (pool, i, (void *) key);
+                if ((found = rec != NULL))
+                    free_rec (rec, NULL);
+                break;
+            case RDB_CAPTURE_ITERATE:
+                walked = 0;
+                rdb_iterate (pool, ev->idx, count_cb, &walked, NULL, NULL);
+                found = ev->result;
+                break;
+            default:
+                found = ev->result;
+        }
+        if (found != ev->result)
+            mismatches++;
+        events++;
+    }
+    ns = now_ns () - t0;
+
+    printf ("{\"events\": %ld, \"mismatches\": %ld, \"ns\": %" PRIu64
+            ", \"events_per_sec\": %.0f, \"paced\": %s, \"ops\": [\n",
+            events, mismatches, ns, ns ? events * 1e9 / ns : 0.0,
+            paced ? "true" : "false");
+    for (i = 0; i < RDB_LAT_OPS; i++) {
+        memset (&lat, 0, sizeof (lat));
+        rdb_latency (pool, i, &lat);
+        printf ("  {\"op\": \"%s\", \"count\": %" PRIu64 ", \"p50_ns\": %"
+                PRIu64 ", \"p99_ns\": %" PRIu64 ", \"p999_ns\": %" PRIu64
+                ", \"max_ns\": %" PRIu64 "}%s\n", names[i], lat.count,
+                lat.p50, lat.p99, lat.p999, lat.max,
+                i < RDB_LAT_OPS - 1 ? "," : "");
+    }
+    printf ("]}\n");
+
+    rdb_iterate (pool, 0, delete_cb, NULL, free_rec, NULL);
+    rdb_drop_pool (pool);
+    rdb_clean (0);
+    free (data);
+    return 0;
+}
@@ -41,22 +41,40 @@
 #include <net/genetlink.h>
 #include <linux/semaphore.h>
 #include <linux/vmalloc.h>
+#include <linux/rcupdate.h>
+#include <linux/ktime.h>
 #include "rdb.h"
 
 #define rdb_free(a) kfree(a)
 #define rdb_alloc(a) kmalloc (a, GFP_KERNEL);
+// may not sleep: inside rcu_read_lock (_rdb_reg_enter)
+#define rdb_alloc_atomic(a) kmalloc (a, GFP_ATOMIC)
 
 #else
 // Build a User-Space Library
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE                             // rwlock writer preference
+#endif
 #include <stdio.h>                              //printf,
 #include <stdlib.h>                             //exit,
 #include <string.h>                             //strcmp,
+#include <unistd.h>                             //sysconf,
+#include <time.h>                               //clock_gettime,
+#include <stdarg.h>                             //va_list,
+#include <stddef.h>                             //offsetof,
+#include <fcntl.h>                              //open,
+#include <sys/mman.h>                           //mmap,
+#include <sys/stat.h>
+#include <sys/wait.h>                           //waitpid,
+#include <errno.h>
 #include <pthread.h>
+#include <sched.h>                              //sched_yield,
 #include "rdb.h"
 
 #define rdb_free(a) free(a)
 #define rdb_alloc(a) malloc (a);
+#define rdb_alloc_atomic(a) malloc (a)
 
 #endif
 
@@ -78,7 +96,37 @@
 */
 
 
-rdb_pool_t  *pool_root;
+// pool registry: name hash -> chain through pool->hnext
+typedef struct rdb_reg_table_s {
+    uint32_t    size;
+    rdb_pool_t  *bucket[];
+} rdb_reg_table_t;
+
+// An rDB instance: its pools, their registry and its lock. Contexts share
+// nothing, rdb_init() sets up the default one the calls without a context
+// argument use.
+struct rdb_ctx_s {
+    rdb_pool_t          *pool_root;
+    rdb_reg_table_t     *reg_table;
+    uint32_t            reg_count, 
+                        reg_seq;        // odd while the table is rehashed
+#ifdef KM
+    struct semaphore    reg_mutex;
+#else
+    pthread_mutex_t     reg_mutex;
+    int                 reg_epoch;
+    // written by every lookup, kept off the line the writers use
+    long                reg_readers[2] __attribute__ ((aligned (64)));
+#endif
+} __attribute__ ((aligned (64)));
+
+static rdb_ctx_t    rdb_ctx_default;
+#ifndef KM
+static uint64_t     rdb_lf_gen;
+
+// added to snap_refs by rdb_drop_pool, the last snapshot frees the pool
+#define RDB_SNAP_DROPPED    (1 << 30)
+#endif
 
 
 //struct  RDB_POOLS **poolIds;
@@ -87,109 +135,506 @@ rdb_pool_t  *pool_root;
 //struct  RDB_POOLS **poolIdsTmp;
 #endif
 
-char      *rdb_error_string = NULL;
-
-// used to calculate tree depth by dump Fn()
-int     levels,
-        maxLevels;
+#ifdef KM
+const char  *rdb_error_string = NULL;
+int         rdb_errno;
+#else
+__thread const char *rdb_error_string = NULL;
+__thread int        rdb_errno;
+#endif
 
 
 
 #ifdef KM
-struct semaphore reg_mutex;
-struct semaphore rdb_error_mutex;
 #define rdb_sem_lock(A) down_interruptible(A)
+#define rdb_sem_trylock(A) (down_trylock(A) == 0)
 #define rdb_sem_unlock(A) up(A)
 #else
-pthread_mutex_t reg_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t rdb_error_mutex = PTHREAD_MUTEX_INITIALIZER;
 #define rdb_sem_lock(A) pthread_mutex_lock(A)
+#define rdb_sem_trylock(A) (pthread_mutex_trylock(A) == 0)
 #define rdb_sem_unlock(A) pthread_mutex_unlock(A)
 #endif
-// Initilize the rDB subsystem, must be called once before any other rDB 
-// function
-void rdb_init (void)
-{
+
 #ifdef KM
-    sema_init(&reg_mutex, 1);
-    sema_init(&rdb_error_mutex, 1);
+#define rdb_rw_rdlock(A) down_read(A)
+#define rdb_rw_rdunlock(A) up_read(A)
+#define rdb_rw_wrlock(A) down_write(A)
+#define rdb_rw_wrunlock(A) up_write(A)
+#else
+#define rdb_rw_rdlock(A) pthread_rwlock_rdlock(A)
+#define rdb_rw_rdunlock(A) pthread_rwlock_unlock(A)
+#define rdb_rw_wrlock(A) pthread_rwlock_wrlock(A)
+#define rdb_rw_wrunlock(A) pthread_rwlock_unlock(A)
 #endif
-    pool_root = NULL;
+
+/* RDB_POOL_THREADSAFE locking. All are no-ops on other pools.
+ *
+ * Writers (insert, delete, move) serialize on the pool update_mutex, so a
+ * record is always linked into, or removed from, all indexes as one unit
+ * with regard to other writers. Within that, an index is write-locked only
+ * while it is being changed, so readers (gets, dump) of other indexes keep
+ * going. iterate and flush may remove records from every index from within
+ * the walk, so they lock the whole pool.
+ */
+#define RDB_TS(pool) ((pool)->FLAGS[0] & RDB_POOL_THREADSAFE)
+
+static inline void _rdb_ts_read_lock (rdb_pool_t *pool, int idx)
+{
+    if (RDB_TS(pool)) rdb_rw_rdlock (&pool->idx_lock[idx]);
 }
 
-// Store internal error string to allow user to retrieve it, and return with
-// user set value. typical use will look like
-// Example: return rdv_error_value(-1, "failed to dance this dance");
-// library user can later print that string to errno/errstr or similar.
-int rdb_error_value (int rv, char *err)
+static inline void _rdb_ts_read_unlock (rdb_pool_t *pool, int idx)
+{
+    if (RDB_TS(pool)) rdb_rw_rdunlock (&pool->idx_lock[idx]);
+}
+
+static inline void _rdb_ts_update_lock (rdb_pool_t *pool)
+{
+    if (RDB_TS(pool)) rdb_sem_lock (&pool->update_mutex);
+}
+
+static inline void _rdb_ts_update_unlock (rdb_pool_t *pool)
+{
+    if (RDB_TS(pool)) rdb_sem_unlock (&pool->update_mutex);
+}
+
+static inline void _rdb_ts_idx_lock (rdb_pool_t *pool, int idx)
+{
+    if (RDB_TS(pool)) rdb_rw_wrlock (&pool->idx_lock[idx]);
+}
+
+static inline void _rdb_ts_idx_unlock (rdb_pool_t *pool, int idx)
+{
+    if (RDB_TS(pool)) rdb_rw_wrunlock (&pool->idx_lock[idx]);
+}
+
+static void _rdb_ts_lock_all (rdb_pool_t *pool)
+{
+    int idx;
+
+    if (!RDB_TS(pool)) return;
+    rdb_sem_lock (&pool->update_mutex);
+    for (idx = 0; idx < pool->indexCount; idx++)
+        rdb_rw_wrlock (&pool->idx_lock[idx]);
+}
+
+static void _rdb_ts_unlock_all (rdb_pool_t *pool)
 {
-    rdb_sem_lock(&rdb_error_mutex);
+    int idx;
+
+    if (!RDB_TS(pool)) return;
+    for (idx = pool->indexCount - 1; idx >= 0; idx--)
+        rdb_rw_wrunlock (&pool->idx_lock[idx]);
+    rdb_sem_unlock (&pool->update_mutex);
+}
+
+/* Write-ahead log hooks, see rdb_wal_open(). RDB_WAL logs a mutation, from
+ * within the writer's lock so the log order is the apply order. 
+ * RDB_WAL_WAIT, after the lock is dropped, waits for it to be on disk when
+ * the log is in RDB_WAL_SYNC mode - so concurrent writers share a sync -
+ * and writes out a full buffer.
+ */
+#define RDB_WAL_INSERT  1
+#define RDB_WAL_DELETE  2
+#define RDB_WAL_FLUSH   3
+#define RDB_WAL_INSERT_ONE  4           // one index, index number << 8
+#define RDB_WAL_DELETE_ONE  5
+
+#ifndef KM
+static void _rdb_wal_append (rdb_pool_t *pool, int op, void *rec);
+static void _rdb_wal_wait (rdb_pool_t *pool);
+#define RDB_WAL(pool, op, rec) \
+    do { if ((pool)->wal) _rdb_wal_append (pool, op, rec); } while (0)
+#define RDB_WAL_WAIT(pool) \
+    do { if ((pool)->wal) _rdb_wal_wait (pool); } while (0)
+#else
+#define RDB_WAL(pool, op, rec) do { } while (0)
+#define RDB_WAL_WAIT(pool) do { } while (0)
+#endif
+
+// Capture hook, see rdb_capture_start(). Called with the pool's own locks
+// held, so rdb_capture_stop() detaches it under _rdb_ts_lock_all().
+#ifndef KM
+static void _rdb_capture (rdb_pool_t *pool, int op, int idx, 
+        const void *key, int result);
+#define RDB_CAPTURE(pool, op, idx, key, result) \
+    do { \
+        if (__atomic_load_n (&(pool)->capture, __ATOMIC_RELAXED)) \
+            _rdb_capture (pool, op, idx, key, result); \
+    } while (0)
+#else
+#define RDB_CAPTURE(pool, op, idx, key, result) do { } while (0)
+#endif
+
+// record_count has one writer at a time (the update lock, or atomic adds on
+// RDB_LOCKFREE pools); lock free readers such as rdb_export load it relaxed
+#define RDB_COUNT_SET(pool, v) \
+    __atomic_store_n (&(pool)->record_count, v, __ATOMIC_RELAXED)
+
+// RDB_TRACE: a probe at every mutation, lookup, rotation, iterate restart
+// and insert undo. Where <sys/sdt.h> is around, each is a USDT probe 
+// (provider rdb: pool name, index, record) for perf or bpftrace - a nop
+// until attached. A callback set by rdb_trace_set() sees the same events
+// for one well predicted branch per probe while none is set. Without 
+// RDB_TRACE probes compile to nothing.
+#ifdef RDB_TRACE
+#if !defined (KM) && defined (__has_include)
+#if __has_include (<sys/sdt.h>)
+#include <sys/sdt.h>
+#define RDB_USDT(probe, pool, idx, rec) \
+    DTRACE_PROBE3 (rdb, probe, (pool)->name, idx, rec)
+#endif
+#endif
+#ifndef RDB_USDT
+#define RDB_USDT(probe, pool, idx, rec) do { } while (0)
+#endif
+// callback and argument are published together. A replaced setting may
+// still be running in a probe, it is kept until rdb_clean(0)
+typedef struct rdb_trace_s {
+    rdb_trace_fn_t      fn;
+    void                *arg;
+    struct rdb_trace_s  *next;              // retired list
+} rdb_trace_t;
+static rdb_trace_t      *rdb_trace;
+static rdb_trace_t      *rdb_trace_retired;
+#define RDB_TRACEPOINT(probe, ev, pool, idx, rec) \
+    do { \
+        rdb_trace_t *_t; \
+        RDB_USDT (probe, pool, idx, rec); \
+        _t = __atomic_load_n (&rdb_trace, __ATOMIC_ACQUIRE); \
+        if (__builtin_expect (_t != NULL, 0)) \
+            _t->fn (ev, pool, idx, rec, _t->arg); \
+    } while (0)
+#else
+#define RDB_TRACEPOINT(probe, ev, pool, idx, rec) do { } while (0)
+#endif
+
+// RDB_POOL_STATS: operation counters are relaxed atomic adds on the pool.
+// Comparisons and rotations, counted deep in the recursion, collect in
+// per thread scratch counters and are added to an index once per operation.
+#ifdef RDB_POOL_STATS
 #ifdef KM
+static uint64_t         _rdb_stat_cmp, _rdb_stat_rot;  // approximate
+#else
+static __thread uint64_t _rdb_stat_cmp, _rdb_stat_rot;
+#endif
+#define RDB_STAT_ADD(pool, idx, f, n) \
+    __atomic_fetch_add (&(pool)->stats[idx].f, n, __ATOMIC_RELAXED)
+#define RDB_STAT(pool, idx, f) RDB_STAT_ADD (pool, idx, f, 1)
+#define RDB_STAT_CMP() (_rdb_stat_cmp++)
+#define RDB_STAT_ROT() (_rdb_stat_rot++)
+#define RDB_STAT_FLUSH(pool, idx) \
+    do { \
+        if (_rdb_stat_cmp) \
+            __atomic_fetch_add (&(pool)->stats[idx].compares, _rdb_stat_cmp, \
+                                                        __ATOMIC_RELAXED); \
+        if (_rdb_stat_rot) \
+            __atomic_fetch_add (&(pool)->stats[idx].rotations, _rdb_stat_rot,\
+                                                        __ATOMIC_RELAXED); \
+        _rdb_stat_cmp = _rdb_stat_rot = 0; \
+    } while (0)
+#else
+#define RDB_STAT_ADD(pool, idx, f, n) do { } while (0)
+#define RDB_STAT(pool, idx, f) do { } while (0)
+#define RDB_STAT_CMP() do { } while (0)
+#define RDB_STAT_ROT() do { } while (0)
+#define RDB_STAT_FLUSH(pool, idx) do { } while (0)
+#endif
 
-    if (rdb_error_string != NULL) {
-        kfree (rdb_error_string);
-        rdb_error_string = NULL;
-    }
+// RDB_POOL_STATS: latency histograms, see rdb_latency_enable(). A sampled
+// call reads the clock twice, any other call pays a pointer test and a
+// per thread countdown.
+#ifdef RDB_POOL_STATS
+#define RDB_LAT_SUB_BITS    4       // 16 linear sub buckets per power of 2
+#define RDB_LAT_BUCKETS     ((64 - RDB_LAT_SUB_BITS + 1) << RDB_LAT_SUB_BITS)
+
+typedef struct rdb_lat_s {
+    uint32_t    every;              // sample one call in every, 0 = off
+    uint64_t    max[RDB_LAT_OPS];
+    uint64_t    bucket[RDB_LAT_OPS][RDB_LAT_BUCKETS];
+} rdb_lat_t;
 
-    rdb_error_string = kmalloc (strlen (err) + 1, GFP_KERNEL);
+#ifdef KM
+static uint32_t         _rdb_lat_skip;
+#else
+static __thread uint32_t _rdb_lat_skip;
+#endif
+static uint64_t _rdb_lat_start (rdb_pool_t *pool);
+static void _rdb_lat_end (rdb_pool_t *pool, int op, uint64_t t0);
+#define RDB_LAT_START(pool) uint64_t _rdb_lat_t0 = _rdb_lat_start (pool)
+#define RDB_LAT_END(pool, op) \
+    do { if (_rdb_lat_t0) _rdb_lat_end (pool, op, _rdb_lat_t0); } while (0)
 #else
-    rdb_error_string = realloc (rdb_error_string, strlen (err) + 1);
+#define RDB_LAT_START(pool) do { } while (0)
+#define RDB_LAT_END(pool, op) do { } while (0)
 #endif
 
-    if (rdb_error_string == NULL)
-        rdb_info ("rdb: failed to Alloc RAM for error message, original error was"
-                " \"%s\"\n", err);
-    else
-        strcpy (rdb_error_string, err);
+// RDB_POOL_STATS: hot key sketches, see rdb_hotkeys_enable(). Lookups on
+// an index without one pay a pointer test.
+#ifdef RDB_POOL_STATS
+typedef struct rdb_hot_s {
+    uint32_t        every;          // sample one lookup in every, 0 = off
+    int             k;
+    int             used;
+    int             key_size;       // 0 for strings
+    char            busy;           // sketch lock, lookups never wait
+    uint64_t        seen;           // sampled lookups, dropped ones not
+    uint64_t        *hash;          // of each slot's key, scanned first
+    rdb_hotkey_t    *slot;
+} rdb_hot_t;
+
+#define RDB_HOT_BYTES(k) \
+    (sizeof (rdb_hot_t) + (k) * (sizeof (rdb_hotkey_t) + sizeof (uint64_t)))
+
+#ifdef KM
+static uint32_t         _rdb_hot_skip;
+#else
+static __thread uint32_t _rdb_hot_skip;
+#endif
+
+static void _rdb_hot_add (rdb_pool_t *pool, int idx, const void *key);
+#define RDB_HOT(pool, idx, key) \
+    do { if ((pool)->hot[idx]) _rdb_hot_add (pool, idx, key); } while (0)
+#else
+#define RDB_HOT(pool, idx, key) do { } while (0)
+#endif
+// Initilize the rDB subsystem, must be called once before any other rDB 
+// function
+static void _rdb_ctx_init (rdb_ctx_t *ctx)
+{
+    memset (ctx, 0, sizeof (rdb_ctx_t));
+#ifdef KM
+    sema_init(&ctx->reg_mutex, 1);
+#else
+    pthread_mutex_init(&ctx->reg_mutex, NULL);
+#endif
+}
 
-    rdb_sem_unlock(&rdb_error_mutex);
+void rdb_init (void)
+{
+    _rdb_ctx_init (&rdb_ctx_default);
+}
 
+// Errors are reported per thread, as a numeric code in rdb_errno and a
+// message in rdb_error_string. Messages are static strings, so reporting
+// takes no lock and allocates nothing (a failed insert is a hot path).
+// Example: return rdb_error_value(-1, "failed to dance this dance");
+// library user can later print that string to errno/errstr or similar.
+int rdb_error_code (int rv, int code, const char *err)
+{
+    rdb_errno = code;
+    rdb_error_string = err;
     return rv;
 }
 
+int rdb_error_value (int rv, char *err)
+{
+    return rdb_error_code (rv, RDB_E_ERROR, err);
+}
+
 // Same as above, without returning a value
 void rdb_error (char *err)
 {
-    rdb_sem_lock(&rdb_error_mutex);
+    rdb_error_code (0, RDB_E_ERROR, err);
+}
+
+// Generic message for an rdb_errno value
+const char *rdb_strerror (int code)
+{
+    static const char *msg[] = {
+        [RDB_E_OK]          = "no error",
+        [RDB_E_ERROR]       = "error",
+        [RDB_E_DUPLICATE]   = "duplicate key",
+        [RDB_E_NOMEM]       = "out of memory",
+        [RDB_E_NOTFOUND]    = "not found",
+        [RDB_E_IO]          = "i/o error",
+    };
+
+    if (code < 0 || code >= (int) (sizeof (msg) / sizeof (msg[0])))
+        return "unknown error";
+    return msg[code];
+}
+
+/* Pool registry
+ *
+ * Names hash into a table of chains, grown by doubling. Lookups take no
+ * lock: registration, drop and growth (all under reg_mutex) publish with
+ * release stores, and a pool or an old table is freed only once every
+ * lookup that might still be looking at it is done - RCU in the kernel, a
+ * two phase reader count here. A lookup that misses while the table was
+ * being rehashed retries.
+ */
 #ifdef KM
+#define rdb_load_acquire(p)         smp_load_acquire (&(p))
+#define rdb_store_release(p, v)     smp_store_release (&(p), v)
+
+static inline int _rdb_reg_enter (rdb_ctx_t *ctx)
+{
+    rcu_read_lock ();
+    return 0;
+}
 
-    if (rdb_error_string != NULL)
-        kfree (rdb_error_string);
+static inline void _rdb_reg_exit (rdb_ctx_t *ctx, int epoch)
+{
+    rcu_read_unlock ();
+}
 
-    rdb_error_string = kmalloc (strlen (err) + 1, GFP_KERNEL);
+static void _rdb_reg_sync (rdb_ctx_t *ctx)
+{
+    synchronize_rcu ();
+}
 #else
-    rdb_error_string = realloc (rdb_error_string, strlen (err) + 1);
+#define rdb_load_acquire(p)         __atomic_load_n (&(p), __ATOMIC_ACQUIRE)
+#define rdb_store_release(p, v)     __atomic_store_n (&(p), v, __ATOMIC_RELEASE)
+
+static int _rdb_reg_enter (rdb_ctx_t *ctx)
+{
+    int epoch;
+
+    for (;;) {
+        epoch = __atomic_load_n (&ctx->reg_epoch, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch (&ctx->reg_readers[epoch], 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n (&ctx->reg_epoch, __ATOMIC_SEQ_CST) == epoch)
+            return epoch;
+        __atomic_sub_fetch (&ctx->reg_readers[epoch], 1, __ATOMIC_RELEASE);
+    }
+}
+
+static void _rdb_reg_exit (rdb_ctx_t *ctx, int epoch)
+{
+    __atomic_sub_fetch (&ctx->reg_readers[epoch], 1, __ATOMIC_RELEASE);
+}
+
+// wait out lookups that started before now. reg_mutex held. two flips, as
+// readers of the other epoch may predate the last one
+static void _rdb_reg_sync (rdb_ctx_t *ctx)
+{
+    int i, epoch;
+
+    for (i = 0; i < 2; i++) {
+        epoch = ctx->reg_epoch;
+        __atomic_store_n (&ctx->reg_epoch, epoch ^ 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n (&ctx->reg_readers[epoch], __ATOMIC_ACQUIRE))
+            sched_yield ();
+    }
+}
 #endif
 
-    if (rdb_error_string == NULL)
-        rdb_info ("rdb: failed to Alloc RAM for error message, original error was"
-                " \"%s\"\n", err);
-    else
-        strcpy (rdb_error_string, err);
+static uint32_t _rdb_name_hash (const char *name)
+{
+    uint32_t h = 2166136261u;
+
+    while (*name)
+        h = (h ^ (unsigned char) *name++) * 16777619u;
+    return h;
+}
+
+// rDB internal: one pass over the chain the name hashes to
+static rdb_pool_t *_rdb_reg_lookup (rdb_ctx_t *ctx, const char *name, 
+        uint32_t hash)
+{
+    rdb_reg_table_t *table;
+    rdb_pool_t      *pool;
+
+    table = rdb_load_acquire (ctx->reg_table);
+    if (table == NULL)
+        return NULL;
+    for (pool = rdb_load_acquire (table->bucket[hash & (table->size - 1)]); 
+            pool; 
+            pool = rdb_load_acquire (pool->hnext))
+        if (pool->hash == hash && strcmp (pool->name, name) == 0)
+            return pool;
+    return NULL;
+}
+
+// rDB internal: make room for one more pool. reg_mutex held
+static int _rdb_reg_grow (rdb_ctx_t *ctx)
+{
+    rdb_reg_table_t *table, *old = ctx->reg_table;
+    rdb_pool_t      *pool, *next, **head;
+    uint32_t        size, i;
+
+    if (old && ctx->reg_count < old->size)
+        return 0;
+    size = old ? old->size * 2 : 64;
+    table = rdb_alloc (sizeof (rdb_reg_table_t) + sizeof (void *) * size);
+    if (table == NULL)
+        return old ? 0 : -1;                // longer chains will do
+    memset (table, 0, sizeof (rdb_reg_table_t) + sizeof (void *) * size);
+    table->size = size;
+
+    // relinking changes chains under running lookups, they retry on a miss
+    rdb_store_release (ctx->reg_seq, ctx->reg_seq + 1);
+    for (i = 0; old && i < old->size; i++)
+        for (pool = old->bucket[i]; pool; pool = next) {
+            next = pool->hnext;
+            head = &table->bucket[pool->hash & (size - 1)];
+            rdb_store_release (pool->hnext, *head);
+            *head = pool;
+        }
+    rdb_store_release (ctx->reg_table, table);
+    rdb_store_release (ctx->reg_seq, ctx->reg_seq + 1);
+
+    if (old) {
+        _rdb_reg_sync (ctx);
+        rdb_free (old);
+    }
+    return 0;
+}
+
+// rDB internal: publish a fully set up pool. reg_mutex held, room made
+static void _rdb_reg_add (rdb_ctx_t *ctx, rdb_pool_t *pool)
+{
+    rdb_pool_t **head;
+
+    pool->hash = _rdb_name_hash (pool->name);
+    head = &ctx->reg_table->bucket[pool->hash & (ctx->reg_table->size - 1)];
+    pool->hnext = *head;
+    rdb_store_release (*head, pool);
+    ctx->reg_count++;
+}
+
+// rDB internal: unlink pool, it may be freed after _rdb_reg_sync ()
+static void _rdb_reg_del (rdb_ctx_t *ctx, rdb_pool_t *pool)
+{
+    rdb_reg_table_t *table = ctx->reg_table;
+    rdb_pool_t      **link;
 
-    rdb_sem_unlock(&rdb_error_mutex);
+    if (table == NULL)
+        return;
+    for (link = &table->bucket[pool->hash & (table->size - 1)]; *link;
+            link = (rdb_pool_t **) &(*link)->hnext)
+        if (*link == pool) {
+            rdb_store_release (*link, pool->hnext);
+            ctx->reg_count--;
+            return;
+        }
 }
 
 // If you lost your pool handle, or more likely, you are working in a multi-
 // threaded application, and you need to attach to a data pool you did not
 // create, you can use this function to retrieve the matching rDB handle.
 // * Remember to use locks on shared data pools.
-rdb_pool_t *rdb_find_pool_by_name (char *poolName)
+rdb_pool_t *rdb_ctx_find_pool_by_name (rdb_ctx_t *ctx, char *poolName)
 {
-    rdb_pool_t *pool;
-
-    if (pool_root != NULL) {
-        pool = pool_root;
+    rdb_pool_t  *pool;
+    uint32_t    hash = _rdb_name_hash (poolName), seq;
+    int         epoch;
 
-        while (pool != NULL) {
-            if (strcmp (pool->name, poolName) == 0)
-                return (pool);
+    epoch = _rdb_reg_enter (ctx);
+    do {
+        seq = rdb_load_acquire (ctx->reg_seq);
+        pool = _rdb_reg_lookup (ctx, poolName, hash);
+    } while (pool == NULL && 
+            ((seq & 1) || rdb_load_acquire (ctx->reg_seq) != seq));
+    _rdb_reg_exit (ctx, epoch);
 
-            pool = pool->next;
-        }
-    }
+    return (pool);
+}
 
-    return (NULL);
+rdb_pool_t *rdb_find_pool_by_name (char *poolName)
+{
+    return rdb_ctx_find_pool_by_name (&rdb_ctx_default, poolName);
 }
 // Print pool usage report
 char * rdb_print_pool_stats (char *buf, int max_len)
@@ -200,8 +645,8 @@ char * rdb_print_pool_stats (char *buf, int max_len)
     rdb_pool_t *pool;
     int rc;
 
-    if (pool_root != NULL) {
-        pool = pool_root;
+    if (rdb_ctx_default.pool_root != NULL) {
+        pool = rdb_ctx_default.pool_root;
 
         while (pool != NULL) {
             rc = snprintf(buf + used, max_len - used, "Pool: %s : %d\n",
@@ -223,732 +668,2087 @@ char * rdb_print_pool_stats (char *buf, int max_len)
 #endif
     return (buf);
 }
-// rDB Internal. this will set the various compate functions for the rDB
-// data maganment routines.
-int set_pool_fn_pointers(rdb_pool_t *pool, int i, uint32_t flags, void *cmp_fn){
+// rDB internal: walk a subtree into report, parent is NULL at the root
+static void _rdb_analyze (rdb_pool_t *pool, int idx, void *node, 
+        void *parent, uint32_t depth, rdb_analyze_t *report, uint64_t *sum,
+        uint64_t *ext)
+{
+    PP_T *pp = node + sizeof (PP_T) * idx;
+
+    report->nodes++;
+    *sum += depth;
+    if (depth > report->height)
+        report->height = depth;
+    if (depth <= RDB_ANALYZE_LEVELS)
+        report->level[depth - 1]++;
+    if (pp->balance < -1 || pp->balance > 1)
+        report->unbalanced++;
+    else
+        report->balance[pp->balance + 1]++;
+    if (parent) {
+        report->links++;
+        if (((uintptr_t) parent >> 6) == ((uintptr_t) node >> 6))
+            report->same_line++;
+        if (((uintptr_t) parent >> 12) == ((uintptr_t) node >> 12))
+            report->same_page++;
+    }
+    // a miss ends below a NULL child, after depth compares
+    if (pp->left)
+        _rdb_analyze (pool, idx, pp->left, node, depth + 1, report, sum, ext);
+    else
+        *ext += depth;
+    if (pp->right)
+        _rdb_analyze (pool, idx, pp->right, node, depth + 1, report, sum, ext);
+    else
+        *ext += depth;
+}
 
-    if (cmp_fn) {
-        pool->fn[i] = cmp_fn;
-        pool->get_fn[i] = cmp_fn;
-        pool->get_const_fn[i] = cmp_fn;
-    } else if (flags & RDB_KINT32) {   
-        pool->fn[i] = key_cmp_int32;
-        pool->get_fn[i] = key_cmp_int32;
-        pool->get_const_fn[i] = key_cmp_const_int32;
-    } else if (flags & RDB_KUINT32){  
-        pool->fn[i] = key_cmp_uint32;
-        pool->get_fn[i] = key_cmp_uint32;
-        pool->get_const_fn[i] = key_cmp_const_uint32;
-    } else if (flags & RDB_KINT64) {
-        pool->fn[i] = key_cmp_int64;
-        pool->get_fn[i] = key_cmp_int64;
-        pool->get_const_fn[i] = key_cmp_const_int64;
-    } else if (flags & RDB_KUINT64) {
-        pool->fn[i] = key_cmp_uint64;
-        pool->get_fn[i] = key_cmp_uint64;
-        pool->get_const_fn[i] = key_cmp_const_uint64;
-    } else if (flags & RDB_KINT16) {
-        pool->fn[i] = key_cmp_int16;
-        pool->get_fn[i] = key_cmp_int16;
-        pool->get_const_fn[i] = key_cmp_const_int16;
-    } else if (flags & RDB_KUINT16) {
-        pool->fn[i] = key_cmp_uint16;
-        pool->get_fn[i] = key_cmp_uint16;
-        pool->get_const_fn[i] = key_cmp_const_uint16;
-    } else if (flags & RDB_KINT8) {
-        pool->fn[i] = key_cmp_int8;
-        pool->get_fn[i] = key_cmp_int8;
-        pool->get_const_fn[i] = key_cmp_const_int8;
-    } else if (flags & RDB_KUINT8) {
-        pool->fn[i] = key_cmp_uint8;
-        pool->get_fn[i] = key_cmp_uint8;
-        pool->get_const_fn[i] = key_cmp_const_uint8;
-    } else if (flags & RDB_KSIZE_t) {
-        pool->fn[i] = key_cmp_size_t;
-        pool->get_fn[i] = key_cmp_size_t;
-        pool->get_const_fn[i] = key_cmp_const_size_t;
-    } else if (flags & RDB_KSSIZE_t) {
-        pool->fn[i] = key_cmp_ssize_t;
-        pool->get_fn[i] = key_cmp_ssize_t;
-        pool->get_const_fn[i] = key_cmp_const_ssize_t;
-    } else if (flags & RDB_KPTR) {
-        pool->fn[i] = key_cmp_ptr;
-        pool->get_fn[i] = key_cmp_const_ptr;
-        pool->get_const_fn[i] = key_cmp_const_ptr;
-    } 
-#ifdef USE_128_BIT_TYPES
-      else if (flags & RDB_KINT128) {
-        pool->fn[i] = key_cmp_int128;
-        pool->get_fn[i] = key_cmp_int128;
-        pool->get_const_fn[i] = key_cmp_const_int128;
-    } else if (flags & RDB_KUINT128) {
-        pool->fn[i] = key_cmp_uint128;
-        pool->get_fn[i] = key_cmp_uint128;
-        pool->get_const_fn[i] = key_cmp_const_uint128;
-    } 
-#endif
-      else if (flags & RDB_KSTR) {
-        pool->fn[i] = key_cmp_str;
-        pool->get_fn[i] = key_cmp_str; 
-        pool->get_const_fn[i] = key_cmp_str; 
-    } else if (flags & RDB_KPSTR) {
-        pool->fn[i] = key_cmp_str_p;
-        pool->get_fn[i] = key_cmp_const_str_p;
-        pool->get_const_fn[i] = key_cmp_const_str_p;
-    //else if (FLAGS & RDB_KTME)    pool->fn[0] = keyCompareTME;
-    //else if (FLAGS & RDB_KTMA)    pool->fn[0] = keyCompareTMA;
-    } else if (flags & RDB_NOKEYS) {
-        pool->fn[i] = NULL;
-        pool->get_fn[i] = NULL;
-        pool->get_const_fn[i] = NULL;
-    } else {
-        return -1;
+// Measure the shape of one index: height against the least possible for
+// its size, nodes per level, mean lookup path, AVL balance factors and how
+// many parent / child links stay within a cache line or page. List indexes
+// report node count and link locality only. Takes the index read lock and
+// prints nothing, so it is safe alongside any other call.
+int rdb_analyze (rdb_pool_t *pool, int idx, rdb_analyze_t *report)
+{
+    uint64_t    sum = 0, ext = 0;
+    PP_T        *pp, *next;
+
+    if (pool == NULL || report == NULL || idx < 0 || idx >= pool->indexCount)
+        return rdb_error_value (-1, "rdb_analyze: bad argument");
+    memset (report, 0, sizeof (rdb_analyze_t));
+
+    _rdb_ts_read_lock (pool, idx);
+    if (pool->FLAGS[idx] & RDB_NOKEYS) {
+        pp = pool->root[idx] ? 
+                    (void *) pool->root[idx] + sizeof (PP_T) * idx : NULL;
+        for (; pp; pp = next) {
+            report->nodes++;
+            next = pp->right;
+            if (next == NULL)
+                break;
+            report->links++;
+            if (((uintptr_t) pp >> 6) == ((uintptr_t) next >> 6))
+                report->same_line++;
+            if (((uintptr_t) pp >> 12) == ((uintptr_t) next >> 12))
+                report->same_page++;
+        }
+    } else if (pool->root[idx])
+        _rdb_analyze (pool, idx, pool->root[idx], NULL, 1, report, &sum, 
+                                                                    &ext);
+    _rdb_ts_read_unlock (pool, idx);
+
+    if (report->nodes && !(pool->FLAGS[idx] & RDB_NOKEYS)) {
+        while (((uint64_t) 1 << report->min_height) - 1 < report->nodes)
+            report->min_height++;
+        report->avg_path = (double) sum / report->nodes;
+        report->avg_miss_path = (double) ext / (report->nodes + 1);
     }
     return 0;
 }
 
-// rDB Iternal: drop a new pool from our pool chain
-void rdb_drop_pool (rdb_pool_t *pool) {
-    rdb_pool_t *prev, *next;
-
-    if (pool && pool->name); // info("dropping %s\n", pool->name);
-    else return;
-
-    next=pool->next;
-    prev=pool->prev;
+// rDB internal: copy the counters of pool, no lock taken
+static void _rdb_pool_counters (rdb_pool_t *pool, rdb_pool_stats_t *stats)
+{
+    int idx;
 
-    if (prev) {
-        prev->next = pool->next;
-    }
-    if (next) {
-        next->prev = pool->prev;
-    }
-    if (pool_root == pool) {
-        if (prev) {
-            pool_root = prev;
-        } else if (next) {
-            pool_root = next;
-        } else {
-            pool_root = NULL;
-        }
+    memset (stats, 0, sizeof (rdb_pool_stats_t));
+    stats->indexCount = pool->indexCount;
+#ifdef RDB_POOL_COUNTERS
+    stats->record_count = __atomic_load_n (&pool->record_count, 
+                                                        __ATOMIC_RELAXED);
+#endif
+    for (idx = 0; idx < pool->indexCount; idx++) {
+#ifdef RDB_POOL_STATS
+        stats->idx[idx].inserts = 
+            __atomic_load_n (&pool->stats[idx].inserts, __ATOMIC_RELAXED);
+        stats->idx[idx].gets = 
+            __atomic_load_n (&pool->stats[idx].gets, __ATOMIC_RELAXED);
+        stats->idx[idx].misses = 
+            __atomic_load_n (&pool->stats[idx].misses, __ATOMIC_RELAXED);
+        stats->idx[idx].deletes = 
+            __atomic_load_n (&pool->stats[idx].deletes, __ATOMIC_RELAXED);
+        stats->idx[idx].compares = 
+            __atomic_load_n (&pool->stats[idx].compares, __ATOMIC_RELAXED);
+        stats->idx[idx].rotations = 
+            __atomic_load_n (&pool->stats[idx].rotations, __ATOMIC_RELAXED);
+        stats->idx[idx].restarts = 
+            __atomic_load_n (&pool->stats[idx].restarts, __ATOMIC_RELAXED);
+#endif
     }
+}
 
-    if (pool->name) {
-        //info ("freeing %s\n", pool->name);
-        rdb_free (pool->name);
+// Fill stats with the pool's counters (zero without RDB_POOL_STATS) and the
+// current shape of each tree index, see rdb_analyze() - O(records)
+int rdb_pool_stats (rdb_pool_t *pool, rdb_pool_stats_t *stats)
+{
+    rdb_analyze_t   report;
+    int             idx;
+
+    if (pool == NULL || stats == NULL)
+        return rdb_error_value (-1, "rdb_pool_stats: NULL argument");
+    _rdb_pool_counters (pool, stats);
+    for (idx = 0; idx < pool->indexCount; idx++) {
+        if (pool->FLAGS[idx] & RDB_NOKEYS)
+            continue;
+        rdb_analyze (pool, idx, &report);
+        stats->idx[idx].max_depth = report.height;
+        stats->idx[idx].avg_depth = report.avg_path;
     }
+    return 0;
+}
 
-    if (pool) {
-        rdb_free(pool) ;
-        pool = NULL;
+// Zero the operation counters of pool
+void rdb_pool_stats_reset (rdb_pool_t *pool)
+{
+#ifdef RDB_POOL_STATS
+    int idx;
+
+    for (idx = 0; idx < RDB_POOL_MAX_IDX; idx++) {
+        __atomic_store_n (&pool->stats[idx].inserts, 0, __ATOMIC_RELAXED);
+        __atomic_store_n (&pool->stats[idx].gets, 0, __ATOMIC_RELAXED);
+        __atomic_store_n (&pool->stats[idx].misses, 0, __ATOMIC_RELAXED);
+        __atomic_store_n (&pool->stats[idx].deletes, 0, __ATOMIC_RELAXED);
+        __atomic_store_n (&pool->stats[idx].compares, 0, __ATOMIC_RELAXED);
+        __atomic_store_n (&pool->stats[idx].rotations, 0, __ATOMIC_RELAXED);
+        __atomic_store_n (&pool->stats[idx].restarts, 0, __ATOMIC_RELAXED);
     }
-
-    return;
+#endif
 }
 
-// rDB Iternal: Add a new pool to our pool chain
-rdb_pool_t *rdb_add_pool (
-        char *poolName, 
-        int indexCount, 
-        int key_offset, 
-        int FLAGS, 
-        void *compare_fn) {
+#ifdef RDB_POOL_STATS
+// rDB internal: monotonic nanoseconds, never 0
+static inline uint64_t _rdb_lat_now (void)
+{
+#ifdef KM
+    return ktime_get_ns () | 1;
+#else
+    struct timespec ts;
 
-    rdb_pool_t *pool;
-    int name_length;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec) | 1;
+#endif
+}
 
-    pool = rdb_alloc(sizeof (rdb_pool_t));
+// rDB internal: start time if this call is sampled, 0 if not
+static uint64_t _rdb_lat_start (rdb_pool_t *pool)
+{
+    rdb_lat_t   *lat = pool->lat;
+    uint32_t    every;
 
-    if (pool == NULL) {
-        rdb_error ("Fatal: Pool allocation error, out of memory");
-        return NULL;
+    if (lat == NULL)
+        return 0;
+    every = __atomic_load_n (&lat->every, __ATOMIC_RELAXED);
+    if (every == 0)
+        return 0;
+    if (_rdb_lat_skip > 1 && _rdb_lat_skip <= every) {
+        _rdb_lat_skip--;
+        return 0;
     }
+    _rdb_lat_skip = every;
+    return _rdb_lat_now ();
+}
 
-    memset (pool, 0, sizeof (rdb_pool_t));
-
-    // inserting myself to the top of the pool, why? 
-    // because it is easy, don't need to look for the end of the pool chain
-    pool->next = pool_root;
+// rDB internal: log-linear bucket of a value, exact below 16ns, within
+// 1/16 above
+static inline int _rdb_lat_bucket (uint64_t v)
+{
+    int e;
 
-    if (pool_root)
-        pool_root->prev = pool;
+    if (v < (1 << RDB_LAT_SUB_BITS))
+        return v;
+    e = 63 - __builtin_clzll (v);
+    return ((e - RDB_LAT_SUB_BITS + 1) << RDB_LAT_SUB_BITS) + 
+            ((v >> (e - RDB_LAT_SUB_BITS)) & ((1 << RDB_LAT_SUB_BITS) - 1));
+}
 
-    pool_root = pool;
-    name_length = strlen (poolName);
-    pool->name = rdb_alloc (name_length + 1);
+// rDB internal: highest value that falls in bucket b
+static uint64_t _rdb_lat_value (int b)
+{
+    int e, sub;
+
+    if (b < (1 << RDB_LAT_SUB_BITS))
+        return b;
+    e = (b >> RDB_LAT_SUB_BITS) + RDB_LAT_SUB_BITS - 1;
+    sub = b & ((1 << RDB_LAT_SUB_BITS) - 1);
+    return ((((uint64_t) (1 << RDB_LAT_SUB_BITS) + sub + 1) << 
+                                        (e - RDB_LAT_SUB_BITS))) - 1;
+}
 
-    if (pool->name == NULL) {
-        rdb_error ("rDB: Fatal: pool allocation error, out of memor for pool"
-                " name");
-        pool_root = pool->next;
-        rdb_free (pool);
-        return NULL;
-    }
+static void _rdb_lat_end (rdb_pool_t *pool, int op, uint64_t t0)
+{
+    rdb_lat_t   *lat = pool->lat;
+    uint64_t    d = _rdb_lat_now () - t0;
+    uint64_t    max;
+
+    __atomic_fetch_add (&lat->bucket[op][_rdb_lat_bucket (d)], 1, 
+                                                        __ATOMIC_RELAXED);
+    max = __atomic_load_n (&lat->max[op], __ATOMIC_RELAXED);
+    while (d > max && !__atomic_compare_exchange_n (&lat->max[op], &max, d,
+                        1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+#endif
 
-    strncpy (pool->name, poolName, name_length+1); //+1 to shut compiler warning on some systems, even though we overwrite it to ensure terminating null.
-    pool->name[name_length] = 0;
-    
-    if (-1 == set_pool_fn_pointers(pool, 0, FLAGS, compare_fn)){
-        rdb_error ("rDB: Fatal: pool registration without type or matching"
-                " compare fn");
-        pool_root = pool->next;
-        rdb_free (pool);
-        return NULL;
+// Start timing pool operations, sampling one call in every (per thread,
+// 1 times every call). The histograms are allocated on first use and live
+// until the pool is dropped; call again to change the rate.
+int rdb_latency_enable (rdb_pool_t *pool, uint32_t every)
+{
+#ifdef RDB_POOL_STATS
+    rdb_lat_t *lat, *old = NULL;
+
+    if (pool == NULL || every == 0)
+        return rdb_error_value (-1, "rdb_latency_enable: bad argument");
+    if (pool->lat == NULL) {
+        lat = rdb_alloc (sizeof (rdb_lat_t));
+        if (lat == NULL)
+            return rdb_error_code (-1, RDB_E_NOMEM,
+                    "rdb_latency_enable: out of memory");
+        memset (lat, 0, sizeof (rdb_lat_t));
+        if (!__atomic_compare_exchange_n ((rdb_lat_t **) &pool->lat, &old, 
+                        lat, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            rdb_free (lat);
     }
-
-    pool->root[0] = NULL;
-    pool->key_offset[0] = sizeof (PP_T) * indexCount + key_offset;
-
-    debug ("pool->key_offset=%d\n", pool->key_offset[0]);
-
-    pool->indexCount = indexCount;
-    pool->FLAGS[0] = FLAGS;
-
-    debug ("pool %s, FLAGS=%xn", pool->name, pool->FLAGS[0]);
-#ifdef KM
-    sema_init(&pool->read_mutex, 1);
-    sema_init(&pool->write_mutex, 1);
+    __atomic_store_n (&((rdb_lat_t *) pool->lat)->every, every, 
+                                                        __ATOMIC_RELAXED);
+    return 0;
 #else
-    pthread_mutex_init(&pool->read_mutex, NULL); 
-    pthread_mutex_init(&pool->write_mutex, NULL); 
+    return rdb_error_value (-1, "rdb_latency_enable: built without "
+                                                        "RDB_POOL_STATS");
 #endif
-    return pool;
-}
-
-// Register data pool with rDB, returns a pool handler to be used with future
-// function calls.
-// key_offset is the offset form the start of the user data, ignoring the pp_t[]
-// at the start of the structure - however it is calculated and stored as offset
-// from the top of the structure.
-
-rdb_pool_t *rdb_register_um_pool (
-        char *poolName, 
-        int idxCount, 
-        int key_offset, 
-        int FLAGS, 
-        void *fn) {
-
-    rdb_pool_t *pool;
-
-    //TODO:kernel frindly locks
-    rdb_sem_lock(&reg_mutex);
-
-    if (rdb_find_pool_by_name (poolName) != NULL) {
-        rdb_error ("rDB: Fatal: Duplicte pool name in rdb_register_pool");
-        pool = NULL;
-    } else {
-        pool = rdb_add_pool (poolName, idxCount, key_offset, FLAGS, fn);
-    }
-    rdb_sem_unlock(&reg_mutex);
-
-    return pool;
 }
 
-// Remove rDB traces. use before exit() or when rDB no longer needed.
-// Use rdb_init after, to re_start rDB
-
-// rdb_gc: drop pools that are marked for dropping. pools must be empty first.
-void rdb_gc() {
-    rdb_clean(1);
+// Stop sampling, the collected histograms are kept
+void rdb_latency_disable (rdb_pool_t *pool)
+{
+#ifdef RDB_POOL_STATS
+    if (pool->lat)
+        __atomic_store_n (&((rdb_lat_t *) pool->lat)->every, 0, 
+                                                        __ATOMIC_RELAXED);
+#endif
 }
 
-void rdb_clean(int gc) {
-    rdb_pool_t  *pool, 
-                *pool_next;
-
-    if (pool_root != NULL) {
-        pool = pool_root;
-
-        while (pool != NULL) {
-            pool_next = pool->next;
-
-            if (gc == 0 || (gc == 1 && pool->drop)) { 
-                rdb_drop_pool (pool);
+// Percentiles of one operation (RDB_LAT_*), in nanoseconds, each accurate 
+// to 1/16 of its value. Zeroes if nothing was sampled.
+int rdb_latency (rdb_pool_t *pool, int op, rdb_latency_t *out)
+{
+    if (pool == NULL || out == NULL || op < 0 || op >= RDB_LAT_OPS)
+        return rdb_error_value (-1, "rdb_latency: bad argument");
+    memset (out, 0, sizeof (rdb_latency_t));
+#ifdef RDB_POOL_STATS
+    {
+        rdb_lat_t   *lat = pool->lat;
+        uint64_t    *p[3] = { &out->p50, &out->p99, &out->p999 };
+        // in 1/1000s
+        uint64_t    q[3] = { 500, 990, 999 };
+        uint64_t    seen = 0, n;
+        int         b, i = 0;
+
+        if (lat == NULL)
+            return 0;
+        for (b = 0; b < RDB_LAT_BUCKETS; b++)
+            out->count += __atomic_load_n (&lat->bucket[op][b], 
+                                                        __ATOMIC_RELAXED);
+        out->max = __atomic_load_n (&lat->max[op], __ATOMIC_RELAXED);
+        for (b = 0; b < RDB_LAT_BUCKETS && i < 3; b++) {
+            n = __atomic_load_n (&lat->bucket[op][b], __ATOMIC_RELAXED);
+            if (n == 0)
+                continue;
+            seen += n;
+            while (i < 3 && seen * 1000 >= out->count * q[i]) {
+                *p[i] = _rdb_lat_value (b);
+                if (*p[i] > out->max)
+                    *p[i] = out->max;
+                i++;
             }
-
-            pool = pool_next;
         }
     }
-
-    if (!gc && rdb_error_string) {
-        rdb_free (rdb_error_string);
-        rdb_error_string = NULL;
-    }
-
-    pool_root = NULL;
-
-    return ;
+#endif
+    return 0;
 }
 
-void rdb_print_pools(void *out) {
-    rdb_pool_t  *pool, 
-                *pool_next;
-
-    if (pool_root != NULL) {
-        pool = pool_root;
+// Empty the histograms of pool
+void rdb_latency_reset (rdb_pool_t *pool)
+{
+#ifdef RDB_POOL_STATS
+    rdb_lat_t   *lat = pool->lat;
+    int         op, b;
 
-        while (pool != NULL) {
-            pool_next = pool->next;
-            //rdb_flush(pool,NULL,NULL);
-#ifdef KM
-            printk("%s\n", pool->name);
-#else
-            FILE *fp = out;
-            fprintf(fp,"%s\n", pool->name);
-#endif
-            pool = pool_next;
-        }
+    if (lat == NULL)
+        return;
+    for (op = 0; op < RDB_LAT_OPS; op++) {
+        __atomic_store_n (&lat->max[op], 0, __ATOMIC_RELAXED);
+        for (b = 0; b < RDB_LAT_BUCKETS; b++)
+            __atomic_store_n (&lat->bucket[op][b], 0, __ATOMIC_RELAXED);
     }
-    return ;
+#endif
 }
 
-// Register additional Indexes to an existing data pool
-int rdb_register_um_idx (rdb_pool_t *pool, int idx, int key_offset,
-        int FLAGS, void *compare_fn) {
-    rdb_sem_lock(&reg_mutex);
-    if (idx == 0) {
-        rdb_sem_unlock(&reg_mutex);
-        return (rdb_error_value (-1, 
-            "Index 0 (zero) can only be set via rdb_register_pool"));
-    }
+#ifdef RDB_TRACE
+// rDB internal: free replaced trace settings, no probe may be running
+static void _rdb_trace_retired_free (void)
+{
+    rdb_trace_t *t, *next;
 
-    if (idx >= RDB_POOL_MAX_IDX) {
-        rdb_sem_unlock(&reg_mutex);
-        return (rdb_error_value (-2, "Index >= RDB_POOL_MAX_IDX"));
+    t = __atomic_exchange_n (&rdb_trace_retired, NULL, __ATOMIC_ACQUIRE);
+    for (; t; t = next) {
+        next = t->next;
+        rdb_free (t);
     }
+}
+#endif
 
-    if (pool->FLAGS[idx] != 0) {
-        rdb_sem_unlock(&reg_mutex);
-        return (rdb_error_value (-3, "Redefinition of used index not allowed"));
+// Send every RDB_TRACE event to fn (NULL stops). fn runs inside the call
+// being traced, index locks held: keep it short and stay out of rDB.
+int rdb_trace_set (rdb_trace_fn_t fn, void *arg)
+{
+#ifdef RDB_TRACE
+    rdb_trace_t *t = NULL, *old;
+
+    if (fn) {
+        t = rdb_alloc (sizeof (rdb_trace_t));
+        if (t == NULL)
+            return rdb_error_code (-1, RDB_E_NOMEM, 
+                    "rdb_trace_set: out of memory");
+        t->fn = fn;
+        t->arg = arg;
     }
-
-    if (-1 == set_pool_fn_pointers(pool, idx, FLAGS, compare_fn)){
-        rdb_sem_unlock(&reg_mutex);
-        return (rdb_error_value (-4,
-            "Index Registration without valid type or compare fn. Ignored"));
+    old = __atomic_exchange_n (&rdb_trace, t, __ATOMIC_ACQ_REL);
+    if (old) {
+        old->next = __atomic_load_n (&rdb_trace_retired, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n (&rdb_trace_retired, &old->next,
+                            old, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
     }
-
-    pool->root[idx] = NULL;
-    pool->key_offset[idx] = sizeof (PP_T) * pool->indexCount + key_offset;
-    pool->FLAGS[idx] = FLAGS;
-    debug ("registered index %d for pool %s, Keyoffset is %d\n", idx, pool->name, key_offset);
-    rdb_sem_unlock(&reg_mutex);
-    return (idx);
+    return 0;
+#else
+    return rdb_error_value (-1, "rdb_trace_set: built without RDB_TRACE");
+#endif
 }
 
-// Below is a set of self explanatory compare functions...
-int key_cmp_int32 (int32_t *old, int32_t *new)
+// Size of the user structure, pointer packs included. Needed by rdb_save,
+// rdb_load (mapped pools know theirs) and counted by rdb_pool_mem().
+int rdb_pool_record_size (rdb_pool_t *pool, size_t record_size)
 {
-    return (*new <  *old) ? -1 : (( *new > *old) ? 1 : 0); 
+    if (record_size <= sizeof (PP_T) * pool->indexCount)
+        return rdb_error_value (-1, "rdb_pool_record_size: no room past the"
+                " pointer packs");
+    pool->record_size = record_size;
+    return 0;
 }
-int key_cmp_const_int32 (int32_t *old, __intmax_t new)
+
+#ifdef RDB_POOL_COUNTERS
+// rDB internal: record, index and string bytes held in pool. Records are
+// counted whole once their size is known, by their pointer packs before.
+static uint64_t _rdb_mem_data (rdb_pool_t *pool)
 {
-    return (new <  *old) ? -1 : (( new > *old) ? 1 : 0); 
+    uint64_t n = __atomic_load_n (&pool->record_count, __ATOMIC_RELAXED);
+
+    return n * (pool->record_size ? pool->record_size : 
+                                        sizeof (PP_T) * pool->indexCount) +
+        __atomic_load_n (&pool->string_bytes, __ATOMIC_RELAXED);
 }
 
-int key_cmp_uint32 (uint32_t *old, uint32_t *new)
+// rDB internal: records were added, raise the high-water mark
+static void _rdb_mem_peak (rdb_pool_t *pool)
 {
-    return (*new <  *old) ? -1 : (( *new > *old) ? 1 : 0); 
+    uint64_t    now = _rdb_mem_data (pool);
+    uint64_t    peak = __atomic_load_n (&pool->mem_peak, __ATOMIC_RELAXED);
+
+    while (now > peak && !__atomic_compare_exchange_n (&pool->mem_peak,
+                        &peak, now, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
 }
-int key_cmp_const_uint32 (uint32_t *old, __uintmax_t new)
+
+// rDB internal: add (dir 1) or remove (-1) the RDB_KPSTR strings of rec,
+// those of index only, or of all indexes (-1). A string is counted once per
+// index holding it, so rdb_insert_one / rdb_delete_one charge their own.
+static void _rdb_mem_strings_idx (rdb_pool_t *pool, void *rec, int only,
+        int dir)
 {
-    return (new <  *old) ? -1 : (( new > *old) ? 1 : 0); 
+    char    **str;
+    size_t  n = 0;
+    int     idx;
+
+    for (idx = 0; idx < pool->indexCount; idx++)
+        if (pool->FLAGS[idx] & RDB_KPSTR && (only < 0 || idx == only)) {
+            str = rec + pool->key_offset[idx];
+            if (*str) n += strlen (*str) + 1;
+        }
+    if (n == 0)
+        return;
+    if (dir > 0)
+        __atomic_add_fetch (&pool->string_bytes, n, __ATOMIC_RELAXED);
+    else
+        __atomic_sub_fetch (&pool->string_bytes, n, __ATOMIC_RELAXED);
 }
 
-int key_cmp_int16 (int16_t *old, int16_t *new)
+static void _rdb_mem_strings (rdb_pool_t *pool, void *rec, int dir)
 {
-    return (*new <  *old) ? -1 : (( *new > *old) ? 1 : 0); 
-}
-int key_cmp_const_int16 (int16_t *old, __intmax_t new)
-{   
-    return (new <  *old) ? -1 : (( new > *old) ? 1 : 0); 
+    _rdb_mem_strings_idx (pool, rec, -1, dir);
 }
+#endif
 
-int key_cmp_uint16 (uint16_t *old, uint16_t *new)
+// Memory held by pool. Records are user allocated; they are counted at 
+// the size given to rdb_pool_record_size(), or only by their pointer packs
+// (index_bytes) when that was never set.
+int rdb_pool_mem (rdb_pool_t *pool, rdb_pool_mem_t *mem)
 {
-    return (*new <  *old) ? -1 : (( *new > *old) ? 1 : 0); 
+#ifdef RDB_POOL_STATS
+    int i;
+#endif
+
+    if (pool == NULL || mem == NULL)
+        return rdb_error_value (-1, "rdb_pool_mem: NULL argument");
+    memset (mem, 0, sizeof (rdb_pool_mem_t));
+    mem->pool_bytes = sizeof (rdb_pool_t) + strlen (pool->name) + 1;
+#ifdef RDB_POOL_STATS
+    if (pool->lat)
+        mem->pool_bytes += sizeof (rdb_lat_t);
+    if (pool->lock_stats)
+        mem->pool_bytes += sizeof (rdb_lock_site_t) * RDB_LOCK_SITES;
+    for (i = 0; i < RDB_POOL_MAX_IDX; i++)
+        if (pool->hot[i])
+            mem->pool_bytes += RDB_HOT_BYTES (((rdb_hot_t *) 
+                                                        pool->hot[i])->k);
+#endif
+#ifdef RDB_POOL_COUNTERS
+    mem->records = __atomic_load_n (&pool->record_count, __ATOMIC_RELAXED);
+    mem->record_bytes = mem->records * pool->record_size;
+    mem->index_bytes = mem->records * sizeof (PP_T) * pool->indexCount;
+    mem->string_bytes = __atomic_load_n (&pool->string_bytes, 
+                                                        __ATOMIC_RELAXED);
+    mem->peak = __atomic_load_n (&pool->mem_peak, __ATOMIC_RELAXED);
+    mem->total = _rdb_mem_data (pool) + mem->pool_bytes;
+    return 0;
+#else
+    return rdb_error_value (-1, "rdb_pool_mem: built without "
+                                                    "RDB_POOL_COUNTERS");
+#endif
 }
-int key_cmp_const_uint16 (uint16_t *old, __uintmax_t new)
+
+// Restart the high-water mark from what pool holds now
+void rdb_pool_mem_reset_peak (rdb_pool_t *pool)
 {
-    return (new <  *old) ? -1 : (( new > *old) ? 1 : 0); 
+#ifdef RDB_POOL_COUNTERS
+    __atomic_store_n (&pool->mem_peak, _rdb_mem_data (pool), 
+                                                        __ATOMIC_RELAXED);
+#endif
 }
 
-int key_cmp_int8 (int8_t *old, int8_t *new)
+/* Stats export
+ *
+ * Every pool of an instance is first copied into a private snapshot, in
+ * one pass over the registry under the lookup grace period (no lock, so
+ * writers never wait for a scrape), and the text is then formatted from
+ * the copies. Counters, memory and latency are all read with relaxed
+ * loads; the tree shape, which would need the index locks, is left out.
+ */
+typedef struct rdb_export_pool_s {
+    char                *name;
+    rdb_pool_stats_t    stats;
+    rdb_pool_mem_t      mem;
+    rdb_latency_t       lat[RDB_LAT_OPS];
+    int                 has_lat;
+} rdb_export_pool_t;
+
+typedef struct rdb_export_out_s {
+    char    *buf;
+    size_t  len;
+    long    used;               // as if buf were large enough
+} rdb_export_out_t;
+
+static const char *rdb_export_ops[RDB_LAT_OPS] = {
+    [RDB_LAT_INSERT]    = "insert",
+    [RDB_LAT_GET]       = "get",
+    [RDB_LAT_DELETE]    = "delete",
+    [RDB_LAT_ITERATE]   = "iterate",
+};
+
+#ifdef RDB_POOL_STATS
+static const struct {
+    const char  *name;
+    size_t      offset;
+} rdb_export_idx[] = {
+    { "inserts",    offsetof (rdb_idx_stats_t, inserts) },
+    { "gets",       offsetof (rdb_idx_stats_t, gets) },
+    { "misses",     offsetof (rdb_idx_stats_t, misses) },
+    { "deletes",    offsetof (rdb_idx_stats_t, deletes) },
+    { "compares",   offsetof (rdb_idx_stats_t, compares) },
+    { "rotations",  offsetof (rdb_idx_stats_t, rotations) },
+    { "restarts",   offsetof (rdb_idx_stats_t, restarts) },
+};
+#define RDB_EXPORT_IDX  (sizeof (rdb_export_idx) / sizeof (rdb_export_idx[0]))
+#define RDB_IDX_STAT(st, i, f) \
+    (*(uint64_t *) ((void *) &(st)->idx[i] + rdb_export_idx[f].offset))
+#endif
+
+static void _rdb_out (rdb_export_out_t *o, const char *fmt, ...)
 {
-    return (*new <  *old) ? -1 : (( *new > *old) ? 1 : 0); 
+    va_list ap;
+    size_t  room = (size_t) o->used < o->len ? o->len - o->used : 0;
+    int     n;
+
+    va_start (ap, fmt);
+    n = vsnprintf (room ? o->buf + o->used : NULL, room, fmt, ap);
+    va_end (ap);
+    if (n > 0)
+        o->used += n;
 }
-int key_cmp_const_int8 (int8_t *old, __intmax_t new)
+
+// rDB internal: a pool name as a JSON string or Prometheus label value
+static void _rdb_out_name (rdb_export_out_t *o, const char *name, int json)
 {
-    return (new <  *old) ? -1 : (( new > *old) ? 1 : 0); 
+    _rdb_out (o, "\"");
+    for (; *name; name++) {
+        if (*name == '"' || *name == '\\')
+            _rdb_out (o, "\\%c", *name);
+        else if (*name == '\n')
+            _rdb_out (o, "\\n");
+        else if (json && (unsigned char) *name < 0x20)
+            _rdb_out (o, "\\u%04x", *name);
+        else
+            _rdb_out (o, "%c", *name);
+    }
+    _rdb_out (o, "\"");
 }
 
-int key_cmp_uint8 (uint8_t *old, uint8_t *new)
+// rDB internal: copy every pool of ctx into snap, at most max. Returns the
+// count, -1 if ctx holds more
+static int _rdb_export_snap (rdb_ctx_t *ctx, rdb_export_pool_t *snap, 
+        int max)
 {
-    return (*new <  *old) ? -1 : (( *new > *old) ? 1 : 0); 
+    rdb_reg_table_t *table;
+    rdb_pool_t      *pool;
+    uint32_t        seq, b;
+    int             n, epoch;
+#ifdef RDB_POOL_STATS
+    int             op;
+#endif
+
+    epoch = _rdb_reg_enter (ctx);
+    do {
+        for (n = 0; n < max; n++)
+            if (snap[n].name) {
+                rdb_free (snap[n].name);
+                snap[n].name = NULL;
+            }
+        n = 0;
+        seq = rdb_load_acquire (ctx->reg_seq);
+        table = rdb_load_acquire (ctx->reg_table);
+        for (b = 0; table && b < table->size && n <= max; b++)
+            for (pool = rdb_load_acquire (table->bucket[b]); pool && n <= max;
+                    pool = rdb_load_acquire (pool->hnext)) {
+                if (n == max) {
+                    n++;
+                    break;
+                }
+                snap[n].name = rdb_alloc_atomic (strlen (pool->name) + 1);
+                if (snap[n].name == NULL)
+                    continue;
+                strcpy (snap[n].name, pool->name);
+                _rdb_pool_counters (pool, &snap[n].stats);
+#ifdef RDB_POOL_COUNTERS
+                rdb_pool_mem (pool, &snap[n].mem);
+#endif
+                snap[n].has_lat = 0;
+#ifdef RDB_POOL_STATS
+                snap[n].has_lat = pool->lat != NULL;
+                for (op = 0; snap[n].has_lat && op < RDB_LAT_OPS; op++)
+                    rdb_latency (pool, op, &snap[n].lat[op]);
+#endif
+                n++;
+            }
+    } while ((seq & 1) || rdb_load_acquire (ctx->reg_seq) != seq);
+    _rdb_reg_exit (ctx, epoch);
+    return n > max ? -1 : n;
 }
-int key_cmp_const_uint8 (uint8_t *old, __uintmax_t new)
+
+static void _rdb_export_json (rdb_export_out_t *o, rdb_export_pool_t *snap,
+        int n)
 {
-    return (new <  *old) ? -1 : (( new > *old) ? 1 : 0); 
-}
+    rdb_export_pool_t   *p;
+    const char          *sep = "";
+    int                 i, op;
+#ifdef RDB_POOL_STATS
+    int                 idx;
+#endif
 
-int key_cmp_int64 (int64_t *old, int64_t *new)
-{
-    return (*new <  *old) ? -1 : (( *new > *old) ? 1 : 0); 
-}
-int key_cmp_const_int64 (int64_t *old, __intmax_t new)
-{
-    return (new <  *old) ? -1 : (( new > *old) ? 1 : 0); 
+    _rdb_out (o, "{\"pools\":[");
+    for (i = 0; i < n; i++) {
+        p = &snap[i];
+        if (p->name == NULL)
+            continue;
+        _rdb_out (o, "%s{\"name\":", sep);
+        sep = ",";
+        _rdb_out_name (o, p->name, 1);
+        _rdb_out (o, ",\"indexes\":%d", p->stats.indexCount);
+#ifdef RDB_POOL_COUNTERS
+        _rdb_out (o, ",\"records\":%lu,\"memory\":{\"record_bytes\":%llu,"
+                "\"index_bytes\":%llu,\"string_bytes\":%llu,"
+                "\"pool_bytes\":%llu,\"total\":%llu,\"peak\":%llu}",
+                (unsigned long) p->stats.record_count,
+                (unsigned long long) p->mem.record_bytes,
+                (unsigned long long) p->mem.index_bytes,
+                (unsigned long long) p->mem.string_bytes,
+                (unsigned long long) p->mem.pool_bytes,
+                (unsigned long long) p->mem.total,
+                (unsigned long long) p->mem.peak);
+#endif
+#ifdef RDB_POOL_STATS
+        _rdb_out (o, ",\"index\":[");
+        for (idx = 0; idx < p->stats.indexCount; idx++) {
+            for (op = 0; op < (int) RDB_EXPORT_IDX; op++)
+                _rdb_out (o, "%s\"%s\":%llu", op ? "," : idx ? ",{" : "{",
+                        rdb_export_idx[op].name,
+                        (unsigned long long) RDB_IDX_STAT (&p->stats, idx, op));
+            _rdb_out (o, "}");
+        }
+        _rdb_out (o, "]");
+#endif
+        if (p->has_lat) {
+            _rdb_out (o, ",\"latency_ns\":{");
+            for (op = 0; op < RDB_LAT_OPS; op++)
+                _rdb_out (o, "%s\"%s\":{\"count\":%llu,\"p50\":%llu,"
+                        "\"p99\":%llu,\"p999\":%llu,\"max\":%llu}", 
+                        op ? "," : "", rdb_export_ops[op],
+                        (unsigned long long) p->lat[op].count,
+                        (unsigned long long) p->lat[op].p50,
+                        (unsigned long long) p->lat[op].p99,
+                        (unsigned long long) p->lat[op].p999,
+                        (unsigned long long) p->lat[op].max);
+            _rdb_out (o, "}");
+        }
+        _rdb_out (o, "}");
+    }
+    _rdb_out (o, "]}\n");
 }
 
-int key_cmp_uint64 (uint64_t *old, uint64_t *new)
+// rDB internal: one Prometheus sample line, labels are pool and extra
+static void _rdb_prom (rdb_export_out_t *o, const char *metric, 
+        const char *pool, const char *extra, unsigned long long value)
 {
-    return (*new <  *old) ? -1 : (( *new > *old) ? 1 : 0); 
-}
-int key_cmp_const_uint64 (uint64_t *old, __uintmax_t new)
-{
-    return (new <  *old) ? -1 : (( new > *old) ? 1 : 0); 
+    _rdb_out (o, "%s{pool=", metric);
+    _rdb_out_name (o, pool, 0);
+    _rdb_out (o, "%s} %llu\n", extra, value);
 }
 
-int key_cmp_ptr (void **old, void **new)
-{
-    if ( new == NULL ) {
-       return -1;
-    } 
-    return (*new <  *old) ? -1 : (( *new > *old) ? 1 : 0); 
-}
-int key_cmp_const_ptr (void *old, size_t new)
+static void _rdb_export_prom (rdb_export_out_t *o, rdb_export_pool_t *snap,
+        int n)
 {
-    return ((void *) new <  old) ? -1 : (( (void *) new > old) ? 1 : 0); 
-}
+    char    label[48];
+    int     i, op;
+#ifdef RDB_POOL_STATS
+    char    metric[48];
+    int     idx, f;
+#endif
 
-int key_cmp_size_t (size_t *old, size_t *new)
-{
-    return (*new <  *old) ? -1 : (( *new > *old) ? 1 : 0); 
-}
-int key_cmp_const_size_t (size_t *old, size_t new)
-{
-    return (new <  *old) ? -1 : (( new > *old) ? 1 : 0); 
+#ifdef RDB_POOL_COUNTERS
+    _rdb_out (o, "# TYPE rdb_pool_records gauge\n");
+    for (i = 0; i < n; i++)
+        if (snap[i].name)
+            _rdb_prom (o, "rdb_pool_records", snap[i].name, "",
+                                                snap[i].stats.record_count);
+    _rdb_out (o, "# TYPE rdb_pool_memory_bytes gauge\n");
+    for (i = 0; i < n; i++) {
+        if (snap[i].name == NULL)
+            continue;
+        _rdb_prom (o, "rdb_pool_memory_bytes", snap[i].name, 
+                                ",kind=\"record\"", snap[i].mem.record_bytes);
+        _rdb_prom (o, "rdb_pool_memory_bytes", snap[i].name, 
+                                ",kind=\"index\"", snap[i].mem.index_bytes);
+        _rdb_prom (o, "rdb_pool_memory_bytes", snap[i].name, 
+                                ",kind=\"string\"", snap[i].mem.string_bytes);
+        _rdb_prom (o, "rdb_pool_memory_bytes", snap[i].name, 
+                                ",kind=\"pool\"", snap[i].mem.pool_bytes);
+    }
+    _rdb_out (o, "# TYPE rdb_pool_memory_peak_bytes gauge\n");
+    for (i = 0; i < n; i++)
+        if (snap[i].name)
+            _rdb_prom (o, "rdb_pool_memory_peak_bytes", snap[i].name, "", 
+                                                        snap[i].mem.peak);
+#endif
+#ifdef RDB_POOL_STATS
+    for (f = 0; f < (int) RDB_EXPORT_IDX; f++) {
+        snprintf (metric, sizeof (metric), "rdb_index_%s_total", 
+                                                    rdb_export_idx[f].name);
+        _rdb_out (o, "# TYPE %s counter\n", metric);
+        for (i = 0; i < n; i++)
+            for (idx = 0; snap[i].name && idx < snap[i].stats.indexCount; 
+                                                                    idx++) {
+                snprintf (label, sizeof (label), ",index=\"%d\"", idx);
+                _rdb_prom (o, metric, snap[i].name, label, 
+                                        RDB_IDX_STAT (&snap[i].stats, idx, f));
+            }
+    }
+#endif
+    _rdb_out (o, "# TYPE rdb_latency_nanoseconds summary\n");
+    for (i = 0; i < n; i++) {
+        if (snap[i].name == NULL || !snap[i].has_lat)
+            continue;
+        for (op = 0; op < RDB_LAT_OPS; op++) {
+            snprintf (label, sizeof (label), ",op=\"%s\",quantile=\"0.5\"", 
+                                                        rdb_export_ops[op]);
+            _rdb_prom (o, "rdb_latency_nanoseconds", snap[i].name, label, 
+                                                        snap[i].lat[op].p50);
+            snprintf (label, sizeof (label), ",op=\"%s\",quantile=\"0.99\"",
+                                                        rdb_export_ops[op]);
+            _rdb_prom (o, "rdb_latency_nanoseconds", snap[i].name, label, 
+                                                        snap[i].lat[op].p99);
+            snprintf (label, sizeof (label), ",op=\"%s\",quantile=\"0.999\"",
+                                                        rdb_export_ops[op]);
+            _rdb_prom (o, "rdb_latency_nanoseconds", snap[i].name, label, 
+                                                        snap[i].lat[op].p999);
+            snprintf (label, sizeof (label), ",op=\"%s\"", 
+                                                        rdb_export_ops[op]);
+            _rdb_prom (o, "rdb_latency_nanoseconds_count", snap[i].name, 
+                                                label, snap[i].lat[op].count);
+        }
+    }
 }
 
-int key_cmp_ssize_t (ssize_t *old, ssize_t *new)
+// Write the counters, memory and latency of every pool of ctx to buf as
+// JSON (RDB_EXPORT_JSON) or Prometheus text (RDB_EXPORT_PROM). Returns 
+// the length of the whole text, like snprintf: when that is len or more, 
+// buf was too short and holds a truncated copy. -1 on error.
+long rdb_ctx_export (rdb_ctx_t *ctx, int format, char *buf, size_t len)
 {
-    return (*new <  *old) ? -1 : (( *new > *old) ? 1 : 0); 
+    rdb_export_pool_t   *snap;
+    rdb_export_out_t    o = { buf, len, 0 };
+    int                 max, n, i;
+
+    if (ctx == NULL || (buf == NULL && len) || 
+            (format != RDB_EXPORT_JSON && format != RDB_EXPORT_PROM))
+        return rdb_error_value (-1, "rdb_export: bad argument");
+    for (max = __atomic_load_n (&ctx->reg_count, __ATOMIC_RELAXED) + 16;; 
+                                                                max *= 2) {
+        snap = rdb_alloc (sizeof (rdb_export_pool_t) * max);
+        if (snap == NULL)
+            return rdb_error_code (-1, RDB_E_NOMEM, 
+                                            "rdb_export: out of memory");
+        memset (snap, 0, sizeof (rdb_export_pool_t) * max);
+        if ((n = _rdb_export_snap (ctx, snap, max)) >= 0)
+            break;
+        for (i = 0; i < max; i++)
+            if (snap[i].name)
+                rdb_free (snap[i].name);
+        rdb_free (snap);
+    }
+
+    if (len)
+        buf[0] = 0;
+    if (format == RDB_EXPORT_JSON)
+        _rdb_export_json (&o, snap, n);
+    else
+        _rdb_export_prom (&o, snap, n);
+
+    for (i = 0; i < n; i++)
+        if (snap[i].name)
+            rdb_free (snap[i].name);
+    rdb_free (snap);
+    return o.used;
 }
-int key_cmp_const_ssize_t (ssize_t *old, ssize_t new)
+
+long rdb_export (int format, char *buf, size_t len)
 {
-    return (new <  *old) ? -1 : (( new > *old) ? 1 : 0); 
+    return rdb_ctx_export (&rdb_ctx_default, format, buf, len);
 }
-/* 128 bit fn's are tricky when we don't have 128 native type to supply a 
- * comperator.
- * 256 bit's are alwways that way .... 
- * as such, 'const' fn's will take biggest native size as comperator while
- * non-const will use full size of type
- * */
 
+// rDB Internal. this will set the various compate functions for the rDB
+// data maganment routines.
+int set_pool_fn_pointers(rdb_pool_t *pool, int i, uint32_t flags, void *cmp_fn){
+
+    if (cmp_fn) {
+        pool->fn[i] = cmp_fn;
+        pool->get_fn[i] = cmp_fn;
+        pool->get_const_fn[i] = cmp_fn;
+    } else if (flags & RDB_KINT32) {   
+        pool->fn[i] = key_cmp_int32;
+        pool->get_fn[i] = key_cmp_int32;
+        pool->get_const_fn[i] = key_cmp_const_int32;
+    } else if (flags & RDB_KUINT32){  
+        pool->fn[i] = key_cmp_uint32;
+        pool->get_fn[i] = key_cmp_uint32;
+        pool->get_const_fn[i] = key_cmp_const_uint32;
+    } else if (flags & RDB_KINT64) {
+        pool->fn[i] = key_cmp_int64;
+        pool->get_fn[i] = key_cmp_int64;
+        pool->get_const_fn[i] = key_cmp_const_int64;
+    } else if (flags & RDB_KUINT64) {
+        pool->fn[i] = key_cmp_uint64;
+        pool->get_fn[i] = key_cmp_uint64;
+        pool->get_const_fn[i] = key_cmp_const_uint64;
+    } else if (flags & RDB_KINT16) {
+        pool->fn[i] = key_cmp_int16;
+        pool->get_fn[i] = key_cmp_int16;
+        pool->get_const_fn[i] = key_cmp_const_int16;
+    } else if (flags & RDB_KUINT16) {
+        pool->fn[i] = key_cmp_uint16;
+        pool->get_fn[i] = key_cmp_uint16;
+        pool->get_const_fn[i] = key_cmp_const_uint16;
+    } else if (flags & RDB_KINT8) {
+        pool->fn[i] = key_cmp_int8;
+        pool->get_fn[i] = key_cmp_int8;
+        pool->get_const_fn[i] = key_cmp_const_int8;
+    } else if (flags & RDB_KUINT8) {
+        pool->fn[i] = key_cmp_uint8;
+        pool->get_fn[i] = key_cmp_uint8;
+        pool->get_const_fn[i] = key_cmp_const_uint8;
+    } else if (flags & RDB_KSIZE_t) {
+        pool->fn[i] = key_cmp_size_t;
+        pool->get_fn[i] = key_cmp_size_t;
+        pool->get_const_fn[i] = key_cmp_const_size_t;
+    } else if (flags & RDB_KSSIZE_t) {
+        pool->fn[i] = key_cmp_ssize_t;
+        pool->get_fn[i] = key_cmp_ssize_t;
+        pool->get_const_fn[i] = key_cmp_const_ssize_t;
+    } else if (flags & RDB_KPTR) {
+        pool->fn[i] = key_cmp_ptr;
+        pool->get_fn[i] = key_cmp_const_ptr;
+        pool->get_const_fn[i] = key_cmp_const_ptr;
+    } 
 #ifdef USE_128_BIT_TYPES
-int key_cmp_int128 (__int128_t *old, __int128_t *new)
-{
-    return (*new <  *old) ? -1 : (( *new > *old) ? 1 : 0); 
-}
-int key_cmp_const_int128 (__int128_t *old, __int128_t new)
-{
-    return (new <  *old) ? -1 : (( new > *old) ? 1 : 0); 
+      else if (flags & RDB_KINT128) {
+        pool->fn[i] = key_cmp_int128;
+        pool->get_fn[i] = key_cmp_int128;
+        pool->get_const_fn[i] = key_cmp_const_int128;
+    } else if (flags & RDB_KUINT128) {
+        pool->fn[i] = key_cmp_uint128;
+        pool->get_fn[i] = key_cmp_uint128;
+        pool->get_const_fn[i] = key_cmp_const_uint128;
+    } 
+#endif
+      else if (flags & RDB_KSTR) {
+        pool->fn[i] = key_cmp_str;
+        pool->get_fn[i] = key_cmp_str; 
+        pool->get_const_fn[i] = key_cmp_str; 
+    } else if (flags & RDB_KPSTR) {
+        pool->fn[i] = key_cmp_str_p;
+        pool->get_fn[i] = key_cmp_const_str_p;
+        pool->get_const_fn[i] = key_cmp_const_str_p;
+    //else if (FLAGS & RDB_KTME)    pool->fn[0] = keyCompareTME;
+    //else if (FLAGS & RDB_KTMA)    pool->fn[0] = keyCompareTMA;
+    } else if (flags & RDB_NOKEYS) {
+        pool->fn[i] = NULL;
+        pool->get_fn[i] = NULL;
+        pool->get_const_fn[i] = NULL;
+    } else {
+        return -1;
+    }
+    return 0;
 }
 
-int key_cmp_uint128 (__uint128_t *old, __uint128_t *new)
-{
-    return (*new <  *old) ? -1 : (( *new > *old) ? 1 : 0); 
-}
-int key_cmp_const_uint128 (__uint128_t *old, __uint128_t new)
-{
-    return (new <  *old) ? -1 : (( new > *old) ? 1 : 0); 
-}
-#else
-//TODO: use GMP if found, to support big numbers safely.
-/* - this junk is here until i decide which way to go - GMP, native, or NONE, when we have no native 128 bit support
- * currently it's out - no 128 bit without 128 bit native support.
- *
-int key_cmp_int128 (type_128 *old, type_128 *new)
-{
-    return (*new->msb <  *old->msb) ? -1 : (( *new->msb > *old->msb) ? 1 : ((*new->lsb < *old->lsb) ? -1 : ((*new->lsb > *old->lsb) ? 1 : 0 ))); 
-}
-int key_cmp_const_int128 (type_128 *old, __intmax_t new)
-{
-    //type_128 new_new;
-    //new_new.lsb=new;
-    //if (new < 0) new_new.msb=0xffffffffffffffff; // extending the sign
-    if (0 < *old->msb ) return -1;    // must be bigger then what we can spcify with 64 bits 'new'
-    if (0 > *old->msb && *old->msb != -1) return 1;
-    return (new <  (int64_t) *old->lsb) ? -1 : (( new > (int64_t) *old->lsb) ? 1 : 0); 
-    //return (new <  *old) ? -1 : (( new > *old) ? 1 : 0); 
-    //return (new <  *old->msb) ? -1 : (( new > *old->msb) ? 1 : ((new < *old->lsb) ? -1 : ((new > *old->lsb) ? 1 : 0 ))); 
-}
+// rDB Iternal: drop a new pool from our pool chain
+#ifndef KM
+static void _rdb_snap_drop (rdb_pool_t *pool);
+#endif
 
-int key_cmp_uint128 (__uint128_t *old, type_128 *new)
-{
-    return (*new <  *old) ? -1 : (( *new > *old) ? 1 : 0); 
-    return (*new->msb <  *old->msb) ? -1 : (( *new->msb > *old->msb) ? 1 : ((*new->lsb < *old->lsb) ? -1 : ((*new->lsb > *old->lsb) ? 1 : 0 ))); 
-}
-int key_cmp_const_uint128 (__uint128_t *old, __uint128_t new)
+// rDB internal: free a pool no longer in the pool chain
+static void _rdb_pool_free (rdb_pool_t *pool)
 {
-    return (new <  *old) ? -1 : (( new > *old) ? 1 : 0); 
-}*/
+#ifdef RDB_POOL_STATS
+    int        i;
+
+    if (pool->lat)
+        rdb_free (pool->lat);
+    if (pool->lock_stats)
+        rdb_free (pool->lock_stats);
+    for (i = 0; i < RDB_POOL_MAX_IDX; i++)
+        if (pool->hot[i])
+            rdb_free (pool->hot[i]);
 #endif
-//TODO add 256 bit types, and fix rDB.h line 38 to reflect
 
-int key_cmp_str (char *old, char *new)
-{
-    return strcmp ( new, old);
+    if (pool->name) {
+        //info ("freeing %s\n", pool->name);
+        rdb_free (pool->name);
+    }
+    rdb_free (pool);
 }
 
-int key_cmp_str_p (char **old, char **new)
-{
-    return strcmp ( *new, *old);
-}
-int key_cmp_const_str_p (char **old, char *new)
-{
-    return strcmp ( new, *old);
-}
-/*int keyCompareTME (struct timeval *key, struct timeval *keyNew)
-{
-    if (keyNew->tv_sec != key->tv_sec) return ((keyNew->tv_sec < key->tv_sec) ? -1 : 1);
+void rdb_drop_pool (rdb_pool_t *pool) {
+    rdb_pool_t *prev, *next;
+    rdb_ctx_t  *ctx;
 
-    if (keyNew->tv_usec != key->tv_sec) return ((keyNew->tv_usec < key->tv_usec) ? -1 : 1);
-    return 0;
-}*/
+    if (pool && pool->name); // info("dropping %s\n", pool->name);
+    else return;
 
-/*int keyCompareTMA (TVA *key, TVA *keyNew)
-{
-    if (keyNew->tv.tv_sec != key->tv.tv_sec) return ((keyNew->tv.tv_sec <
-                        key->tv.tv_sec) ? -1 : 1);
-    if (keyNew->tv.tv_usec != key->tv.tv_usec) return ((keyNew->tv.tv_usec <
-                        key->tv.tv_usec) ? -1 : 1);
-    if (keyNew->acc != key->acc) return ((keyNew->acc < key->acc) ? -1 : 1);
-    return 0;
-}*/
+#ifndef KM
+    // a mapped pool is written back first; rdb_mmap_close() then drops it
+    if (pool->mmap) {
+        rdb_mmap_close (pool);
+        return;
+    }
+#endif
 
-//TODO: some compilers dont like this inlining. need more research
-/*inline*/ void set_pointers (
-        rdb_pool_t *pool, 
-        int index, 
-        void *start, 
-        PP_T ** ppk, 
-        void **dataHead){
+    ctx = pool->ctx;
+    rdb_sem_lock(&ctx->reg_mutex);
+    next=pool->next;
+    prev=pool->prev;
 
-    if (start == NULL || (start == pool->root[index]))
-        *ppk = (void *) pool->root[index] + (sizeof (PP_T) * index);
-    else
-        *ppk = (void *) start + (sizeof (PP_T) * index);
+    if (prev) {
+        prev->next = pool->next;
+    }
+    if (next) {
+        next->prev = pool->prev;
+    }
+    if (ctx->pool_root == pool) {
+        if (prev) {
+            ctx->pool_root = prev;
+        } else if (next) {
+            ctx->pool_root = next;
+        } else {
+            ctx->pool_root = NULL;
+        }
+    }
+    // lookups may still be passing through it
+    _rdb_reg_del (ctx, pool);
+    _rdb_reg_sync (ctx);
+    rdb_sem_unlock(&ctx->reg_mutex);
+
+#ifndef KM
+    if (pool->capture)
+        rdb_capture_stop (pool);
+    // pending log entries are committed before the log goes
+    if (pool->wal)
+        rdb_wal_close (pool);
+    // our magazine goes back to the stack; other threads' are dropped by
+    // generation the next time they look the address up
+    if (pool->FLAGS[0] & RDB_MAGAZINE)
+        rdb_lifo_mag_flush (pool);
+    // live snapshots keep the pool, the last release frees it
+    if (__atomic_fetch_add (&pool->snap_refs, RDB_SNAP_DROPPED, 
+                                                    __ATOMIC_ACQ_REL))
+        return;
+    _rdb_snap_drop (pool);
+#endif
 
-    *dataHead = (void *) *ppk - (sizeof (PP_T) * index);
-    return;
+    _rdb_pool_free (pool);
 }
 
-// TODO: Bring this up-to-date
-// Note: type casting used to 
-// 1) hash compiler about identcal type warnings, like 
-// uint32 and unisnged long ...
-// 2) handle int32 as long, since long is 32 bit on 16, 32 and 64 bit machines
-//
-void _rdb_dump (rdb_pool_t *pool, int index, char *separator, void *start)
-{
-    void  **searchNext;
-    PP_T   *pp;
-    rdb_key_union *key;
+// rDB Iternal: Add a new pool to the ctx pool chain. reg_mutex held
+static rdb_pool_t *_rdb_add_pool (
+        rdb_ctx_t *ctx,
+        char *poolName, 
+        int indexCount, 
+        int key_offset, 
+        int FLAGS, 
+        void *compare_fn) {
 
-    if (start == NULL && pool->root[index] == NULL) return;
+    rdb_pool_t *pool;
+    int name_length;
+    int i;
+#ifndef KM
+    pthread_rwlockattr_t rw_attr;
+#endif
 
-    if (start == NULL)
-        maxLevels = 1;
-    else
-        levels++;
+    if (_rdb_reg_grow (ctx)) {
+        rdb_error_code (0, RDB_E_NOMEM,
+                "rDB: Fatal: pool registry allocation error, out of memory");
+        return NULL;
+    }
 
-    if (levels > maxLevels)
-        maxLevels = levels;
+    pool = rdb_alloc(sizeof (rdb_pool_t));
 
-    if (pool->FLAGS[index] & RDB_BTREE && (pool->FLAGS[index] & RDB_NOKEYS))  {
-        pp = ((void *) (pool->root[index])) + (sizeof (PP_T) * index) ;    // print data-head
-        while (pp) {
-            //searchNext = (void **) pp;
-            //key = (void *) searchNext + pool->key_offset[0];
-            //info ("%s%s", &key->str, separator);
-            rdb_c_info ("%p%s", pp, separator);
-            pp = pp->right;
-        }
-    } else if (pool->FLAGS[index] & RDB_BTREE && (pool->FLAGS[index] & RDB_KEYS)) {
-        if (start == NULL) {
-            pp = (void *) pool->root[index] + (sizeof (PP_T) * index);
-            searchNext = (void **) pool->root[index];
-        }
-        else {
-            searchNext = start;
-            pp = start + (sizeof (PP_T) * index);
-        }
+    if (pool == NULL) {
+        rdb_error_code (0, RDB_E_NOMEM,
+                "Fatal: Pool allocation error, out of memory");
+        return NULL;
+    }
 
-        key = (void *) searchNext + pool->key_offset[index];
+    memset (pool, 0, sizeof (rdb_pool_t));
 
-        if (pp->left != NULL) {
-            _rdb_dump (pool, index, separator, pp->left);
-            levels--;
-        }
+    // inserting myself to the top of the pool, why? 
+    // because it is easy, don't need to look for the end of the pool chain
+    pool->ctx = ctx;
+    pool->next = ctx->pool_root;
 
-        switch (pool->FLAGS[index] & RDB_KEYS) {
-            case RDB_KPTR:
-                rdb_c_info ("%p%s", (void *) key->pStr, separator);
-                break;
+    if (ctx->pool_root)
+        ((rdb_pool_t *) ctx->pool_root)->prev = pool;
 
-            case RDB_KPSTR:
-                rdb_c_info ("%s%s", key->pStr, separator);
-                break;
+    ctx->pool_root = pool;
+    name_length = strlen (poolName);
+    pool->name = rdb_alloc (name_length + 1);
 
-            case RDB_KSTR:
-                rdb_c_info ("%s%s", &key->str, separator);
-                break;
+    if (pool->name == NULL) {
+        rdb_error ("rDB: Fatal: pool allocation error, out of memor for pool"
+                " name");
+        ctx->pool_root = pool->next;
+        if (ctx->pool_root)
+            ctx->pool_root->prev = NULL;
+        rdb_free (pool);
+        return NULL;
+    }
 
-            case RDB_KINT8:
-                rdb_c_info ("%hhd%s", key->i8, separator);
-                break;
+    strncpy (pool->name, poolName, name_length+1); //+1 to shut compiler warning on some systems, even though we overwrite it to ensure terminating null.
+    pool->name[name_length] = 0;
+    
+    if (-1 == set_pool_fn_pointers(pool, 0, FLAGS, compare_fn)){
+        rdb_error ("rDB: Fatal: pool registration without type or matching"
+                " compare fn");
+        ctx->pool_root = pool->next;
+        if (ctx->pool_root)
+            ctx->pool_root->prev = NULL;
+        rdb_free (pool);
+        return NULL;
+    }
 
-            case RDB_KINT16:
-                rdb_c_info ("%hd%s", key->i16, separator);
-                break;
+#ifndef KM
+    if ((FLAGS & RDB_LOCKFREE && (!(FLAGS & RDB_KLIFO) || indexCount != 1)) ||
+            (FLAGS & RDB_MAGAZINE && !(FLAGS & RDB_LOCKFREE))) {
+        rdb_error ("rDB: Fatal: RDB_LOCKFREE requires a single index RDB_KLIFO"
+                " pool");
+        ctx->pool_root = pool->next;
+        if (ctx->pool_root)
+            ctx->pool_root->prev = NULL;
+        rdb_free (pool->name);
+        rdb_free (pool);
+        return NULL;
+    }
+    if (FLAGS & RDB_MAGAZINE)
+        pool->lf_gen = __atomic_add_fetch (&rdb_lf_gen, 1,
+                                                    __ATOMIC_RELAXED);
+#endif
 
-            case RDB_KINT32:
-                rdb_c_info ("%ld%s", (long) key->i32, separator);
-                break;
+    pool->root[0] = NULL;
+    pool->key_offset[0] = sizeof (PP_T) * indexCount + key_offset;
 
-            case RDB_KINT64:
-                rdb_c_info ("%lld%s", (long long int) key->i64, separator);
-                break;
+    debug ("pool->key_offset=%d\n", pool->key_offset[0]);
 
-            case RDB_KUINT8:
-                rdb_c_info ("%hhu%s", key->u8, separator);
-                break;
+    pool->indexCount = indexCount;
+    pool->FLAGS[0] = FLAGS;
 
-            case RDB_KUINT16:
-                rdb_c_info ("%hu%s", key->u16, separator);
-                break;
+    debug ("pool %s, FLAGS=%xn", pool->name, pool->FLAGS[0]);
+#ifdef KM
+    sema_init(&pool->read_mutex, 1);
+    sema_init(&pool->write_mutex, 1);
+    sema_init(&pool->update_mutex, 1);
+    for (i = 0; i < RDB_POOL_MAX_IDX; i++)
+        init_rwsem(&pool->idx_lock[i]);
+#else
+    pthread_mutex_init(&pool->read_mutex, NULL); 
+    pthread_mutex_init(&pool->write_mutex, NULL); 
+    pthread_mutex_init(&pool->update_mutex, NULL); 
+    pthread_rwlockattr_init(&rw_attr);
+#ifdef __GLIBC__
+    // steady get traffic should not starve writers
+    pthread_rwlockattr_setkind_np(&rw_attr,
+            PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+    for (i = 0; i < RDB_POOL_MAX_IDX; i++)
+        pthread_rwlock_init(&pool->idx_lock[i], &rw_attr);
+    pthread_rwlockattr_destroy(&rw_attr);
+#endif
+    _rdb_reg_add (ctx, pool);
+    return pool;
+}
 
-            case RDB_KUINT32:
-                rdb_c_info ("%lu%s", (unsigned long) key->u32, separator);
-                break;
+rdb_pool_t *rdb_add_pool (
+        char *poolName, 
+        int indexCount, 
+        int key_offset, 
+        int FLAGS, 
+        void *compare_fn) {
 
-            case RDB_KUINT64:
-                rdb_c_info ("%llu%s", (unsigned long long) key->u64, separator);
-                break;
+    rdb_pool_t *pool;
 
-            //TODO: this is a bug, data below may be truncated.
-            //need to craft 128bit decimal print functions.
-            //
-#ifdef USE_128_BIT_TYPES
-            case RDB_KUINT128:
-                rdb_c_info ("%llu%s", (unsigned long long) key->u128, separator);
-                break;
+    rdb_sem_lock(&rdb_ctx_default.reg_mutex);
+    pool = _rdb_add_pool (&rdb_ctx_default, poolName, indexCount, key_offset,
+            FLAGS, compare_fn);
+    rdb_sem_unlock(&rdb_ctx_default.reg_mutex);
+    return pool;
+}
 
-            case RDB_KINT128:
-                rdb_c_info ("%lld%s", (long long) key->u128, separator);
-                break;
-#endif
-            case RDB_KSIZE_t:
-                rdb_c_info ("%zu%s", (size_t) key->st, separator);
-                break;
+// Register data pool with rDB, returns a pool handler to be used with future
+// function calls.
+// key_offset is the offset form the start of the user data, ignoring the pp_t[]
+// at the start of the structure - however it is calculated and stored as offset
+// from the top of the structure.
 
-            case RDB_KSSIZE_t:
-                rdb_c_info ("%zd%s", (ssize_t) key->sst, separator);
-                break;
-            // we can't print custom functions data so we print the address
-            // TODO: Consider adding a print-to-str fn() hook to pool, so we can dump custom-index data
-            case RDB_KCF:
-                rdb_c_info ("%p%s", key, separator);
-                break;
- /*           case RDB_KTME:
-                printoutalways ("Dump_TME: %ld:%ld\n", key->tv.tv_sec, key->tv.tv_usec);
-                break;
+rdb_pool_t *rdb_ctx_register_um_pool (
+        rdb_ctx_t *ctx,
+        char *poolName, 
+        int idxCount, 
+        int key_offset, 
+        int FLAGS, 
+        void *fn) {
 
-            case RDB_KTMA:
-                printoutalways ("Dump_TMA: %lu:%lu.%lu\n", (unsigned long) key->tva.tv.tv_sec,
-                                (unsigned long) key->tva.tv.tv_usec, (unsigned long) key->tva.acc);
-                break;
-*/
-            /*case RDB_K4U32A:
-                printoutalways ("Dump_4U23A: %lu:%lu:%lu:%lu\n", (unsigned long) key->u32a.l1,
-                                (unsigned long) key->u32a.l2, (unsigned long) key->u32a.l3, (unsigned long) key->u32a.acc);
-                break;*/
-        }
+    rdb_pool_t *pool;
 
-#ifdef DEBUG
-        //        if (levels == maxLevels)
-        //            printf ("LEVELS %d\n", maxLevels);
-#endif
+    //TODO:kernel frindly locks
+    rdb_sem_lock(&ctx->reg_mutex);
 
-        if (pp->right != NULL) {
-            _rdb_dump (pool, index, separator, pp->right);
-            levels--;
-        }
+    if (rdb_ctx_find_pool_by_name (ctx, poolName) != NULL) {
+        rdb_error ("rDB: Fatal: Duplicte pool name in rdb_register_pool");
+        pool = NULL;
+    } else {
+        pool = _rdb_add_pool (ctx, poolName, idxCount, key_offset, FLAGS, fn);
     }
+    rdb_sem_unlock(&ctx->reg_mutex);
+
+    return pool;
+}
 
-    if (start == NULL)
-        debug ("Final Level=%d\n", maxLevels);
+rdb_pool_t *rdb_register_um_pool (
+        char *poolName, 
+        int idxCount, 
+        int key_offset, 
+        int FLAGS, 
+        void *fn) {
 
+    return rdb_ctx_register_um_pool (&rdb_ctx_default, poolName, idxCount,
+            key_offset, FLAGS, fn);
 }
 
-int rdb_lock(rdb_pool_t *pool, const char *parent) 
-{
-#ifdef RDB_LOCK_DEBUG
-    info("RDBL    %s by %s\n", pool->name, parent);
-#endif
-    return rdb_sem_lock(&pool->write_mutex);
+// Remove rDB traces. use before exit() or when rDB no longer needed.
+// Use rdb_init after, to re_start rDB
+
+// rdb_gc: drop pools that are marked for dropping. pools must be empty first.
+void rdb_gc() {
+    rdb_clean(1);
 }
 
-void rdb_unlock(rdb_pool_t *pool, const char *parent) 
-{
-#ifdef RDB_LOCK_DEBUG
-    info("RDb-UL %s - %s\n", pool->name, parent);
+#ifndef KM
+static void _rdb_reclaim_shutdown (void);
 #endif
-    rdb_sem_unlock(&pool->write_mutex);
-    return ;
-}
 
-// Dump an entire pool to stdout. only the selected index field will be
-// printed out. Also calculates tree depth...
-void rdb_dump (rdb_pool_t *pool, int index, char *separator) {
+// rDB internal: drop all pools of ctx, or those marked for dropping (gc)
+static void _rdb_ctx_clean (rdb_ctx_t *ctx, int gc) {
+    rdb_pool_t  *pool, 
+                *pool_next;
 
-    if (pool->root[index] == NULL) return;
+    if (ctx->pool_root != NULL) {
+        pool = ctx->pool_root;
 
-    if ((pool->FLAGS[index] & (RDB_KEYS | RDB_NOKEYS)) != 0)
-        _rdb_dump (pool, index, separator, NULL);
-}
+        while (pool != NULL) {
+            pool_next = pool->next;
 
-int _rdb_insert (
-        rdb_pool_t  *pool, 
-        void        *data, 
-        void        *start, 
-        int         index, 
-        void        *parent, 
-        int         side) { 
+            if (gc == 0 || (gc == 1 && pool->drop)) { 
+                rdb_drop_pool (pool);
+            }
 
-    int     rc, rc2;
-    void   *dataHead;
+            pool = pool_next;
+        }
+    }
 
-    if (data == NULL)
-        return (-1);
+    if (!gc && ctx->reg_table) {
+        rdb_free (ctx->reg_table);
+        ctx->reg_table = NULL;
+        ctx->reg_count = 0;
+    }
+}
 
-    debug ("Insert:AVL: pool=%s, idx=%d, start = %p\n",
-            pool->name , 
-            (int) index, 
-            start);
+void rdb_clean(int gc) {
 
-    if ((pool->FLAGS[index] & RDB_BTREE) == RDB_BTREE) {
-        PP_T   *ppk,
-               *ppkNew;
-        PP_T   *ppkParent = NULL;       // NULL is here to make compiler happy
-        PP_T   *ppkRotate;
-        PP_T   *ppkBottom;
+#ifndef KM
+    if (gc == 0)
+        _rdb_reclaim_shutdown ();
+#endif
 
-        if (pool->FLAGS[index] & (RDB_NOKEYS)) {
-            if (pool->root[index] == NULL) {
-                pool->root[index] = pool->tail[index] = data;
-                ppkNew = (void *) data + (sizeof (PP_T) * index);
+    _rdb_ctx_clean (&rdb_ctx_default, gc);
+
+    if (!gc) {
+        rdb_error_string = NULL;
+        rdb_errno = RDB_E_OK;
+#ifdef RDB_TRACE
+        _rdb_trace_retired_free ();
+#endif
+    }
+
+    return ;
+}
+
+// A new, empty rDB instance. Pools registered into it are found only
+// through it, and its registry lock is its own.
+rdb_ctx_t *rdb_ctx_new (void) {
+    rdb_ctx_t *ctx;
+
+#ifdef KM
+    ctx = kmalloc (sizeof (rdb_ctx_t), GFP_KERNEL);
+#else
+    if (posix_memalign ((void **) &ctx, 64, sizeof (rdb_ctx_t)))
+        ctx = NULL;
+#endif
+    if (ctx == NULL) {
+        rdb_error_code (0, RDB_E_NOMEM, "rdb_ctx_new: out of memory");
+        return NULL;
+    }
+    _rdb_ctx_init (ctx);
+    return ctx;
+}
+
+// rdb_gc() for ctx
+void rdb_ctx_gc (rdb_ctx_t *ctx) {
+    _rdb_ctx_clean (ctx, 1);
+}
+
+// Drop all pools of ctx, and ctx itself
+void rdb_ctx_free (rdb_ctx_t *ctx) {
+    _rdb_ctx_clean (ctx, 0);
+#ifndef KM
+    pthread_mutex_destroy (&ctx->reg_mutex);
+#endif
+    rdb_free (ctx);
+}
+
+void rdb_print_pools(void *out) {
+    rdb_pool_t  *pool, 
+                *pool_next;
+
+    if (rdb_ctx_default.pool_root != NULL) {
+        pool = rdb_ctx_default.pool_root;
+
+        while (pool != NULL) {
+            pool_next = pool->next;
+            //rdb_flush(pool,NULL,NULL);
+#ifdef KM
+            printk("%s\n", pool->name);
+#else
+            FILE *fp = out;
+            fprintf(fp,"%s\n", pool->name);
+#endif
+            pool = pool_next;
+        }
+    }
+    return ;
+}
+
+// Register additional Indexes to an existing data pool
+#ifndef KM
+static int _rdb_mmap_restore_idx (rdb_pool_t *pool, int idx);
+#endif
+
+int rdb_register_um_idx (rdb_pool_t *pool, int idx, int key_offset,
+        int FLAGS, void *compare_fn) {
+    rdb_ctx_t *ctx = pool->ctx;
+
+    rdb_sem_lock(&ctx->reg_mutex);
+    if (idx == 0) {
+        rdb_sem_unlock(&ctx->reg_mutex);
+        return (rdb_error_value (-1, 
+            "Index 0 (zero) can only be set via rdb_register_pool"));
+    }
+
+    if (idx >= RDB_POOL_MAX_IDX) {
+        rdb_sem_unlock(&ctx->reg_mutex);
+        return (rdb_error_value (-2, "Index >= RDB_POOL_MAX_IDX"));
+    }
+
+    if (pool->FLAGS[idx] != 0) {
+        rdb_sem_unlock(&ctx->reg_mutex);
+        return (rdb_error_value (-3, "Redefinition of used index not allowed"));
+    }
+
+    if (-1 == set_pool_fn_pointers(pool, idx, FLAGS, compare_fn)){
+        rdb_sem_unlock(&ctx->reg_mutex);
+        return (rdb_error_value (-4,
+            "Index Registration without valid type or compare fn. Ignored"));
+    }
+
+    pool->root[idx] = NULL;
+    pool->key_offset[idx] = sizeof (PP_T) * pool->indexCount + key_offset;
+    pool->FLAGS[idx] = FLAGS;
+#ifndef KM
+    if (pool->mmap && _rdb_mmap_restore_idx (pool, idx)) {
+        pool->FLAGS[idx] = 0;
+        rdb_sem_unlock(&ctx->reg_mutex);
+        return (rdb_error_value (-5, 
+            "Index does not match the mapped pool file"));
+    }
+#endif
+    debug ("registered index %d for pool %s, Keyoffset is %d\n", idx, pool->name, key_offset);
+    rdb_sem_unlock(&ctx->reg_mutex);
+    return (idx);
+}
+
+// Below is a set of self explanatory compare functions...
+int key_cmp_int32 (int32_t *old, int32_t *new)
+{
+    return (*new <  *old) ? -1 : (( *new > *old) ? 1 : 0); 
+}
+int key_cmp_const_int32 (int32_t *old, __intmax_t new)
+{
+    return (new <  *old) ? -1 : (( new > *old) ? 1 : 0); 
+}
+
+int key_cmp_uint32 (uint32_t *old, uint32_t *new)
+{
+    return (*new <  *old) ? -1 : (( *new > *old) ? 1 : 0); 
+}
+int key_cmp_const_uint32 (uint32_t *old, __uintmax_t new)
+{
+    return (new <  *old) ? -1 : (( new > *old) ? 1 : 0); 
+}
+
+int key_cmp_int16 (int16_t *old, int16_t *new)
+{
+    return (*new <  *old) ? -1 : (( *new > *old) ? 1 : 0); 
+}
+int key_cmp_const_int16 (int16_t *old, __intmax_t new)
+{   
+    return (new <  *old) ? -1 : (( new > *old) ? 1 : 0); 
+}
+
+int key_cmp_uint16 (uint16_t *old, uint16_t *new)
+{
+    return (*new <  *old) ? -1 : (( *new > *old) ? 1 : 0); 
+}
+int key_cmp_const_uint16 (uint16_t *old, __uintmax_t new)
+{
+    return (new <  *old) ? -1 : (( new > *old) ? 1 : 0); 
+}
+
+int key_cmp_int8 (int8_t *old, int8_t *new)
+{
+    return (*new <  *old) ? -1 : (( *new > *old) ? 1 : 0); 
+}
+int key_cmp_const_int8 (int8_t *old, __intmax_t new)
+{
+    return (new <  *old) ? -1 : (( new > *old) ? 1 : 0); 
+}
+
+int key_cmp_uint8 (uint8_t *old, uint8_t *new)
+{
+    return (*new <  *old) ? -1 : (( *new > *old) ? 1 : 0); 
+}
+int key_cmp_const_uint8 (uint8_t *old, __uintmax_t new)
+{
+    return (new <  *old) ? -1 : (( new > *old) ? 1 : 0); 
+}
+
+int key_cmp_int64 (int64_t *old, int64_t *new)
+{
+    return (*new <  *old) ? -1 : (( *new > *old) ? 1 : 0); 
+}
+int key_cmp_const_int64 (int64_t *old, __intmax_t new)
+{
+    return (new <  *old) ? -1 : (( new > *old) ? 1 : 0); 
+}
+
+int key_cmp_uint64 (uint64_t *old, uint64_t *new)
+{
+    return (*new <  *old) ? -1 : (( *new > *old) ? 1 : 0); 
+}
+int key_cmp_const_uint64 (uint64_t *old, __uintmax_t new)
+{
+    return (new <  *old) ? -1 : (( new > *old) ? 1 : 0); 
+}
+
+int key_cmp_ptr (void **old, void **new)
+{
+    if ( new == NULL ) {
+       return -1;
+    } 
+    return (*new <  *old) ? -1 : (( *new > *old) ? 1 : 0); 
+}
+int key_cmp_const_ptr (void *old, size_t new)
+{
+    return ((void *) new <  old) ? -1 : (( (void *) new > old) ? 1 : 0); 
+}
+
+int key_cmp_size_t (size_t *old, size_t *new)
+{
+    return (*new <  *old) ? -1 : (( *new > *old) ? 1 : 0); 
+}
+int key_cmp_const_size_t (size_t *old, size_t new)
+{
+    return (new <  *old) ? -1 : (( new > *old) ? 1 : 0); 
+}
+
+int key_cmp_ssize_t (ssize_t *old, ssize_t *new)
+{
+    return (*new <  *old) ? -1 : (( *new > *old) ? 1 : 0); 
+}
+int key_cmp_const_ssize_t (ssize_t *old, ssize_t new)
+{
+    return (new <  *old) ? -1 : (( new > *old) ? 1 : 0); 
+}
+/* 128 bit fn's are tricky when we don't have 128 native type to supply a 
+ * comperator.
+ * 256 bit's are alwways that way .... 
+ * as such, 'const' fn's will take biggest native size as comperator while
+ * non-const will use full size of type
+ * */
+
+#ifdef USE_128_BIT_TYPES
+int key_cmp_int128 (__int128_t *old, __int128_t *new)
+{
+    return (*new <  *old) ? -1 : (( *new > *old) ? 1 : 0); 
+}
+int key_cmp_const_int128 (__int128_t *old, __int128_t new)
+{
+    return (new <  *old) ? -1 : (( new > *old) ? 1 : 0); 
+}
+
+int key_cmp_uint128 (__uint128_t *old, __uint128_t *new)
+{
+    return (*new <  *old) ? -1 : (( *new > *old) ? 1 : 0); 
+}
+int key_cmp_const_uint128 (__uint128_t *old, __uint128_t new)
+{
+    return (new <  *old) ? -1 : (( new > *old) ? 1 : 0); 
+}
+#else
+//TODO: use GMP if found, to support big numbers safely.
+/* - this junk is here until i decide which way to go - GMP, native, or NONE, when we have no native 128 bit support
+ * currently it's out - no 128 bit without 128 bit native support.
+ *
+int key_cmp_int128 (type_128 *old, type_128 *new)
+{
+    return (*new->msb <  *old->msb) ? -1 : (( *new->msb > *old->msb) ? 1 : ((*new->lsb < *old->lsb) ? -1 : ((*new->lsb > *old->lsb) ? 1 : 0 ))); 
+}
+int key_cmp_const_int128 (type_128 *old, __intmax_t new)
+{
+    //type_128 new_new;
+    //new_new.lsb=new;
+    //if (new < 0) new_new.msb=0xffffffffffffffff; // extending the sign
+    if (0 < *old->msb ) return -1;    // must be bigger then what we can spcify with 64 bits 'new'
+    if (0 > *old->msb && *old->msb != -1) return 1;
+    return (new <  (int64_t) *old->lsb) ? -1 : (( new > (int64_t) *old->lsb) ? 1 : 0); 
+    //return (new <  *old) ? -1 : (( new > *old) ? 1 : 0); 
+    //return (new <  *old->msb) ? -1 : (( new > *old->msb) ? 1 : ((new < *old->lsb) ? -1 : ((new > *old->lsb) ? 1 : 0 ))); 
+}
+
+int key_cmp_uint128 (__uint128_t *old, type_128 *new)
+{
+    return (*new <  *old) ? -1 : (( *new > *old) ? 1 : 0); 
+    return (*new->msb <  *old->msb) ? -1 : (( *new->msb > *old->msb) ? 1 : ((*new->lsb < *old->lsb) ? -1 : ((*new->lsb > *old->lsb) ? 1 : 0 ))); 
+}
+int key_cmp_const_uint128 (__uint128_t *old, __uint128_t new)
+{
+    return (new <  *old) ? -1 : (( new > *old) ? 1 : 0); 
+}*/
+#endif
+//TODO add 256 bit types, and fix rDB.h line 38 to reflect
+
+int key_cmp_str (char *old, char *new)
+{
+    return strcmp ( new, old);
+}
+
+int key_cmp_str_p (char **old, char **new)
+{
+    return strcmp ( *new, *old);
+}
+int key_cmp_const_str_p (char **old, char *new)
+{
+    return strcmp ( new, *old);
+}
+/*int keyCompareTME (struct timeval *key, struct timeval *keyNew)
+{
+    if (keyNew->tv_sec != key->tv_sec) return ((keyNew->tv_sec < key->tv_sec) ? -1 : 1);
+
+    if (keyNew->tv_usec != key->tv_sec) return ((keyNew->tv_usec < key->tv_usec) ? -1 : 1);
+    return 0;
+}*/
+
+/*int keyCompareTMA (TVA *key, TVA *keyNew)
+{
+    if (keyNew->tv.tv_sec != key->tv.tv_sec) return ((keyNew->tv.tv_sec <
+                        key->tv.tv_sec) ? -1 : 1);
+    if (keyNew->tv.tv_usec != key->tv.tv_usec) return ((keyNew->tv.tv_usec <
+                        key->tv.tv_usec) ? -1 : 1);
+    if (keyNew->acc != key->acc) return ((keyNew->acc < key->acc) ? -1 : 1);
+    return 0;
+}*/
+
+//TODO: some compilers dont like this inlining. need more research
+/*inline*/ void set_pointers (
+        rdb_pool_t *pool, 
+        int index, 
+        void *start, 
+        PP_T ** ppk, 
+        void **dataHead){
+
+    if (start == NULL || (start == pool->root[index]))
+        *ppk = (void *) pool->root[index] + (sizeof (PP_T) * index);
+    else
+        *ppk = (void *) start + (sizeof (PP_T) * index);
+
+    *dataHead = (void *) *ppk - (sizeof (PP_T) * index);
+    return;
+}
+
+#ifndef KM
+static void _rdb_limbo_push (rdb_pool_t *pool, void *dataHead);
+static void _rdb_mmap_release (rdb_pool_t *pool, void *dataHead);
+#endif
+
+// Courtesy delete of data block and dynamic indexes: when an index is a
+// pointer (RDB_KPSTR), need to free it too.
+static void _rdb_free_data_now (rdb_pool_t *pool, void *dataHead)
+{
+    void    **dataField;
+    int     indexCount;
+
+    for (indexCount = 0; indexCount < pool->indexCount; indexCount++)
+        if (pool->FLAGS[indexCount] & RDB_KPSTR) { 
+            dataField = dataHead + pool->key_offset[indexCount];
+            if (*dataField) rdb_free(*dataField);
+        }
+#ifndef KM
+    if (pool->mmap) {
+        _rdb_mmap_release (pool, dataHead);
+        return;
+    }
+#endif
+    rdb_free (dataHead);
+}
+
+static void _rdb_free_data (rdb_pool_t *pool, void *dataHead)
+{
+    if (dataHead == NULL)
+        return;
+#ifndef KM
+    // a live snapshot may still point at it
+    if (__atomic_load_n (&pool->snap_refs, __ATOMIC_ACQUIRE)) {
+        _rdb_limbo_push (pool, dataHead);
+        return;
+    }
+#endif
+    _rdb_free_data_now (pool, dataHead);
+}
+
+// TODO: Bring this up-to-date
+// Note: type casting used to 
+// 1) hash compiler about identcal type warnings, like 
+// uint32 and unisnged long ...
+// 2) handle int32 as long, since long is 32 bit on 16, 32 and 64 bit machines
+//
+void _rdb_dump (rdb_pool_t *pool, int index, char *separator, void *start)
+{
+    void  **searchNext;
+    PP_T   *pp;
+    rdb_key_union *key;
+
+    if (start == NULL && pool->root[index] == NULL) return;
+
+    if (pool->FLAGS[index] & RDB_BTREE && (pool->FLAGS[index] & RDB_NOKEYS))  {
+        pp = ((void *) (pool->root[index])) + (sizeof (PP_T) * index) ;    // print data-head
+        while (pp) {
+            //searchNext = (void **) pp;
+            //key = (void *) searchNext + pool->key_offset[0];
+            //info ("%s%s", &key->str, separator);
+            rdb_c_info ("%p%s", pp, separator);
+            pp = pp->right;
+        }
+    } else if (pool->FLAGS[index] & RDB_BTREE && (pool->FLAGS[index] & RDB_KEYS)) {
+        if (start == NULL) {
+            pp = (void *) pool->root[index] + (sizeof (PP_T) * index);
+            searchNext = (void **) pool->root[index];
+        }
+        else {
+            searchNext = start;
+            pp = start + (sizeof (PP_T) * index);
+        }
+
+        key = (void *) searchNext + pool->key_offset[index];
+
+        if (pp->left != NULL)
+            _rdb_dump (pool, index, separator, pp->left);
+
+        switch (pool->FLAGS[index] & RDB_KEYS) {
+            case RDB_KPTR:
+                rdb_c_info ("%p%s", (void *) key->pStr, separator);
+                break;
+
+            case RDB_KPSTR:
+                rdb_c_info ("%s%s", key->pStr, separator);
+                break;
+
+            case RDB_KSTR:
+                rdb_c_info ("%s%s", &key->str, separator);
+                break;
+
+            case RDB_KINT8:
+                rdb_c_info ("%hhd%s", key->i8, separator);
+                break;
+
+            case RDB_KINT16:
+                rdb_c_info ("%hd%s", key->i16, separator);
+                break;
+
+            case RDB_KINT32:
+                rdb_c_info ("%ld%s", (long) key->i32, separator);
+                break;
+
+            case RDB_KINT64:
+                rdb_c_info ("%lld%s", (long long int) key->i64, separator);
+                break;
+
+            case RDB_KUINT8:
+                rdb_c_info ("%hhu%s", key->u8, separator);
+                break;
+
+            case RDB_KUINT16:
+                rdb_c_info ("%hu%s", key->u16, separator);
+                break;
+
+            case RDB_KUINT32:
+                rdb_c_info ("%lu%s", (unsigned long) key->u32, separator);
+                break;
+
+            case RDB_KUINT64:
+                rdb_c_info ("%llu%s", (unsigned long long) key->u64, separator);
+                break;
+
+            //TODO: this is a bug, data below may be truncated.
+            //need to craft 128bit decimal print functions.
+            //
+#ifdef USE_128_BIT_TYPES
+            case RDB_KUINT128:
+                rdb_c_info ("%llu%s", (unsigned long long) key->u128, separator);
+                break;
+
+            case RDB_KINT128:
+                rdb_c_info ("%lld%s", (long long) key->u128, separator);
+                break;
+#endif
+            case RDB_KSIZE_t:
+                rdb_c_info ("%zu%s", (size_t) key->st, separator);
+                break;
+
+            case RDB_KSSIZE_t:
+                rdb_c_info ("%zd%s", (ssize_t) key->sst, separator);
+                break;
+            // we can't print custom functions data so we print the address
+            // TODO: Consider adding a print-to-str fn() hook to pool, so we can dump custom-index data
+            case RDB_KCF:
+                rdb_c_info ("%p%s", key, separator);
+                break;
+ /*           case RDB_KTME:
+                printoutalways ("Dump_TME: %ld:%ld\n", key->tv.tv_sec, key->tv.tv_usec);
+                break;
+
+            case RDB_KTMA:
+                printoutalways ("Dump_TMA: %lu:%lu.%lu\n", (unsigned long) key->tva.tv.tv_sec,
+                                (unsigned long) key->tva.tv.tv_usec, (unsigned long) key->tva.acc);
+                break;
+*/
+            /*case RDB_K4U32A:
+                printoutalways ("Dump_4U23A: %lu:%lu:%lu:%lu\n", (unsigned long) key->u32a.l1,
+                                (unsigned long) key->u32a.l2, (unsigned long) key->u32a.l3, (unsigned long) key->u32a.acc);
+                break;*/
+        }
+
+        if (pp->right != NULL)
+            _rdb_dump (pool, index, separator, pp->right);
+    }
+}
+
+/* Lock statistics
+ *
+ * With rdb_lock_stats_enable() every rdb_lock() is counted against the
+ * parent string it was called with: acquisitions, how many found the lock
+ * taken, and the time spent waiting for and holding it. Sites are only 
+ * ever written by the lock holder; readers load them relaxed.
+ */
+#ifdef RDB_POOL_STATS
+#define RDB_LK_ADD(f, v) \
+    __atomic_store_n (&(f), (f) + (v), __ATOMIC_RELAXED)
+#define RDB_LK_MAX(f, v) \
+    do { \
+        if ((v) > (f)) __atomic_store_n (&(f), v, __ATOMIC_RELAXED); \
+    } while (0)
+
+// rDB internal: the site for parent, write_mutex held. The last slot 
+// takes whatever does not fit
+static rdb_lock_site_t *_rdb_lock_site (rdb_lock_site_t *tab, 
+        const char *parent)
+{
+    uint32_t    h, i, n;
+
+    if (parent == NULL)
+        parent = "(null)";
+    h = _rdb_name_hash (parent);
+    for (n = 0; n < RDB_LOCK_SITES - 1; n++) {
+        i = (h + n) % (RDB_LOCK_SITES - 1);
+        if (tab[i].site == NULL) {
+            rdb_store_release (tab[i].site, parent);
+            return &tab[i];
+        }
+        if (tab[i].site == parent || strcmp (tab[i].site, parent) == 0)
+            return &tab[i];
+    }
+    if (tab[RDB_LOCK_SITES - 1].site == NULL)
+        rdb_store_release (tab[RDB_LOCK_SITES - 1].site, "(other)");
+    return &tab[RDB_LOCK_SITES - 1];
+}
+#endif
+
+// Start collecting lock statistics on pool, see rdb_lock_stats(). parent
+// strings given to rdb_lock() must then stay valid, as __FUNCTION__ does
+int rdb_lock_stats_enable (rdb_pool_t *pool)
+{
+#ifdef RDB_POOL_STATS
+    rdb_lock_site_t *tab, *old = NULL;
+
+    if (pool == NULL)
+        return rdb_error_value (-1, "rdb_lock_stats_enable: NULL pool");
+    if (pool->lock_stats)
+        return 0;
+    tab = rdb_alloc (sizeof (rdb_lock_site_t) * RDB_LOCK_SITES);
+    if (tab == NULL)
+        return rdb_error_code (-1, RDB_E_NOMEM, 
+                                    "rdb_lock_stats_enable: out of memory");
+    memset (tab, 0, sizeof (rdb_lock_site_t) * RDB_LOCK_SITES);
+    if (!__atomic_compare_exchange_n ((rdb_lock_site_t **) &pool->lock_stats,
+                    &old, tab, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        rdb_free (tab);
+    return 0;
+#else
+    return rdb_error_value (-1, "rdb_lock_stats_enable: built without "
+                                                        "RDB_POOL_STATS");
+#endif
+}
+
+// Copy up to max call sites of pool into sites, most waited on first. 
+// Returns the number copied
+int rdb_lock_stats (rdb_pool_t *pool, rdb_lock_site_t *sites, int max)
+{
+    int n = 0;
+#ifdef RDB_POOL_STATS
+    rdb_lock_site_t *tab = pool->lock_stats, site;
+    int             i, j;
+
+    for (i = 0; tab && i < RDB_LOCK_SITES; i++) {
+        site.site = rdb_load_acquire (tab[i].site);
+        if (site.site == NULL)
+            continue;
+        site.acquired = __atomic_load_n (&tab[i].acquired, __ATOMIC_RELAXED);
+        site.contended = __atomic_load_n (&tab[i].contended, 
+                                                        __ATOMIC_RELAXED);
+        site.wait_ns = __atomic_load_n (&tab[i].wait_ns, __ATOMIC_RELAXED);
+        site.wait_max_ns = __atomic_load_n (&tab[i].wait_max_ns, 
+                                                        __ATOMIC_RELAXED);
+        site.hold_ns = __atomic_load_n (&tab[i].hold_ns, __ATOMIC_RELAXED);
+        site.hold_max_ns = __atomic_load_n (&tab[i].hold_max_ns, 
+                                                        __ATOMIC_RELAXED);
+        // insertion sort on total wait, keeping the top max
+        for (j = n < max ? n++ : max; 
+                j > 0 && sites[j - 1].wait_ns < site.wait_ns; j--)
+            if (j < max)
+                sites[j] = sites[j - 1];
+        if (j < max)
+            sites[j] = site;
+    }
+#endif
+    return n;
+}
+
+// Zero the counters of pool's lock sites
+void rdb_lock_stats_reset (rdb_pool_t *pool)
+{
+#ifdef RDB_POOL_STATS
+    rdb_lock_site_t *tab = pool->lock_stats;
+    int             i;
+
+    for (i = 0; tab && i < RDB_LOCK_SITES; i++) {
+        __atomic_store_n (&tab[i].acquired, 0, __ATOMIC_RELAXED);
+        __atomic_store_n (&tab[i].contended, 0, __ATOMIC_RELAXED);
+        __atomic_store_n (&tab[i].wait_ns, 0, __ATOMIC_RELAXED);
+        __atomic_store_n (&tab[i].wait_max_ns, 0, __ATOMIC_RELAXED);
+        __atomic_store_n (&tab[i].hold_ns, 0, __ATOMIC_RELAXED);
+        __atomic_store_n (&tab[i].hold_max_ns, 0, __ATOMIC_RELAXED);
+    }
+#endif
+}
+
+#if defined (RDB_POOL_STATS) || !defined (KM)
+// rDB internal: size of a fixed size key, 0 for strings, -1 for keys that
+// can not be copied (custom compare, no key). Hot keys and capture
+static int _rdb_key_size (uint32_t flags)
+{
+    if (flags & (RDB_KSTR | RDB_KPSTR))
+        return 0;
+    if (flags & (RDB_KINT8 | RDB_KUINT8))
+        return 1;
+    if (flags & (RDB_KINT16 | RDB_KUINT16))
+        return 2;
+    if (flags & (RDB_KINT32 | RDB_KUINT32))
+        return 4;
+    if (flags & (RDB_KINT64 | RDB_KUINT64))
+        return 8;
+    if (flags & (RDB_KINT128 | RDB_KUINT128))
+        return 16;
+    if (flags & (RDB_KSIZE_t | RDB_KSSIZE_t))
+        return sizeof (size_t);
+    if (flags & RDB_KPTR)
+        return sizeof (void *);
+    return -1;
+}
+#endif
+
+/* Hot keys
+ *
+ * rdb_hotkeys_enable() keeps a space-saving sketch of the keys looked up 
+ * through rdb_get() / rdb_get_const() on one index: k slots, each a key 
+ * and its count. A key not in the sketch takes over the slot with the 
+ * lowest count and inherits that count as its error, so any key seen in 
+ * more than 1/k of the sampled lookups is always listed. Lookups never 
+ * wait on the sketch: one that finds it busy is not counted.
+ */
+#ifdef RDB_POOL_STATS
+// rDB internal: count one lookup of key on idx
+static void _rdb_hot_add (rdb_pool_t *pool, int idx, const void *key)
+{
+    rdb_hot_t       *hot = rdb_load_acquire (pool->hot[idx]);
+    rdb_hotkey_t    *slot;
+    const unsigned char *p = key;
+    uint64_t        h = 14695981039346656037ull;
+    uint32_t        every, len;
+    int             i, min = 0;
+
+    every = __atomic_load_n (&hot->every, __ATOMIC_RELAXED);
+    if (every == 0 || key == NULL)
+        return;
+    if (_rdb_hot_skip > 1 && _rdb_hot_skip <= every) {
+        _rdb_hot_skip--;
+        return;
+    }
+    _rdb_hot_skip = every;
+
+    if (hot->key_size) {
+        len = hot->key_size;
+        for (i = 0; i < len; i++)
+            h = (h ^ p[i]) * 1099511628211ull;
+    } else {
+        for (len = 1; *p; len++)
+            h = (h ^ *p++) * 1099511628211ull;
+        p = key;
+    }
+
+    if (__atomic_test_and_set (&hot->busy, __ATOMIC_ACQUIRE))
+        return;
+    hot->seen++;
+    for (i = 0; i < hot->used; i++) {
+        if (hot->hash[i] == h) {
+            hot->slot[i].count++;
+            __atomic_clear (&hot->busy, __ATOMIC_RELEASE);
+            return;
+        }
+        if (hot->slot[i].count < hot->slot[min].count)
+            min = i;
+    }
+    if (hot->used < hot->k) {
+        slot = &hot->slot[min = hot->used++];
+        slot->count = slot->error = 0;
+    } else {
+        slot = &hot->slot[min];
+        slot->error = slot->count;
+    }
+    slot->count++;
+    slot->len = len;
+    memset (slot->key, 0, RDB_HOTKEY_LEN);
+    memcpy (slot->key, p, len <= RDB_HOTKEY_LEN ? len : RDB_HOTKEY_LEN - 1);
+    hot->hash[min] = h;
+    __atomic_clear (&hot->busy, __ATOMIC_RELEASE);
+}
+
+// rDB internal: take the sketch lock, for readers that may wait
+static void _rdb_hot_lock (rdb_hot_t *hot)
+{
+    while (__atomic_test_and_set (&hot->busy, __ATOMIC_ACQUIRE))
+        ;
+}
+#endif
+
+// Track the k most looked up keys of idx, sampling one rdb_get() / 
+// rdb_get_const() in every (per thread, 1 for all). Misses count too. The 
+// sketch is allocated on the first call and lives until the pool is 
+// dropped; calling again only changes the rate.
+int rdb_hotkeys_enable (rdb_pool_t *pool, int idx, int k, uint32_t every)
+{
+#ifdef RDB_POOL_STATS
+    rdb_hot_t   *hot, *old = NULL;
+    int         key_size;
+
+    if (pool == NULL || idx < 0 || idx >= pool->indexCount || every == 0 ||
+            k < 1 || k > RDB_HOTKEY_MAX)
+        return rdb_error_value (-1, "rdb_hotkeys_enable: bad argument");
+    key_size = _rdb_key_size (pool->FLAGS[idx]);
+    if (key_size < 0 || pool->FLAGS[idx] & (RDB_KCF | RDB_NOKEYS))
+        return rdb_error_value (-1, "rdb_hotkeys_enable: unsupported key");
+    if (pool->hot[idx] == NULL) {
+        hot = rdb_alloc (RDB_HOT_BYTES (k));
+        if (hot == NULL)
+            return rdb_error_code (-1, RDB_E_NOMEM,
+                    "rdb_hotkeys_enable: out of memory");
+        memset (hot, 0, sizeof (rdb_hot_t));
+        hot->k = k;
+        hot->key_size = key_size;
+        hot->slot = (rdb_hotkey_t *) (hot + 1);
+        hot->hash = (uint64_t *) (hot->slot + k);
+        if (!__atomic_compare_exchange_n ((rdb_hot_t **) &pool->hot[idx], 
+                    &old, hot, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            rdb_free (hot);
+    }
+    __atomic_store_n (&((rdb_hot_t *) pool->hot[idx])->every, every, 
+                                                        __ATOMIC_RELAXED);
+    return 0;
+#else
+    return rdb_error_value (-1, "rdb_hotkeys_enable: built without "
+                                                        "RDB_POOL_STATS");
+#endif
+}
+
+// Stop sampling idx, the sketch is kept
+void rdb_hotkeys_disable (rdb_pool_t *pool, int idx)
+{
+#ifdef RDB_POOL_STATS
+    if (idx >= 0 && idx < RDB_POOL_MAX_IDX && pool->hot[idx])
+        __atomic_store_n (&((rdb_hot_t *) pool->hot[idx])->every, 0, 
+                                                        __ATOMIC_RELAXED);
+#endif
+}
+
+// Copy up to max of the hottest keys of idx into keys, highest count 
+// first, and the number of lookups sampled into seen (may be NULL). A 
+// key's true count lies between count - error and count. Returns the 
+// number copied
+int rdb_hotkeys (rdb_pool_t *pool, int idx, rdb_hotkey_t *keys, int max, 
+        uint64_t *seen)
+{
+    int n = 0;
+#ifdef RDB_POOL_STATS
+    rdb_hot_t   *hot;
+    int         i, j;
+
+    if (seen)
+        *seen = 0;
+    if (idx < 0 || idx >= RDB_POOL_MAX_IDX || 
+            (hot = rdb_load_acquire (pool->hot[idx])) == NULL)
+        return 0;
+    _rdb_hot_lock (hot);
+    for (i = 0; i < hot->used; i++) {
+        // insertion sort on count, keeping the top max
+        for (j = n < max ? n++ : max; 
+                j > 0 && keys[j - 1].count < hot->slot[i].count; j--)
+            if (j < max)
+                keys[j] = keys[j - 1];
+        if (j < max)
+            keys[j] = hot->slot[i];
+    }
+    if (seen)
+        *seen = hot->seen;
+    __atomic_clear (&hot->busy, __ATOMIC_RELEASE);
+#endif
+    return n;
+}
+
+// Empty the sketch of idx
+void rdb_hotkeys_reset (rdb_pool_t *pool, int idx)
+{
+#ifdef RDB_POOL_STATS
+    rdb_hot_t   *hot;
+
+    if (idx < 0 || idx >= RDB_POOL_MAX_IDX || 
+            (hot = rdb_load_acquire (pool->hot[idx])) == NULL)
+        return;
+    _rdb_hot_lock (hot);
+    hot->used = 0;
+    hot->seen = 0;
+    __atomic_clear (&hot->busy, __ATOMIC_RELEASE);
+#endif
+}
+
+// Caller side pool lock. Pools registered with RDB_POOL_THREADSAFE lock
+// internally and need this only to group several calls into one unit.
+int rdb_lock(rdb_pool_t *pool, const char *parent) 
+{
+#ifdef RDB_POOL_STATS
+    rdb_lock_site_t *site;
+    uint64_t        t0, wait = 0;
+    int             rc, contended;
+#endif
+
+#ifdef RDB_LOCK_DEBUG
+    info("RDBL    %s by %s\n", pool->name, parent);
+#endif
+#ifdef RDB_POOL_STATS
+    if (pool->lock_stats) {
+        t0 = _rdb_lat_now ();
+        contended = !rdb_sem_trylock (&pool->write_mutex);
+        if (contended) {
+            if ((rc = rdb_sem_lock (&pool->write_mutex)) != 0)
+                return rc;
+            wait = _rdb_lat_now () - t0;
+        }
+        site = _rdb_lock_site (pool->lock_stats, parent);
+        RDB_LK_ADD (site->acquired, 1);
+        if (contended) {
+            RDB_LK_ADD (site->contended, 1);
+            RDB_LK_ADD (site->wait_ns, wait);
+            RDB_LK_MAX (site->wait_max_ns, wait);
+        }
+        pool->lock_site = site;
+        pool->lock_t0 = t0 + wait;
+        return 0;
+    }
+#endif
+    return rdb_sem_lock(&pool->write_mutex);
+}
+
+void rdb_unlock(rdb_pool_t *pool, const char *parent) 
+{
+#ifdef RDB_POOL_STATS
+    rdb_lock_site_t *site = pool->lock_site;
+    uint64_t        hold;
+#endif
+
+#ifdef RDB_LOCK_DEBUG
+    info("RDb-UL %s - %s\n", pool->name, parent);
+#endif
+#ifdef RDB_POOL_STATS
+    // charged to the site that took the lock
+    if (site) {
+        hold = _rdb_lat_now () - pool->lock_t0;
+        RDB_LK_ADD (site->hold_ns, hold);
+        RDB_LK_MAX (site->hold_max_ns, hold);
+        pool->lock_site = NULL;
+    }
+#endif
+    rdb_sem_unlock(&pool->write_mutex);
+    return ;
+}
+
+// Dump an entire pool to stdout. only the selected index field will be
+// printed out. Tree shape is measured by rdb_analyze()
+void rdb_dump (rdb_pool_t *pool, int index, char *separator) {
+
+    _rdb_ts_read_lock (pool, index);
+    if (pool->root[index] != NULL &&
+            (pool->FLAGS[index] & (RDB_KEYS | RDB_NOKEYS)) != 0)
+        _rdb_dump (pool, index, separator, NULL);
+    _rdb_ts_read_unlock (pool, index);
+}
+
+int _rdb_insert (
+        rdb_pool_t  *pool, 
+        void        *data, 
+        void        *start, 
+        int         index, 
+        void        *parent, 
+        int         side) { 
+
+    int     rc, rc2;
+    void   *dataHead;
+
+    if (data == NULL)
+        return (-1);
+
+    debug ("Insert:AVL: pool=%s, idx=%d, start = %p\n",
+            pool->name , 
+            (int) index, 
+            start);
+
+    if ((pool->FLAGS[index] & RDB_BTREE) == RDB_BTREE) {
+        PP_T   *ppk,
+               *ppkNew;
+        PP_T   *ppkParent = NULL;       // NULL is here to make compiler happy
+        PP_T   *ppkRotate;
+        PP_T   *ppkBottom;
+
+        if (pool->FLAGS[index] & (RDB_NOKEYS)) {
+            if (pool->root[index] == NULL) {
+                pool->root[index] = pool->tail[index] = data;
+                ppkNew = (void *) data + (sizeof (PP_T) * index);
                 ppkNew->left = ppkNew->right = NULL;
                 ppkNew->balance = 0;
             } else {   
@@ -962,1542 +2762,4633 @@ int _rdb_insert (
                     ppkNew->right = NULL;
                     ppkParent->right = ppkNew;// - index;
                     ppkNew->balance = 0;
-                    pool->tail[index] = data;
+                    pool->tail[index] = data;
+                }
+                else if (pool->FLAGS[index] & RDB_KLIFO) {   
+                    // LIFO, add to head, as we always read/remove from head 
+                    // forward
+                    ppkParent = (void *) pool->root[index] + (sizeof (PP_T) * index);
+                    ppkNew = data + (sizeof (PP_T) * index);
+                    ppkNew->right = ppkParent;// - index;
+                    ppkNew->left = NULL;
+                    ppkParent->left = ppkNew;// - index;
+                    ppkNew->balance = 0;
+                    pool->root[index] = data;
+                }
+            }
+        }
+
+        else if (pool->root[index] == NULL) {
+            debug ("Virgin Insert, pool=%s\n",pool->name);
+            pool->root[index] = data;
+            debug ("ppkRoot  = %p,%p \n",  pool->root[index],
+                       pool->root[index] + (sizeof (PP_T) * index));
+            ppkNew = data + (sizeof (PP_T) * index);
+            ppkNew->left = ppkNew->right = NULL;
+            ppkNew->balance = 0;
+
+#ifdef DEBUG
+            if (start == NULL)
+                ppk = (PP_T *) pool->root[index] + (sizeof (PP_T) * index);
+            else
+                ppk = start + (sizeof (PP_T) * index);
+
+            dataHead = ppk - index;
+            ppkNew = data;
+            debug ("Datahead: %p, data: %p, ppkNew: %p, start%snull %p ? %p\n",
+                    dataHead, data, ppkNew, (start == NULL) ? "=" : "!=",
+                    dataHead + pool->key_offset[index], 
+                    (void *) (ppkNew) + pool->key_offset[index]);
+#endif
+        }
+        else {
+            set_pointers (pool, index, start, &ppk, &dataHead);
+            debug ("Pointers SET, start = %x\n", (unsigned long) (start));
+            ppkNew = (void *) data + (sizeof (PP_T) * index);
+
+            RDB_STAT_CMP ();
+            if ((rc = pool->fn[index] (dataHead + pool->key_offset[index],
+                    (void *) data + pool->key_offset[index])) < 0) {
+                // left side
+                if (ppk->left == NULL) {
+                    debug ("Left Insert\n");
+                    ppk->left = data;           //ppkNew;
+                    ppk->balance -= 1;
+                    ppkNew->left = ppkNew->right = NULL;
+                    ppkNew->balance = 0;
+
+                    if (ppk->balance != 0)
+                        return 1;           // added a level
+                    else
+                        return 0;           // added a leaf in an existing level
+                }
+                else {
+                    // Here we possibly added a level to the left tree
+                    debug ("Diving Left\n");
+
+                    if ((rc2 = _rdb_insert (pool, data, ppk->left, index, start,
+                                           RDB_TREE_LEFT)) == 1) {
+                        // level added on left side
+                        ppk->balance--;
+
+                        if (ppk->balance == -2) {
+                            // we need to rotate
+                            RDB_STAT_ROT ();
+                            RDB_TRACEPOINT (rotate, RDB_TRACE_ROTATE, pool, 
+                                            index, data);
+                            ppkRotate = (void *) ppk->left + 
+                                    (sizeof (PP_T) * index);
+
+                            if (ppkRotate->balance < 0) {
+                                //left left case
+                                debug ("Left Left Rotate\n");
+
+                                if (parent) {
+                                    ppkParent = (void *) parent + 
+                                            (sizeof (PP_T) * index);
+
+                                    if (!side)  //RDB_TREE_LEFT
+                                        ppkParent->left = ppk->left;
+                                    else
+                                        ppkParent->right = ppk->left;
+                                }
+                                else
+                                    pool->root[index] = ppk->left;  //ppkRotate;
+
+                                ppk->left = ppkRotate->right;
+                                ppkRotate->right = dataHead;    //ppk;
+                                ppk->balance = -1 * (ppkRotate->balance + 1);
+                                ppkRotate->balance = (ppkRotate->balance + 1);
+                                ppk = ppkRotate;
+                            }
+                            else {
+                                // left right case
+                                debug ("Left Right Rotate\n");
+                                ppkBottom = (void *) ppkRotate->right + 
+                                                (sizeof (PP_T) * index);
+
+                                if (ppkBottom->balance > 0) {
+                                    ppk->balance = 0;
+                                    ppkRotate->balance = -1;
+                                }
+                                else if (ppkBottom->balance == 0) {
+                                    ppk->balance = 0;
+                                    ppkRotate->balance = 0;
+                                }
+                                else {
+                                    ppk->balance = 1;
+                                    ppkRotate->balance = 0;
+                                }
+
+                                ppkBottom->balance = 0;
+
+                                ppkRotate->right = ppkBottom->left;
+                                ppkBottom->left = ppkRotate - index;
+                                ppk->left = ppkBottom->right;
+                                ppkBottom->right = dataHead;    //ppk;
+                                ppk = ppkBottom;
+
+                                if (parent) {
+                                    ppkParent = (void *) parent + 
+                                            (sizeof (PP_T) * index);
+
+                                    if (!side)  //RDB_TREE_LEFT
+                                        ppkParent->left = ppkBottom - index;
+                                    else
+                                        ppkParent->right = ppkBottom - index;
+                                }
+                                else pool->root[index] = ppkBottom - index;
+                            }
+                        }
+
+                        if (ppk->balance >= 0)
+                            return 0;   // no further balanceing action needed
+
+                        if (ppk->balance == -1)
+                            return 1;   // need to continue balancing up
+                    }
+                    else if (rc2 == -1) return -1;
+                }
+            }
+            else if (rc > 0) {                  // addin on Right side
+                //right side
+                if (ppk->right == NULL) {
+                    debug ("Right Insert\n");
+                    ppk->right = data;          //ppkNew;
+                    ppk->balance += 1;
+                    ppkNew->left = ppkNew->right = NULL;
+                    ppkNew->balance = 0;
+
+                    if (ppk->balance != 0)
+                        return 1;       // added a level
+                    else
+                        return 0;       // added a leaf... in an existing level
+                }
+                else {
+                    debug ("Diving Right, start = %p, balance=%d\n", 
+                                                        start, ppk->balance);
+
+                    if (( rc2 = _rdb_insert (pool, data, ppk->right, index, 
+                                            start, RDB_TREE_RIGHT)) == 1) {
+                        // level added on right side
+                        ppk->balance++;
+
+                        if (ppk->balance == 2) {
+                            // we need to rotate
+                            RDB_STAT_ROT ();
+                            RDB_TRACEPOINT (rotate, RDB_TRACE_ROTATE, pool, 
+                                            index, data);
+                            ppkRotate = (void *) ppk->right + 
+                                    (sizeof (PP_T) * index);
+
+                            if (ppkRotate->balance > 0) {
+                                //right right case ( left rotation )
+                                debug ("Right Right Rotate, parent = %x, "
+                                        "index=%d\n", (unsigned) parent, index);
+
+                                if (parent != NULL) {
+                                    debug ("parent exist\n");
+                                    ppkParent = (void *) parent + 
+                                            (sizeof (PP_T) * index);
+
+                                    if (!side)  //RDB_TREE_LEFT
+                                        ppkParent->left = ppk->right;
+                                    else
+                                        ppkParent->right = ppk->right;
+                                }
+                                else
+                                    pool->root[index] = ppk->right; //ppkRotate;
+
+                                ppk->right = ppkRotate->left;
+                                ppkRotate->left = dataHead;     //ppk;
+                                ppk->balance = -1 * (ppkRotate->balance - 1);
+                                ppkRotate->balance = (ppkRotate->balance - 1);
+                                ppk = ppkRotate;
+                                debug ("pool->root[%d] = %x\n", index, 
+                                        pool->root[index]);
+                            }
+                            else {
+                                // right left case 
+                                // (right rotation followed by left rotation )
+                                debug ("Right Left Rotate\n");
+                                ppkBottom = (void *) ppkRotate->left + 
+                                        (sizeof (PP_T) * index);
+
+                                if (ppkBottom->balance < 0) {
+                                    ppk->balance = 0;
+                                    ppkRotate->balance = 1;
+                                }
+                                else if (ppkBottom->balance == 0) {
+                                    ppk->balance = 0;
+                                    ppkRotate->balance = 0;
+                                }
+                                else {
+                                    ppk->balance = -1;
+                                    ppkRotate->balance = 0;
+                                }
+
+                                ppkBottom->balance = 0;
+
+                                ppkRotate->left = ppkBottom->right;
+                                ppkBottom->right = ppkRotate - index;
+                                ppk->right = ppkBottom->left;
+                                ppkBottom->left = dataHead;     //ppk;
+                                ppk = ppkBottom;
+
+                                if (parent) {
+                                    ppkParent = (void *) parent + 
+                                            (sizeof (PP_T) * index);
+
+                                    if (!side)  //RDB_TREE_LEFT
+                                        ppkParent->left = ppkBottom - index;
+                                    else
+                                        ppkParent->right = ppkBottom - index;
+                                }
+                                else pool->root[index] = ppkBottom - index;
+                            }
+                        }
+
+                        if (ppk->balance <= 0)
+                            return 0;   // no further balanceing action needed
+
+                        if (ppk->balance == 1)
+                            return 1;   // need to continue balancing up
+                    }
+                    else if (rc2 == -1) return -1;
+                }
+            }
+            else {
+                debug ("Skipped due to multiple key on pool %s index %d\n",
+                        pool->name, index);
+                //TODO: give actal data
+                return (rdb_error_code(-1, RDB_E_DUPLICATE, "Insert index "
+                        "failed due to duplicate key in pool")); 
+            }   // multiple keys not yet supported!
+        }
+
+        return 0;
+    }
+
+    return -1;                          // we found no mechanizm to add node
+}
+
+inline int _rdb_delete_by_pointer (
+        rdb_pool_t  *pool, 
+        void        *parent, 
+        int         index,
+        PP_T        *ppkDead,
+        int         side);
+
+int _rdb_delete (
+        rdb_pool_t  *pool, 
+        int         lookupIndex, 
+        void        *data, 
+        void        *start, 
+        PP_T        *parent,
+        int         side);
+
+// rDB internal: undo a partial insert, unlinking data from indexes 
+// 0 .. last_success. Returns the number of indexes unlinked.
+static int _rdb_insert_undo (rdb_pool_t *pool, void *data, int last_success)
+{
+    int     ic2, rc = 0;
+
+    for (ic2 = 0; ic2 <= last_success; ic2++ ) {
+        //printf("RECOVERY %d\n", ic2);
+        _rdb_ts_idx_lock (pool, ic2);
+        (_rdb_delete (pool, ic2, data, NULL, NULL, 0) < 0) ? rc : rc++;
+        _rdb_ts_idx_unlock (pool, ic2);
+    }
+    if (rc != ic2) {
+        //not able to delete what we just inserted? Lock missed?
+        rdb_error_value(-1, "rdb_insert failed. Insert UNDO failed. LOCK ERROR?");
+    } 
+    return rc;
+}
+
+// Return shoud be the # of updated indexes, which must match the number of 
+// defined indexes, anything less shows an error and should be treated as 
+// such by user. A partial insert is undone, and 0 is returned.
+
+int rdb_insert (rdb_pool_t *pool, void *data)
+{
+    int     indexCount, last_success = -1;
+    int     rc = 0;
+
+#ifndef KM
+    if (pool->FLAGS[0] & RDB_LOCKFREE)
+        return rdb_lifo_push (pool, data);
+#endif
+  
+    if (data != NULL) {
+        RDB_LAT_START (pool);
+
+        _rdb_ts_update_lock (pool);
+        for (indexCount = 0; indexCount < pool->indexCount; indexCount++) {
+            _rdb_ts_idx_lock (pool, indexCount);
+            (_rdb_insert (pool, data, pool->root[indexCount], 
+                indexCount, NULL, 0) < 0) ? rc : rc++;
+            _rdb_ts_idx_unlock (pool, indexCount);
+            RDB_STAT_FLUSH (pool, indexCount);
+
+            if ( rc <= indexCount ) {
+                if (last_success >= 0) { // we failed to insert, we have what to undo
+                    //printf("RECOVERY\n");
+                    _rdb_insert_undo (pool, data, last_success);
+                    RDB_TRACEPOINT (undo, RDB_TRACE_UNDO, pool, last_success,
+                                                                    data);
+                    rc = 0; // to ensure counter will not go up
+                }
+                break;
+            }
+            else {
+                last_success = indexCount;
+            }
+        }
+#ifdef RDB_POOL_COUNTERS
+        if (rc > 0) {
+            RDB_COUNT_SET (pool, pool->record_count + 1);
+            _rdb_mem_strings (pool, data, 1);
+            _rdb_mem_peak (pool);
+        }
+#endif
+#ifdef RDB_POOL_STATS
+        for (indexCount = 0; indexCount < rc; indexCount++)
+            RDB_STAT (pool, indexCount, inserts);
+#endif
+        if (rc > 0) {
+            RDB_TRACEPOINT (insert, RDB_TRACE_INSERT, pool, -1, data);
+            RDB_WAL (pool, RDB_WAL_INSERT, data);
+        }
+        RDB_CAPTURE (pool, RDB_TRACE_INSERT, -1, data, rc);
+        _rdb_ts_update_unlock (pool);
+        if (rc > 0)
+            RDB_WAL_WAIT (pool);
+        RDB_LAT_END (pool, RDB_LAT_INSERT);
+    } else
+        rc = -1;
+
+    return rc;
+}
+
+// Only insert one index (asuming this index was removed and updated prior).
+int rdb_insert_one (rdb_pool_t *pool, int index, void *data)
+{
+    int rc;
+
+    _rdb_ts_update_lock (pool);
+    _rdb_ts_idx_lock (pool, index);
+    rc = _rdb_insert (pool, data, pool->root[index], index, NULL, 0) ;
+    _rdb_ts_idx_unlock (pool, index);
+    if (rc >= 0) {
+#ifdef RDB_POOL_COUNTERS
+        _rdb_mem_strings_idx (pool, data, index, 1);
+        _rdb_mem_peak (pool);
+#endif
+        RDB_WAL (pool, RDB_WAL_INSERT_ONE | index << 8, data);
+    }
+    _rdb_ts_update_unlock (pool);
+    if (rc >= 0)
+        RDB_WAL_WAIT (pool);
+    RDB_STAT_FLUSH (pool, index);
+    if (rc >= 0) {
+        RDB_STAT (pool, index, inserts);
+        RDB_TRACEPOINT (insert, RDB_TRACE_INSERT, pool, index, data);
+    }
+    return rc;
+}
+
+#ifndef KM
+/* Bulk ingest
+ *
+ * Each index only ever touches its own slot of a record's pointer pack, so
+ * indexes can be built side by side: every thread inserts the whole record
+ * array into its share of the indexes. A record refused by any index is
+ * unlinked from the others afterwards, on the calling thread, and retried
+ * in order once all refused records are out.
+ */
+
+typedef struct rdb_bulk_s {
+    rdb_pool_t      *pool;
+    void            **recs;
+    int             count;
+    int             nthreads;
+    uint32_t        *refused;       // per record, bit per index refusing it
+} rdb_bulk_t;
+
+typedef struct rdb_bulk_worker_s {
+    rdb_bulk_t      *bulk;
+    int             first;          // first index, then every nthreads'th
+    pthread_t       thread;
+} rdb_bulk_worker_t;
+
+static void *_rdb_bulk_worker (void *arg)
+{
+    rdb_bulk_worker_t   *w = arg;
+    rdb_bulk_t          *bulk = w->bulk;
+    rdb_pool_t          *pool = bulk->pool;
+    int                 idx, r;
+
+    for (idx = w->first; idx < pool->indexCount; idx += bulk->nthreads) {
+        for (r = 0; r < bulk->count; r++) {
+            if (_rdb_insert (pool, bulk->recs[r], pool->root[idx], idx, 
+                                                            NULL, 0) < 0)
+                __atomic_fetch_or (&bulk->refused[r], 1u << idx, 
+                                                        __ATOMIC_RELAXED);
+        }
+        RDB_STAT_FLUSH (pool, idx);
+    }
+    return NULL;
+}
+
+// Insert a record refused by the parallel pass into every index, in record
+// order, as rdb_insert would have. Pool locks are held. Returns 1 if taken
+static int _rdb_bulk_retry (rdb_pool_t *pool, void *rec)
+{
+    int idx, i;
+
+    for (idx = 0; idx < pool->indexCount; idx++)
+        if (_rdb_insert (pool, rec, pool->root[idx], idx, NULL, 0) < 0)
+            break;
+    if (idx == pool->indexCount)
+        return 1;
+    for (i = 0; i < idx; i++)
+        _rdb_delete (pool, i, rec, NULL, NULL, 0);
+    return 0;
+}
+
+// Insert count records into all indexes of pool, one thread per index (at
+// most nthreads, <= 0 for one per index). Records refused by any index
+// (duplicate key) are not inserted; if failed is not NULL, failed[n] is set
+// to 1 for those and 0 for the rest. Returns the number of records
+// inserted, or -1. As with rdb_insert, hold rdb_lock() on pools that are
+// not RDB_POOL_THREADSAFE.
+int rdb_insert_bulk (rdb_pool_t *pool, void **recs, int count, int nthreads,
+        unsigned char *failed)
+{
+    rdb_bulk_t          bulk;
+    rdb_bulk_worker_t   w[RDB_POOL_MAX_IDX];
+    int                 i, idx, started, inserted = 0;
+
+    if (pool == NULL || recs == NULL || count < 0)
+        return rdb_error_value (-1, "rdb_insert_bulk: bad arguments");
+    if (pool->FLAGS[0] & RDB_LOCKFREE)
+        return rdb_error_value (-1, "rdb_insert_bulk: use rdb_lifo_push on "
+                "lock-free pools");
+    for (i = 0; i < count; i++)
+        if (recs[i] == NULL)
+            return rdb_error_value (-1, "rdb_insert_bulk: NULL record");
+
+    if (nthreads <= 0 || nthreads > pool->indexCount)
+        nthreads = pool->indexCount;
+
+    bulk.pool = pool;
+    bulk.recs = recs;
+    bulk.count = count;
+    bulk.nthreads = nthreads;
+    bulk.refused = rdb_alloc (sizeof (uint32_t) * (count + 1));
+    if (bulk.refused == NULL)
+        return rdb_error_code (-1, RDB_E_NOMEM,
+                "rdb_insert_bulk: out of memory");
+    memset (bulk.refused, 0, sizeof (uint32_t) * (count + 1));
+
+    _rdb_ts_lock_all (pool);
+
+    for (i = 0; i < nthreads; i++) {
+        w[i].bulk = &bulk;
+        w[i].first = i;
+    }
+    for (started = 1; started < nthreads; started++)
+        if (pthread_create (&w[started].thread, NULL, _rdb_bulk_worker, 
+                                                                &w[started]))
+            break;
+    // the calling thread builds the first share, and any share whose
+    // thread could not be started
+    for (i = 0; i < nthreads; i++)
+        if (i == 0 || i >= started)
+            _rdb_bulk_worker (&w[i]);
+    for (i = 1; i < started; i++)
+        pthread_join (w[i].thread, NULL);
+
+    // unlink refused records from the indexes that did take them
+    for (i = 0; i < count; i++)
+        for (idx = 0; bulk.refused[i] && idx < pool->indexCount; idx++)
+            if ((bulk.refused[i] & (1u << idx)) == 0)
+                _rdb_delete (pool, idx, recs[i], NULL, NULL, 0);
+
+    // A record may have been refused for a key held only by another refused
+    // record. Records taken by every index hold no key an earlier record
+    // has, so retrying the refused ones in order gives the sequential result
+    for (i = 0; i < count; i++) {
+        if (bulk.refused[i] && _rdb_bulk_retry (pool, recs[i]))
+            bulk.refused[i] = 0;
+        if (failed)
+            failed[i] = bulk.refused[i] != 0;
+        if (bulk.refused[i] == 0) {
+            RDB_TRACEPOINT (insert, RDB_TRACE_INSERT, pool, -1, recs[i]);
+            RDB_WAL (pool, RDB_WAL_INSERT, recs[i]);
+#ifdef RDB_POOL_COUNTERS
+            _rdb_mem_strings (pool, recs[i], 1);
+#endif
+            inserted++;
+        }
+    }
+#ifdef RDB_POOL_COUNTERS
+    RDB_COUNT_SET (pool, pool->record_count + inserted);
+    _rdb_mem_peak (pool);
+#endif
+    for (idx = 0; idx < pool->indexCount; idx++) {
+        RDB_STAT_FLUSH (pool, idx);
+        RDB_STAT_ADD (pool, idx, inserts, inserted);
+    }
+
+    _rdb_ts_unlock_all (pool);
+    RDB_WAL_WAIT (pool);
+    rdb_free (bulk.refused);
+    return inserted;
+}
+#endif
+
+void   *_rdb_get (
+        rdb_pool_t  *pool, 
+        int         index, 
+        const void  *data, 
+        void        *start, 
+        int         partial) {
+
+    PP_T   *ppk;
+    int     rc;
+    void   *dataHead;
+
+    if ((pool->FLAGS[index] & RDB_BTREE) == RDB_BTREE) {
+
+        if (pool->root[index] == NULL) {
+            debug("GetFail - pool=%s, Null rool node\n",pool->name);
+            return (NULL);
+        } else {
+            if (pool->FLAGS[index] & (RDB_NOKEYS)) {
+                return pool->root[index];
+
+            }
+            set_pointers (pool, index, start, &ppk, &dataHead);
+
+            if (data == NULL ) {
+                debug("GetFail???\n");
+                return (dataHead);          // special case, return root node
+            }
+
+            RDB_STAT_CMP ();
+            if ((rc = pool->get_fn[index] (dataHead + pool->key_offset[index],
+                    (void *) data)) < 0) {
+                // left side
+
+                debug("Left Get\n");
+
+                if (ppk->left == NULL) {
+                    return (NULL);
+                }
+                else
+                    return (_rdb_get (pool, index, data, ppk->left, partial));
+            } else if (rc > 0) {
+                //i right side
+
+                debug("Right Get\n");
+
+                if (ppk->right == NULL) {
+                    return (NULL);
+                }
+                else
+                    return (_rdb_get (pool, index, data, ppk->right, partial));
+            }
+            else {
+                debug("Get:Done\n");
+                return (dataHead);              
+            }
+        }
+    }
+    return NULL;                                //should never get here
+}
+
+/*
+void   *_rdb_get_const (
+        rdb_pool_t  *pool, 
+        int         index, 
+        __int128_t  value, 
+        void        *start, 
+        int         partial) {
+
+    PP_T   *ppk;
+    int     rc;
+    void   *dataHead;
+
+    if ((pool->FLAGS[index] & RDB_BTREE) == RDB_BTREE) {
+
+        if (pool->root[index] == NULL) {
+            debug("GetFail - pool=%s, Null rool node\n",pool->name);
+            return (NULL);
+        }
+        else {
+            set_pointers (pool, index, start, &ppk, &dataHead);
+
+            if ((rc = pool->get_const_fn[index] (dataHead + 
+                    pool->key_offset[index], value)) < 0) {
+                // left side
+
+                debug("Left Get\n");
+
+                if (ppk->left == NULL) {
+                    return (NULL);
+                }
+                else
+                    return (_rdb_get_const (pool, index, value, ppk->left, partial));
+            } else if (rc > 0) {
+                //i right side
+
+                debug("Right Get\n");
+
+                if (ppk->right == NULL) {
+                    return (NULL);
+                }
+                else
+                    return (_rdb_get_const (pool, index, value, ppk->right, partial));
+            }
+            else {
+                debug("Get:Done\n");
+                return (dataHead); 
+            }
+        }
+    }
+    return NULL;                                //should never eet here
+}*/
+
+// Find requested data set and return a pointer to it
+// As a special case, if data = null, root node will be returned.
+void   *rdb_get (rdb_pool_t *pool, int idx, const void *data)
+{
+    void *ptr;
+
+    debug("Get:pool=%s,idx=%d", pool->name, idx);
+    RDB_LAT_START (pool);
+
+    _rdb_ts_read_lock (pool, idx);
+    ptr = _rdb_get (pool, idx, data, NULL, 0);
+    RDB_CAPTURE (pool, RDB_TRACE_GET, idx, data, ptr != NULL);
+    _rdb_ts_read_unlock (pool, idx);
+    RDB_LAT_END (pool, RDB_LAT_GET);
+    RDB_STAT_FLUSH (pool, idx);
+    RDB_STAT (pool, idx, gets);
+    if (ptr == NULL)
+        RDB_STAT (pool, idx, misses);
+    RDB_HOT (pool, idx, data);
+    RDB_TRACEPOINT (get, RDB_TRACE_GET, pool, idx, ptr);
+    return ptr;
+}
+
+void   *rdb_get_const (rdb_pool_t *pool, int idx, __intmax_t value)
+{
+    void *ptr;
+
+    debug("Get:pool=%s,idx=%d", pool->name, idx);
+    RDB_LAT_START (pool);
+
+    _rdb_ts_read_lock (pool, idx);
+    ptr = _rdb_get/*_const*/ (pool, idx, &value, NULL, 0);
+    RDB_CAPTURE (pool, RDB_TRACE_GET, idx, &value, ptr != NULL);
+    _rdb_ts_read_unlock (pool, idx);
+    RDB_LAT_END (pool, RDB_LAT_GET);
+    RDB_STAT_FLUSH (pool, idx);
+    RDB_STAT (pool, idx, gets);
+    if (ptr == NULL)
+        RDB_STAT (pool, idx, misses);
+    RDB_HOT (pool, idx, &value);
+    RDB_TRACEPOINT (get, RDB_TRACE_GET, pool, idx, ptr);
+    return ptr;
+}
+
+void   *_rdb_get_neigh (
+        rdb_pool_t  *pool, 
+        int         index, 
+        void        *data, 
+        void        *start, 
+        int         partial,
+        void        **before, 
+        void        **after) {
+
+    PP_T   *ppk;
+    int     rc;
+    void   *dataHead;
+
+    if ((pool->FLAGS[index] & RDB_BTREE) == RDB_BTREE) {
+
+        if (pool->root[index] == NULL) {
+            debug("GetFail\n");
+            before = NULL;
+            after = NULL;
+            return (NULL);
+        }
+        else {
+            set_pointers (pool, index, start, &ppk, &dataHead);
+
+            if (data == NULL ) {
+                debug("GetFail???\n");
+                before = NULL;
+                after = NULL;
+                return (dataHead);              // special case, return root node
+            }
+
+            RDB_STAT_CMP ();
+            if ((rc = pool->fn[index] (dataHead + pool->key_offset[index],
+                                  (void *) data)) < 0) {
+                // left side
+                debug("Left Get\n");
+
+                *after = (NULL == start) ? (void *) pool->root[index] : start ;
+
+                //*after=start;
+                if (ppk->left == NULL) {
+                    return (NULL);
+                }
+                else
+                    return (_rdb_get_neigh (pool, index, data, ppk->left, 
+                                                    partial, before, after));
+            }
+            else if (rc > 0) {
+                //right side
+                debug("Right Get\n");
+                *before = (NULL == start) ? (void *) pool->root[index] : start ;
+
+                //*before=start;
+                if (ppk->right == NULL) {
+                    return (NULL);
                 }
-                else if (pool->FLAGS[index] & RDB_KLIFO) {   
-                    // LIFO, add to head, as we always read/remove from head 
-                    // forward
-                    ppkParent = (void *) pool->root[index] + (sizeof (PP_T) * index);
-                    ppkNew = data + (sizeof (PP_T) * index);
-                    ppkNew->right = ppkParent;// - index;
-                    ppkNew->left = NULL;
-                    ppkParent->left = ppkNew;// - index;
-                    ppkNew->balance = 0;
-                    pool->root[index] = data;
+                else
+                    return (_rdb_get_neigh (pool, index, data, ppk->right, 
+                                                    partial, before, after));
+            }
+            else {
+                debug("Get:Done\n");
+                *after = *before = NULL;
+                return (dataHead);
+            }
+        }
+
+    }
+
+    return NULL;                                //should never eet here
+}
+
+// Same as pair above, plus, if key not found, set up pointers to
+// records before and after the lookup record.
+void   *rdb_get_neigh (rdb_pool_t *pool, int idx, void *data, void **before, void **after)
+{
+    void *ptr;
+
+    RDB_LAT_START (pool);
+
+    _rdb_ts_read_lock (pool, idx);
+    ptr = _rdb_get_neigh (pool, idx, data, NULL, 0, before, after);
+    _rdb_ts_read_unlock (pool, idx);
+    RDB_LAT_END (pool, RDB_LAT_GET);
+    RDB_STAT_FLUSH (pool, idx);
+    RDB_STAT (pool, idx, gets);
+    if (ptr == NULL)
+        RDB_STAT (pool, idx, misses);
+    RDB_TRACEPOINT (get, RDB_TRACE_GET, pool, idx, ptr);
+    return ptr;
+}
+
+
+// Internal usage
+#define RDBFE_NODE_DELETED 1
+#define RDBFE_NODE_RESUME_ON 2
+#define RDBFE_NODE_DONE 4
+#define RDBFE_NODE_FIND_NEXT 8
+#define RDBFE_ABORT 32
+
+int _rdb_iterate (
+        rdb_pool_t  *pool, 
+        int         index, 
+        int         fn (void *, void *), 
+        void        *data,
+        void        del_fn(void *, void*),
+        void        *delfn_data, 
+        void        *start, 
+        void        *parent, 
+        int         side, 
+        void        **resumePtr) {
+
+    void   *dataHead;
+    PP_T   *pp, *pr;
+    int     rc, rc2 = 0;
+    int     rc3 = 0;
+    int     indexCount;
+
+    if (pool->FLAGS[index] & RDB_BTREE) {
+        set_pointers (pool, index, start, &pp, &dataHead);
+
+        if (*resumePtr != NULL) {
+            debug ("0->Resumeing\n");
+            if ((rc3 = pool->fn[index] (dataHead + pool->key_offset[index],
+                            (void *) *resumePtr /*+ (sizeof (PP_T) * pool->indexCount)*/ + pool->key_offset[index])) < 0) {
+                debug("1->left(i=%d)\n",index);
+                if ( 1 == ( 1 & (rc =  _rdb_iterate (pool, index, fn, data,
+                                    del_fn, delfn_data, pp->left, start, RDB_TREE_LEFT,
+                                    resumePtr)))) { 
+                    // tree may have been modified
+                    // moving bit left - getting RDBFE_NODE_RESUME_ON and
+                    // not changing abort status;
+                    return (rc + 1 ); 
+                }
+                else if ( rc & RDBFE_NODE_FIND_NEXT ) {
+                    *resumePtr = dataHead;
+                    return rc - 8 ; //(leave abort status in if exist)
+                }
+                else if (rc > 1) return rc;
+            }
+        }
+        else {
+            if (pp->left != NULL) {
+                debug("2->left\n");
+                if ( 1 == ( 1 & (rc =  _rdb_iterate (pool, index, fn, data,
+                                    del_fn, delfn_data, pp->left, start, RDB_TREE_LEFT,
+                                    resumePtr)))) { 
+                    // tree may have been modified
+                    return (rc + 1 ) ; //RDBFE_NODE_RESUME_ON);
+                }
+                else if ( rc & RDBFE_NODE_FIND_NEXT ) {
+                    *resumePtr = dataHead;
+                    return rc - 8 ; //
+                }
+                else if (rc > 1) return rc;
+            }
+        }
+
+        if (*resumePtr != NULL &&  (dataHead == *resumePtr)) {
+            *resumePtr = NULL; 
+            debug ("redume work\n");
+        }
+                       // time to start working again
+
+        if (*resumePtr == NULL) {
+            rc = 0;
+
+            if (fn == NULL || RDB_CB_DELETE_NODE == (rc2 = fn (dataHead, data))
+                    || RDB_CB_DELETE_NODE_AND_ABORT == rc2 || 
+                                                        RDB_CB_ABORT == rc2 ) {
+
+                if (rc2 == RDB_CB_DELETE_NODE_AND_ABORT) 
+                    rc =  RDBFE_NODE_DELETED | RDBFE_ABORT ;
+                else if (rc2 == RDB_CB_ABORT) 
+                    return RDBFE_ABORT;
+                else rc = RDBFE_NODE_DELETED;
+
+                // Setting resume pointer to next record
+                if (pp->right) {
+                    pr = (void *) pp->right + (sizeof (PP_T) * index);
+
+                    while(pr->left != NULL) {
+                        pr = pr->left + (sizeof (PP_T) * index);
+                    }
+                    *resumePtr = (void *) pr - (sizeof (PP_T) * index);
+                }
+                else if (parent == NULL) {
+                    pr = (void *) pool->root[index] + (sizeof (PP_T) * index);
+
+                    if (pr->right) {
+                        pr = pr->right + (sizeof (PP_T) * index);
+
+                        while(pr->left != NULL) {
+                            pr = pr->left + (sizeof (PP_T) * index);
+                        }
+                        *resumePtr = (void *) pr - (sizeof (PP_T) * index);
+                    }
+                    else {
+                        *resumePtr = NULL; 
+                        // we are removing root and there is nothing to it's
+                        // right, we are done
+                        // Signal we are done
+                        rc = RDBFE_NODE_DONE | (rc & RDBFE_ABORT);  
+                    }
+
+                }
+                else {   // Parent is not null
+                    if (side == 0) {
+                        *resumePtr = parent;
+                        //*resumePtr = (void *) parent - (sizeof (PP_T) * index);
+                    }
+                    else {
+                        *resumePtr = NULL;
+                        // Signal we still need to find next pointer
+                        rc = RDBFE_NODE_FIND_NEXT | (rc & RDBFE_ABORT);
+                    }
+                }
+
+                for (indexCount = 0; indexCount < pool->indexCount; 
+                                                            indexCount++) {
+                    debug ("rdb_iterate: Delete # %d\n", indexCount);
+                    _rdb_delete (pool, indexCount, dataHead, NULL, NULL, 0);
+                    RDB_STAT_FLUSH (pool, indexCount);
+                    RDB_STAT (pool, indexCount, deletes);
+                }
+#ifdef RDB_POOL_COUNTERS
+                RDB_COUNT_SET (pool, pool->record_count - 1);
+                _rdb_mem_strings (pool, dataHead, -1);
+#endif
+                RDB_TRACEPOINT (delete, RDB_TRACE_DELETE, pool, -1, dataHead);
+                RDB_WAL (pool, RDB_WAL_DELETE, dataHead);
+                RDB_CAPTURE (pool, RDB_TRACE_DELETE, -1, dataHead, 1);
+
+                if (del_fn) del_fn(dataHead, delfn_data);
+                else _rdb_free_data (pool, dataHead);
+
+                debug ("after delete rc=%d\n", rc);
+                return rc;
+            }
+        }
+
+        if (pp->right != NULL) {
+            debug("(3)->right start %p resumePtr %p\n",start, *resumePtr);
+            if (1 == (1 & (rc = _rdb_iterate(pool, index, fn, data, del_fn, 
+                    delfn_data, pp->right, start, RDB_TREE_RIGHT, 
+                                                            resumePtr)))) {
+                // Moving bit left- getting RDBFE_NODE_RESUME_ON and not 
+                // changing abort status;
+                return ( rc + 1 ); 
+            }
+            else if ( rc > 1 ) return rc;
+        }
+
+    }
+
+    return 0;
+}
+
+int _rdb_iterate_list (
+        rdb_pool_t  *pool, 
+        int         index, 
+        int         fn (void *, void *), 
+        void        *data,
+        void        del_fn(void *, void*),
+        void        *delfn_data, 
+        void        *start, 
+        void        *parent, 
+        int         side, 
+        void        **resumePtr) {
+
+    void   *dataHead;
+    PP_T   *pp;
+    int     rc, rc2 = 0;
+    int     indexCount;
+
+rfeStart:
+
+    if (*resumePtr) {
+        set_pointers (pool, index, *resumePtr, &pp, &dataHead); 
+        *resumePtr = NULL;
+    } else
+        set_pointers (pool, index, start, &pp, &dataHead); 
+			
+
+    if (*resumePtr != NULL &&  (dataHead == *resumePtr)) *resumePtr = NULL; 
+                       // time to start working again
+
+    if (*resumePtr == NULL) {
+        rc = 0;
+
+        if (fn == NULL || RDB_CB_DELETE_NODE == (rc2 = fn (dataHead, data))
+                || RDB_CB_DELETE_NODE_AND_ABORT == rc2 || 
+                RDB_CB_ABORT == rc2 ) {
+
+            if (rc2 == RDB_CB_DELETE_NODE_AND_ABORT) 
+                rc =  RDBFE_NODE_DELETED | RDBFE_ABORT ;
+            else if (rc2 == RDB_CB_ABORT) 
+                return RDBFE_ABORT;
+            else rc = RDBFE_NODE_DELETED;
+
+            // Setting resume pointer to next record
+            if (pool->FLAGS[index] & (RDB_NOKEYS)) { 
+                // FIFO/LIFO, no need to recurse -
+                if (pp->right) {
+                    *resumePtr = (void *) pp->right - (sizeof (PP_T) * index);
                 }
+                else *resumePtr = NULL ;   // we are the last one;
+            }
+
+            for (indexCount = 0; indexCount < pool->indexCount; 
+                    indexCount++) {
+                debug ("rdb_iterate: Delete # %d\n", indexCount);
+                _rdb_delete (pool, indexCount, dataHead, NULL, NULL, 0);
+                RDB_STAT_FLUSH (pool, indexCount);
+                RDB_STAT (pool, indexCount, deletes);
+            }
+#ifdef RDB_POOL_COUNTERS
+            RDB_COUNT_SET (pool, pool->record_count - 1);
+            _rdb_mem_strings (pool, dataHead, -1);
+#endif
+            RDB_TRACEPOINT (delete, RDB_TRACE_DELETE, pool, -1, dataHead);
+            RDB_WAL (pool, RDB_WAL_DELETE, dataHead);
+            RDB_CAPTURE (pool, RDB_TRACE_DELETE, -1, dataHead, 1);
+
+            if (del_fn) del_fn(dataHead, delfn_data);
+            else _rdb_free_data (pool, dataHead);
+
+            return rc;
+        }
+    }
+
+    if (pp->right) {
+        start = (void *) pp->right - (sizeof (*pp) * index);
+        goto rfeStart;
+    }
+    return 0;
+}
+
+/* rdb_iterate scans the data pool, in order, by index, calling fn() on each node
+ * that is not null.
+ * If fn returns RDB_DB_DELETE_NODE, or if fn is null, the tree node will be 
+ * deleted from rDB and del_fn will be called to do it's thing (if not NULL).
+ *
+ * del_fn is called after node is unlinked from all data pools and it's purpose
+ * is to free any allocated memory and any other cleanup needed.
+ *
+ * del_fn receive a pointer to the node head, and a potential user  argument
+ * del_fn is optional but is highly recommanded. if it is missing (NULL), 
+ * rRB will free ptr for you, but it will not know how to free
+ * any dynamic allocations tied to it (except PSTR index fields, which is will
+ * free), So If there are any, and del_fn is null, memoty leak will occur.
+ */
+
+void rdb_iterate(
+        rdb_pool_t  *pool, 
+        int         index, 
+        int         fn(void *, void *),
+        void        *fn_data,
+        void        del_fn(void *, void *),
+        void        *del_data) {
+
+    void        *resumePtr;
+    int         rc = 0;
+
+    if (pool == NULL) {
+        return rdb_error("rdb_iterate called with NULL pool");
+    }
+
+    if (pool->root[index] == NULL) {
+        return;	    // no data is not an error
+    }
+
+    if ((pool->FLAGS[index] & RDB_BTREE) == 0) {
+        return rdb_error("iterate called without RDB_BTREE flag.");
+    }
+
+    resumePtr = NULL;
+    RDB_LAT_START (pool);
+
+    _rdb_ts_lock_all (pool);
+    RDB_CAPTURE (pool, RDB_CAPTURE_ITERATE, index, NULL, 0);
+    do {
+        if (resumePtr) {
+            RDB_STAT (pool, index, restarts);
+            RDB_TRACEPOINT (restart, RDB_TRACE_RESTART, pool, index, 
+                                                                resumePtr);
+        }
+        if ((pool->FLAGS[index] & (RDB_NOKEYS)) == 0) { 
+            // tree iteration
+            debug("Tree iterate - %s",pool->name);
+            rc = _rdb_iterate (pool, index, fn, fn_data, del_fn, del_data,
+                                pool->root[index], NULL, 0, &resumePtr);
+        } else { 
+            // list iteration
+            debug("List iterate - %s",pool->name);
+            rc = _rdb_iterate_list (pool, index, fn, fn_data, del_fn, del_data,
+                                pool->root[index], NULL, 0, &resumePtr);
+        }
+	    debug("rc=%d %p\n",rc, resumePtr);
+    } while (rc != 0 && ( rc & RDBFE_ABORT ) != RDBFE_ABORT && 
+                                                    resumePtr != NULL);
+    RDB_STAT_FLUSH (pool, index);
+    _rdb_ts_unlock_all (pool);
+    RDB_WAL_WAIT (pool);
+    RDB_LAT_END (pool, RDB_LAT_ITERATE);
+}
+
+#ifndef KM
+/* Parallel iteration
+ *
+ * The tree is cut into disjoint subtrees, a few per thread, and threads
+ * take the next unclaimed subtree off a shared counter until none is left,
+ * so a thread that drew small subtrees simply takes more of them. Nodes
+ * above the cut are single node tasks. Visit order is unspecified.
+ */
+
+#define RDB_PAR_TASKS_PER_THREAD    8
+#define RDB_PAR_MAX_THREADS         64
+#define RDB_PAR_STACK               128     // > AVL height of 2^64 records
+
+typedef struct rdb_par_task_s {
+    void        *node;
+    int         whole;              // whole subtree, or just this node
+} rdb_par_task_t;
+
+typedef struct rdb_par_s {
+    rdb_pool_t      *pool;
+    int             idx;
+    int             (*fn) (void *, void *);
+    rdb_par_task_t  *tasks;
+    int             ntasks;
+    int             next;           // next unclaimed task
+    int             abort;
+    int             misuse;         // fn returned neither OK nor ABORT
+} rdb_par_t;
+
+typedef struct rdb_par_worker_s {
+    rdb_par_t       *par;
+    void            *local;         // per thread reduce context
+    long            visited;
+    pthread_t       thread;
+} rdb_par_worker_t;
+
+// rDB internal: call fn on data, returns 0 to stop.
+static inline int _rdb_par_visit (rdb_par_worker_t *w, void *data)
+{
+    int rc;
+
+    w->visited++;
+    rc = w->par->fn (data, w->local);
+    if (rc == RDB_CB_OK)
+        return 1;
+    // the error is thread local, the caller sets it after the join
+    if (rc != RDB_CB_ABORT)
+        __atomic_store_n (&w->par->misuse, 1, __ATOMIC_RELAXED);
+    __atomic_store_n (&w->par->abort, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static void *_rdb_par_worker (void *arg)
+{
+    rdb_par_worker_t    *w = arg;
+    rdb_par_t           *par = w->par;
+    void                *stack[RDB_PAR_STACK], *node;
+    int                 t, sp;
+
+    while (!__atomic_load_n (&par->abort, __ATOMIC_RELAXED) &&
+            (t = __atomic_fetch_add (&par->next, 1, __ATOMIC_RELAXED)) <
+                                                                par->ntasks) {
+        node = par->tasks[t].node;
+        if (!par->tasks[t].whole) {
+            if (!_rdb_par_visit (w, node))
+                break;
+            continue;
+        }
+
+        // in order walk of the subtree, without recursion
+        sp = 0;
+        while (sp || node) {
+            if (node) {
+                stack[sp++] = node;
+                node = ((PP_T *) (node + sizeof (PP_T) * par->idx))->left;
+                continue;
+            }
+            node = stack[--sp];
+            if (!_rdb_par_visit (w, node) || 
+                    __atomic_load_n (&par->abort, __ATOMIC_RELAXED))
+                return NULL;
+            node = ((PP_T *) (node + sizeof (PP_T) * par->idx))->right;
+        }
+    }
+    return NULL;
+}
+
+// rDB internal: cut the tree into about target subtree tasks, using at most
+// max slots. returns the task count.
+static int _rdb_par_split (rdb_par_t *par, int target, int max)
+{
+    rdb_par_task_t  *t = par->tasks;
+    PP_T            *pp;
+    int             n = 1, whole = 1, i, end;
+
+    t[0].node = par->pool->root[par->idx];
+    t[0].whole = 1;
+
+    // each round turns every whole subtree into node + two subtrees
+    while (whole > 0 && whole < target && n + 2 * whole <= max) {
+        end = n;
+        whole = 0;
+        for (i = 0; i < end; i++) {
+            if (!t[i].whole)
+                continue;
+            pp = t[i].node + sizeof (PP_T) * par->idx;
+            t[i].whole = 0;
+            if (pp->left) {
+                t[n].node = pp->left;
+                t[n++].whole = 1;
+                whole++;
+            }
+            if (pp->right) {
+                t[n].node = pp->right;
+                t[n++].whole = 1;
+                whole++;
+            }
+        }
+    }
+    return n;
+}
+
+// Call fn (record, local) for every record of index idx, from nthreads 
+// threads (<= 0: one per online cpu). fn must not change the pool and 
+// returns RDB_CB_OK, or RDB_CB_ABORT to stop all threads.
+//
+// With ctx, each thread gets its own context from ctx->init (ctx->user)
+// and, once all threads are done, the calling thread folds each one into
+// ctx->user with ctx->combine (which also frees it). Without init, all
+// threads share ctx->user.
+//
+// Returns the number of records visited, or -1 (also when fn returned
+// anything else). The pool must not be written meanwhile:
+// RDB_POOL_THREADSAFE pools are read locked here, for others hold
+// rdb_lock(). List indexes are walked by the calling thread.
+long rdb_iterate_parallel (rdb_pool_t *pool, int idx, 
+        int fn (void *, void *), rdb_reduce_t *ctx, int nthreads)
+{
+    rdb_par_t           par;
+    rdb_par_worker_t    *w;
+    void                *node;
+    long                visited = 0;
+    int                 i, started;
+
+    if (pool == NULL || fn == NULL || idx < 0 || idx >= pool->indexCount)
+        return rdb_error_value (-1, "rdb_iterate_parallel: bad arguments");
+    if ((pool->FLAGS[idx] & RDB_BTREE) == 0)
+        return rdb_error_value (-1, "rdb_iterate_parallel called without "
+                "RDB_BTREE flag.");
+    if (pool->FLAGS[idx] & RDB_LOCKFREE)
+        return rdb_error_value (-1, "rdb_iterate_parallel: lock-free pools"
+                " can not be iterated");
+
+    if (nthreads <= 0)
+        nthreads = sysconf (_SC_NPROCESSORS_ONLN);
+    if (nthreads > RDB_PAR_MAX_THREADS)
+        nthreads = RDB_PAR_MAX_THREADS;
+    if (nthreads < 1 || pool->FLAGS[idx] & RDB_NOKEYS)
+        nthreads = 1;
+
+    memset (&par, 0, sizeof (par));
+    par.pool = pool;
+    par.idx = idx;
+    par.fn = fn;
+
+    w = rdb_alloc (sizeof (rdb_par_worker_t) * nthreads + 
+            sizeof (rdb_par_task_t) * nthreads * RDB_PAR_TASKS_PER_THREAD * 3);
+    if (w == NULL)
+        return rdb_error_code (-1, RDB_E_NOMEM,
+                "rdb_iterate_parallel: out of memory");
+    par.tasks = (void *) (w + nthreads);
+
+    for (i = 0; i < nthreads; i++) {
+        w[i].par = &par;
+        w[i].visited = 0;
+        w[i].local = NULL;
+        if (ctx)
+            w[i].local = ctx->init ? ctx->init (ctx->user) : ctx->user;
+    }
+
+    _rdb_ts_read_lock (pool, idx);
+
+    if (pool->root[idx] == NULL)
+        par.ntasks = 0;
+    else if (pool->FLAGS[idx] & RDB_NOKEYS) {
+        // lists do not split, walk it here
+        for (node = pool->root[idx]; node; ) {
+            if (!_rdb_par_visit (&w[0], node))
+                break;
+            node = ((PP_T *) (node + sizeof (PP_T) * idx))->right;
+            if (node)
+                node -= sizeof (PP_T) * idx;
+        }
+    } else
+        par.ntasks = _rdb_par_split (&par, nthreads * RDB_PAR_TASKS_PER_THREAD,
+                                nthreads * RDB_PAR_TASKS_PER_THREAD * 3);
+
+    // the calling thread is worker 0
+    for (started = 1; started < nthreads && par.ntasks > 1; started++) {
+        if (pthread_create (&w[started].thread, NULL, _rdb_par_worker, 
+                                                            &w[started]))
+            break;                  // run with what we have
+    }
+    _rdb_par_worker (&w[0]);
+    for (i = 1; i < started; i++)
+        pthread_join (w[i].thread, NULL);
+
+    _rdb_ts_read_unlock (pool, idx);
+
+    for (i = 0; i < nthreads; i++) {
+        visited += w[i].visited;
+        if (ctx && ctx->init && ctx->combine)
+            ctx->combine (ctx->user, w[i].local);
+    }
+    rdb_free (w);
+    if (par.misuse)
+        return rdb_error_value (-1, "rdb_iterate_parallel: callbacks are "
+                "read only, only RDB_CB_OK / RDB_CB_ABORT are allowed");
+    return visited;
+}
+#endif
+
+void _rdb_flush( 
+        rdb_pool_t  *pool, 
+        void        *start, 
+        void        fn( void *, void *), 
+        void        *fn_data) {
+
+    void   *dataHead;
+    PP_T   *pp;
+
+    if (pool->FLAGS[0] & RDB_BTREE) {
+        set_pointers( pool, 0, start, &pp, &dataHead);
+
+        if (pp->left != NULL)
+            _rdb_flush( pool, pp->left, fn, fn_data );
+
+        if (pp->right != NULL)
+            _rdb_flush( pool, pp->right, fn, fn_data );
+
+        if (NULL != fn) fn(dataHead, fn_data);
+        else _rdb_free_data (pool, dataHead);
+    }
+}
+
+void _rdb_flush_list(   
+        rdb_pool_t  *pool, 
+        void        *start, 
+        void        fn( void *, void *), 
+        void *fn_data) {
+
+    void   *dataHead;
+    PP_T   *pp;
+
+    if (pool->FLAGS[0] & RDB_BTREE)
+        do {
+            set_pointers( pool, 0, start, &pp, &dataHead);
+
+            start = pp->right;
+
+            if (NULL != fn) fn(dataHead, fn_data);
+            else _rdb_free_data (pool, dataHead);
+        }
+        while (start != NULL);
+}
+
+/* This will delete all the nodes in the tree,
+ * Since we are destroying the tree, we do not care about fixing parent
+ * pointers, re-balancing etc, this means there is no before and after delete
+ * functions, but only one fn which serve as both.
+ *
+ * This fn should free the allocated memory (ptr), and any additionali
+ * dynamic allocations tied to it.
+ *
+ * fn() is optional but is highly recommanded. if it is missing (NULL), 
+ * rdb will free ptr for you, but it will not know how to free any dynamic 
+ * allocations tied to it, so If there is any, and fn is null, 
+ * memoty leak will occur.
+ */
+#ifndef KM
+static void *_rdb_lf_detach (rdb_pool_t *pool);
+#endif
+
+void rdb_flush( rdb_pool_t *pool, void fn( void *, void *), void *fn_data)
+{
+
+    int cnt;
+
+#ifndef KM
+    if (pool->FLAGS[0] & RDB_LOCKFREE) {
+        // Detach the whole stack in one swap and flush it as a plain list.
+        // Records cached by other threads' magazines are not reachable here
+        rdb_lifo_mag_flush (pool);
+        pool->root[0] = _rdb_lf_detach (pool);
+    }
+#endif
+
+    _rdb_ts_lock_all (pool);
+
+    if (pool->root[0] == NULL) {
+        _rdb_ts_unlock_all (pool);
+        return;
+    }
+
+    if (pool->FLAGS[0] & (RDB_NOKEYS))
+        _rdb_flush_list (pool, NULL, fn, fn_data);
+    else
+        _rdb_flush (pool, NULL, fn, fn_data);
+
+    for (cnt = 0; cnt < pool->indexCount; cnt++)
+        if (pool->root[cnt])
+            pool->root[cnt] = NULL;
+
+#ifdef RDB_POOL_COUNTERS
+    RDB_COUNT_SET (pool, 0);
+    __atomic_store_n (&pool->string_bytes, 0, __ATOMIC_RELAXED);
+#endif
+    RDB_WAL (pool, RDB_WAL_FLUSH, NULL);
+
+    _rdb_ts_unlock_all (pool);
+    RDB_WAL_WAIT (pool);
+}
+
+#ifndef KM
+/* Deferred reclamation
+ *
+ * rdb_flush_async() unhooks every index root of the pool, so the pool is
+ * empty when it returns, and queues the detached records for a background
+ * reclaimer thread (started on first use). The reclaimer walks each tree
+ * without recursion, unthreading it as it goes, and calls fn - or frees the
+ * record - for each one, optionally at a limited rate so a huge flush does
+ * not compete with the rest of the process for the allocator and cache.
+ */
+
+typedef struct rdb_reclaim_job_s {
+    struct rdb_reclaim_job_s *next;
+    rdb_pool_t      shadow;         // detached root, and what freeing needs
+    void            (*fn) (void *, void *);
+    void            *fn_data;
+} rdb_reclaim_job_t;
+
+static pthread_mutex_t      rdb_reclaim_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t       rdb_reclaim_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t       rdb_reclaim_idle = PTHREAD_COND_INITIALIZER;
+static rdb_reclaim_job_t    *rdb_reclaim_head, 
+                            *rdb_reclaim_tail;
+static pthread_t            rdb_reclaim_thread;
+static int                  rdb_reclaim_running, 
+                            rdb_reclaim_busy, 
+                            rdb_reclaim_stop;
+static long                 rdb_reclaim_rate;   // records / second, 0: no limit
+
+#define RDB_RECLAIM_PACE    256     // records between rate checks
+
+// rDB internal: free (or hand to fn) every record of a detached job
+static void _rdb_reclaim_job (rdb_reclaim_job_t *job)
+{
+    rdb_pool_t      *pool = &job->shadow;
+    PP_T            *pp, *lpp;
+    void            *node = pool->root[0], 
+                    *next;
+    struct timespec start, now, pause;
+    long            rate = __atomic_load_n (&rdb_reclaim_rate, __ATOMIC_RELAXED);
+    long            count = 0;
+    int64_t         ahead;
+
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    while (node) {
+        pp = node;                      // index 0 pointer pack
+        if ((pool->FLAGS[0] & RDB_NOKEYS) == 0 && pp->left) {
+            // rotate right, until the leftmost node is on top
+            next = pp->left;
+            lpp = next;
+            pp->left = lpp->right;
+            lpp->right = node;
+            node = next;
+            continue;
+        }
+        next = pp->right;
+        if (job->fn) job->fn (node, job->fn_data);
+        else _rdb_free_data (pool, node);
+        node = next;
+
+        if (rate && ++count % RDB_RECLAIM_PACE == 0) {
+            clock_gettime (CLOCK_MONOTONIC, &now);
+            ahead = count * 1000000000LL / rate - 
+                    ((now.tv_sec - start.tv_sec) * 1000000000LL + 
+                                        (now.tv_nsec - start.tv_nsec));
+            if (ahead > 0) {
+                pause.tv_sec = ahead / 1000000000LL;
+                pause.tv_nsec = ahead % 1000000000LL;
+                nanosleep (&pause, NULL);
             }
         }
+    }
+}
+
+static void *_rdb_reclaimer (void *arg)
+{
+    rdb_reclaim_job_t *job;
+
+    rdb_sem_lock (&rdb_reclaim_mutex);
+    for (;;) {
+        while (rdb_reclaim_head == NULL && !rdb_reclaim_stop)
+            pthread_cond_wait (&rdb_reclaim_work, &rdb_reclaim_mutex);
+        if ((job = rdb_reclaim_head) == NULL)
+            break;
+        if ((rdb_reclaim_head = job->next) == NULL)
+            rdb_reclaim_tail = NULL;
+        rdb_reclaim_busy = 1;
+        rdb_sem_unlock (&rdb_reclaim_mutex);
+
+        _rdb_reclaim_job (job);
+        rdb_free (job);
+
+        rdb_sem_lock (&rdb_reclaim_mutex);
+        rdb_reclaim_busy = 0;
+        if (rdb_reclaim_head == NULL)
+            pthread_cond_broadcast (&rdb_reclaim_idle);
+    }
+    rdb_sem_unlock (&rdb_reclaim_mutex);
+    return NULL;
+}
+
+// rDB internal: hand a job to the reclaimer, starting it if needed
+static void _rdb_reclaim_queue (rdb_reclaim_job_t *job)
+{
+    rdb_sem_lock (&rdb_reclaim_mutex);
+    if (!rdb_reclaim_running) {
+        rdb_reclaim_stop = 0;
+        if (pthread_create (&rdb_reclaim_thread, NULL, _rdb_reclaimer, NULL)) {
+            // no thread, reclaim here
+            rdb_sem_unlock (&rdb_reclaim_mutex);
+            _rdb_reclaim_job (job);
+            rdb_free (job);
+            return;
+        }
+        rdb_reclaim_running = 1;
+    }
+    if (rdb_reclaim_tail)
+        rdb_reclaim_tail->next = job;
+    else
+        rdb_reclaim_head = job;
+    rdb_reclaim_tail = job;
+    pthread_cond_signal (&rdb_reclaim_work);
+    rdb_sem_unlock (&rdb_reclaim_mutex);
+}
+
+// Empty the pool now, reclaim its records in the background. fn (record,
+// fn_data) is called from the reclaimer thread; without it records are
+// freed as rdb_flush would. Returns 0, or -1 on error (pool untouched).
+int rdb_flush_async (rdb_pool_t *pool, void fn (void *, void *), 
+        void *fn_data)
+{
+    rdb_reclaim_job_t   *job;
+    int                 cnt;
+
+    if (pool == NULL)
+        return rdb_error_value (-1, "rdb_flush_async called with NULL pool");
+    if ((pool->FLAGS[0] & RDB_BTREE) == 0)
+        return rdb_error_value (-1, "rdb_flush_async called without "
+                "RDB_BTREE flag.");
+
+    job = rdb_alloc (sizeof (rdb_reclaim_job_t));
+    if (job == NULL)
+        return rdb_error_code (-1, RDB_E_NOMEM,
+                "rdb_flush_async: out of memory");
+    memset (job, 0, sizeof (rdb_reclaim_job_t));
+    job->fn = fn;
+    job->fn_data = fn_data;
+
+    if (pool->FLAGS[0] & RDB_LOCKFREE) {
+        // as rdb_flush, other threads' magazines are not reachable here
+        rdb_lifo_mag_flush (pool);
+        job->shadow.root[0] = _rdb_lf_detach (pool);
+    }
+
+    _rdb_ts_lock_all (pool);
+    job->shadow.indexCount = pool->indexCount;
+    job->shadow.mmap = pool->mmap;
+    memcpy (job->shadow.FLAGS, pool->FLAGS, sizeof (pool->FLAGS));
+    memcpy (job->shadow.key_offset, pool->key_offset, 
+                                                sizeof (pool->key_offset));
+    if (job->shadow.root[0] == NULL)
+        job->shadow.root[0] = pool->root[0];
+    for (cnt = 0; cnt < pool->indexCount; cnt++)
+        pool->root[cnt] = pool->tail[cnt] = NULL;
+#ifdef RDB_POOL_COUNTERS
+    RDB_COUNT_SET (pool, 0);
+    __atomic_store_n (&pool->string_bytes, 0, __ATOMIC_RELAXED);
+#endif
+    RDB_WAL (pool, RDB_WAL_FLUSH, NULL);
+    _rdb_ts_unlock_all (pool);
+    RDB_WAL_WAIT (pool);
+
+    if (job->shadow.root[0] == NULL) {
+        rdb_free (job);
+        return 0;
+    }
+
+    rdb_sem_lock (&rdb_reclaim_mutex);
+    if (__atomic_load_n (&pool->snap_refs, __ATOMIC_ACQUIRE)) {
+        // snapshots still see these records, queued on the last release
+        job->next = pool->snap_jobs;
+        pool->snap_jobs = job;
+        rdb_sem_unlock (&rdb_reclaim_mutex);
+        return 0;
+    }
+    rdb_sem_unlock (&rdb_reclaim_mutex);
+
+    _rdb_reclaim_queue (job);
+    return 0;
+}
+
+// Limit the reclaimer to about records_per_sec records a second, 0 for
+// no limit. Applies from the next flushed pool on.
+void rdb_reclaim_set_rate (long records_per_sec)
+{
+    __atomic_store_n (&rdb_reclaim_rate, records_per_sec > 0 ? 
+                                        records_per_sec : 0, __ATOMIC_RELAXED);
+}
+
+// Block until every pool handed to rdb_flush_async is reclaimed
+void rdb_reclaim_wait (void)
+{
+    rdb_sem_lock (&rdb_reclaim_mutex);
+    while (rdb_reclaim_head || rdb_reclaim_busy)
+        pthread_cond_wait (&rdb_reclaim_idle, &rdb_reclaim_mutex);
+    rdb_sem_unlock (&rdb_reclaim_mutex);
+}
+
+/* Snapshots
+ *
+ * Records are the tree nodes, so writers can not path-copy them. Instead
+ * rdb_snapshot() copies every index, in index order, into a pointer array,
+ * while writers are held off (update lock, or the caller's rdb_lock()).
+ * That is one linear pass per index instead of a callback scan under
+ * lock; from then on snapshot gets and iteration take no lock at all and
+ * writers carry on. The copy is the price: writers pause for it, so large
+ * pools with many indexes should be snapshot sparingly.
+ *
+ * Lookups compare against the keys in the records, so keys must not change
+ * while a snapshot is live: rdb_delete_one(), the first half of a re-key,
+ * is refused until the last snapshot is released.
+ *
+ * What a snapshot must be protected from is a record being freed under it.
+ * While any snapshot of the pool is live, records rDB frees (courtesy
+ * frees in rdb_flush / rdb_iterate, rdb_snapshot_retire) are parked in a
+ * limbo list and rdb_flush_async jobs are held; the last release frees and
+ * queues them. Records rDB hands back to the caller (rdb_delete, flush and
+ * delete callbacks) should be freed with rdb_snapshot_retire() for the same
+ * reason.
+ */
+
+static void _rdb_limbo_drain (rdb_pool_t *pool);
+
+// rDB internal: park a record until the last snapshot is released. the
+// link is the (unused by now) index 0 pointer pack.
+static void _rdb_limbo_push (rdb_pool_t *pool, void *dataHead)
+{
+    PP_T    *pp = dataHead;
+    void    *head = __atomic_load_n (&pool->limbo, __ATOMIC_RELAXED);
+
+    do {
+        pp->left = head;
+    } while (!__atomic_compare_exchange_n (&pool->limbo, &head, dataHead, 1,
+                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    // raced with the last release? then nobody else will drain it
+    if (__atomic_load_n (&pool->snap_refs, __ATOMIC_ACQUIRE) == 0)
+        _rdb_limbo_drain (pool);
+}
+
+static void _rdb_limbo_drain (rdb_pool_t *pool)
+{
+    void    *dataHead, 
+            *next;
+
+    dataHead = __atomic_exchange_n (&pool->limbo, NULL, __ATOMIC_ACQUIRE);
+    while (dataHead) {
+        next = ((PP_T *) dataHead)->left;
+        _rdb_free_data_now (pool, dataHead);
+        dataHead = next;
+    }
+}
+
+// rDB internal: hand flushes held for snapshots to the reclaimer
+static void _rdb_snap_jobs_release (rdb_pool_t *pool)
+{
+    rdb_reclaim_job_t *job, *next;
+
+    rdb_sem_lock (&rdb_reclaim_mutex);
+    job = pool->snap_jobs;
+    pool->snap_jobs = NULL;
+    rdb_sem_unlock (&rdb_reclaim_mutex);
+
+    for (; job; job = next) {
+        next = job->next;
+        job->next = NULL;
+        _rdb_reclaim_queue (job);
+    }
+}
+
+static void _rdb_snap_drop (rdb_pool_t *pool)
+{
+    _rdb_snap_jobs_release (pool);
+    _rdb_limbo_drain (pool);
+}
+
+// rDB internal: fill out with the records of index idx, in index order.
+// returns the number of records stored, at most max. out NULL just counts
+static uint32_t _rdb_snap_index (rdb_pool_t *pool, int idx, void **out,
+        uint32_t max)
+{
+    void        *stack[RDB_PAR_STACK], *node = pool->root[idx];
+    uint32_t    n = 0;
+    int         sp = 0;
+
+    if (pool->FLAGS[idx] & RDB_NOKEYS) {
+        while (node && n < max) {
+            if (out) out[n] = node;
+            n++;
+            node = ((PP_T *) (node + sizeof (PP_T) * idx))->right;
+            if (node)
+                node -= sizeof (PP_T) * idx;
+        }
+        return n;
+    }
+    while ((sp || node) && n < max) {
+        if (node) {
+            stack[sp++] = node;
+            node = ((PP_T *) (node + sizeof (PP_T) * idx))->left;
+            continue;
+        }
+        node = stack[--sp];
+        if (out) out[n] = node;
+        n++;
+        node = ((PP_T *) (node + sizeof (PP_T) * idx))->right;
+    }
+    return n;
+}
 
-        else if (pool->root[index] == NULL) {
-            debug ("Virgin Insert, pool=%s\n",pool->name);
-            pool->root[index] = data;
-            debug ("ppkRoot  = %p,%p \n",  pool->root[index],
-                       pool->root[index] + (sizeof (PP_T) * index));
-            ppkNew = data + (sizeof (PP_T) * index);
-            ppkNew->left = ppkNew->right = NULL;
-            ppkNew->balance = 0;
+// Point in time view of all indexes of pool. release with 
+// rdb_snapshot_release(). For pools that are not RDB_POOL_THREADSAFE hold
+// rdb_lock() for this call (only). Writers wait for two walks of every
+// index, O(records x indexes).
+rdb_snapshot_t *rdb_snapshot (rdb_pool_t *pool)
+{
+    rdb_snapshot_t  *snap;
+    void            **recs;
+    uint32_t        len[RDB_POOL_MAX_IDX];
+    size_t          total = 0;
+    int             idx;
 
-#ifdef DEBUG
-            if (start == NULL)
-                ppk = (PP_T *) pool->root[index] + (sizeof (PP_T) * index);
-            else
-                ppk = start + (sizeof (PP_T) * index);
+    if (pool == NULL)
+        return NULL;
+    if (pool->FLAGS[0] & RDB_LOCKFREE) {
+        rdb_error ("rdb_snapshot: lock-free pools can not be snapshot");
+        return NULL;
+    }
 
-            dataHead = ppk - index;
-            ppkNew = data;
-            debug ("Datahead: %p, data: %p, ppkNew: %p, start%snull %p ? %p\n",
-                    dataHead, data, ppkNew, (start == NULL) ? "=" : "!=",
-                    dataHead + pool->key_offset[index], 
-                    (void *) (ppkNew) + pool->key_offset[index]);
+    _rdb_ts_update_lock (pool);
+    // indexes can differ in size (rdb_delete_one), and record_count does not
+    // follow them, so every index is counted
+    for (idx = 0; idx < pool->indexCount; idx++) {
+        len[idx] = _rdb_snap_index (pool, idx, NULL, UINT32_MAX);
+        total += len[idx];
+    }
+    snap = rdb_alloc (sizeof (rdb_snapshot_t) + sizeof (void *) * total);
+    if (snap == NULL) {
+        _rdb_ts_update_unlock (pool);
+        rdb_error_code (0, RDB_E_NOMEM, "rdb_snapshot: out of memory");
+        return NULL;
+    }
+    memset (snap, 0, sizeof (rdb_snapshot_t));
+    snap->pool = pool;
+    snap->refs = 1;
+    recs = (void *) (snap + 1);
+    for (idx = 0; idx < pool->indexCount; idx++) {
+        snap->recs[idx] = recs;
+        snap->len[idx] = _rdb_snap_index (pool, idx, recs, len[idx]);
+        recs += len[idx];
+    }
+    snap->count = snap->len[0];
+    __atomic_fetch_add (&pool->snap_refs, 1, __ATOMIC_ACQ_REL);
+    _rdb_ts_update_unlock (pool);
+
+    return snap;
+}
+
+// Take another reference, for handing a snapshot to another thread
+void rdb_snapshot_ref (rdb_snapshot_t *snap)
+{
+    __atomic_fetch_add (&snap->refs, 1, __ATOMIC_RELAXED);
+}
+
+void rdb_snapshot_release (rdb_snapshot_t *snap)
+{
+    rdb_pool_t  *pool;
+    int         refs;
+
+    if (snap == NULL || __atomic_sub_fetch (&snap->refs, 1, __ATOMIC_ACQ_REL))
+        return;
+
+    pool = snap->pool;
+    rdb_free (snap);
+    refs = __atomic_sub_fetch (&pool->snap_refs, 1, __ATOMIC_ACQ_REL);
+    if (refs == 0 || refs == RDB_SNAP_DROPPED)
+        _rdb_snap_drop (pool);
+    if (refs == RDB_SNAP_DROPPED)
+        _rdb_pool_free (pool);
+}
+
+// Free a record the way rdb_flush would, once no snapshot can see it
+void rdb_snapshot_retire (rdb_pool_t *pool, void *data)
+{
+    _rdb_free_data (pool, data);
+}
+
+// Lookup in a snapshot, same arguments as rdb_get. lists return their head
+void *rdb_snapshot_get (rdb_snapshot_t *snap, int idx, const void *data)
+{
+    rdb_pool_t  *pool = snap->pool;
+    uint32_t    lo = 0, 
+                hi, 
+                mid;
+    int         rc;
+
+    if (idx < 0 || idx >= pool->indexCount || snap->len[idx] == 0)
+        return NULL;
+    if (pool->FLAGS[idx] & RDB_NOKEYS)
+        return snap->recs[idx][0];
+
+    hi = snap->len[idx];
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        rc = pool->get_fn[idx] (snap->recs[idx][mid] + pool->key_offset[idx],
+                (void *) data);
+        if (rc < 0)
+            hi = mid;
+        else if (rc > 0)
+            lo = mid + 1;
+        else
+            return snap->recs[idx][mid];
+    }
+    return NULL;
+}
+
+// Call fn (record, fn_data) for every record of index idx in the snapshot, 
+// in index order, until it returns RDB_CB_ABORT. Returns records visited
+uint32_t rdb_snapshot_iterate (rdb_snapshot_t *snap, int idx, 
+        int fn (void *, void *), void *fn_data)
+{
+    uint32_t n;
+
+    if (idx < 0 || idx >= snap->pool->indexCount)
+        return 0;
+    for (n = 0; n < snap->len[idx]; n++)
+        if (fn (snap->recs[idx][n], fn_data) == RDB_CB_ABORT)
+            return n + 1;
+    return n;
+}
+
+// rDB internal: finish pending reclamation and stop the reclaimer
+static void _rdb_reclaim_shutdown (void)
+{
+    int running;
+
+    rdb_sem_lock (&rdb_reclaim_mutex);
+    running = rdb_reclaim_running;
+    rdb_reclaim_stop = 1;
+    pthread_cond_signal (&rdb_reclaim_work);
+    rdb_sem_unlock (&rdb_reclaim_mutex);
+
+    if (running) {
+        pthread_join (rdb_reclaim_thread, NULL);
+        rdb_reclaim_running = 0;
+    }
+}
 #endif
-        }
-        else {
-            set_pointers (pool, index, start, &ppk, &dataHead);
-            debug ("Pointers SET, start = %x\n", (unsigned long) (start));
-            ppkNew = (void *) data + (sizeof (PP_T) * index);
 
-            if ((rc = pool->fn[index] (dataHead + pool->key_offset[index],
-                    (void *) data + pool->key_offset[index])) < 0) {
-                // left side
-                if (ppk->left == NULL) {
-                    debug ("Left Insert\n");
-                    ppk->left = data;           //ppkNew;
-                    ppk->balance -= 1;
-                    ppkNew->left = ppkNew->right = NULL;
-                    ppkNew->balance = 0;
 
-                    if (ppk->balance != 0)
-                        return 1;           // added a level
-                    else
-                        return 0;           // added a leaf in an existing level
-                }
-                else {
-                    // Here we possibly added a level to the left tree
-                    debug ("Diving Left\n");
 
-                    if ((rc2 = _rdb_insert (pool, data, ppk->left, index, start,
-                                           RDB_TREE_LEFT)) == 1) {
-                        // level added on left side
-                        ppk->balance--;
 
-                        if (ppk->balance == -2) {
-                            // we need to rotate
-                            ppkRotate = (void *) ppk->left + 
-                                    (sizeof (PP_T) * index);
+/* In order to delete and keep an AVL tree balanced, when we may have multiple
+ * indexes, we need to do the following:
+ *
+ * 1) Do an rdb_get to aquire a 'data' pointer so we can read all indexes and 
+ *    delete the node out of all index trees. this is done by rdb_delete().
+ *
+ * 2) Next, recursive function _rdb_delete() is called, Once for each index.
+ *    It will find the pointer to the data to be deleted (ppkDead), as well as
+ *    a 'data' pointer to the parent.
+ *
+ * 3) Next we call _rdb_delete_by_pointer() to actually un-link the data blocks
+ *    from the index trees. We have the following cases...
+ *    3.1) Unlink block is a leaf (no childrens), we just update parent pointers
+ *         point to NULL and return indicator to parent to re-balance tree if 
+ *         needed
+ */
 
-                            if (ppkRotate->balance < 0) {
-                                //left left case
-                                debug ("Left Left Rotate\n");
 
-                                if (parent) {
-                                    ppkParent = (void *) parent + 
-                                            (sizeof (PP_T) * index);
+/* In orfer to delete a node we need to do the following:
+ *
+ * 1) Find the parent node (if we are not deleting the root node) so new 
+ *    subtree can be linked to it (*parent)
+ *
+ * 2) Find the node to be deleted , same is in normal lookup 
+ *    (this is how we get the parent - *ppkDead)
+ *
+ * 3) If deleted node only has one child, link ppkLeft Or ppkRight 
+ *    to parent and we are done
+ *
+ * 4) If we have 2 children set *ppkLeft and *ppkRight and...
+ *    Find most right point of left child (*ppkHook)
+ *
+ * 5) ppkHook->right = ppkRight
+ *
+ * 6) parent->side = ppkLeft...
+ */
 
-                                    if (!side)  //RDB_TREE_LEFT
-                                        ppkParent->left = ppk->left;
-                                    else
-                                        ppkParent->right = ppk->left;
-                                }
-                                else
-                                    pool->root[index] = ppk->left;  //ppkRotate;
+//TODO inline this
+int _rdb_delete_by_pointer (
+        rdb_pool_t  *pool, 
+        void        *parent, 
+        int         index, 
+        PP_T        *ppkDead, 
+        int side) {
 
-                                ppk->left = ppkRotate->right;
-                                ppkRotate->right = dataHead;    //ppk;
-                                ppk->balance = -1 * (ppkRotate->balance + 1);
-                                ppkRotate->balance = (ppkRotate->balance + 1);
-                                ppk = ppkRotate;
-                            }
-                            else {
-                                // left right case
-                                debug ("Left Right Rotate\n");
-                                ppkBottom = (void *) ppkRotate->right + 
-                                                (sizeof (PP_T) * index);
+    PP_T   *ppkParent = NULL;           // NULL is here to make compiler happy
 
-                                if (ppkBottom->balance > 0) {
-                                    ppk->balance = 0;
-                                    ppkRotate->balance = -1;
-                                }
-                                else if (ppkBottom->balance == 0) {
-                                    ppk->balance = 0;
-                                    ppkRotate->balance = 0;
-                                }
-                                else {
-                                    ppk->balance = 1;
-                                    ppkRotate->balance = 0;
-                                }
+    if (parent)
+        ppkParent = (void *) parent + (sizeof (PP_T) * index);
 
-                                ppkBottom->balance = 0;
+    debug("deleteByPtr:  pool=%s, parent %p\n", pool->name, parent);
 
-                                ppkRotate->right = ppkBottom->left;
-                                ppkBottom->left = ppkRotate - index;
-                                ppk->left = ppkBottom->right;
-                                ppkBottom->right = dataHead;    //ppk;
-                                ppk = ppkBottom;
+    if (ppkDead->right == NULL && ppkDead->left == NULL) {
+        // No children, only need to fix parent if exist
+        debug("rdb_delete_by_ptr: no Children : inside:  parent %p\n", parent);
 
-                                if (parent) {
-                                    ppkParent = (void *) parent + 
-                                            (sizeof (PP_T) * index);
+        if (parent) {
+            if (side)                           // We hung of the parents right
+                ppkParent->right = NULL;
+            else                                // Left
+                ppkParent->left = NULL;
+        }
+        else pool->root[index] = NULL ;
 
-                                    if (!side)  //RDB_TREE_LEFT
-                                        ppkParent->left = ppkBottom - index;
-                                    else
-                                        ppkParent->right = ppkBottom - index;
-                                }
-                                else pool->root[index] = ppkBottom - index;
-                            }
-                        }
+        // We just deleted a leaf, parent need to update balance.
+        return PARENT_BAL_CNG; 
+    } else if (ppkDead->right && (ppkDead->left == NULL)) {
+        // One child on the right
+        if (parent) {
+            if (side)
+                // we hook up parent to his new child
+                ppkParent->right = ppkDead->right;     
+            else
+                ppkParent->left = ppkDead->right;
+        } else
+            // ppkDead child now become root node
+            pool->root[index] = ppkDead->right; 
 
-                        if (ppk->balance >= 0)
-                            return 0;   // no further balanceing action needed
+        // parent need to update balance.
+        return PARENT_BAL_CNG;                  
+    }
+    else if ((ppkDead->right == NULL) && ppkDead->left) {
+        // One chile on left
+        if (parent) {
+            if (side)
+                // we hooked up parent to his new child
+                ppkParent->right = ppkDead->left; 
+            else
+                ppkParent->left = ppkDead->left;
+        } else
+            //ppkDead child now become root node
+            pool->root[index] = ppkDead->left; 
 
-                        if (ppk->balance == -1)
-                            return 1;   // need to continue balancing up
-                    }
-                    else if (rc2 == -1) return -1;
-                }
-            }
-            else if (rc > 0) {                  // addin on Right side
-                //right side
-                if (ppk->right == NULL) {
-                    debug ("Right Insert\n");
-                    ppk->right = data;          //ppkNew;
-                    ppk->balance += 1;
-                    ppkNew->left = ppkNew->right = NULL;
-                    ppkNew->balance = 0;
+        // parent need to update balance.
+        return PARENT_BAL_CNG;
+    } else {
+        // Two children
 
-                    if (ppk->balance != 0)
-                        return 1;       // added a level
-                    else
-                        return 0;       // added a leaf... in an existing level
-                }
-                else {
-                    debug ("Diving Right, start = %p, balance=%d\n", 
-                                                        start, ppk->balance);
+        debug("rdbDeleteByPointer: a: I should never get here! index = %d, %p %p\n",
+                                        index, ppkDead->left, ppkDead->right);
+#ifdef KM
+        return 0;
+#else
+        exit(1);
+#endif
+    }
+}
 
-                    if (( rc2 = _rdb_insert (pool, data, ppk->right, index, 
-                                            start, RDB_TREE_RIGHT)) == 1) {
-                        // level added on right side
-                        ppk->balance++;
+int _rdb_delete (
+        rdb_pool_t  *pool, 
+        int         lookupIndex, 
+        void        *data, 
+        void        *start, 
+        PP_T        *parent, 
+        int side) {
 
-                        if (ppk->balance == 2) {
-                            // we need to rotate
-                            ppkRotate = (void *) ppk->right + 
-                                    (sizeof (PP_T) * index);
+    PP_T   *ppkDead;
+    PP_T   *ppkParent;
+    PP_T   *ppkRotate;
+    PP_T   *ppkBottom;
+    int     rc,
+            rc2;
+    void   *dataHead;
 
-                            if (ppkRotate->balance > 0) {
-                                //right right case ( left rotation )
-                                debug ("Right Right Rotate, parent = %x, "
-                                        "index=%d\n", (unsigned) parent, index);
+    if (pool->FLAGS[lookupIndex] & (RDB_NOKEYS)) {
+        void   *ptr = NULL;         // NULL to sashhh the compiler
+        int         indexCount;
+        PP_T   *ppk,
+               *ppkRight,
+               *ppkLeft;
+        ptr = data; 
+        indexCount = lookupIndex;
+        if (pool->FLAGS[indexCount] & (RDB_NOKEYS)) {
+            ppk = ptr + (sizeof (PP_T) * indexCount);
 
-                                if (parent != NULL) {
-                                    debug ("parent exist\n");
-                                    ppkParent = (void *) parent + 
-                                            (sizeof (PP_T) * index);
+            if (ppk->left) ppkLeft = ppk->left ;
+            else ppkLeft = NULL;
 
-                                    if (!side)  //RDB_TREE_LEFT
-                                        ppkParent->left = ppk->right;
-                                    else
-                                        ppkParent->right = ppk->right;
-                                }
-                                else
-                                    pool->root[index] = ppk->right; //ppkRotate;
+            if (ppk->right) ppkRight = ppk->right ;
+            else ppkRight = NULL;
 
-                                ppk->right = ppkRotate->left;
-                                ppkRotate->left = dataHead;     //ppk;
-                                ppk->balance = -1 * (ppkRotate->balance - 1);
-                                ppkRotate->balance = (ppkRotate->balance - 1);
-                                ppk = ppkRotate;
-                                debug ("pool->root[%d] = %x\n", index, 
-                                        pool->root[index]);
-                            }
-                            else {
-                                // right left case 
-                                // (right rotation followed by left rotation )
-                                debug ("Right Left Rotate\n");
-                                ppkBottom = (void *) ppkRotate->left + 
-                                        (sizeof (PP_T) * index);
+            if (pool->root[indexCount] == pool->tail[indexCount]) 
+                //we were the last item
+                pool->root[indexCount] = pool->tail[indexCount] = NULL; 
+            else { 
+                if (ppkLeft) ppkLeft->right = ppk->right;
 
-                                if (ppkBottom->balance < 0) {
-                                    ppk->balance = 0;
-                                    ppkRotate->balance = 1;
-                                }
-                                else if (ppkBottom->balance == 0) {
-                                    ppk->balance = 0;
-                                    ppkRotate->balance = 0;
-                                }
-                                else {
-                                    ppk->balance = -1;
-                                    ppkRotate->balance = 0;
-                                }
+                if (ppkRight) ppkRight->left = ppk->left;
 
-                                ppkBottom->balance = 0;
+                if (pool->root[indexCount] == ptr) 
+                    pool->root[indexCount] = ppkRight - indexCount;
 
-                                ppkRotate->left = ppkBottom->right;
-                                ppkBottom->right = ppkRotate - index;
-                                ppk->right = ppkBottom->left;
-                                ppkBottom->left = dataHead;     //ppk;
-                                ppk = ppkBottom;
+                if (pool->tail[indexCount] == ptr) 
+                    pool->tail[indexCount] = ppkLeft - indexCount;
+            }
+        }
+    } else if ((pool->FLAGS[lookupIndex] & RDB_BTREE) == RDB_BTREE) {
+        debug("Delete:start: \n");
 
-                                if (parent) {
-                                    ppkParent = (void *) parent + 
-                                            (sizeof (PP_T) * index);
+        if (pool->root[lookupIndex] == NULL) {
+            return (0);
+        } else {
+            set_pointers (pool, lookupIndex, start, &ppkDead, &dataHead);
+            debug("Delete:before compare: \n");
 
-                                    if (!side)  //RDB_TREE_LEFT
-                                        ppkParent->left = ppkBottom - index;
-                                    else
-                                        ppkParent->right = ppkBottom - index;
-                                }
-                                else pool->root[index] = ppkBottom - index;
-                            }
-                        }
+            //TODO should be pool->get_fn? make a test with p_str
+            RDB_STAT_CMP ();
+            if ((rc = pool->fn[lookupIndex] (dataHead + 
+                    pool->key_offset[lookupIndex], (void *) data + 
+                            (pool->key_offset[lookupIndex]))) != 0) {
+retest_delete_cond:
+                debug("Delete:compare: (%d) idx (%d)\n", rc, lookupIndex);
+                rc2 = 0;
 
-                        if (ppk->balance <= 0)
-                            return 0;   // no further balanceing action needed
+                if (rc < 0) {
+                    // Left child
+                    debug("D:left Child!\n");
 
-                        if (ppk->balance == 1)
-                            return 1;   // need to continue balancing up
+                    if (ppkDead->left == NULL) {
+                        return 0;
                     }
-                    else if (rc2 == -1) return -1;
+
+                    rc2 = _rdb_delete (pool, lookupIndex, data, ppkDead->left,
+                                                    dataHead, RDB_TREE_LEFT);
+                    debug("(L)My Bal After  %d %d\n", ppkDead->balance, rc2);
                 }
-            }
-            else {
-                debug ("Skipped due to multiple key on pool %s index %d\n",
-                        pool->name, index);
-                //TODO: give actal data
-                return (rdb_error_value(-1, "Insert index failed due to "
-                        "duplicate key in pool")); 
-            }   // multiple keys not yet supported!
-        }
+                else if (rc > 0) {
+                    // Right child
+                    debug("D:right Child!\n");
 
-        return 0;
-    }
+                    if (ppkDead->right == NULL) {
+                        return 0;
+                    }
 
-    return -1;                          // we found no mechanizm to add node
-}
+                    rc2 = _rdb_delete (pool, lookupIndex, data, ppkDead->right,
+                                                    dataHead, RDB_TREE_RIGHT);
+                    debug("(R)My Bal After  %d %d\n", ppkDead->balance, rc2);
+                }
 
-inline int _rdb_delete_by_pointer (
-        rdb_pool_t  *pool, 
-        void        *parent, 
-        int         index,
-        PP_T        *ppkDead,
-        int         side);
+                if (PARENT_BAL_CNG == rc2) { // And I am the parent...
+                    ppkParent = (PP_T *) parent + lookupIndex;
+                    ppkParent = parent + lookupIndex;
+                    debug("- bal  to be changed = %d\n", ppkDead->balance);
+                    // If on right side then add -1 - subtract one form balance
+                    ppkDead->balance += (rc > 0) ? -1 : 1;
+                    debug("- bal changed = %d\n", ppkDead->balance);
 
-int _rdb_delete (
-        rdb_pool_t  *pool, 
-        int         lookupIndex, 
-        void        *data, 
-        void        *start, 
-        PP_T        *parent,
-        int         side);
+                    if (ppkDead->balance == -1 || ppkDead->balance == 1) {
+                        // We moved from balance to -1 or +1 after delete, 
+                        // nothing more we need to do
+                        return 0;
+                    } else if (ppkDead->balance == 0) {
+                        // We transitioned to zero by delete, need to keep 
+                        // balancing up
+                        return PARENT_BAL_CNG;  
+                    } else if (ppkDead->balance < -1) {
+                        // Left case rotare
+                        debug("Some left rotation ppkDead->left=%p\n", 
+                                                            ppkDead->left);
+                        RDB_STAT_ROT ();
+                        RDB_TRACEPOINT (rotate, RDB_TRACE_ROTATE, pool, 
+                                        lookupIndex, data);
+                        ppkRotate = (PP_T *) ppkDead->left + lookupIndex;
 
-// Return shoud be the # of updated indexes, which must match the number of 
-// defined indexes, anything less shows an error and should be treated as 
-// such by user.
-// TODO? Should we make this atomic - meaning if one index failes fo insert, 
-// delete the previously inserted ones?
+                        if (ppkRotate->balance < 1) {
+                            // Left left rotate
+                            debug ("Left Left Rotate\n");
 
-int rdb_insert (rdb_pool_t *pool, void *data)
-{
-    int     indexCount, ic2, last_success = -1;
-    int     rc = 0;
-  
-    if (data != NULL) {
-        for (indexCount = 0; indexCount < pool->indexCount; indexCount++) {
-            (_rdb_insert (pool, data, pool->root[indexCount], 
-                indexCount, NULL, 0) < 0) ? rc : rc++;
+                            if (parent) {
+                                ppkParent = (PP_T *) parent + lookupIndex;
 
-            if ( rc <= indexCount ) {
-                //TODO: NOW!: finish partial delete
-                if (last_success >= 0) { // we failed to insert, we have what to undo
-                    //printf("RECOVERY\n");
-                    rc = 0;
-                    for (ic2 = 0; ic2 <= last_success; ic2++ ) {
-                        //printf("RECOVERY %d\n", ic2);
-                        (_rdb_delete (pool, ic2, data, NULL, NULL, 0) < 0) ? rc : rc++;
-                    }
-                    if (rc != ic2 + 1) {
-                        //not able to delete what we just inserted? Lock missed?
-                        rdb_error_value(-1, "rdb_insert failed. Insert UNDO failed. LOCK ERROR?");
-                    } 
-                    rc = 0; // to ensure counter will not go up
-                }
-                break;
-            }
-            else {
-                last_success = indexCount;
-            }
-        }
-#ifdef RDB_POOL_COUNTERS
-        if (rc > 0) pool->record_count++;
-#endif
-    } else
-        rc = -1;
+                                if (!side)      //RDB_TREE_LEFT
+                                    ppkParent->left = ppkDead->left;
+                                else ppkParent->right = ppkDead->left;
+                            } else pool->root[lookupIndex] = ppkDead->left;
 
-    return rc;
-}
+                            ppkDead->left = ppkRotate->right;
+                            ppkRotate->right = dataHead;
+                            ppkDead->balance = -1 * (ppkRotate->balance + 1);
+                            ppkRotate->balance = (ppkRotate->balance + 1);
+                            ppkDead = ppkRotate;
 
-// Only insert one index (asuming this index was removed and updated prior).
-int rdb_insert_one (rdb_pool_t *pool, int index, void *data)
-{
-    return _rdb_insert (pool, data, pool->root[index], index, NULL, 0) ;
-}
+                            if (ppkRotate->balance == -1 || 
+                                    ppkRotate->balance == 1) return 0;
+                            else return PARENT_BAL_CNG;
+
+                        }
+                        else {
+                            // Left right
 
-void   *_rdb_get (
-        rdb_pool_t  *pool, 
-        int         index, 
-        const void  *data, 
-        void        *start, 
-        int         partial) {
+                            debug ("Left Right Rotate\n");
+                            ppkBottom = (void *) ppkRotate->right + 
+                                    (sizeof (PP_T) * lookupIndex);
 
-    PP_T   *ppk;
-    int     rc;
-    void   *dataHead;
+                            if (ppkBottom->balance > 0) {
+                                ppkDead->balance = 0;
+                                ppkRotate->balance = -1;
+                            }
+                            else if (ppkBottom->balance == 0) {
+                                ppkDead->balance = 0;
+                                ppkRotate->balance = 0;
+                            }
+                            else {
+                                ppkDead->balance = 1;
+                                ppkRotate->balance = 0;
+                            }
 
-    if ((pool->FLAGS[index] & RDB_BTREE) == RDB_BTREE) {
+                            ppkBottom->balance = 0;
 
-        if (pool->root[index] == NULL) {
-            debug("GetFail - pool=%s, Null rool node\n",pool->name);
-            return (NULL);
-        } else {
-            if (pool->FLAGS[index] & (RDB_NOKEYS)) {
-                return pool->root[index];
+                            ppkRotate->right = ppkBottom->left;
+                            ppkBottom->left = ppkRotate - lookupIndex;
+                            ppkDead->left = ppkBottom->right;
+                            ppkBottom->right = dataHead;
+                            ppkDead = ppkBottom;
 
-            }
-            set_pointers (pool, index, start, &ppk, &dataHead);
+                            if (parent) {
+                                ppkParent = (void *) parent + (sizeof (PP_T) *
+                                                                lookupIndex);
 
-            if (data == NULL ) {
-                debug("GetFail???\n");
-                return (dataHead);          // special case, return root node
-            }
+                                if (!side)      //RDB_TREE_LEFT
+                                    ppkParent->left = ppkBottom - lookupIndex;
+                                else
+                                    ppkParent->right = ppkBottom - lookupIndex;
+                            }
+                            else {
+                                pool->root[lookupIndex] =  ppkBottom - 
+                                                                lookupIndex;
+                            }
 
-            if ((rc = pool->get_fn[index] (dataHead + pool->key_offset[index],
-                    (void *) data)) < 0) {
-                // left side
+                            return PARENT_BAL_CNG;
+                        }
+                    }
+                    else if (ppkDead->balance > 1) {
+                        // Rotate
+                        RDB_STAT_ROT ();
+                        RDB_TRACEPOINT (rotate, RDB_TRACE_ROTATE, pool, 
+                                        lookupIndex, data);
+                        ppkRotate = (PP_T *) ppkDead->right + lookupIndex;
 
-                debug("Left Get\n");
+                        if (ppkRotate->balance > -1) {
+                            // Right right rotate
+                            debug ("Right Right Rotate, parent = %p,index=%d\n",
+                                                (unsigned) parent, lookupIndex);
 
-                if (ppk->left == NULL) {
-                    return (NULL);
-                }
-                else
-                    return (_rdb_get (pool, index, data, ppk->left, partial));
-            } else if (rc > 0) {
-                //i right side
+                            if (parent != NULL) {
+                                debug ("parent exist\n");
+                                ppkParent = (void *) parent + (sizeof (PP_T) * 
+                                                                lookupIndex);
 
-                debug("Right Get\n");
+                                if (!side)      //RDB_TREE_LEFT
+                                    ppkParent->left = ppkDead->right;
+                                else
+                                    ppkParent->right = ppkDead->right;
+                            }
+                            else
+                                pool->root[lookupIndex] = ppkDead->right;
 
-                if (ppk->right == NULL) {
-                    return (NULL);
-                }
-                else
-                    return (_rdb_get (pool, index, data, ppk->right, partial));
-            }
-            else {
-                debug("Get:Done\n");
-                return (dataHead);              
-            }
-        }
-    }
-    return NULL;                                //should never get here
-}
+                            ppkDead->right = ppkRotate->left;
+                            ppkRotate->left = dataHead; 
+                            ppkDead->balance = -1 * (ppkRotate->balance - 1);
+                            ppkRotate->balance = (ppkRotate->balance - 1);
+                            ppkDead = ppkRotate;
 
-/*
-void   *_rdb_get_const (
-        rdb_pool_t  *pool, 
-        int         index, 
-        __int128_t  value, 
-        void        *start, 
-        int         partial) {
+                            if (ppkRotate->balance == -1 || 
+                                            ppkRotate->balance == 1) return 0;
+                            else return PARENT_BAL_CNG;
 
-    PP_T   *ppk;
-    int     rc;
-    void   *dataHead;
+                        }
+                        else {
+                            // Right left case
+                            debug ("Right Left Rotate\n");
+                            ppkBottom = (void *) ppkRotate->left + 
+                                                (sizeof (PP_T) * lookupIndex);
 
-    if ((pool->FLAGS[index] & RDB_BTREE) == RDB_BTREE) {
+                            if (ppkBottom->balance < 0) {
+                                ppkDead->balance = 0;
+                                ppkRotate->balance = 1;
+                            }
+                            else if (ppkBottom->balance == 0) {
+                                ppkDead->balance = 0;
+                                ppkRotate->balance = 0;
+                            }
+                            else {
+                                ppkDead->balance = -1;
+                                ppkRotate->balance = 0;
+                            }
 
-        if (pool->root[index] == NULL) {
-            debug("GetFail - pool=%s, Null rool node\n",pool->name);
-            return (NULL);
-        }
-        else {
-            set_pointers (pool, index, start, &ppk, &dataHead);
+                            ppkBottom->balance = 0;
 
-            if ((rc = pool->get_const_fn[index] (dataHead + 
-                    pool->key_offset[index], value)) < 0) {
-                // left side
+                            ppkRotate->left = ppkBottom->right;
+                            ppkBottom->right = ppkRotate - lookupIndex;
+                            ppkDead->right = ppkBottom->left;
+                            ppkBottom->left = dataHead; //ppk;
+                            ppkDead = ppkBottom;
 
-                debug("Left Get\n");
+                            if (parent) {
+                                ppkParent = (void *) parent + (sizeof (PP_T) * 
+                                                                lookupIndex);
 
-                if (ppk->left == NULL) {
-                    return (NULL);
-                }
-                else
-                    return (_rdb_get_const (pool, index, value, ppk->left, partial));
-            } else if (rc > 0) {
-                //i right side
+                                if (!side)      //RDB_TREE_LEFT
+                                    ppkParent->left = ppkBottom - lookupIndex;
+                                else
+                                    ppkParent->right = ppkBottom - lookupIndex;
+                            }
+                            else {
+                                pool->root[lookupIndex] = ppkBottom - 
+                                                                lookupIndex;
+                            }
 
-                debug("Right Get\n");
+                            return PARENT_BAL_CNG;
+                        }
+                    }
 
-                if (ppk->right == NULL) {
-                    return (NULL);
                 }
-                else
-                    return (_rdb_get_const (pool, index, value, ppk->right, partial));
             }
             else {
-                debug("Get:Done\n");
-                return (dataHead); 
-            }
-        }
-    }
-    return NULL;                                //should never eet here
-}*/
-
-// Find requested data set and return a pointer to it
-// As a special case, if data = null, root node will be returned.
-void   *rdb_get (rdb_pool_t *pool, int idx, const void *data)
-{
-    debug("Get:pool=%s,idx=%d", pool->name, idx);
-    return _rdb_get (pool, idx, data, NULL, 0);
-}
+                debug("Delete:compare:- _%d_ idx _%d_ ppkDead = %x\n", rc, 
+                                    lookupIndex, (unsigned) ppkDead);
 
-void   *rdb_get_const (rdb_pool_t *pool, int idx, __intmax_t value)
-{
-    debug("Get:pool=%s,idx=%d", pool->name, idx);
-    return _rdb_get/*_const*/ (pool, idx, &value, NULL, 0);
-}
+                if (ppkDead->right != NULL && ppkDead->left != NULL) { 
+                    // we need to perform a pre-delete swap!
+                    PP_T *ppkTemp;
 
-void   *_rdb_get_neigh (
-        rdb_pool_t  *pool, 
-        int         index, 
-        void        *data, 
-        void        *start, 
-        int         partial,
-        void        **before, 
-        void        **after) {
+                    debug("Rotate 1 ppkDead %x\n", (unsigned) ppkDead);
+                    ppkRotate = (PP_T *) ppkDead->right + lookupIndex;
+                    ppkTemp = NULL;
 
-    PP_T   *ppk;
-    int     rc;
-    void   *dataHead;
+                    if (ppkRotate->left) {
+                        while (ppkRotate->left) {
+                            ppkTemp   = ppkRotate;
+                            ppkRotate = (PP_T *) ppkRotate->left + lookupIndex;
+                        }
 
-    if ((pool->FLAGS[index] & RDB_BTREE) == RDB_BTREE) {
+                        // Here we have the smallest element of the right tree, 
+                        // now we need to perform the swap
+                        if (parent) {
+                            ppkParent = (PP_T *) parent + lookupIndex;
+                            debug("D:We have a parent\n");
 
-        if (pool->root[index] == NULL) {
-            debug("GetFail\n");
-            before = NULL;
-            after = NULL;
-            return (NULL);
-        }
-        else {
-            set_pointers (pool, index, start, &ppk, &dataHead);
+                            if (side) ppkParent->right = (PP_T *) ppkRotate - 
+                                                                    lookupIndex;
+                            else ppkParent->left = (PP_T *) ppkRotate - 
+                                                                    lookupIndex;
+                        }
+                        else pool->root[lookupIndex] = ppkRotate - lookupIndex;
 
-            if (data == NULL ) {
-                debug("GetFail???\n");
-                before = NULL;
-                after = NULL;
-                return (dataHead);              // special case, return root node
-            }
+                        ppkBottom = ppkDead->right;
+                        ppkDead->right = ppkRotate->right;
+                        ppkRotate->right = ppkBottom;
 
-            if ((rc = pool->fn[index] (dataHead + pool->key_offset[index],
-                                  (void *) data)) < 0) {
-                // left side
-                debug("Left Get\n");
+                        ppkBottom = ppkDead->left;
+                        ppkDead->left = ppkRotate->left;
+                        ppkRotate->left = ppkBottom;
 
-                *after = (NULL == start) ? (void *) pool->root[index] : start ;
+                        rc = ppkRotate->balance;
+                        ppkRotate->balance = ppkDead->balance;
+                        ppkDead->balance = rc;
 
-                //*after=start;
-                if (ppk->left == NULL) {
-                    return (NULL);
-                }
-                else
-                    return (_rdb_get_neigh (pool, index, data, ppk->left, 
-                                                    partial, before, after));
-            }
-            else if (rc > 0) {
-                //right side
-                debug("Right Get\n");
-                *before = (NULL == start) ? (void *) pool->root[index] : start ;
+                        if (ppkTemp) ppkTemp->left = ppkDead - lookupIndex ; 
+                        // if ppkRotate is now root, it has no father
+                    }
+                    else {   
+                        // Special case for root deletion with no left node on 
+                        // right side, we'll just swap ppkDead with ppkRotate
+                        debug("DS: Parent = %x\n", (unsigned) parent);
 
-                //*before=start;
-                if (ppk->right == NULL) {
-                    return (NULL);
-                }
-                else
-                    return (_rdb_get_neigh (pool, index, data, ppk->right, 
-                                                    partial, before, after));
-            }
-            else {
-                debug("Get:Done\n");
-                *after = *before = NULL;
-                return (dataHead);
-            }
-        }
+                        if (parent) {
+                            ppkParent = (PP_T *) parent + lookupIndex;
+                            debug("DS: We have a parent\n");
 
-    }
+                            if (side) ppkParent->right = (PP_T *) ppkRotate - 
+                                                                    lookupIndex;
+                            else ppkParent->left = (PP_T *) ppkRotate - 
+                                                                    lookupIndex;
+                        }
+                        else pool->root[lookupIndex] = ppkRotate - lookupIndex;
 
-    return NULL;                                //should never eet here
-}
+                        ppkDead->right = ppkRotate->right;
+                        ppkRotate->right = ppkDead - lookupIndex;
+                        ppkRotate->left = ppkDead->left;
+                        ppkDead->left = NULL;
 
-// Same as pair above, plus, if key not found, set up pointers to
-// records before and after the lookup record.
-void   *rdb_get_neigh (rdb_pool_t *pool, int idx, void *data, void **before, void **after)
-{
-    return _rdb_get_neigh (pool, idx, data, NULL, 0, before, after);
-}
+                        rc = ppkDead->balance;
+                        ppkDead->balance = ppkRotate->balance;
+                        ppkRotate->balance = rc;
 
 
-// Internal usage
-#define RDBFE_NODE_DELETED 1
-#define RDBFE_NODE_RESUME_ON 2
-#define RDBFE_NODE_DONE 4
-#define RDBFE_NODE_FIND_NEXT 8
-#define RDBFE_ABORT 32
+                    }
 
-int _rdb_iterate (
-        rdb_pool_t  *pool, 
-        int         index, 
-        int         fn (void *, void *), 
-        void        *data,
-        void        del_fn(void *, void*),
-        void        *delfn_data, 
-        void        *start, 
-        void        *parent, 
-        int         side, 
-        void        **resumePtr) {
+                    start = ppkRotate - lookupIndex;
+                    set_pointers(pool, lookupIndex, start, &ppkDead, &dataHead);
 
-    void   *dataHead;
-    char   **dataField;
-    PP_T   *pp, *pr;
-    int     rc, rc2 = 0;
-    int     rc3 = 0;
-    int     indexCount;
+                    rc = 1;
 
-    if (pool->FLAGS[index] & RDB_BTREE) {
-        set_pointers (pool, index, start, &pp, &dataHead);
+                    goto retest_delete_cond;
 
-        if (*resumePtr != NULL) {
-            debug ("0->Resumeing\n");
-            if ((rc3 = pool->fn[index] (dataHead + pool->key_offset[index],
-                            (void *) *resumePtr /*+ (sizeof (PP_T) * pool->indexCount)*/ + pool->key_offset[index])) < 0) {
-                debug("1->left(i=%d)\n",index);
-                if ( 1 == ( 1 & (rc =  _rdb_iterate (pool, index, fn, data,
-                                    del_fn, delfn_data, pp->left, start, RDB_TREE_LEFT,
-                                    resumePtr)))) { 
-                    // tree may have been modified
-                    // moving bit left - getting RDBFE_NODE_RESUME_ON and
-                    // not changing abort status;
-                    return (rc + 1 ); 
-                }
-                else if ( rc & RDBFE_NODE_FIND_NEXT ) {
-                    *resumePtr = dataHead;
-                    return rc - 8 ; //(leave abort status in if exist)
-                }
-                else if (rc > 1) return rc;
-            }
-        }
-        else {
-            if (pp->left != NULL) {
-                debug("2->left\n");
-                if ( 1 == ( 1 & (rc =  _rdb_iterate (pool, index, fn, data,
-                                    del_fn, delfn_data, pp->left, start, RDB_TREE_LEFT,
-                                    resumePtr)))) { 
-                    // tree may have been modified
-                    return (rc + 1 ) ; //RDBFE_NODE_RESUME_ON);
-                }
-                else if ( rc & RDBFE_NODE_FIND_NEXT ) {
-                    *resumePtr = dataHead;
-                    return rc - 8 ; //
                 }
-                else if (rc > 1) return rc;
+
+                debug("My Bal Before ... and now I'm dead %d\n", 
+                                                        ppkDead->balance);
+                rc = _rdb_delete_by_pointer (pool, (void *) parent, lookupIndex,
+                                                                 ppkDead, side);
+                debug("Delete by Ptr returned %d\n", rc);
+                return (rc);
             }
         }
+    }
 
-        if (*resumePtr != NULL &&  (dataHead == *resumePtr)) {
-            *resumePtr = NULL; 
-            debug ("redume work\n");
-        }
-                       // time to start working again
+    return 0;                                // Should never get here
+}   
 
-        if (*resumePtr == NULL) {
-            rc = 0;
+void   *rdb_delete_const (rdb_pool_t *pool, int idx, __intmax_t value)
+{
+    debug("Get:pool=%s,idx=%d", pool->name, idx);
+    return rdb_delete (pool, idx, &value); //, NULL, 0);
+}
 
-            if (fn == NULL || RDB_CB_DELETE_NODE == (rc2 = fn (dataHead, data))
-                    || RDB_CB_DELETE_NODE_AND_ABORT == rc2 || 
-                                                        RDB_CB_ABORT == rc2 ) {
+// TODO, make sure rdb_delete works well on trees with both indexed and non-indexed 
+// indexes. ( is that a valid configuration? )
+//
+// rDB internal: unlink a record from all indexes. writers must be serialized
+// by the caller, index locks are taken here.
+static void *
+_rdb_delete_record (rdb_pool_t *pool, int lookupIndex, void *data)
+{
 
-                if (rc2 == RDB_CB_DELETE_NODE_AND_ABORT) 
-                    rc =  RDBFE_NODE_DELETED | RDBFE_ABORT ;
-                else if (rc2 == RDB_CB_ABORT) 
-                    return RDBFE_ABORT;
-                else rc = RDBFE_NODE_DELETED;
+    int     indexCount;
+    void   *ptr = NULL;                     // NULL to hash the compiler
 
-                // Setting resume pointer to next record
-                if (pp->right) {
-                    pr = (void *) pp->right + (sizeof (PP_T) * index);
+    if (pool->FLAGS[lookupIndex] & (RDB_NOKEYS)) {
+        PP_T   *ppk = NULL,
+               *ppkRight = NULL,
+               *ppkLeft = NULL;
+        ptr = pool->root[lookupIndex]; 
+        if (ptr == NULL)
+            return NULL;
 
-                    while(pr->left != NULL) {
-                        pr = pr->left + (sizeof (PP_T) * index);
-                    }
-                    *resumePtr = (void *) pr - (sizeof (PP_T) * index);
-                }
-                else if (parent == NULL) {
-                    pr = (void *) pool->root[index] + (sizeof (PP_T) * index);
+        for (indexCount = 0; indexCount < pool->indexCount; 
+                                                        indexCount++) {
+            _rdb_ts_idx_lock (pool, indexCount);
+            if (pool->FLAGS[indexCount] & (RDB_NOKEYS)) {
+                ppk = ptr + (sizeof (PP_T) * indexCount);
 
-                    if (pr->right) {
-                        pr = pr->right + (sizeof (PP_T) * index);
+                if (ppk->left) 
+                    ppkLeft = ppk->left ;//+ indexCount;
+                else ppkLeft = NULL;
 
-                        while(pr->left != NULL) {
-                            pr = pr->left + (sizeof (PP_T) * index);
-                        }
-                        *resumePtr = (void *) pr - (sizeof (PP_T) * index);
-                    }
-                    else {
-                        *resumePtr = NULL; 
-                        // we are removing root and there is nothing to it's
-                        // right, we are done
-                        // Signal we are done
-                        rc = RDBFE_NODE_DONE | (rc & RDBFE_ABORT);  
-                    }
+                if (ppk->right) 
+                    ppkRight = ppk->right ;//+ indexCount;
+                else ppkRight = NULL;
 
-                }
-                else {   // Parent is not null
-                    if (side == 0) {
-                        *resumePtr = parent;
-                        //*resumePtr = (void *) parent - (sizeof (PP_T) * index);
-                    }
-                    else {
-                        *resumePtr = NULL;
-                        // Signal we still need to find next pointer
-                        rc = RDBFE_NODE_FIND_NEXT | (rc & RDBFE_ABORT);
-                    }
-                }
+                if (pool->root[indexCount] == pool->tail[indexCount]) 
+                        pool->root[indexCount] = pool->tail[indexCount] = NULL;
+                        // We were the last item
+                else { 
+                    if (ppkLeft) ppkLeft->right = ppk->right;
 
-                for (indexCount = 0; indexCount < pool->indexCount; 
-                                                            indexCount++) {
-                    debug ("rdb_iterate: Delete # %d\n", indexCount);
-                    _rdb_delete (pool, indexCount, dataHead, NULL, NULL, 0);
-                }
-#ifdef RDB_POOL_COUNTERS
-                pool->record_count--;
-#endif
+                    if (ppkRight) ppkRight->left = ppk->left;
 
-                if (del_fn) del_fn(dataHead, delfn_data);
-                else { 
-                    // Courtesy delete of data block and dynamic indexes
-                    // We have an index which is a pointer, need to free it too.
-                    for (indexCount = 0; indexCount < pool->indexCount;
-                            indexCount++) if (pool->FLAGS[indexCount] &
-                                                            RDB_KPSTR) { 
-                        dataField = dataHead + pool->key_offset[indexCount];
-                        //debug("off = %d add %x, str %s\n",
-                        // pool->key_offset[indexCount],
-                        // (unsigned) *dataField, *dataField);
-                            if (*dataField) rdb_free(*dataField);
-                    }
-                    if (dataHead) rdb_free (dataHead);
-                }
+                    if (pool->root[indexCount] == ptr) pool->root[indexCount] =
+                                                        ppkRight - indexCount;
 
-                debug ("after delete rc=%d\n", rc);
-                return rc;
+                    if (pool->tail[indexCount] == ptr) pool->tail[indexCount] =
+                                                        ppkLeft - indexCount;
+                }
             }
-        }
-
-        if (pp->right != NULL) {
-            debug("(3)->right start %p resumePtr %p\n",start, *resumePtr);
-            if (1 == (1 & (rc = _rdb_iterate(pool, index, fn, data, del_fn, 
-                    delfn_data, pp->right, start, RDB_TREE_RIGHT, 
-                                                            resumePtr)))) {
-                // Moving bit left- getting RDBFE_NODE_RESUME_ON and not 
-                // changing abort status;
-                return ( rc + 1 ); 
+            else {
+                _rdb_delete (pool, indexCount, ptr, NULL, NULL, 0);
             }
-            else if ( rc > 1 ) return rc;
+            _rdb_ts_idx_unlock (pool, indexCount);
+            RDB_STAT_FLUSH (pool, indexCount);
+            RDB_STAT (pool, indexCount, deletes);
         }
-
     }
+    else if (data) {
+        // no read lock for the lookup, we are the only writer
+        ptr = _rdb_get (pool, lookupIndex, data, NULL, 0);
+        RDB_STAT_FLUSH (pool, lookupIndex);
+        if (ptr == NULL)
+            RDB_STAT (pool, lookupIndex, misses);
+        if (ptr != NULL)
+            for (indexCount = 0; indexCount < pool->indexCount; indexCount++) {
+                _rdb_ts_idx_lock (pool, indexCount);
+                _rdb_delete (pool, indexCount, ptr, NULL, NULL, 0);
+                _rdb_ts_idx_unlock (pool, indexCount);
+                RDB_STAT_FLUSH (pool, indexCount);
+                RDB_STAT (pool, indexCount, deletes);
+            }
 
-    return 0;
-}
+        else
+            debug ("Can't locate delete item\n");
 
-int _rdb_iterate_list (
-        rdb_pool_t  *pool, 
-        int         index, 
-        int         fn (void *, void *), 
-        void        *data,
-        void        del_fn(void *, void*),
-        void        *delfn_data, 
-        void        *start, 
-        void        *parent, 
-        int         side, 
-        void        **resumePtr) {
+    }
 
-    void   *dataHead;
-    char   **dataField;
-    PP_T   *pp;
-    int     rc, rc2 = 0;
-    int     indexCount;
+#ifdef RDB_POOL_COUNTERS
+    if (ptr != NULL) {
+        RDB_COUNT_SET (pool, pool->record_count - 1);
+        _rdb_mem_strings (pool, ptr, -1);
+    }
+#endif
+    if (ptr != NULL)
+        RDB_TRACEPOINT (delete, RDB_TRACE_DELETE, pool, -1, ptr);
 
-rfeStart:
+    return ptr;
+}
 
-    if (*resumePtr) {
-        set_pointers (pool, index, *resumePtr, &pp, &dataHead); 
-        *resumePtr = NULL;
-    } else
-        set_pointers (pool, index, start, &pp, &dataHead); 
-			
+void   *
+rdb_delete (rdb_pool_t *pool, int lookupIndex, void *data)
+{
+    void   *ptr;
 
-    if (*resumePtr != NULL &&  (dataHead == *resumePtr)) *resumePtr = NULL; 
-                       // time to start working again
+#ifndef KM
+    if (pool->FLAGS[lookupIndex] & RDB_LOCKFREE)
+        return rdb_lifo_pop (pool);
+#endif
 
-    if (*resumePtr == NULL) {
-        rc = 0;
+    RDB_LAT_START (pool);
 
-        if (fn == NULL || RDB_CB_DELETE_NODE == (rc2 = fn (dataHead, data))
-                || RDB_CB_DELETE_NODE_AND_ABORT == rc2 || 
-                RDB_CB_ABORT == rc2 ) {
+    _rdb_ts_update_lock (pool);
+    ptr = _rdb_delete_record (pool, lookupIndex, data);
+    if (ptr)
+        RDB_WAL (pool, RDB_WAL_DELETE, ptr);
+    RDB_CAPTURE (pool, RDB_TRACE_DELETE, lookupIndex, data, ptr != NULL);
+    _rdb_ts_update_unlock (pool);
+    if (ptr)
+        RDB_WAL_WAIT (pool);
+    RDB_LAT_END (pool, RDB_LAT_DELETE);
 
-            if (rc2 == RDB_CB_DELETE_NODE_AND_ABORT) 
-                rc =  RDBFE_NODE_DELETED | RDBFE_ABORT ;
-            else if (rc2 == RDB_CB_ABORT) 
-                return RDBFE_ABORT;
-            else rc = RDBFE_NODE_DELETED;
+    return ptr;
+}
 
-            // Setting resume pointer to next record
-            if (pool->FLAGS[index] & (RDB_NOKEYS)) { 
-                // FIFO/LIFO, no need to recurse -
-                if (pp->right) {
-                    *resumePtr = (void *) pp->right - (sizeof (PP_T) * index);
-                }
-                else *resumePtr = NULL ;   // we are the last one;
-            }
+int rdb_delete_one (rdb_pool_t *pool, int index, void *data)
+{
+    int rc;
 
-            for (indexCount = 0; indexCount < pool->indexCount; 
-                    indexCount++) {
-                debug ("rdb_iterate: Delete # %d\n", indexCount);
-                _rdb_delete (pool, indexCount, dataHead, NULL, NULL, 0);
-            }
+    _rdb_ts_update_lock (pool);
+#ifndef KM
+    // a re-key would reorder records under a live snapshot
+    if (__atomic_load_n (&pool->snap_refs, __ATOMIC_ACQUIRE)) {
+        _rdb_ts_update_unlock (pool);
+        return rdb_error_value (-1, "rdb_delete_one: pool has a live "
+                "snapshot");
+    }
+#endif
+    _rdb_ts_idx_lock (pool, index);
+    rc = _rdb_delete (pool, index, data, NULL, NULL, 0);
+    _rdb_ts_idx_unlock (pool, index);
+    if (rc >= 0) {
 #ifdef RDB_POOL_COUNTERS
-            pool->record_count--;
+        _rdb_mem_strings_idx (pool, data, index, -1);
 #endif
+        RDB_WAL (pool, RDB_WAL_DELETE_ONE | index << 8, data);
+    }
+    _rdb_ts_update_unlock (pool);
+    if (rc >= 0)
+        RDB_WAL_WAIT (pool);
+    RDB_STAT_FLUSH (pool, index);
+    if (rc >= 0) {
+        RDB_STAT (pool, index, deletes);
+        RDB_TRACEPOINT (delete, RDB_TRACE_DELETE, pool, index, data);
+    }
+    return rc;
+}
 
-            if (del_fn) del_fn(dataHead, delfn_data);
-            else { 
-                // Courtesy delete of data block and dynamic indexes
-                // We have an index which is a pointer, need to free it too.
-                for (indexCount = 0; indexCount < pool->indexCount;
-                        indexCount++) if (pool->FLAGS[indexCount] &
-                            RDB_KPSTR) { 
-                            dataField = dataHead + pool->key_offset[indexCount];
-                            //debug("off = %d add %x, str %s\n",
-                            // pool->key_offset[indexCount],
-                            // (unsigned) *dataField, *dataField);
-                            if (*dataField) rdb_free(*dataField);
-                        }
-                        if (dataHead) rdb_free (dataHead);
-            }
+// move data (identified by value const, from source tree to destination tree.
+// data is not copied or reallocated, only trees pointers are updated.
+//
+void *rdb_move_const (rdb_pool_t *dst_pool, rdb_pool_t *src_pool, int idx, __intmax_t value) {
+    void *ptr;
+    ptr = rdb_delete (src_pool, idx, &value);
+    if (ptr && rdb_insert (dst_pool, ptr)) return ptr;
+    return NULL;
+}
 
-            return rc;
-        }
-    }
+void *rdb_move (rdb_pool_t *dst_pool, rdb_pool_t *src_pool, int idx, void *data) {
+    void *ptr;
+    ptr = rdb_delete (src_pool, idx, data);
+    if (ptr && rdb_insert (dst_pool, ptr)) return ptr;
+    return 0;
+}
 
-    if (pp->right) {
-        start = (void *) pp->right - (sizeof (*pp) * index);
-        goto rfeStart;
+// same but slower, with mode debug (not returning a pointer to data)
+int rdb_move2 (rdb_pool_t *dst_pool, rdb_pool_t *src_pool, int idx, void *data) {
+    void *ptr;
+    if ((ptr = rdb_delete (src_pool, idx, data))) {
+        if ( dst_pool->indexCount == rdb_insert (dst_pool, ptr)) return 0;
+        return -2;
     }
-    return 0;
+    return -1;
 }
 
-/* rdb_iterate scans the data pool, in order, by index, calling fn() on each node
- * that is not null.
- * If fn returns RDB_DB_DELETE_NODE, or if fn is null, the tree node will be 
- * deleted from rDB and del_fn will be called to do it's thing (if not NULL).
+/* Batches
  *
- * del_fn is called after node is unlinked from all data pools and it's purpose
- * is to free any allocated memory and any other cleanup needed.
+ * rdb_batch_t collects inserts, deletes and moves on one pool, and
+ * rdb_batch_commit() applies them in one pass, taking each involved pool's
+ * lock once (RDB_POOL_THREADSAFE pools: the update mutex, plus each index
+ * lock once per run of operations).
  *
- * del_fn receive a pointer to the node head, and a potential user  argument
- * del_fn is optional but is highly recommanded. if it is missing (NULL), 
- * rRB will free ptr for you, but it will not know how to free
- * any dynamic allocations tied to it (except PSTR index fields, which is will
- * free), So If there are any, and del_fn is null, memoty leak will occur.
+ * Consecutive operations of the same kind form a run. Within a run the
+ * operations commute, so they are applied index by index, in key order of
+ * that index, which keeps descents short and the top of each tree hot.
+ * Runs are applied in the order they were added.
+ *
+ * All or nothing: if any operation fails (duplicate key, delete or move
+ * target not found), everything done so far is undone in reverse, using
+ * the same partial undo as rdb_insert, and the pool is left unchanged.
+ * FIFO/LIFO positions are the exception, re-linked records go to the end.
+ *
+ * After a successful commit ops[n].rec holds the record each operation
+ * touched - deleted records are the caller's to free, as with rdb_delete.
+ * rdb_batch_commit() takes the pool locks itself, do not call it while
+ * holding rdb_lock() on any of the involved pools.
  */
 
-void rdb_iterate(
-        rdb_pool_t  *pool, 
-        int         index, 
-        int         fn(void *, void *),
-        void        *fn_data,
-        void        del_fn(void *, void *),
-        void        *del_data) {
-
-    void        *resumePtr;
-    int         rc = 0;
+typedef struct rdb_batch_undo_s {
+    void        *rec;       // must be first, see _rdb_sort()
+    rdb_pool_t  *pool;
+    int         linked;     // rec was linked into pool (else unlinked)
+    int         upto;       // last index done
+    int         counted;    // record_count was adjusted
+} rdb_batch_undo_t;
 
-    if (pool == NULL) {
-        return rdb_error("rdb_iterate called with NULL pool");
-    }
+// rDB internal: a sorts before b in index idx (tree in-order)
+static inline int _rdb_before (rdb_pool_t *pool, int idx, void *a, void *b)
+{
+    return pool->fn[idx] (a + pool->key_offset[idx],
+                            b + pool->key_offset[idx]) > 0;
+}
 
-    if (pool->root[index] == NULL) {
-        return;	    // no data is not an error
-    }
+#define RDB_SORT_REC(item) (indirect ? *(void **) (item) : (item))
 
-    if ((pool->FLAGS[index] & RDB_BTREE) == 0) {
-        return rdb_error("iterate called without RDB_BTREE flag.");
+// rDB internal: stable bottom up merge sort of n records by the key of 
+// index idx. with indirect set, items point to a struct whose first member
+// is the record pointer. tmp must hold n pointers.
+static void _rdb_sort (rdb_pool_t *pool, int idx, void **items, void **tmp,
+        size_t n, int indirect)
+{
+    size_t  width, lo, mid, hi, i, j, k;
+    void    **src = items, 
+            **dst = tmp, 
+            **swap;
+
+    for (width = 1; width < n; width *= 2) {
+        for (lo = 0; lo < n; lo += 2 * width) {
+            mid = (lo + width < n) ? lo + width : n;
+            hi = (lo + 2 * width < n) ? lo + 2 * width : n;
+            i = lo;
+            j = mid;
+            k = lo;
+            while (i < mid && j < hi) {
+                if (_rdb_before (pool, idx, RDB_SORT_REC(src[j]), 
+                                                    RDB_SORT_REC(src[i])))
+                    dst[k++] = src[j++];
+                else
+                    dst[k++] = src[i++];
+            }
+            while (i < mid) dst[k++] = src[i++];
+            while (j < hi) dst[k++] = src[j++];
+        }
+        swap = src;
+        src = dst;
+        dst = swap;
     }
+    if (src != items)
+        memcpy (items, src, n * sizeof (void *));
+}
 
-    resumePtr = NULL;
+// rDB internal: order undo entries for index idx. key order for trees, 
+// operation order for lists.
+static void _rdb_batch_order (rdb_pool_t *pool, int idx, 
+        rdb_batch_undo_t *ent, void **items, void **tmp, int n)
+{
+    int e;
 
-    do {
-        if ((pool->FLAGS[index] & (RDB_NOKEYS)) == 0) { 
-            // tree iteration
-            debug("Tree iterate - %s",pool->name);
-            rc = _rdb_iterate (pool, index, fn, fn_data, del_fn, del_data,
-                                pool->root[index], NULL, 0, &resumePtr);
-        } else { 
-            // list iteration
-            debug("List iterate - %s",pool->name);
-            rc = _rdb_iterate_list (pool, index, fn, fn_data, del_fn, del_data,
-                                pool->root[index], NULL, 0, &resumePtr);
-        }
-	    debug("rc=%d %p\n",rc, resumePtr);
-    } while (rc != 0 && ( rc & RDBFE_ABORT ) != RDBFE_ABORT && 
-                                                    resumePtr != NULL);
+    for (e = 0; e < n; e++)
+        items[e] = &ent[e];
+    if ((pool->FLAGS[idx] & RDB_NOKEYS) == 0)
+        _rdb_sort (pool, idx, items, tmp, n, 1);
 }
 
-void _rdb_flush( 
-        rdb_pool_t  *pool, 
-        void        *start, 
-        void        fn( void *, void *), 
-        void        *fn_data) {
+// rDB internal: link n records into every index of pool, index by index
+static int _rdb_batch_link (rdb_pool_t *pool, rdb_batch_undo_t *ent, 
+        void **items, void **tmp, int n)
+{
+    rdb_batch_undo_t    *u;
+    int                 idx, e;
+
+    for (idx = 0; idx < pool->indexCount; idx++) {
+        _rdb_batch_order (pool, idx, ent, items, tmp, n);
+        _rdb_ts_idx_lock (pool, idx);
+        for (e = 0; e < n; e++) {
+            u = items[e];
+            if (_rdb_insert (pool, u->rec, pool->root[idx], idx, NULL, 0) < 0){
+                _rdb_ts_idx_unlock (pool, idx);
+                return rdb_error_value (-1, "rdb_batch_commit: insert failed, "
+                                "duplicate key");
+            }
+            u->upto = idx;
+        }
+        _rdb_ts_idx_unlock (pool, idx);
+        RDB_STAT_FLUSH (pool, idx);
+        RDB_STAT_ADD (pool, idx, inserts, n);
+    }
 
-    void   *dataHead;
-    PP_T   *pp;
-    void   **dataField;
-    int     indexCount;
+    for (e = 0; e < n; e++) {
+        ent[e].counted = 1;
+        RDB_TRACEPOINT (insert, RDB_TRACE_INSERT, pool, -1, ent[e].rec);
+    }
+#ifdef RDB_POOL_COUNTERS
+    RDB_COUNT_SET (pool, pool->record_count + n);
+    for (e = 0; e < n; e++)
+        _rdb_mem_strings (pool, ent[e].rec, 1);
+    _rdb_mem_peak (pool);
+#endif
+    return 0;
+}
 
-    if (pool->FLAGS[0] & RDB_BTREE) {
-        set_pointers( pool, 0, start, &pp, &dataHead);
+// rDB internal: unlink n (resolved) records from every index of pool
+static int _rdb_batch_unlink (rdb_pool_t *pool, rdb_batch_undo_t *ent, 
+        void **items, void **tmp, int n)
+{
+    rdb_batch_undo_t    *u;
+    int                 idx, e;
+
+    // Two operations hitting the same record would make the later one 
+    // miss, catch that before anything is changed.
+    for (idx = 0; idx < pool->indexCount; idx++) {
+        if ((pool->FLAGS[idx] & RDB_NOKEYS) == 0) {
+            _rdb_batch_order (pool, idx, ent, items, tmp, n);
+            for (e = 1; e < n; e++) {
+                if (((rdb_batch_undo_t *) items[e - 1])->rec == 
+                                        ((rdb_batch_undo_t *) items[e])->rec)
+                    return rdb_error_value (-1, "rdb_batch_commit: record "
+                                "deleted twice in one batch");
+            }
+            break;
+        }
+    }
 
-        if (pp->left != NULL)
-            _rdb_flush( pool, pp->left, fn, fn_data );
+    for (idx = 0; idx < pool->indexCount; idx++) {
+        _rdb_batch_order (pool, idx, ent, items, tmp, n);
+        _rdb_ts_idx_lock (pool, idx);
+        for (e = 0; e < n; e++) {
+            u = items[e];
+            _rdb_delete (pool, idx, u->rec, NULL, NULL, 0);
+            u->upto = idx;
+        }
+        _rdb_ts_idx_unlock (pool, idx);
+        RDB_STAT_FLUSH (pool, idx);
+        RDB_STAT_ADD (pool, idx, deletes, n);
+    }
 
-        if (pp->right != NULL)
-            _rdb_flush( pool, pp->right, fn, fn_data );
+    for (e = 0; e < n; e++) {
+        ent[e].counted = 1;
+        RDB_TRACEPOINT (delete, RDB_TRACE_DELETE, pool, -1, ent[e].rec);
+    }
+#ifdef RDB_POOL_COUNTERS
+    RDB_COUNT_SET (pool, pool->record_count - n);
+    for (e = 0; e < n; e++)
+        _rdb_mem_strings (pool, ent[e].rec, -1);
+#endif
+    return 0;
+}
 
-        if (NULL != fn) fn(dataHead, fn_data);
-        else { 
-            // Courtesy delete of data block
-
-            for (indexCount = 0; indexCount < pool->indexCount;
-                    indexCount++) if (pool->FLAGS[indexCount] &
-                                                        RDB_KPSTR) { 
-                // We have an index which is a pointer, need to free it too.
-                dataField = dataHead + pool->key_offset[indexCount];
-                //debug("off = %d add %x, str %s\n",
-                //pool->key_offset[indexCount],(unsigned) *dataField,
-                //*dataField);
-                if (*dataField) rdb_free(*dataField);
-                }
-            if (dataHead) rdb_free (dataHead);
+// rDB internal: find the record a delete / move operation refers to. list 
+// lookups take the next record from cursor, so a run of them walks the list.
+static void *_rdb_batch_resolve (rdb_pool_t *pool, int idx, void *data,
+        void **cursor)
+{
+    void    *rec;
+    PP_T    *ppk;
+
+    if (pool->FLAGS[idx] & RDB_NOKEYS) {
+        rec = (*cursor) ? *cursor : pool->root[idx];
+        if (rec) {
+            ppk = rec + (sizeof (PP_T) * idx);
+            *cursor = ppk->right ?
+                    (void *) ppk->right - sizeof (PP_T) * idx : NULL;
         }
+        return rec;
     }
+    if (data == NULL)
+        return NULL;
+    return _rdb_get (pool, idx, data, NULL, 0);
 }
 
-void _rdb_flush_list(   
-        rdb_pool_t  *pool, 
-        void        *start, 
-        void        fn( void *, void *), 
-        void *fn_data) {
-
-    void   *dataHead;
-    PP_T   *pp;
-    void   **dataField;
-    int     indexCount;
-
-    if (pool->FLAGS[0] & RDB_BTREE)
-        do {
-            set_pointers( pool, 0, start, &pp, &dataHead);
-
-            start = pp->right;
-
-            if (NULL != fn) fn(dataHead, fn_data);
-            else { 
-                // Courtesy delete of data block
-
-                for (indexCount = 0; indexCount < pool->indexCount;
-                        indexCount++) if (pool->FLAGS[indexCount] &
-                                                        RDB_KPSTR) { 
-                    // We have an index which is a pointer, need to free it too.
-                    dataField = dataHead + pool->key_offset[indexCount];
-                    // debug("off = %d add %x, str %s\n",
-                    // pool->key_offset[indexCount],
-                    // (unsigned) *dataField, *dataField);
-                        if (*dataField) rdb_free(*dataField);
-                    }
-                if (dataHead) rdb_free (dataHead);
-            }
-        }
-        while (start != NULL);
+int rdb_batch_init (rdb_batch_t *batch, rdb_pool_t *pool)
+{
+    memset (batch, 0, sizeof (rdb_batch_t));
+    if (pool == NULL
+#ifndef KM
+            || pool->FLAGS[0] & RDB_LOCKFREE
+#endif
+            )
+        return rdb_error_value (-1, "rdb_batch_init: no pool, or a lock-free"
+                " pool");
+    batch->pool = pool;
+    return 0;
 }
 
-/* This will delete all the nodes in the tree,
- * Since we are destroying the tree, we do not care about fixing parent
- * pointers, re-balancing etc, this means there is no before and after delete
- * functions, but only one fn which serve as both.
- *
- * This fn should free the allocated memory (ptr), and any additionali
- * dynamic allocations tied to it.
- *
- * fn() is optional but is highly recommanded. if it is missing (NULL), 
- * rdb will free ptr for you, but it will not know how to free any dynamic 
- * allocations tied to it, so If there is any, and fn is null, 
- * memoty leak will occur.
- */
-void rdb_flush( rdb_pool_t *pool, void fn( void *, void *), void *fn_data)
+// rDB internal: append one operation to a batch
+static int _rdb_batch_add (rdb_batch_t *batch, int op, int idx, void *data,
+        rdb_pool_t *dst)
 {
+    rdb_batch_op_t  *ops;
+
+    if (batch->pool == NULL || idx < 0 || idx >= batch->pool->indexCount)
+        return rdb_error_value (-1, "rdb_batch: bad pool or index");
+
+    if (batch->count == batch->size) {
+        ops = rdb_alloc (sizeof (rdb_batch_op_t) * 
+                        (batch->size ? batch->size * 2 : 64));
+        if (ops == NULL)
+            return rdb_error_code (-1, RDB_E_NOMEM, "rdb_batch: out of memory");
+        if (batch->ops) {
+            memcpy (ops, batch->ops, sizeof (rdb_batch_op_t) * batch->count);
+            rdb_free (batch->ops);
+        }
+        batch->ops = ops;
+        batch->size = batch->size ? batch->size * 2 : 64;
+    }
 
-    int cnt;
-    
-    if (pool->root[0] == NULL)
-        return;
+    ops = &batch->ops[batch->count++];
+    ops->op = op;
+    ops->idx = idx;
+    ops->data = data;
+    ops->dst = dst;
+    ops->rec = NULL;
+    return batch->count;
+}
 
-    if (pool->FLAGS[0] & (RDB_NOKEYS))
-        _rdb_flush_list (pool, NULL, fn, fn_data);
-    else
-        _rdb_flush (pool, NULL, fn, fn_data);
+int rdb_batch_insert (rdb_batch_t *batch, void *data)
+{
+    if (data == NULL)
+        return rdb_error_value (-1, "rdb_batch_insert: NULL record");
+    return _rdb_batch_add (batch, RDB_BATCH_INSERT, 0, data, NULL);
+}
 
-    for (cnt = 0; cnt < pool->indexCount; cnt++)
-        if (pool->root[cnt])
-            pool->root[cnt] = NULL;
+// data is the lookup key, as with rdb_delete. it is read at commit time,
+// so must stay valid until then. list indexes take records from the head
+int rdb_batch_delete (rdb_batch_t *batch, int idx, void *data)
+{
+    return _rdb_batch_add (batch, RDB_BATCH_DELETE, idx, data, NULL);
+}
 
-#ifdef RDB_POOL_COUNTERS
-    pool->record_count = 0;
+int rdb_batch_move (rdb_batch_t *batch, rdb_pool_t *dst, int idx, void *data)
+{
+    if (dst == NULL || dst == batch->pool
+#ifndef KM
+            || dst->FLAGS[0] & RDB_LOCKFREE
 #endif
+            )
+        return rdb_error_value (-1, "rdb_batch_move: bad destination pool");
+    return _rdb_batch_add (batch, RDB_BATCH_MOVE, idx, data, dst);
+}
 
+// Drop all collected operations, keeping the buffer for reuse
+void rdb_batch_reset (rdb_batch_t *batch)
+{
+    batch->count = 0;
 }
 
+void rdb_batch_free (rdb_batch_t *batch)
+{
+    if (batch->ops)
+        rdb_free (batch->ops);
+    batch->ops = NULL;
+    batch->count = batch->size = 0;
+}
 
+// Apply all operations, returns the number applied or -1 with the pool(s)
+// left untouched.
+int rdb_batch_commit (rdb_batch_t *batch)
+{
+    rdb_pool_t          **pools, *pool = batch->pool, *dst;
+    rdb_batch_undo_t    *undo, *u;
+    void                **items, *cursor[RDB_POOL_MAX_IDX];
+    int                 npools = 0, nundo = 0, rc = batch->count;
+    int                 i, j, k, first, op;
+
+    if (pool == NULL)
+        return rdb_error_value (-1, "rdb_batch_commit: batch not initialized");
+    if (batch->count == 0)
+        return 0;
 
+    // one allocation: pools[count + 1], undo[2 * count], items[4 * count]
+    pools = rdb_alloc (sizeof (void *) * (batch->count + 1) + 
+                        sizeof (rdb_batch_undo_t) * 2 * batch->count +
+                        sizeof (void *) * 4 * batch->count);
+    if (pools == NULL)
+        return rdb_error_code (-1, RDB_E_NOMEM,
+                "rdb_batch_commit: out of memory");
+    undo = (void *) (pools + batch->count + 1);
+    items = (void *) (undo + 2 * batch->count);
+
+    // Lock every pool involved once, in address order so two batches
+    // moving records in opposite directions can not deadlock.
+    pools[npools++] = pool;
+    for (i = 0; i < batch->count; i++) {
+        if (batch->ops[i].op != RDB_BATCH_MOVE)
+            continue;
+        for (j = 0; j < npools && pools[j] != batch->ops[i].dst; j++);
+        if (j == npools)
+            pools[npools++] = batch->ops[i].dst;
+    }
+    for (i = 1; i < npools; i++)
+        for (j = i; j > 0 && pools[j] < pools[j - 1]; j--) {
+            dst = pools[j];
+            pools[j] = pools[j - 1];
+            pools[j - 1] = dst;
+        }
+    for (i = 0; i < npools; i++) {
+        if (RDB_TS(pools[i])) 
+            _rdb_ts_update_lock (pools[i]);
+        else 
+            rdb_lock (pools[i], __FUNCTION__);
+    }
 
-/* In order to delete and keep an AVL tree balanced, when we may have multiple
- * indexes, we need to do the following:
- *
- * 1) Do an rdb_get to aquire a 'data' pointer so we can read all indexes and 
- *    delete the node out of all index trees. this is done by rdb_delete().
- *
- * 2) Next, recursive function _rdb_delete() is called, Once for each index.
- *    It will find the pointer to the data to be deleted (ppkDead), as well as
- *    a 'data' pointer to the parent.
- *
- * 3) Next we call _rdb_delete_by_pointer() to actually un-link the data blocks
- *    from the index trees. We have the following cases...
- *    3.1) Unlink block is a leaf (no childrens), we just update parent pointers
- *         point to NULL and return indicator to parent to re-balance tree if 
- *         needed
- */
+    for (i = 0; i < batch->count; i = j) {
+        op = batch->ops[i].op;
+        for (j = i; j < batch->count && batch->ops[j].op == op; j++);
+        first = nundo;
+
+        if (op == RDB_BATCH_INSERT) {
+            for (k = i; k < j; k++) {
+                u = &undo[nundo++];
+                u->rec = batch->ops[k].rec = batch->ops[k].data;
+                u->pool = pool;
+                u->linked = 1;
+                u->upto = -1;
+                u->counted = 0;
+            }
+            if (_rdb_batch_link (pool, &undo[first], items, 
+                        items + 2 * batch->count, nundo - first) < 0)
+                goto rollback;
+            continue;
+        }
 
+        memset (cursor, 0, sizeof (cursor));
+        for (k = i; k < j; k++) {
+            batch->ops[k].rec = _rdb_batch_resolve (pool, batch->ops[k].idx,
+                    batch->ops[k].data, &cursor[batch->ops[k].idx]);
+            if (batch->ops[k].rec == NULL) {
+                rdb_error_code (0, RDB_E_NOTFOUND,
+                        "rdb_batch_commit: delete or move target not found");
+                goto rollback;
+            }
+            u = &undo[nundo++];
+            u->rec = batch->ops[k].rec;
+            u->pool = pool;
+            u->linked = 0;
+            u->upto = -1;
+            u->counted = 0;
+        }
+        if (_rdb_batch_unlink (pool, &undo[first], items, 
+                    items + 2 * batch->count, nundo - first) < 0)
+            goto rollback;
+
+        if (op != RDB_BATCH_MOVE)
+            continue;
+
+        // link moved records into their destinations, one pool at a time
+        for (k = i; k < j; k++) {
+            dst = batch->ops[k].dst;
+            for (op = i; op < k && batch->ops[op].dst != dst; op++);
+            if (op < k)
+                continue;                   // destination already done
+            first = nundo;
+            for (op = k; op < j; op++) {
+                if (batch->ops[op].dst != dst) 
+                    continue;
+                u = &undo[nundo++];
+                u->rec = batch->ops[op].rec;
+                u->pool = dst;
+                u->linked = 1;
+                u->upto = -1;
+                u->counted = 0;
+            }
+            if (_rdb_batch_link (dst, &undo[first], items, 
+                        items + 2 * batch->count, nundo - first) < 0)
+                goto rollback;
+        }
+    }
 
-/* In orfer to delete a node we need to do the following:
- *
- * 1) Find the parent node (if we are not deleting the root node) so new 
- *    subtree can be linked to it (*parent)
- *
- * 2) Find the node to be deleted , same is in normal lookup 
- *    (this is how we get the parent - *ppkDead)
- *
- * 3) If deleted node only has one child, link ppkLeft Or ppkRight 
- *    to parent and we are done
+    for (i = 0; i < batch->count; i++) {
+        op = batch->ops[i].op;
+        RDB_WAL (pool, op == RDB_BATCH_INSERT ? RDB_WAL_INSERT :
+                                        RDB_WAL_DELETE, batch->ops[i].rec);
+        if (op == RDB_BATCH_MOVE)
+            RDB_WAL (batch->ops[i].dst, RDB_WAL_INSERT, batch->ops[i].rec);
+    }
+    goto unlock;
+
+rollback:
+    rc = -1;
+    for (u = &undo[nundo - 1]; u >= undo; u--) {
+        if (u->linked) {
+            _rdb_insert_undo (u->pool, u->rec, u->upto);
+            RDB_TRACEPOINT (undo, RDB_TRACE_UNDO, u->pool, u->upto, u->rec);
+#ifdef RDB_POOL_COUNTERS
+            if (u->counted) {
+                RDB_COUNT_SET (u->pool, u->pool->record_count - 1);
+                _rdb_mem_strings (u->pool, u->rec, -1);
+            }
+#endif
+        }
+        else {
+            for (k = 0; k <= u->upto; k++) {
+                _rdb_ts_idx_lock (u->pool, k);
+                _rdb_insert (u->pool, u->rec, u->pool->root[k], k, NULL, 0);
+                _rdb_ts_idx_unlock (u->pool, k);
+            }
+#ifdef RDB_POOL_COUNTERS
+            if (u->counted) {
+                RDB_COUNT_SET (u->pool, u->pool->record_count + 1);
+                _rdb_mem_strings (u->pool, u->rec, 1);
+            }
+#endif
+        }
+    }
+
+unlock:
+    for (i = npools - 1; i >= 0; i--) {
+        if (RDB_TS(pools[i])) 
+            _rdb_ts_update_unlock (pools[i]);
+        else 
+            rdb_unlock (pools[i], __FUNCTION__);
+    }
+    if (rc > 0)
+        for (i = 0; i < npools; i++)
+            RDB_WAL_WAIT (pools[i]);
+    rdb_free (pools);
+    return rc;
+}
+
+#ifndef KM
+/* Memory mapped pools
  *
- * 4) If we have 2 children set *ppkLeft and *ppkRight and...
- *    Find most right point of left child (*ppkHook)
+ * rdb_mmap_pool() keeps a pool's records in a file: a header page, then
+ * fixed size record slots handed out by rdb_mmap_alloc(). Tree and list
+ * links are the records' own pointer packs, so they live in the file too,
+ * and on rdb_mmap_close() the header saves the index roots next to them.
  *
- * 5) ppkHook->right = ppkRight
+ * Links stay plain pointers, the tree code is not touched. Instead the
+ * header remembers the address the file was mapped at and reopening maps
+ * it there again, making the pool usable with no work at all. Should that
+ * address be taken, every link is shifted by the difference in one linear
+ * pass over the slots - still no rebuild or rebalancing.
  *
- * 6) parent->side = ppkLeft...
+ * Records must be position independent apart from the pointer packs, so
+ * RDB_KPSTR indexes are not allowed. The file is only consistent after
+ * rdb_mmap_close(), which rdb_drop_pool() and rdb_clean() call for pools
+ * still mapped; a process that dies with the pool open leaves a file that
+ * is refused on open.
  */
 
-//TODO inline this
-int _rdb_delete_by_pointer (
-        rdb_pool_t  *pool, 
-        void        *parent, 
-        int         index, 
-        PP_T        *ppkDead, 
-        int side) {
+#define RDB_MMAP_MAGIC      0x7244426d6d617031ULL      // "rDBmmap1"
+#define RDB_MMAP_VERSION    1
+#define RDB_MMAP_HDR_SIZE   4096
+#define RDB_MMAP_FREE       0x5eadf4ee                  // balance of a free slot
+
+typedef struct rdb_mmap_hdr_s {
+    uint64_t    magic;
+    uint32_t    version;
+    uint32_t    clean;                          // closed with rdb_mmap_close
+    uint64_t    base;                           // address mapped at
+    uint64_t    size;                           // file size
+    uint64_t    record_size;
+    uint64_t    slot_size;
+    uint64_t    capacity;                       // slots
+    uint64_t    used;                           // slots ever handed out
+    uint64_t    free_list;                      // freed slots, via pp[0].left
+    uint32_t    indexCount;
+    uint32_t    record_count;
+    uint32_t    FLAGS[RDB_POOL_MAX_IDX];
+    uint32_t    key_offset[RDB_POOL_MAX_IDX];
+    uint64_t    root[RDB_POOL_MAX_IDX];
+    uint64_t    tail[RDB_POOL_MAX_IDX];
+} rdb_mmap_hdr_t;
+
+typedef struct rdb_mmap_s {
+    rdb_mmap_hdr_t  *hdr;                       // start of the mapping
+    void            *slots;
+    int             fd;
+    pthread_mutex_t lock;                       // slot allocation
+} rdb_mmap_t;
+
+// rDB internal: shift every link of a mapping that moved by delta
+static void _rdb_mmap_rebase (rdb_mmap_t *mm, intptr_t delta)
+{
+    rdb_mmap_hdr_t  *hdr = mm->hdr;
+    PP_T            *pp;
+    uint64_t        slot;
+    uint32_t        idx;
+
+#define RDB_REBASE(p) do { if (p) (p) = (void *) ((char *) (p) + delta); } \
+                                                                    while (0)
+    for (slot = 0; slot < hdr->used; slot++) {
+        pp = mm->slots + slot * hdr->slot_size;
+        if (pp[0].balance == RDB_MMAP_FREE) {
+            RDB_REBASE (pp[0].left);
+            continue;
+        }
+        for (idx = 0; idx < hdr->indexCount; idx++) {
+            RDB_REBASE (pp[idx].left);
+            RDB_REBASE (pp[idx].right);
+        }
+    }
+    for (idx = 0; idx < RDB_POOL_MAX_IDX; idx++) {
+        if (hdr->root[idx]) hdr->root[idx] += delta;
+        if (hdr->tail[idx]) hdr->tail[idx] += delta;
+    }
+    if (hdr->free_list) hdr->free_list += delta;
+    hdr->base = (uintptr_t) hdr;
+#undef RDB_REBASE
+}
 
-    PP_T   *ppkParent = NULL;           // NULL is here to make compiler happy
+// Open (or create) a pool backed by the file at path. record_size is the
+// size of the user structure, pointer packs included. capacity is the
+// number of records a new file is sized for; an existing file keeps its
+// own, and must match the other arguments. Other indexes are registered
+// with rdb_register_um_idx() as usual, and pick up their saved trees.
+rdb_pool_t *rdb_mmap_pool (const char *path, char *poolName, int indexCount,
+        int key_offset, int FLAGS, void *compare_fn, size_t record_size,
+        size_t capacity)
+{
+    rdb_mmap_hdr_t  hdr;
+    rdb_mmap_t      *mm;
+    rdb_pool_t      *pool;
+    struct stat     st;
+    void            *map, *hint = NULL;
+    int             fd, created = 0;
+
+    if (FLAGS & (RDB_KPSTR | RDB_LOCKFREE) || indexCount < 1 ||
+            indexCount > RDB_POOL_MAX_IDX || 
+            record_size < sizeof (PP_T) * indexCount) {
+        rdb_error ("rdb_mmap_pool: bad record size, or index type");
+        return NULL;
+    }
 
-    if (parent)
-        ppkParent = (void *) parent + (sizeof (PP_T) * index);
+    if ((fd = open (path, O_RDWR | O_CREAT, 0644)) < 0 || fstat (fd, &st)) {
+        rdb_error_code (0, RDB_E_IO, "rdb_mmap_pool: can not open file");
+        if (fd >= 0) close (fd);
+        return NULL;
+    }
 
-    debug("deleteByPtr:  pool=%s, parent %p\n", pool->name, parent);
+    if (st.st_size == 0) {
+        memset (&hdr, 0, sizeof (hdr));
+        hdr.magic = RDB_MMAP_MAGIC;
+        hdr.version = RDB_MMAP_VERSION;
+        hdr.record_size = record_size;
+        hdr.slot_size = (record_size + 15) & ~(size_t) 15;
+        hdr.capacity = capacity;
+        hdr.size = RDB_MMAP_HDR_SIZE + hdr.slot_size * capacity;
+        hdr.indexCount = indexCount;
+        hdr.FLAGS[0] = FLAGS;
+        hdr.key_offset[0] = sizeof (PP_T) * indexCount + key_offset;
+        if (ftruncate (fd, hdr.size)) {
+            rdb_error_code (0, RDB_E_IO, "rdb_mmap_pool: can not size file");
+            close (fd);
+            return NULL;
+        }
+        created = 1;
+    }
+    else if (pread (fd, &hdr, sizeof (hdr), 0) != sizeof (hdr) ||
+            hdr.magic != RDB_MMAP_MAGIC || hdr.version != RDB_MMAP_VERSION ||
+            hdr.size != (uint64_t) st.st_size) {
+        rdb_error ("rdb_mmap_pool: not an rDB pool file");
+        close (fd);
+        return NULL;
+    }
+    else if (!hdr.clean) {
+        rdb_error ("rdb_mmap_pool: pool file was not closed, rebuild it");
+        close (fd);
+        return NULL;
+    }
+    else if (hdr.record_size != record_size || 
+            hdr.indexCount != (uint32_t) indexCount || 
+            hdr.FLAGS[0] != (uint32_t) FLAGS ||
+            hdr.key_offset[0] != sizeof (PP_T) * indexCount + key_offset) {
+        rdb_error ("rdb_mmap_pool: pool file does not match pool definition");
+        close (fd);
+        return NULL;
+    }
+    else
+        hint = (void *) (uintptr_t) hdr.base;
 
-    if (ppkDead->right == NULL && ppkDead->left == NULL) {
-        // No children, only need to fix parent if exist
-        debug("rdb_delete_by_ptr: no Children : inside:  parent %p\n", parent);
+#ifdef MAP_FIXED_NOREPLACE
+    map = mmap (hint, hdr.size, PROT_READ | PROT_WRITE, 
+            MAP_SHARED | (hint ? MAP_FIXED_NOREPLACE : 0), fd, 0);
+    if (map == MAP_FAILED && hint)
+#endif
+        map = mmap (hint, hdr.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        rdb_error_code (0, RDB_E_IO, "rdb_mmap_pool: mmap failed");
+        close (fd);
+        return NULL;
+    }
 
-        if (parent) {
-            if (side)                           // We hung of the parents right
-                ppkParent->right = NULL;
-            else                                // Left
-                ppkParent->left = NULL;
-        }
-        else pool->root[index] = NULL ;
+    mm = rdb_alloc (sizeof (rdb_mmap_t));
+    pool = mm ? rdb_register_um_pool (poolName, indexCount, key_offset, 
+                                                    FLAGS, compare_fn) : NULL;
+    if (pool == NULL) {
+        if (mm) rdb_free (mm);
+        munmap (map, hdr.size);
+        close (fd);
+        return NULL;
+    }
 
-        // We just deleted a leaf, parent need to update balance.
-        return PARENT_BAL_CNG; 
-    } else if (ppkDead->right && (ppkDead->left == NULL)) {
-        // One child on the right
-        if (parent) {
-            if (side)
-                // we hook up parent to his new child
-                ppkParent->right = ppkDead->right;     
-            else
-                ppkParent->left = ppkDead->right;
-        } else
-            // ppkDead child now become root node
-            pool->root[index] = ppkDead->right; 
+    mm->hdr = map;
+    mm->slots = map + RDB_MMAP_HDR_SIZE;
+    mm->fd = fd;
+    pthread_mutex_init (&mm->lock, NULL);
 
-        // parent need to update balance.
-        return PARENT_BAL_CNG;                  
+    if (created) {
+        hdr.base = (uintptr_t) map;
+        memcpy (mm->hdr, &hdr, sizeof (hdr));
     }
-    else if ((ppkDead->right == NULL) && ppkDead->left) {
-        // One chile on left
-        if (parent) {
-            if (side)
-                // we hooked up parent to his new child
-                ppkParent->right = ppkDead->left; 
-            else
-                ppkParent->left = ppkDead->left;
-        } else
-            //ppkDead child now become root node
-            pool->root[index] = ppkDead->left; 
+    else if (map != hint)
+        _rdb_mmap_rebase (mm, (intptr_t) map - (intptr_t) hint);
 
-        // parent need to update balance.
-        return PARENT_BAL_CNG;
-    } else {
-        // Two children
+    pool->root[0] = (void *) (uintptr_t) mm->hdr->root[0];
+    pool->tail[0] = (void *) (uintptr_t) mm->hdr->tail[0];
+#ifdef RDB_POOL_COUNTERS
+    RDB_COUNT_SET (pool, mm->hdr->record_count);
+#endif
+    mm->hdr->clean = 0;
+    pool->mmap = mm;
+    pool->record_size = record_size;
+#ifdef RDB_POOL_COUNTERS
+    _rdb_mem_peak (pool);
+#endif
+    return pool;
+}
 
-        debug("rdbDeleteByPointer: a: I should never get here! index = %d, %p %p\n",
-                                        index, ppkDead->left, ppkDead->right);
-#ifdef KM
+// rDB internal: rdb_register_um_idx on a mapped pool. picks up the saved
+// tree of an index, or records a new one.
+static int _rdb_mmap_restore_idx (rdb_pool_t *pool, int idx)
+{
+    rdb_mmap_hdr_t *hdr = ((rdb_mmap_t *) pool->mmap)->hdr;
+
+    if (pool->FLAGS[idx] & RDB_KPSTR)
+        return -1;
+    if (hdr->FLAGS[idx] == 0) {
+        hdr->FLAGS[idx] = pool->FLAGS[idx];
+        hdr->key_offset[idx] = pool->key_offset[idx];
         return 0;
-#else
-        exit(1);
-#endif
     }
+    if (hdr->FLAGS[idx] != pool->FLAGS[idx] || 
+            hdr->key_offset[idx] != pool->key_offset[idx])
+        return -1;
+    pool->root[idx] = (void *) (uintptr_t) hdr->root[idx];
+    pool->tail[idx] = (void *) (uintptr_t) hdr->tail[idx];
+    return 0;
 }
 
-int _rdb_delete (
-        rdb_pool_t  *pool, 
-        int         lookupIndex, 
-        void        *data, 
-        void        *start, 
-        PP_T        *parent, 
-        int side) {
+// A zeroed record slot of a mapped pool, NULL when the file is full
+void *rdb_mmap_alloc (rdb_pool_t *pool)
+{
+    rdb_mmap_t      *mm = pool->mmap;
+    rdb_mmap_hdr_t  *hdr;
+    void            *rec = NULL;
 
-    PP_T   *ppkDead;
-    PP_T   *ppkParent;
-    PP_T   *ppkRotate;
-    PP_T   *ppkBottom;
-    int     rc,
-            rc2;
-    void   *dataHead;
+    if (mm == NULL)
+        return NULL;
+    hdr = mm->hdr;
+    rdb_sem_lock (&mm->lock);
+    if (hdr->free_list) {
+        rec = (void *) (uintptr_t) hdr->free_list;
+        hdr->free_list = (uintptr_t) ((PP_T *) rec)->left;
+    }
+    else if (hdr->used < hdr->capacity)
+        rec = mm->slots + hdr->slot_size * hdr->used++;
+    rdb_sem_unlock (&mm->lock);
 
-    if (pool->FLAGS[lookupIndex] & (RDB_NOKEYS)) {
-        void   *ptr = NULL;         // NULL to sashhh the compiler
-        int         indexCount;
-        PP_T   *ppk,
-               *ppkRight,
-               *ppkLeft;
-        ptr = data; 
-        indexCount = lookupIndex;
-        if (pool->FLAGS[indexCount] & (RDB_NOKEYS)) {
-            ppk = ptr + (sizeof (PP_T) * indexCount);
+    if (rec)
+        memset (rec, 0, hdr->record_size);
+    else
+        rdb_error ("rdb_mmap_alloc: pool file is full");
+    return rec;
+}
 
-            if (ppk->left) ppkLeft = ppk->left ;
-            else ppkLeft = NULL;
+static void _rdb_mmap_release (rdb_pool_t *pool, void *dataHead)
+{
+    rdb_mmap_t  *mm = pool->mmap;
+    PP_T        *pp = dataHead;
+
+    rdb_sem_lock (&mm->lock);
+    pp->left = (void *) (uintptr_t) mm->hdr->free_list;
+    pp->balance = RDB_MMAP_FREE;
+    mm->hdr->free_list = (uintptr_t) dataHead;
+    rdb_sem_unlock (&mm->lock);
+}
 
-            if (ppk->right) ppkRight = ppk->right ;
-            else ppkRight = NULL;
+// Give back a record slot (deleted from the pool). Flushes and courtesy
+// deletes on mapped pools do this by themselves.
+void rdb_mmap_free (rdb_pool_t *pool, void *data)
+{
+    if (pool->mmap && data)
+        _rdb_free_data (pool, data);
+}
 
-            if (pool->root[indexCount] == pool->tail[indexCount]) 
-                //we were the last item
-                pool->root[indexCount] = pool->tail[indexCount] = NULL; 
-            else { 
-                if (ppkLeft) ppkLeft->right = ppk->right;
+// Save index roots, write the file back and unmap it. the pool is dropped,
+// and its records are gone from memory. Returns 0, or -1 if the file could
+// not be written (it will then be refused on open).
+int rdb_mmap_close (rdb_pool_t *pool)
+{
+    rdb_mmap_t      *mm;
+    rdb_mmap_hdr_t  *hdr;
+    int             idx, rc = 0;
+
+    if (pool == NULL || (mm = pool->mmap) == NULL)
+        return rdb_error_value (-1, "rdb_mmap_close: not a mapped pool");
+
+    // async flushes and snapshots may still hold slots
+    rdb_reclaim_wait ();
+    _rdb_snap_drop (pool);
+
+    hdr = mm->hdr;
+    _rdb_ts_lock_all (pool);
+    for (idx = 0; idx < RDB_POOL_MAX_IDX; idx++) {
+        hdr->root[idx] = (uintptr_t) pool->root[idx];
+        hdr->tail[idx] = (uintptr_t) pool->tail[idx];
+    }
+#ifdef RDB_POOL_COUNTERS
+    hdr->record_count = pool->record_count;
+#endif
+    if (msync (hdr, hdr->size, MS_SYNC) == 0) {
+        hdr->clean = 1;
+        if (msync (hdr, RDB_MMAP_HDR_SIZE, MS_SYNC))
+            rc = -1;
+    } else
+        rc = -1;
+    _rdb_ts_unlock_all (pool);
+
+    munmap (hdr, hdr->size);
+    close (mm->fd);
+    pthread_mutex_destroy (&mm->lock);
+    pool->mmap = NULL;
+    rdb_free (mm);
+    rdb_drop_pool (pool);
+    return rc ? rdb_error_code (-1, RDB_E_IO,
+                                        "rdb_mmap_close: msync failed") : 0;
+}
+#endif
 
-                if (ppkRight) ppkRight->left = ppk->left;
+#ifndef KM
+/* Save / load
+ *
+ * rdb_save() streams the user part of every record (the pointer packs are
+ * left out) in index 0 order, through a large buffer. rdb_load() reads
+ * that back into an empty pool and builds each tree index bottom up from
+ * a sorted array - index 0 comes sorted, so it is linear, other indexes
+ * are merge sorted first. No insert, compare descent or rotation is done.
+ * List indexes are re-linked in index 0 order.
+ *
+ * Both need the record size, see rdb_pool_record_size(). Records holding
+ * pointers (RDB_KPSTR indexes) can not be saved.
+ */
 
-                if (pool->root[indexCount] == ptr) 
-                    pool->root[indexCount] = ppkRight - indexCount;
+#define RDB_SAVE_MAGIC      0x7244427361766531ULL      // "rDBsave1"
+#define RDB_SAVE_VERSION    1
+#define RDB_SAVE_BUF        (1 << 20)
+
+typedef struct rdb_save_hdr_s {
+    uint64_t    magic;
+    uint32_t    version;
+    uint32_t    indexCount;
+    uint64_t    record_size;
+    uint64_t    count;
+    uint32_t    FLAGS[RDB_POOL_MAX_IDX];
+    uint32_t    key_offset[RDB_POOL_MAX_IDX];
+} rdb_save_hdr_t;
+
+static int _rdb_write_all (int fd, const void *buf, size_t len)
+{
+    ssize_t rc;
 
-                if (pool->tail[indexCount] == ptr) 
-                    pool->tail[indexCount] = ppkLeft - indexCount;
-            }
+    while (len) {
+        if ((rc = write (fd, buf, len)) < 0) {
+            if (errno == EINTR) continue;
+            return -1;
         }
-    } else if ((pool->FLAGS[lookupIndex] & RDB_BTREE) == RDB_BTREE) {
-        debug("Delete:start: \n");
+        buf += rc;
+        len -= rc;
+    }
+    return 0;
+}
 
-        if (pool->root[lookupIndex] == NULL) {
-            return (0);
-        } else {
-            set_pointers (pool, lookupIndex, start, &ppkDead, &dataHead);
-            debug("Delete:before compare: \n");
+static int _rdb_read_all (int fd, void *buf, size_t len)
+{
+    ssize_t rc;
+
+    while (len) {
+        if ((rc = read (fd, buf, len)) <= 0) {
+            if (rc < 0 && errno == EINTR) continue;
+            return -1;
+        }
+        buf += rc;
+        len -= rc;
+    }
+    return 0;
+}
+
+// rDB internal: pool can take part in save / load
+static int _rdb_save_check (rdb_pool_t *pool)
+{
+    int idx;
+
+    if (pool == NULL || pool->record_size == 0)
+        return rdb_error_value (-1, "rdb_save/load: record size not set");
+    if (pool->FLAGS[0] & RDB_LOCKFREE)
+        return rdb_error_value (-1, "rdb_save/load: lock-free pool");
+    for (idx = 0; idx < pool->indexCount; idx++)
+        if (pool->FLAGS[idx] & RDB_KPSTR)
+            return rdb_error_value (-1, "rdb_save/load: RDB_KPSTR index");
+    return 0;
+}
+
+// rDB internal: stream pool to fd through buf (RDB_SAVE_BUF + record_size
+// bytes), no locking and no allocation. Returns the count, or -1
+static long _rdb_save (rdb_pool_t *pool, int fd, void *buf)
+{
+    rdb_save_hdr_t  hdr;
+    void            *stack[RDB_PAR_STACK], *node, *pos;
+    size_t          skip, len;
+    long            count = 0;
+    int             sp = 0, rc = 0;
+
+    skip = sizeof (PP_T) * pool->indexCount;
+    len = pool->record_size - skip;
+
+    // count first, the header leads the stream
+    count = _rdb_snap_index (pool, 0, NULL, UINT32_MAX);
+
+    memset (&hdr, 0, sizeof (hdr));
+    hdr.magic = RDB_SAVE_MAGIC;
+    hdr.version = RDB_SAVE_VERSION;
+    hdr.indexCount = pool->indexCount;
+    hdr.record_size = pool->record_size;
+    hdr.count = count;
+    memcpy (hdr.FLAGS, pool->FLAGS, sizeof (hdr.FLAGS));
+    memcpy (hdr.key_offset, pool->key_offset, sizeof (hdr.key_offset));
+    rc = _rdb_write_all (fd, &hdr, sizeof (hdr));
+
+    pos = buf;
+    node = pool->root[0];
+    while (rc == 0 && (sp || node)) {
+        if (node && (pool->FLAGS[0] & RDB_NOKEYS) == 0) {
+            stack[sp++] = node;
+            node = ((PP_T *) node)->left;
+            continue;
+        }
+        if (node == NULL)
+            node = stack[--sp];
+        memcpy (pos, node + skip, len);
+        pos += len;
+        if (pos - buf >= RDB_SAVE_BUF) {
+            rc = _rdb_write_all (fd, buf, pos - buf);
+            pos = buf;
+        }
+        node = ((PP_T *) node)->right;      // lists link index 0 the same way
+    }
+    if (rc == 0 && pos != buf)
+        rc = _rdb_write_all (fd, buf, pos - buf);
+    return rc ? -1 : count;
+}
+
+// Write all records of pool to fd. Returns the number written, or -1
+long rdb_save (rdb_pool_t *pool, int fd)
+{
+    void    *buf;
+    long    count;
 
-            //TODO should be pool->get_fn? make a test with p_str
-            if ((rc = pool->fn[lookupIndex] (dataHead + 
-                    pool->key_offset[lookupIndex], (void *) data + 
-                            (pool->key_offset[lookupIndex]))) != 0) {
-retest_delete_cond:
-                debug("Delete:compare: (%d) idx (%d)\n", rc, lookupIndex);
-                rc2 = 0;
+    if (_rdb_save_check (pool))
+        return -1;
+    buf = rdb_alloc (RDB_SAVE_BUF + pool->record_size);
+    if (buf == NULL)
+        return rdb_error_code (-1, RDB_E_NOMEM, "rdb_save: out of memory");
+
+    // writers are held off for the whole stream, readers carry on
+    _rdb_ts_update_lock (pool);
+    count = _rdb_save (pool, fd, buf);
+    _rdb_ts_update_unlock (pool);
+
+    rdb_free (buf);
+    if (count < 0)
+        return rdb_error_code (-1, RDB_E_IO, "rdb_save: write failed");
+    return count;
+}
 
-                if (rc < 0) {
-                    // Left child
-                    debug("D:left Child!\n");
+// rDB internal: balanced tree of index idx over sorted recs[lo, hi).
+// returns its root, sets *height.
+static void *_rdb_build (rdb_pool_t *pool, int idx, void **recs, size_t lo,
+        size_t hi, int *height)
+{
+    PP_T    *pp;
+    size_t  mid;
+    int     hl, hr;
 
-                    if (ppkDead->left == NULL) {
-                        return 0;
-                    }
+    if (lo >= hi) {
+        *height = 0;
+        return NULL;
+    }
+    mid = lo + (hi - lo) / 2;
+    pp = recs[mid] + sizeof (PP_T) * idx;
+    pp->left = _rdb_build (pool, idx, recs, lo, mid, &hl);
+    pp->right = _rdb_build (pool, idx, recs, mid + 1, hi, &hr);
+    pp->balance = hr - hl;
+    *height = (hl > hr ? hl : hr) + 1;
+    return recs[mid];
+}
 
-                    rc2 = _rdb_delete (pool, lookupIndex, data, ppkDead->left,
-                                                    dataHead, RDB_TREE_LEFT);
-                    debug("(L)My Bal After  %d %d\n", ppkDead->balance, rc2);
-                }
-                else if (rc > 0) {
-                    // Right child
-                    debug("D:right Child!\n");
+// rDB internal: link recs, in that order, as index idx
+static int _rdb_load_index (rdb_pool_t *pool, int idx, void **recs, 
+        void **tmp, size_t n)
+{
+    PP_T    *pp, *prev = NULL;
+    size_t  i;
+    int     height;
+
+    if ((pool->FLAGS[idx] & RDB_NOKEYS) == 0) {
+        if (idx)
+            _rdb_sort (pool, idx, recs, tmp, n, 0);
+        for (i = 1; i < n; i++)
+            if (pool->fn[idx] (recs[i - 1] + pool->key_offset[idx], 
+                               recs[i] + pool->key_offset[idx]) <= 0)
+                return rdb_error_value (-1, "rdb_load: duplicate or unsorted"
+                        " key");
+        pool->root[idx] = _rdb_build (pool, idx, recs, 0, n, &height);
+        return 0;
+    }
 
-                    if (ppkDead->right == NULL) {
-                        return 0;
-                    }
+    // lists: root to tail through right, back through left. rdb_save 
+    // streams them root first, LIFO stacks top first, so both link in order
+    for (i = 0; i < n; i++) {
+        pp = recs[i] + sizeof (PP_T) * idx;
+        pp->left = prev;
+        pp->right = NULL;
+        pp->balance = 0;
+        if (prev)
+            prev->right = pp;
+        else
+            pool->root[idx] = (void *) pp - sizeof (PP_T) * idx;
+        prev = pp;
+    }
+    pool->tail[idx] = prev ? (void *) prev - sizeof (PP_T) * idx : NULL;
+    return 0;
+}
 
-                    rc2 = _rdb_delete (pool, lookupIndex, data, ppkDead->right,
-                                                    dataHead, RDB_TREE_RIGHT);
-                    debug("(R)My Bal After  %d %d\n", ppkDead->balance, rc2);
-                }
+// Read records saved by rdb_save into pool, which must be empty and 
+// defined the same way. Returns the number loaded, or -1 (pool left empty)
+long rdb_load (rdb_pool_t *pool, int fd)
+{
+    rdb_save_hdr_t  hdr;
+    void            **recs = NULL, *buf = NULL, *pos = NULL;
+    size_t          skip, len, i, n, got = 0, chunk = 0, left;
+    int             idx, rc = -1;
 
-                if (PARENT_BAL_CNG == rc2) { // And I am the parent...
-                    ppkParent = (PP_T *) parent + lookupIndex;
-                    ppkParent = parent + lookupIndex;
-                    debug("- bal  to be changed = %d\n", ppkDead->balance);
-                    // If on right side then add -1 - subtract one form balance
-                    ppkDead->balance += (rc > 0) ? -1 : 1;
-                    debug("- bal changed = %d\n", ppkDead->balance);
+    if (_rdb_save_check (pool))
+        return -1;
+    if (pool->root[0] != NULL)
+        return rdb_error_value (-1, "rdb_load: pool is not empty");
+    if (_rdb_read_all (fd, &hdr, sizeof (hdr)) || 
+            hdr.magic != RDB_SAVE_MAGIC || hdr.version != RDB_SAVE_VERSION)
+        return rdb_error_value (-1, "rdb_load: not an rDB save stream");
+    if (hdr.indexCount != pool->indexCount || 
+            hdr.record_size != pool->record_size ||
+            memcmp (hdr.FLAGS, pool->FLAGS, sizeof (hdr.FLAGS)) ||
+            memcmp (hdr.key_offset, pool->key_offset, sizeof (hdr.key_offset)))
+        return rdb_error_value (-1, "rdb_load: saved pool does not match");
+
+    skip = sizeof (PP_T) * pool->indexCount;
+    len = pool->record_size - skip;
+    // index 0 order, a working copy, and merge sort space
+    n = hdr.count;
+    recs = rdb_alloc (sizeof (void *) * 3 * (n + 1));
+    buf = rdb_alloc (RDB_SAVE_BUF + len);
+    if (recs == NULL || buf == NULL) {
+        rdb_error_code (0, RDB_E_NOMEM, "rdb_load: out of memory");
+        goto out;
+    }
 
-                    if (ppkDead->balance == -1 || ppkDead->balance == 1) {
-                        // We moved from balance to -1 or +1 after delete, 
-                        // nothing more we need to do
-                        return 0;
-                    } else if (ppkDead->balance == 0) {
-                        // We transitioned to zero by delete, need to keep 
-                        // balancing up
-                        return PARENT_BAL_CNG;  
-                    } else if (ppkDead->balance < -1) {
-                        // Left case rotare
-                        debug("Some left rotation ppkDead->left=%p\n", 
-                                                            ppkDead->left);
-                        ppkRotate = (PP_T *) ppkDead->left + lookupIndex;
+    for (i = 0; i < n; i++) {
+        if (chunk == 0) {
+            left = (n - i) * len;
+            chunk = (RDB_SAVE_BUF > len) ? RDB_SAVE_BUF - RDB_SAVE_BUF % len :
+                                                                        len;
+            if (chunk > left)
+                chunk = left;
+            if (_rdb_read_all (fd, buf, chunk)) {
+                rdb_error_code (0, RDB_E_IO, "rdb_load: short read");
+                goto out;
+            }
+            pos = buf;
+        }
+        if (pool->mmap)
+            recs[i] = rdb_mmap_alloc (pool);
+        else
+            recs[i] = rdb_alloc (pool->record_size);
+        if (recs[i] == NULL) {
+            rdb_error_code (0, RDB_E_NOMEM, "rdb_load: out of memory");
+            goto out;
+        }
+        got++;
+        memset (recs[i], 0, skip);
+        memcpy (recs[i] + skip, pos, len);
+        pos += len;
+        chunk -= len;
+    }
 
-                        if (ppkRotate->balance < 1) {
-                            // Left left rotate
-                            debug ("Left Left Rotate\n");
+    _rdb_ts_lock_all (pool);
+    for (idx = 0; idx < pool->indexCount; idx++) {
+        if (pool->FLAGS[idx] == 0)
+            continue;
+        memcpy (recs + n, recs, sizeof (void *) * n);
+        if (_rdb_load_index (pool, idx, recs + n, recs + 2 * n, n)) {
+            for (idx = 0; idx < pool->indexCount; idx++)
+                pool->root[idx] = pool->tail[idx] = NULL;
+            _rdb_ts_unlock_all (pool);
+            goto out;
+        }
+    }
+#ifdef RDB_POOL_COUNTERS
+    RDB_COUNT_SET (pool, n);
+    _rdb_mem_peak (pool);
+#endif
+    _rdb_ts_unlock_all (pool);
+    rc = 0;
+
+out:
+    if (rc)
+        for (i = 0; i < got; i++)
+            _rdb_free_data_now (pool, recs[i]);
+    if (recs) rdb_free (recs);
+    if (buf) rdb_free (buf);
+    return rc ? -1 : (long) n;
+}
+#endif
 
-                            if (parent) {
-                                ppkParent = (PP_T *) parent + lookupIndex;
+#ifndef KM
+/* Write-ahead log
+ *
+ * rdb_wal_open() attaches a log file to a pool. Inserts and deletes (so
+ * also moves, batches, bulk inserts and iterate deletes) append the
+ * record's user part to an in-memory buffer, flushes append a marker.
+ *
+ * Group commit: whoever needs the log on disk - rdb_wal_commit(), a full
+ * buffer, or every write in RDB_WAL_SYNC mode - becomes the leader if no
+ * write is in flight, takes the whole buffer, writes and fdatasyncs it.
+ * Anyone arriving meanwhile waits and is covered by the next round, so one
+ * fdatasync serves every operation that queued up behind the previous one.
+ *
+ * Appends never write: a buffer past RDB_WAL_BUF_MAX is written out by
+ * the writer's RDB_WAL_WAIT, once the pool lock is dropped.
+ *
+ * rdb_insert_one / rdb_delete_one log the record with the index they
+ * changed. Replay finds the record by its key in that index (delete) or in
+ * one of the others (insert), so a re-key replays as it happened.
+ */
 
-                                if (!side)      //RDB_TREE_LEFT
-                                    ppkParent->left = ppkDead->left;
-                                else ppkParent->right = ppkDead->left;
-                            } else pool->root[lookupIndex] = ppkDead->left;
+#define RDB_WAL_MAGIC       0x72444277616c3031ULL      // "rDBwal01"
+#define RDB_WAL_BUF_MAX     (4 << 20)                   // write out beyond
+
+typedef struct rdb_wal_entry_s {
+    uint32_t    len;                    // payload bytes
+    uint32_t    sum;                    // FNV-1a of op and payload
+    uint32_t    op;
+    uint32_t    pad;
+} rdb_wal_entry_t;
+
+typedef struct rdb_wal_s {
+    int             fd;
+    int             flags;
+    pthread_mutex_t lock;
+    pthread_cond_t  done;
+    char            *buf,               // being appended to
+                    *spare;             // being written by the leader
+    size_t          len, 
+                    size, 
+                    spare_size;
+    uint64_t        lsn;                // bytes appended
+    uint64_t        durable;            // bytes written and synced
+    int             flushing;
+    int             error;
+} rdb_wal_t;
+
+static uint32_t _rdb_wal_sum (uint32_t op, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    uint32_t            h = 2166136261u ^ op;
 
-                            ppkDead->left = ppkRotate->right;
-                            ppkRotate->right = dataHead;
-                            ppkDead->balance = -1 * (ppkRotate->balance + 1);
-                            ppkRotate->balance = (ppkRotate->balance + 1);
-                            ppkDead = ppkRotate;
+    while (len--)
+        h = (h ^ *p++) * 16777619u;
+    return h;
+}
 
-                            if (ppkRotate->balance == -1 || 
-                                    ppkRotate->balance == 1) return 0;
-                            else return PARENT_BAL_CNG;
+// rDB internal: write and sync everything up to target. wal->lock held.
+static int _rdb_wal_sync (rdb_wal_t *wal, uint64_t target)
+{
+    char        *buf;
+    size_t      len;
+    uint64_t    end;
+    int         rc;
+
+    while (wal->durable < target && !wal->error) {
+        if (wal->flushing) {
+            pthread_cond_wait (&wal->done, &wal->lock);
+            continue;
+        }
+        // lead: take the whole buffer, let appends go on into the spare
+        buf = wal->buf;
+        len = wal->len;
+        end = wal->lsn;
+        wal->buf = wal->spare;
+        wal->spare = buf;
+        wal->spare_size ^= wal->size;
+        wal->size ^= wal->spare_size;
+        wal->spare_size ^= wal->size;
+        __atomic_store_n (&wal->len, 0, __ATOMIC_RELAXED);
+        wal->flushing = 1;
+        rdb_sem_unlock (&wal->lock);
+
+        rc = _rdb_write_all (wal->fd, buf, len);
+        if (rc == 0)
+            rc = fdatasync (wal->fd);
+
+        rdb_sem_lock (&wal->lock);
+        wal->flushing = 0;
+        if (rc)
+            wal->error = 1;
+        else
+            wal->durable = end;
+        pthread_cond_broadcast (&wal->done);
+    }
+    return wal->error ? -1 : 0;
+}
 
-                        }
-                        else {
-                            // Left right
+static void _rdb_wal_append (rdb_pool_t *pool, int op, void *rec)
+{
+    rdb_wal_t       *wal = pool->wal;
+    rdb_wal_entry_t ent;
+    size_t          skip = sizeof (PP_T) * pool->indexCount;
+    size_t          need, size;
+    char            *buf;
+
+    ent.op = op;
+    ent.len = rec ? pool->record_size - skip : 0;
+    ent.sum = _rdb_wal_sum (op, rec + skip, ent.len);
+    ent.pad = 0;
+    need = sizeof (ent) + ent.len;
+
+    rdb_sem_lock (&wal->lock);
+    if (wal->len + need > wal->size) {
+        for (size = wal->size * 2; size < wal->len + need; size *= 2);
+        buf = rdb_alloc (size);
+        if (buf == NULL) {
+            wal->error = 1;
+            rdb_sem_unlock (&wal->lock);
+            rdb_error_code (0, RDB_E_NOMEM,
+                    "rdb_wal: out of memory, log is broken");
+            return;
+        }
+        memcpy (buf, wal->buf, wal->len);
+        rdb_free (wal->buf);
+        wal->buf = buf;
+        wal->size = size;
+    }
+    memcpy (wal->buf + wal->len, &ent, sizeof (ent));
+    if (ent.len)
+        memcpy (wal->buf + wal->len + sizeof (ent), rec + skip, ent.len);
+    // read unlocked by _rdb_wal_wait
+    __atomic_store_n (&wal->len, wal->len + need, __ATOMIC_RELAXED);
+    wal->lsn += need;
+    rdb_sem_unlock (&wal->lock);
+}
 
-                            debug ("Left Right Rotate\n");
-                            ppkBottom = (void *) ppkRotate->right + 
-                                    (sizeof (PP_T) * lookupIndex);
+// rDB internal: RDB_WAL_WAIT, pool lock dropped. waits for the disk in 
+// RDB_WAL_SYNC mode, writes out a full buffer unless a write is on its way
+static void _rdb_wal_wait (rdb_pool_t *pool)
+{
+    rdb_wal_t *wal = pool->wal;
 
-                            if (ppkBottom->balance > 0) {
-                                ppkDead->balance = 0;
-                                ppkRotate->balance = -1;
-                            }
-                            else if (ppkBottom->balance == 0) {
-                                ppkDead->balance = 0;
-                                ppkRotate->balance = 0;
-                            }
-                            else {
-                                ppkDead->balance = 1;
-                                ppkRotate->balance = 0;
-                            }
+    if ((wal->flags & RDB_WAL_SYNC) == 0 &&
+            __atomic_load_n (&wal->len, __ATOMIC_RELAXED) < RDB_WAL_BUF_MAX)
+        return;
+    rdb_sem_lock (&wal->lock);
+    if (wal->flags & RDB_WAL_SYNC || 
+            (wal->len >= RDB_WAL_BUF_MAX && !wal->flushing))
+        _rdb_wal_sync (wal, wal->lsn);
+    rdb_sem_unlock (&wal->lock);
+}
 
-                            ppkBottom->balance = 0;
+// Make every mutation logged so far durable. Returns 0, or -1 if the log
+// could not be written.
+int rdb_wal_commit (rdb_pool_t *pool)
+{
+    rdb_wal_t   *wal = pool->wal;
+    int         rc;
+
+    if (wal == NULL)
+        return rdb_error_value (-1, "rdb_wal_commit: pool has no log");
+    rdb_sem_lock (&wal->lock);
+    rc = _rdb_wal_sync (wal, wal->lsn);
+    rdb_sem_unlock (&wal->lock);
+    return rc ? rdb_error_code (-1, RDB_E_IO,
+                                        "rdb_wal_commit: log write failed") : 0;
+}
 
-                            ppkRotate->right = ppkBottom->left;
-                            ppkBottom->left = ppkRotate - lookupIndex;
-                            ppkDead->left = ppkBottom->right;
-                            ppkBottom->right = dataHead;
-                            ppkDead = ppkBottom;
+// rDB internal: apply and free what a replay batch collected so far
+static int _rdb_wal_apply (rdb_pool_t *pool, rdb_batch_t *batch)
+{
+    int i, rc = 0;
 
-                            if (parent) {
-                                ppkParent = (void *) parent + (sizeof (PP_T) *
-                                                                lookupIndex);
+    if (batch->count && rdb_batch_commit (batch) < 0) {
+        rc = -1;
+        // nothing was applied, inserted records are still ours
+        for (i = 0; i < batch->count; i++)
+            if (batch->ops[i].op == RDB_BATCH_INSERT)
+                _rdb_free_data_now (pool, batch->ops[i].data);
+    }
+    else
+        for (i = 0; i < batch->count; i++)
+            if (batch->ops[i].op == RDB_BATCH_DELETE)
+                _rdb_free_data (pool, batch->ops[i].rec);
+    rdb_batch_reset (batch);
+    return rc;
+}
 
-                                if (!side)      //RDB_TREE_LEFT
-                                    ppkParent->left = ppkBottom - lookupIndex;
-                                else
-                                    ppkParent->right = ppkBottom - lookupIndex;
-                            }
-                            else {
-                                pool->root[lookupIndex] =  ppkBottom - 
-                                                                lookupIndex;
-                            }
+// rDB internal: is rec linked in index idx
+static int _rdb_wal_linked (rdb_pool_t *pool, int idx, void *rec)
+{
+    void    *node;
 
-                            return PARENT_BAL_CNG;
-                        }
-                    }
-                    else if (ppkDead->balance > 1) {
-                        // Rotate
-                        ppkRotate = (PP_T *) ppkDead->right + lookupIndex;
+    if (pool->FLAGS[idx] == 0)
+        return 0;
+    if ((pool->FLAGS[idx] & RDB_NOKEYS) == 0)
+        return rdb_get (pool, idx, rec + pool->key_offset[idx]) == rec;
+    for (node = pool->root[idx]; node && node != rec; ) {
+        node = ((PP_T *) (node + sizeof (PP_T) * idx))->right;
+        if (node)
+            node -= sizeof (PP_T) * idx;
+    }
+    return node != NULL;
+}
 
-                        if (ppkRotate->balance > -1) {
-                            // Right right rotate
-                            debug ("Right Right Rotate, parent = %p,index=%d\n",
-                                                (unsigned) parent, lookupIndex);
+// rDB internal: the record image was logged for, by its key in index idx
+// (lists: by the whole image)
+static void *_rdb_wal_find (rdb_pool_t *pool, int idx, const char *image)
+{
+    size_t  skip = sizeof (PP_T) * pool->indexCount;
+    void    *node;
 
-                            if (parent != NULL) {
-                                debug ("parent exist\n");
-                                ppkParent = (void *) parent + (sizeof (PP_T) * 
-                                                                lookupIndex);
+    if (pool->FLAGS[idx] == 0)
+        return NULL;
+    if ((pool->FLAGS[idx] & RDB_NOKEYS) == 0)
+        return rdb_get (pool, idx, image + pool->key_offset[idx] - skip);
+    for (node = pool->root[idx]; node; ) {
+        if (memcmp (node + skip, image, pool->record_size - skip) == 0)
+            return node;
+        node = ((PP_T *) (node + sizeof (PP_T) * idx))->right;
+        if (node)
+            node -= sizeof (PP_T) * idx;
+    }
+    return NULL;
+}
 
-                                if (!side)      //RDB_TREE_LEFT
-                                    ppkParent->left = ppkDead->right;
-                                else
-                                    ppkParent->right = ppkDead->right;
-                            }
-                            else
-                                pool->root[lookupIndex] = ppkDead->right;
+// rDB internal: replay an rdb_insert_one / rdb_delete_one entry. The 
+// record is looked up as the caller had it, keys of the other indexes 
+// unchanged; one left in no index is freed, one found in none is new.
+static int _rdb_wal_one (rdb_pool_t *pool, uint32_t op, const char *image)
+{
+    size_t  skip = sizeof (PP_T) * pool->indexCount;
+    void    *rec = NULL;
+    int     idx = op >> 8, j;
+
+    if ((op & 0xff) == RDB_WAL_DELETE_ONE) {
+        rec = _rdb_wal_find (pool, idx, image);
+        if (rec == NULL || rdb_delete_one (pool, idx, rec) < 0)
+            return rdb_error_value (-1, "rdb_wal_open: delete_one target "
+                    "not found");
+        for (j = 0; j < pool->indexCount; j++)
+            if (_rdb_wal_linked (pool, j, rec))
+                return 0;
+        _rdb_free_data_now (pool, rec);
+        return 0;
+    }
 
-                            ppkDead->right = ppkRotate->left;
-                            ppkRotate->left = dataHead; 
-                            ppkDead->balance = -1 * (ppkRotate->balance - 1);
-                            ppkRotate->balance = (ppkRotate->balance - 1);
-                            ppkDead = ppkRotate;
+    for (j = 0; j < pool->indexCount && rec == NULL; j++) {
+        if (j == idx || pool->FLAGS[j] & RDB_NOKEYS)
+            continue;
+        rec = _rdb_wal_find (pool, j, image);
+        if (rec && _rdb_wal_linked (pool, idx, rec))
+            rec = NULL;                 // another record with that key
+    }
+    if (rec == NULL) {
+        rec = pool->mmap ? rdb_mmap_alloc (pool) : 
+                                    rdb_alloc (pool->record_size);
+        if (rec == NULL)
+            return rdb_error_code (-1, RDB_E_NOMEM,
+                    "rdb_wal_open: out of memory");
+        memset (rec, 0, skip);
+        memcpy (rec + skip, image, pool->record_size - skip);
+        if (rdb_insert_one (pool, idx, rec) >= 0)
+            return 0;
+        _rdb_free_data_now (pool, rec);
+    } else {
+        memcpy (rec + skip, image, pool->record_size - skip);
+        if (rdb_insert_one (pool, idx, rec) >= 0)
+            return 0;
+    }
+    return rdb_error_value (-1, "rdb_wal_open: insert_one refused");
+}
 
-                            if (ppkRotate->balance == -1 || 
-                                            ppkRotate->balance == 1) return 0;
-                            else return PARENT_BAL_CNG;
+// rDB internal: replay the log into pool, returns the length of the valid
+// part of the log (a torn tail is cut off by the caller), or -1.
+static off_t _rdb_wal_replay (rdb_pool_t *pool, int fd, long *applied)
+{
+    rdb_batch_t     batch;
+    rdb_wal_entry_t ent;
+    char            *buf, *pos, *end;
+    size_t          skip = sizeof (PP_T) * pool->indexCount;
+    size_t          key = pool->key_offset[0] - skip;
+    off_t           valid = sizeof (uint64_t);
+    ssize_t         got;
+    void            *rec;
+    int             eof = 0, rc = 0;
+
+    buf = rdb_alloc (RDB_SAVE_BUF);
+    if (buf == NULL || rdb_batch_init (&batch, pool)) {
+        if (buf) rdb_free (buf);
+        return rdb_error_code (-1, RDB_E_NOMEM, "rdb_wal_open: out of memory");
+    }
+    pos = end = buf;
 
-                        }
-                        else {
-                            // Right left case
-                            debug ("Right Left Rotate\n");
-                            ppkBottom = (void *) ppkRotate->left + 
-                                                (sizeof (PP_T) * lookupIndex);
+    while (rc == 0) {
+        // keep a whole entry in the buffer
+        if (!eof && (size_t) (end - pos) < sizeof (ent) + pool->record_size) {
+            // keys of pending deletes point into the buffer
+            if ((rc = _rdb_wal_apply (pool, &batch)))
+                break;
+            memmove (buf, pos, end - pos);
+            end = buf + (end - pos);
+            pos = buf;
+            got = read (fd, end, RDB_SAVE_BUF - (end - buf));
+            if (got < 0 && errno == EINTR)
+                continue;
+            if (got <= 0)
+                eof = 1;
+            else
+                end += got;
+            continue;
+        }
+        if ((size_t) (end - pos) < sizeof (ent))
+            break;
+        memcpy (&ent, pos, sizeof (ent));
+        if ((ent.len != 0 && ent.len != pool->record_size - skip) ||
+                (size_t) (end - pos) < sizeof (ent) + ent.len ||
+                ent.sum != _rdb_wal_sum (ent.op, pos + sizeof (ent), ent.len))
+            break;                                  // torn tail
+        pos += sizeof (ent);
+
+        if (ent.op == RDB_WAL_INSERT && ent.len) {
+            if (pool->mmap)
+                rec = rdb_mmap_alloc (pool);
+            else
+                rec = rdb_alloc (pool->record_size);
+            if (rec == NULL) {
+                rc = rdb_error_code (-1, RDB_E_NOMEM,
+                        "rdb_wal_open: out of memory");
+                break;
+            }
+            memset (rec, 0, skip);
+            memcpy (rec + skip, pos, ent.len);
+            if (rdb_batch_insert (&batch, rec) < 0) {
+                _rdb_free_data_now (pool, rec);
+                rc = -1;
+                break;
+            }
+        }
+        else if (ent.op == RDB_WAL_DELETE && ent.len) {
+            if (rdb_batch_delete (&batch, 0, (pool->FLAGS[0] & RDB_NOKEYS) ? 
+                                                    NULL : pos + key) < 0) {
+                rc = -1;
+                break;
+            }
+        }
+        else if (ent.op == RDB_WAL_FLUSH) {
+            if ((rc = _rdb_wal_apply (pool, &batch)) == 0)
+                rdb_flush (pool, NULL, NULL);
+        }
+        else if (((ent.op & 0xff) == RDB_WAL_INSERT_ONE || 
+                  (ent.op & 0xff) == RDB_WAL_DELETE_ONE) && ent.len &&
+                  (ent.op >> 8) < (uint32_t) pool->indexCount) {
+            if ((rc = _rdb_wal_apply (pool, &batch)) == 0)
+                rc = _rdb_wal_one (pool, ent.op, pos);
+            if (rc)
+                break;
+        }
+        else
+            break;
+        (*applied)++;
+        pos += ent.len;
+        valid += sizeof (ent) + ent.len;
+    }
+    if (rc == 0)
+        rc = _rdb_wal_apply (pool, &batch);
+    rdb_batch_free (&batch);
+    rdb_free (buf);
+    return rc ? -1 : valid;
+}
 
-                            if (ppkBottom->balance < 0) {
-                                ppkDead->balance = 0;
-                                ppkRotate->balance = 1;
-                            }
-                            else if (ppkBottom->balance == 0) {
-                                ppkDead->balance = 0;
-                                ppkRotate->balance = 0;
-                            }
-                            else {
-                                ppkDead->balance = -1;
-                                ppkRotate->balance = 0;
-                            }
+// Attach the log at path to pool, replaying whatever it holds first (the
+// pool should be empty, or hold the checkpoint the log was truncated at).
+// flags: RDB_WAL_SYNC makes every logged operation wait for the disk.
+// Returns the number of entries replayed, or -1.
+long rdb_wal_open (rdb_pool_t *pool, const char *path, int flags)
+{
+    rdb_wal_t   *wal;
+    uint64_t    magic;
+    off_t       valid;
+    long        applied = 0;
+    int         fd;
 
-                            ppkBottom->balance = 0;
+    if (_rdb_save_check (pool))
+        return -1;
+    if (pool->wal)
+        return rdb_error_value (-1, "rdb_wal_open: pool already has a log");
 
-                            ppkRotate->left = ppkBottom->right;
-                            ppkBottom->right = ppkRotate - lookupIndex;
-                            ppkDead->right = ppkBottom->left;
-                            ppkBottom->left = dataHead; //ppk;
-                            ppkDead = ppkBottom;
+    if ((fd = open (path, O_RDWR | O_CREAT, 0644)) < 0)
+        return rdb_error_code (-1, RDB_E_IO, "rdb_wal_open: can not open log");
 
-                            if (parent) {
-                                ppkParent = (void *) parent + (sizeof (PP_T) * 
-                                                                lookupIndex);
+    if (_rdb_read_all (fd, &magic, sizeof (magic)) == 0) {
+        if (magic != RDB_WAL_MAGIC) {
+            close (fd);
+            return rdb_error_value (-1, "rdb_wal_open: not an rDB log");
+        }
+        if ((valid = _rdb_wal_replay (pool, fd, &applied)) < 0) {
+            close (fd);
+            return -1;
+        }
+    }
+    else {
+        // new (or empty) log
+        magic = RDB_WAL_MAGIC;
+        if (ftruncate (fd, 0) || lseek (fd, 0, SEEK_SET) ||
+                _rdb_write_all (fd, &magic, sizeof (magic))) {
+            close (fd);
+            return rdb_error_code (-1, RDB_E_IO,
+                    "rdb_wal_open: can not write log");
+        }
+        valid = sizeof (magic);
+    }
+    // drop a torn tail, append from there
+    if (ftruncate (fd, valid) || lseek (fd, valid, SEEK_SET) != valid ||
+            fdatasync (fd)) {
+        close (fd);
+        return rdb_error_code (-1, RDB_E_IO,
+                    "rdb_wal_open: can not write log");
+    }
+
+    wal = rdb_alloc (sizeof (rdb_wal_t));
+    if (wal == NULL) {
+        close (fd);
+        return rdb_error_code (-1, RDB_E_NOMEM, "rdb_wal_open: out of memory");
+    }
+    memset (wal, 0, sizeof (rdb_wal_t));
+    wal->fd = fd;
+    wal->flags = flags;
+    wal->size = wal->spare_size = 64 * 1024;
+    wal->buf = rdb_alloc (wal->size);
+    wal->spare = rdb_alloc (wal->spare_size);
+    if (wal->buf == NULL || wal->spare == NULL) {
+        if (wal->buf) rdb_free (wal->buf);
+        if (wal->spare) rdb_free (wal->spare);
+        rdb_free (wal);
+        close (fd);
+        return rdb_error_code (-1, RDB_E_NOMEM, "rdb_wal_open: out of memory");
+    }
+    pthread_mutex_init (&wal->lock, NULL);
+    pthread_cond_init (&wal->done, NULL);
 
-                                if (!side)      //RDB_TREE_LEFT
-                                    ppkParent->left = ppkBottom - lookupIndex;
-                                else
-                                    ppkParent->right = ppkBottom - lookupIndex;
-                            }
-                            else {
-                                pool->root[lookupIndex] = ppkBottom - 
-                                                                lookupIndex;
-                            }
+    _rdb_ts_lock_all (pool);
+    pool->wal = wal;
+    _rdb_ts_unlock_all (pool);
+    return applied;
+}
 
-                            return PARENT_BAL_CNG;
-                        }
-                    }
+// Empty the log, once the pool is checkpointed (rdb_save) elsewhere. hold
+// rdb_lock() on pools that are not RDB_POOL_THREADSAFE.
+int rdb_wal_truncate (rdb_pool_t *pool)
+{
+    rdb_wal_t   *wal = pool->wal;
+    int         rc;
+
+    if (wal == NULL)
+        return rdb_error_value (-1, "rdb_wal_truncate: pool has no log");
+    _rdb_ts_lock_all (pool);
+    rdb_sem_lock (&wal->lock);
+    while (wal->flushing)
+        pthread_cond_wait (&wal->done, &wal->lock);
+    __atomic_store_n (&wal->len, 0, __ATOMIC_RELAXED);
+    wal->durable = wal->lsn;
+    rc = ftruncate (wal->fd, sizeof (uint64_t)) || 
+            lseek (wal->fd, sizeof (uint64_t), SEEK_SET) < 0 ||
+            fdatasync (wal->fd);
+    rdb_sem_unlock (&wal->lock);
+    _rdb_ts_unlock_all (pool);
+    return rc ? rdb_error_code (-1, RDB_E_IO, "rdb_wal_truncate: failed") : 0;
+}
 
-                }
-            }
-            else {
-                debug("Delete:compare:- _%d_ idx _%d_ ppkDead = %x\n", rc, 
-                                    lookupIndex, (unsigned) ppkDead);
+// Commit and detach the log
+int rdb_wal_close (rdb_pool_t *pool)
+{
+    rdb_wal_t   *wal = pool->wal;
+    int         rc;
+
+    if (wal == NULL)
+        return rdb_error_value (-1, "rdb_wal_close: pool has no log");
+    rc = rdb_wal_commit (pool);
+    _rdb_ts_lock_all (pool);
+    pool->wal = NULL;
+    _rdb_ts_unlock_all (pool);
+
+    close (wal->fd);
+    pthread_mutex_destroy (&wal->lock);
+    pthread_cond_destroy (&wal->done);
+    rdb_free (wal->buf);
+    rdb_free (wal->spare);
+    rdb_free (wal);
+    return rc;
+}
+#endif
 
-                if (ppkDead->right != NULL && ppkDead->left != NULL) { 
-                    // we need to perform a pre-delete swap!
-                    PP_T *ppkTemp;
+#ifndef KM
+/* Operation capture
+ *
+ * rdb_capture_start() logs every rdb_insert, rdb_get / rdb_get_const,
+ * rdb_delete and rdb_iterate call on a pool to a file, with the key bytes,
+ * index, result and time of each, for rdb_replay to run again offline.
+ * Records deleted by an iterate callback are logged as deletes. Events go
+ * to a buffer that is written out when it reaches RDB_CAPTURE_BUF_MAX and
+ * on rdb_capture_stop(). After a failed write or allocation nothing more
+ * is logged, and rdb_capture_stop() reports the failure.
+ *
+ * Writers are logged under the pool's update lock, so inserts, deletes and
+ * iterates are in the order they were applied. A lookup is logged under
+ * its index lock only: one racing a writer on another thread may be
+ * logged on either side of it, and replay may count it as a mismatch.
+ */
 
-                    debug("Rotate 1 ppkDead %x\n", (unsigned) ppkDead);
-                    ppkRotate = (PP_T *) ppkDead->right + lookupIndex;
-                    ppkTemp = NULL;
+#define RDB_CAPTURE_BUF_MAX (1 << 20)
 
-                    if (ppkRotate->left) {
-                        while (ppkRotate->left) {
-                            ppkTemp   = ppkRotate;
-                            ppkRotate = (PP_T *) ppkRotate->left + lookupIndex;
-                        }
+typedef struct rdb_capture_s {
+    int             fd;
+    pthread_mutex_t lock;
+    char            *buf;
+    size_t          len,
+                    size;
+    uint64_t        t0;
+    int32_t         key_size[RDB_POOL_MAX_IDX];
+    int             error;
+} rdb_capture_t;
 
-                        // Here we have the smallest element of the right tree, 
-                        // now we need to perform the swap
-                        if (parent) {
-                            ppkParent = (PP_T *) parent + lookupIndex;
-                            debug("D:We have a parent\n");
+static uint64_t _rdb_capture_now (void)
+{
+    struct timespec ts;
 
-                            if (side) ppkParent->right = (PP_T *) ppkRotate - 
-                                                                    lookupIndex;
-                            else ppkParent->left = (PP_T *) ppkRotate - 
-                                                                    lookupIndex;
-                        }
-                        else pool->root[lookupIndex] = ppkRotate - lookupIndex;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-                        ppkBottom = ppkDead->right;
-                        ppkDead->right = ppkRotate->right;
-                        ppkRotate->right = ppkBottom;
+// rDB internal: append len bytes to the buffer. cap->lock held
+static void _rdb_capture_put (rdb_capture_t *cap, const void *data, 
+        size_t len)
+{
+    size_t  size;
+    char    *buf;
 
-                        ppkBottom = ppkDead->left;
-                        ppkDead->left = ppkRotate->left;
-                        ppkRotate->left = ppkBottom;
+    if (cap->error)
+        return;
+    if (cap->len + len > cap->size) {
+        for (size = cap->size * 2; size < cap->len + len; size *= 2);
+        buf = rdb_alloc (size);
+        if (buf == NULL) {
+            cap->error = 1;
+            cap->len = 0;
+            return;
+        }
+        memcpy (buf, cap->buf, cap->len);
+        rdb_free (cap->buf);
+        cap->buf = buf;
+        cap->size = size;
+    }
+    memcpy (cap->buf + cap->len, data, len);
+    cap->len += len;
+}
 
-                        rc = ppkRotate->balance;
-                        ppkRotate->balance = ppkDead->balance;
-                        ppkDead->balance = rc;
+static void _rdb_capture (rdb_pool_t *pool, int op, int idx, 
+        const void *key, int result)
+{
+    rdb_capture_t       *cap = pool->capture;
+    rdb_capture_ev_t    ev;
+    const void          *k[RDB_POOL_MAX_IDX];
+    uint32_t            len[RDB_POOL_MAX_IDX];
+    int                 i, n = 0, from = idx, to = idx + 1;
+
+    // a whole record: the key of each index, in the form lookups take
+    if (idx < 0) {
+        from = 0;
+        to = key ? pool->indexCount : 0;
+    }
+    for (i = from; i < to; i++) {
+        if (key == NULL || cap->key_size[i] < 0)
+            continue;
+        k[n] = key;
+        if (idx < 0) {
+            k[n] = key + pool->key_offset[i];
+            if (pool->FLAGS[i] & RDB_KPSTR)
+                k[n] = *(char **) k[n];
+        }
+        len[n] = cap->key_size[i] ? cap->key_size[i] : 
+                                            strlen (k[n]) + 1;
+        n++;
+    }
+    ev.ns = _rdb_capture_now () - cap->t0;
+    ev.op = op;
+    ev.idx = idx;
+    ev.result = result;
+    for (ev.len = 0, i = 0; i < n; i++)
+        ev.len += len[i];
+
+    rdb_sem_lock (&cap->lock);
+    _rdb_capture_put (cap, &ev, sizeof (ev));
+    for (i = 0; i < n; i++)
+        _rdb_capture_put (cap, k[i], len[i]);
+    if (cap->len >= RDB_CAPTURE_BUF_MAX) {
+        // on error the buffer is dropped, and stays empty
+        if (_rdb_write_all (cap->fd, cap->buf, cap->len))
+            cap->error = 1;
+        cap->len = 0;
+    }
+    rdb_sem_unlock (&cap->lock);
+}
 
-                        if (ppkTemp) ppkTemp->left = ppkDead - lookupIndex ; 
-                        // if ppkRotate is now root, it has no father
-                    }
-                    else {   
-                        // Special case for root deletion with no left node on 
-                        // right side, we'll just swap ppkDead with ppkRotate
-                        debug("DS: Parent = %x\n", (unsigned) parent);
+// Start logging pool's operations to the file at path (replaced if it
+// exists). Indexes with custom compare functions, and FIFO / LIFO ones,
+// are logged without keys. Returns 0, or -1.
+int rdb_capture_start (rdb_pool_t *pool, const char *path)
+{
+    rdb_capture_t       *cap;
+    rdb_capture_hdr_t   hdr;
+    int                 i, fd;
+
+    if (pool == NULL || path == NULL)
+        return rdb_error_value (-1, "rdb_capture_start: bad argument");
+    if (pool->capture)
+        return rdb_error_value (-1, "rdb_capture_start: already capturing");
+
+    memset (&hdr, 0, sizeof (hdr));
+    hdr.magic = RDB_CAPTURE_MAGIC;
+    hdr.indexCount = pool->indexCount;
+    for (i = 0; i < pool->indexCount; i++) {
+        hdr.FLAGS[i] = pool->FLAGS[i];
+        hdr.key_offset[i] = pool->key_offset[i];
+        hdr.key_size[i] = (pool->FLAGS[i] & RDB_KCF) ? -1 :
+                                        _rdb_key_size (pool->FLAGS[i]);
+    }
+    if ((fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+        return rdb_error_code (-1, RDB_E_IO,
+                "rdb_capture_start: can not open file");
+    if (_rdb_write_all (fd, &hdr, sizeof (hdr))) {
+        close (fd);
+        return rdb_error_code (-1, RDB_E_IO,
+                "rdb_capture_start: can not write file");
+    }
 
-                        if (parent) {
-                            ppkParent = (PP_T *) parent + lookupIndex;
-                            debug("DS: We have a parent\n");
+    cap = rdb_alloc (sizeof (rdb_capture_t));
+    if (cap == NULL) {
+        close (fd);
+        return rdb_error_code (-1, RDB_E_NOMEM, 
+                                    "rdb_capture_start: out of memory");
+    }
+    memset (cap, 0, sizeof (rdb_capture_t));
+    cap->fd = fd;
+    cap->size = 64 * 1024;
+    cap->buf = rdb_alloc (cap->size);
+    if (cap->buf == NULL) {
+        rdb_free (cap);
+        close (fd);
+        return rdb_error_code (-1, RDB_E_NOMEM, 
+                                    "rdb_capture_start: out of memory");
+    }
+    memcpy (cap->key_size, hdr.key_size, sizeof (cap->key_size));
+    pthread_mutex_init (&cap->lock, NULL);
+    cap->t0 = _rdb_capture_now ();
+
+    _rdb_ts_lock_all (pool);
+    __atomic_store_n ((rdb_capture_t **) &pool->capture, cap, 
+                                                        __ATOMIC_RELEASE);
+    _rdb_ts_unlock_all (pool);
+    return 0;
+}
 
-                            if (side) ppkParent->right = (PP_T *) ppkRotate - 
-                                                                    lookupIndex;
-                            else ppkParent->left = (PP_T *) ppkRotate - 
-                                                                    lookupIndex;
-                        }
-                        else pool->root[lookupIndex] = ppkRotate - lookupIndex;
+// Stop capturing and close the file. Pools that are not 
+// RDB_POOL_THREADSAFE must have no call in flight. Returns 0, or -1 if the 
+// file could not be written in full.
+int rdb_capture_stop (rdb_pool_t *pool)
+{
+    rdb_capture_t   *cap = pool->capture;
+    int             rc;
+
+    if (cap == NULL)
+        return rdb_error_value (-1, "rdb_capture_stop: not capturing");
+    _rdb_ts_lock_all (pool);
+    __atomic_store_n (&pool->capture, NULL, __ATOMIC_RELAXED);
+    _rdb_ts_unlock_all (pool);
+
+    rc = cap->error;
+    if (rc == 0 && cap->len)
+        rc = _rdb_write_all (cap->fd, cap->buf, cap->len);
+    if (close (cap->fd))
+        rc = -1;
+    pthread_mutex_destroy (&cap->lock);
+    rdb_free (cap->buf);
+    rdb_free (cap);
+    return rc ? rdb_error_code (-1, RDB_E_IO,
+                                        "rdb_capture_stop: write failed") : 0;
+}
+#endif
 
-                        ppkDead->right = ppkRotate->right;
-                        ppkRotate->right = ppkDead - lookupIndex;
-                        ppkRotate->left = ppkDead->left;
-                        ppkDead->left = NULL;
+#ifndef KM
+/* Background checkpoint
+ *
+ * rdb_checkpoint_bg() holds the pools still only for as long as fork()
+ * takes. The child sees them frozen in its copy-on-write image, streams
+ * them to path as consecutive rdb_save() images (read back with one
+ * rdb_load() per pool, in the same order) and exits; the parent goes on
+ * serving, paying for the pages it touches meanwhile.
+ *
+ * The child of a threaded process must not take locks other threads may
+ * have held at fork time, so the buffer and file names are set up before
+ * forking and the child does nothing but write.
+ */
 
-                        rc = ppkDead->balance;
-                        ppkDead->balance = ppkRotate->balance;
-                        ppkRotate->balance = rc;
+// rDB internal: hold off / let in writers of the listed pools, in address
+// order like rdb_batch_commit
+static void _rdb_checkpoint_lock (rdb_pool_t **pools, int n, int lock)
+{
+    int i, j;
+
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < n && pools[j] != pools[i]; j++);
+        if (j < i)
+            continue;                       // listed twice
+        if (lock)
+            _rdb_ts_update_lock (pools[i]);
+        else
+            _rdb_ts_update_unlock (pools[i]);
+    }
+}
 
+// Checkpoint the NULL terminated pools list to path in a forked child.
+// Pools that are not RDB_POOL_THREADSAFE must be rdb_lock()ed around the
+// call. Returns the child's pid for rdb_checkpoint_wait(), or -1.
+int rdb_checkpoint_bg (rdb_pool_t **pools, const char *path)
+{
+    rdb_pool_t  **sorted;
+    size_t      max = 0;
+    char        *tmp;
+    void        *buf;
+    pid_t       pid;
+    int         n, i, j, fd, rc = 0;
+
+    for (n = 0; pools[n]; n++) {
+        if (_rdb_save_check (pools[n]))
+            return -1;
+        if (pools[n]->mmap)
+            return rdb_error_value (-1, "rdb_checkpoint_bg: mapped pool");
+        if (pools[n]->record_size > max)
+            max = pools[n]->record_size;
+    }
+    if (n == 0)
+        return rdb_error_value (-1, "rdb_checkpoint_bg: no pools");
+
+    // one allocation: sorted[n], buf, tmp path
+    sorted = rdb_alloc (sizeof (void *) * n + RDB_SAVE_BUF + max + 
+                        strlen (path) + 5);
+    if (sorted == NULL)
+        return rdb_error_code (-1, RDB_E_NOMEM,
+                "rdb_checkpoint_bg: out of memory");
+    buf = sorted + n;
+    tmp = buf + RDB_SAVE_BUF + max;
+    sprintf (tmp, "%s.tmp", path);
+    for (i = 0; i < n; i++) {
+        for (j = i; j > 0 && sorted[j - 1] > pools[i]; j--)
+            sorted[j] = sorted[j - 1];
+        sorted[j] = pools[i];
+    }
 
-                    }
+    _rdb_checkpoint_lock (sorted, n, 1);
+    pid = fork ();
+    if (pid == 0) {
+        fd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            _exit (1);
+        for (i = 0; i < n && rc == 0; i++)
+            if (_rdb_save (pools[i], fd, buf) < 0)
+                rc = 1;
+        if (rc == 0 && fsync (fd))
+            rc = 1;
+        close (fd);
+        if (rc == 0 && rename (tmp, path))
+            rc = 1;
+        if (rc)
+            unlink (tmp);
+        _exit (rc);
+    }
+    _rdb_checkpoint_lock (sorted, n, 0);
+    rdb_free (sorted);
 
-                    start = ppkRotate - lookupIndex;
-                    set_pointers(pool, lookupIndex, start, &ppkDead, &dataHead);
+    if (pid < 0)
+        return rdb_error_value (-1, "rdb_checkpoint_bg: fork failed");
+    return pid;
+}
 
-                    rc = 1;
+// Reap the checkpoint child pid. Returns 0 once path is complete, 1 while
+// it is still being written (nohang set), or -1 if the checkpoint failed.
+int rdb_checkpoint_wait (int pid, int nohang)
+{
+    pid_t   rc;
+    int     status;
+
+    do
+        rc = waitpid (pid, &status, nohang ? WNOHANG : 0);
+    while (rc < 0 && errno == EINTR);
+    if (rc == 0)
+        return 1;
+    if (rc < 0 || !WIFEXITED (status) || WEXITSTATUS (status))
+        return rdb_error_code (-1, RDB_E_IO,
+                "rdb_checkpoint_wait: checkpoint failed");
+    return 0;
+}
+#endif
 
-                    goto retest_delete_cond;
+#ifndef KM
+/* Lock-free LIFO (RDB_LOCKFREE)
+ *
+ * A Treiber stack linked through pp[0].right, meant for free lists shared by
+ * worker threads. The head holds the top record pointer in its low bits and
+ * a tag in the high bits, bumped on every push and pop, so a head that
+ * compares equal is guaranteed to be the same stack (ABA protection).
+ *
+ * Like any Treiber stack, pop may read the link of a record another thread
+ * has just popped, so records must stay mapped (not returned to the OS)
+ * while other threads may still pop from the pool.
+ *
+ * With RDB_MAGAZINE, each thread keeps up to RDB_MAG_SIZE records per pool
+ * in a private magazine and moves them to/from the shared stack in batches
+ * of RDB_MAG_SIZE / 2, one CAS per batch. Magazine records are only visible
+ * to their thread; call rdb_lifo_mag_flush() before a thread exits.
+ */
 
-                }
+// pointer bits: 48 on 64 bit (canonical user addresses), 32 on 32 bit.
+#define RDB_LF_PTR_BITS ((sizeof (void *) == 8) ? 48 : 32)
+#define RDB_LF_PTR_MASK ((((uint64_t) 1) << RDB_LF_PTR_BITS) - 1)
 
-                debug("My Bal Before ... and now I'm dead %d\n", 
-                                                        ppkDead->balance);
-                rc = _rdb_delete_by_pointer (pool, (void *) parent, lookupIndex,
-                                                                 ppkDead, side);
-                debug("Delete by Ptr returned %d\n", rc);
-                return (rc);
-            }
-        }
-    }
+typedef struct rdb_magazine_s {
+    rdb_pool_t  *pool;
+    uint64_t    gen;
+    int         count;
+    void        *rec[RDB_MAG_SIZE];
+} rdb_magazine_t;
 
-    return 0;                                // Should never get here
-}   
+static __thread rdb_magazine_t rdb_mag[RDB_MAG_SLOTS];
 
-void   *rdb_delete_const (rdb_pool_t *pool, int idx, __intmax_t value)
+static inline void *_rdb_lf_ptr (uint64_t head)
 {
-    debug("Get:pool=%s,idx=%d", pool->name, idx);
-    return rdb_delete (pool, idx, &value); //, NULL, 0);
+    return (void *) (uintptr_t) (head & RDB_LF_PTR_MASK);
 }
 
-// TODO, make sure rdb_delete works well on trees with both indexed and non-indexed 
-// indexes. ( is that a valid configuration? )
-//
-void   *
-rdb_delete (rdb_pool_t *pool, int lookupIndex, void *data)
+static inline uint64_t _rdb_lf_tag (uint64_t head)
 {
+    return head >> RDB_LF_PTR_BITS;
+}
 
-    int     indexCount;
-    void   *ptr = NULL;                     // NULL to hash the compiler
+static inline uint64_t _rdb_lf_make (void *ptr, uint64_t tag)
+{
+    return ((uint64_t) (uintptr_t) ptr & RDB_LF_PTR_MASK) | 
+                                                    (tag << RDB_LF_PTR_BITS);
+}
 
-    if (pool->FLAGS[lookupIndex] & (RDB_NOKEYS)) {
-        PP_T   *ppk = NULL,
-               *ppkRight = NULL,
-               *ppkLeft = NULL;
-        ptr = pool->root[lookupIndex]; 
-        if (ptr == NULL)
-            return NULL;
+// Push a pre-linked chain (first .. last, linked via pp[0].right) in one CAS
+static void _rdb_lf_push_chain (rdb_pool_t *pool, void *first, void *last)
+{
+    uint64_t    old, new;
+    PP_T        *pp = last;
 
-        for (indexCount = 0; indexCount < pool->indexCount; 
-                                                        indexCount++) {
-            if (pool->FLAGS[indexCount] & (RDB_NOKEYS)) {
-                ppk = ptr + (sizeof (PP_T) * indexCount);
+    old = __atomic_load_n (&pool->lf_head, __ATOMIC_ACQUIRE);
+    do {
+        __atomic_store_n (&pp->right, _rdb_lf_ptr (old), __ATOMIC_RELAXED);
+        new = _rdb_lf_make (first, _rdb_lf_tag (old) + 1);
+    } while (!__atomic_compare_exchange_n (&pool->lf_head, &old, new, 1,
+                __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+}
 
-                if (ppk->left) 
-                    ppkLeft = ppk->left ;//+ indexCount;
-                else ppkLeft = NULL;
+// Pop up to max records in one CAS. popped records are stored in out[],
+// top of stack first. returns number of records popped.
+static int _rdb_lf_pop_chain (rdb_pool_t *pool, void **out, int max)
+{
+    uint64_t    old, new;
+    PP_T        *pp;
+    void        *next;
+    int         cnt;
 
-                if (ppk->right) 
-                    ppkRight = ppk->right ;//+ indexCount;
-                else ppkRight = NULL;
+    old = __atomic_load_n (&pool->lf_head, __ATOMIC_ACQUIRE);
+    do {
+        next = _rdb_lf_ptr (old);
+        for (cnt = 0; cnt < max && next != NULL; cnt++) {
+            out[cnt] = next;
+            pp = next;
+            next = __atomic_load_n (&pp->right, __ATOMIC_RELAXED);
+        }
+        if (cnt == 0)
+            return 0;
+        new = _rdb_lf_make (next, _rdb_lf_tag (old) + 1);
+    } while (!__atomic_compare_exchange_n (&pool->lf_head, &old, new, 1,
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
 
-                if (pool->root[indexCount] == pool->tail[indexCount]) 
-                        pool->root[indexCount] = pool->tail[indexCount] = NULL;
-                        // We were the last item
-                else { 
-                    if (ppkLeft) ppkLeft->right = ppk->right;
+    return cnt;
+}
 
-                    if (ppkRight) ppkRight->left = ppk->left;
+// Take the whole stack, leaving it empty. returns the old top record
+static void *_rdb_lf_detach (rdb_pool_t *pool)
+{
+    uint64_t    old;
 
-                    if (pool->root[indexCount] == ptr) pool->root[indexCount] =
-                                                        ppkRight - indexCount;
+    old = __atomic_load_n (&pool->lf_head, __ATOMIC_ACQUIRE);
+    while (!__atomic_compare_exchange_n (&pool->lf_head, &old,
+                _rdb_lf_make (NULL, _rdb_lf_tag (old) + 1), 1,
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
 
-                    if (pool->tail[indexCount] == ptr) pool->tail[indexCount] =
-                                                        ppkLeft - indexCount;
-                }
-            }
-            else {
-                _rdb_delete (pool, indexCount, ptr, NULL, NULL, 0);
-            }
+    return _rdb_lf_ptr (old);
+}
+
+// Find (or claim) the calling thread's magazine for pool. NULL if all slots
+// are taken by other pools. A slot left by a dropped pool at the same
+// address holds records that are no longer ours, it is forgotten.
+static rdb_magazine_t *_rdb_mag_get (rdb_pool_t *pool)
+{
+    int i;
+    rdb_magazine_t *mag = NULL;
+
+    for (i = 0; i < RDB_MAG_SLOTS; i++) {
+        if (rdb_mag[i].pool == pool) {
+            if (rdb_mag[i].gen == pool->lf_gen)
+                return &rdb_mag[i];
+            rdb_mag[i].count = 0;
         }
+        if (mag == NULL && rdb_mag[i].count == 0)
+            mag = &rdb_mag[i];
     }
-    else if (data) {
-        if ((ptr = _rdb_get (pool, lookupIndex, data, NULL, 0)) != NULL)
-            for (indexCount = 0; indexCount < pool->indexCount; indexCount++) {
-                _rdb_delete (pool, indexCount, ptr, NULL, NULL, 0);
-            }
+    if (mag) {
+        mag->pool = pool;
+        mag->gen = pool->lf_gen;
+    }
+    return mag;
+}
 
-        else
-            debug ("Can't locate delete item\n");
+// Move the oldest cnt records of a magazine to the shared stack
+static void _rdb_mag_spill (rdb_magazine_t *mag, int cnt)
+{
+    PP_T    *pp;
+    int     i;
 
+    if (cnt == 0)
+        return;
+
+    // rec[0] is the oldest, so we link newest-first to keep LIFO order
+    for (i = cnt - 1; i > 0; i--) {
+        pp = mag->rec[i];
+        __atomic_store_n (&pp->right, mag->rec[i - 1], __ATOMIC_RELAXED);
     }
+    _rdb_lf_push_chain (mag->pool, mag->rec[cnt - 1], mag->rec[0]);
+
+    mag->count -= cnt;
+    memmove (&mag->rec[0], &mag->rec[cnt], sizeof (void *) * mag->count);
+}
+
+// Push one record onto an RDB_LOCKFREE pool. no rdb_lock needed.
+// Returns 1 (number of indexes updated), like rdb_insert.
+int rdb_lifo_push (rdb_pool_t *pool, void *data)
+{
+    PP_T            *pp = data;
+    rdb_magazine_t  *mag;
+
+    if (data == NULL)
+        return -1;
+
+    if ((pool->FLAGS[0] & RDB_LOCKFREE) == 0)
+        return rdb_error_value (-1, "rdb_lifo_push on a pool without "
+                "RDB_LOCKFREE");
+
+    pp->left = NULL;
+    pp->balance = 0;
 
 #ifdef RDB_POOL_COUNTERS
-    if (ptr != NULL) pool->record_count--;
+    __atomic_add_fetch (&pool->record_count, 1, __ATOMIC_RELAXED);
+    _rdb_mem_peak (pool);
 #endif
 
-    return ptr;
+    if (pool->FLAGS[0] & RDB_MAGAZINE && (mag = _rdb_mag_get (pool))) {
+        if (mag->count == RDB_MAG_SIZE)
+            _rdb_mag_spill (mag, RDB_MAG_SIZE / 2);
+        mag->rec[mag->count++] = data;
+        return 1;
+    }
+
+    _rdb_lf_push_chain (pool, data, data);
+    return 1;
 }
-int rdb_delete_one (rdb_pool_t *pool, int index, void *data)
+
+// Pop the most recently pushed record, NULL if the pool is empty
+void *rdb_lifo_pop (rdb_pool_t *pool)
 {
-    return _rdb_delete (pool, index, data, NULL, NULL, 0);
-}
+    rdb_magazine_t  *mag;
+    void            *data = NULL;
+    void            *refill[RDB_MAG_SIZE / 2];
+    int             cnt;
 
-// move data (identified by value const, from source tree to destination tree.
-// data is not copied or reallocated, only trees pointers are updated.
-//
-void *rdb_move_const (rdb_pool_t *dst_pool, rdb_pool_t *src_pool, int idx, __intmax_t value) {
-    void *ptr;
-    ptr = rdb_delete (src_pool, idx, &value);
-    if (ptr && rdb_insert (dst_pool, ptr)) return ptr;
-    return NULL;
-}
+    if ((pool->FLAGS[0] & RDB_LOCKFREE) == 0) {
+        rdb_error ("rdb_lifo_pop on a pool without RDB_LOCKFREE");
+        return NULL;
+    }
 
-void *rdb_move (rdb_pool_t *dst_pool, rdb_pool_t *src_pool, int idx, void *data) {
-    void *ptr;
-    ptr = rdb_delete (src_pool, idx, data);
-    if (ptr && rdb_insert (dst_pool, ptr)) return ptr;
-    return 0;
+    if (pool->FLAGS[0] & RDB_MAGAZINE && (mag = _rdb_mag_get (pool))) {
+        if (mag->count == 0) {
+            // refill: half a magazine in one CAS, top of stack is handed out
+            // first so stack order is kept.
+            cnt = _rdb_lf_pop_chain (pool, refill, RDB_MAG_SIZE / 2);
+            while (cnt > 0)
+                mag->rec[mag->count++] = refill[--cnt];
+        }
+        if (mag->count)
+            data = mag->rec[--mag->count];
+    } else {
+        _rdb_lf_pop_chain (pool, &data, 1);
+    }
+
+#ifdef RDB_POOL_COUNTERS
+    if (data)
+        __atomic_sub_fetch (&pool->record_count, 1, __ATOMIC_RELAXED);
+#endif
+    return data;
 }
 
-// same but slower, with mode debug (not returning a pointer to data)
-int rdb_move2 (rdb_pool_t *dst_pool, rdb_pool_t *src_pool, int idx, void *data) {
-    void *ptr;
-    if ((ptr = rdb_delete (src_pool, idx, data))) {
-        if ( dst_pool->indexCount == rdb_insert (dst_pool, ptr)) return 0;
-        return -2;
+// Return the calling thread's magazine records to the shared stack.
+// pool == NULL flushes all of this thread's magazines, the pools they were
+// used with must not have been dropped.
+void rdb_lifo_mag_flush (rdb_pool_t *pool)
+{
+    int i;
+
+    for (i = 0; i < RDB_MAG_SLOTS; i++) {
+        if (rdb_mag[i].pool == NULL || (pool && rdb_mag[i].pool != pool))
+            continue;
+        if (rdb_mag[i].gen == rdb_mag[i].pool->lf_gen)
+            _rdb_mag_spill (&rdb_mag[i], rdb_mag[i].count);
+        rdb_mag[i].count = 0;
+        rdb_mag[i].pool = NULL;
     }
-    return -1;
 }
+#endif
 
 #ifdef KM
 static int __init init (void)
@@ -92,6 +92,11 @@ extern "C" {
 #define RDB_KSIZE_t  (1 << 18)  // Key is an unsigned native (size_t)
 #define RDB_KSSIZE_t (1 << 19)  // Key is a signed natve (ssize_t)
 
+// Concurrency modes
+#define RDB_LOCKFREE (1 << 20)  // RDB_KLIFO only: lock-free stack, no rdb_lock needed
+#define RDB_MAGAZINE (1 << 21)  // RDB_LOCKFREE only: add per-thread record cache
+#define RDB_POOL_THREADSAFE (1 << 22) // pool: public calls lock internally
+
 // special case keys
 #define RDB_KTME	(1 << 25)	// Key is a time_t structure
 #define RDB_KTMA	(1 << 26)	// Key is time_t + 32 bit accomulator for non-unique key simulation
@@ -124,6 +129,12 @@ extern "C" {
 
 #define RDB_POOL_MAX_IDX 24      		// how many indexes we allow on each pool (tree)
 
+// rdb_wal_open flags
+#define RDB_WAL_SYNC        1           // every logged operation waits for disk
+
+#define RDB_MAG_SIZE    32              // records per thread magazine (RDB_MAGAZINE)
+#define RDB_MAG_SLOTS   4               // pools a thread may cache for at once
+
 #ifdef USE_128_BIT_TYPES
 #define __intmax_t __int128_t
 #define __uintmax_t __uint128_t
@@ -194,6 +205,100 @@ typedef struct balanced_pointer_pack_s {
     int	balance;	// rDB uses to keep track of AVL tree balance
 } rdb_bpp_t;
 
+// Per index counters (RDB_POOL_STATS) and shape, see rdb_pool_stats()
+typedef struct rdb_idx_stats_s {
+    uint64_t    inserts;
+    uint64_t    gets;           // lookups: rdb_get*, rdb_get_neigh
+    uint64_t    misses;         // lookups, delete lookups included, not found
+    uint64_t    deletes;
+    uint64_t    compares;       // key compare calls, all operations
+    uint64_t    rotations;      // AVL rebalancing rotations
+    uint64_t    restarts;       // rdb_iterate passes resumed after a delete
+    uint32_t    max_depth;      // tree height, 0 for lists
+    double      avg_depth;      // mean node depth, root is 1
+} rdb_idx_stats_t;
+
+typedef struct rdb_pool_stats_s {
+    uint32_t        record_count;   // with RDB_POOL_COUNTERS
+    int             indexCount;
+    rdb_idx_stats_t idx[RDB_POOL_MAX_IDX];
+} rdb_pool_stats_t;
+
+// Shape of one index, see rdb_analyze()
+#define RDB_ANALYZE_LEVELS  64
+
+typedef struct rdb_analyze_s {
+    uint64_t    nodes;
+    uint32_t    height;         // levels, root is 1, 0 for lists
+    uint32_t    min_height;     // of a perfectly balanced tree this size
+    uint64_t    level[RDB_ANALYZE_LEVELS];  // nodes per level, root at 0
+    double      avg_path;       // nodes visited by a lookup that hits
+    double      avg_miss_path;  // and by one that misses
+    uint64_t    balance[3];     // AVL balance -1 (left heavy), 0, +1
+    uint64_t    unbalanced;     // any other balance, 0 unless corrupt
+    uint64_t    links;          // parent / child (list: next) links
+    uint64_t    same_line;      // links within one 64 byte cache line
+    uint64_t    same_page;      // links within one 4k page
+} rdb_analyze_t;
+
+// Memory held by a pool (RDB_POOL_COUNTERS), see rdb_pool_mem()
+typedef struct rdb_pool_mem_s {
+    uint64_t    records;
+    uint64_t    record_bytes;   // records at rdb_pool_record_size(), or 0
+    uint64_t    index_bytes;    // pointer packs (within record_bytes)
+    uint64_t    string_bytes;   // RDB_KPSTR key strings
+    uint64_t    pool_bytes;     // rdb_pool_t, its name and histograms
+    uint64_t    total;
+    uint64_t    peak;           // high-water mark of total less pool_bytes
+} rdb_pool_mem_t;
+
+// rdb_export() formats
+#define RDB_EXPORT_JSON     0
+#define RDB_EXPORT_PROM     1       // Prometheus text exposition format
+
+// rdb_lock() call site statistics, see rdb_lock_stats()
+#define RDB_LOCK_SITES      32
+
+typedef struct rdb_lock_site_s {
+    const char  *site;          // parent given to rdb_lock()
+    uint64_t    acquired;
+    uint64_t    contended;      // found the lock taken
+    uint64_t    wait_ns;        // total, contended acquisitions
+    uint64_t    wait_max_ns;
+    uint64_t    hold_ns;        // total, rdb_lock() to rdb_unlock()
+    uint64_t    hold_max_ns;
+} rdb_lock_site_t;
+
+// Most looked up keys of one index, see rdb_hotkeys()
+#define RDB_HOTKEY_LEN      16
+#define RDB_HOTKEY_MAX      1024    // slots per index
+
+typedef struct rdb_hotkey_s {
+    uint64_t    count;          // sampled lookups, over by at most error
+    uint64_t    error;
+    uint32_t    len;            // key size, strings: strlen + 1
+    unsigned char key[RDB_HOTKEY_LEN]; // strings cut to fit, NUL ended
+} rdb_hotkey_t;
+
+// rdb_latency() operations
+#define RDB_LAT_INSERT      0
+#define RDB_LAT_GET         1       // rdb_get, rdb_get_const, rdb_get_neigh
+#define RDB_LAT_DELETE      2
+#define RDB_LAT_ITERATE     3
+#define RDB_LAT_OPS         4
+
+// Sampled latency of one operation, nanoseconds, lock waits included
+typedef struct rdb_latency_s {
+    uint64_t    count;          // sampled calls
+    uint64_t    p50;
+    uint64_t    p99;
+    uint64_t    p999;
+    uint64_t    max;
+} rdb_latency_t;
+
+// an rDB instance, see rdb_ctx_new()
+typedef struct rdb_ctx_s rdb_ctx_t;
+
 typedef struct RDB_POOLS {
     // pointer to 1st (root) node - new
     rdb_bpp_t  		*root[RDB_POOL_MAX_IDX];
@@ -207,6 +312,11 @@ typedef struct RDB_POOLS {
     // pool chain pointers
     void   			*next; 
     void   			*prev;
+    // registry hash chain, and the name's hash
+    void            *hnext;
+    uint32_t        hash;
+    // the rDB instance (registry) the pool belongs to
+    rdb_ctx_t       *ctx;
 
     // Number of indexs this data poll have
     unsigned char 	indexCount;
@@ -230,17 +340,147 @@ typedef struct RDB_POOLS {
     pthread_mutex_t write_mutex;
     pthread_mutex_t read_mutex;
 #endif
+    // RDB_POOL_THREADSAFE: writers serialize on update_mutex and hold an
+    // index lock only while changing that index. Readers share index locks.
+#ifdef KM
+    struct semaphore    update_mutex;
+    struct rw_semaphore idx_lock[RDB_POOL_MAX_IDX];
+#else
+    pthread_mutex_t     update_mutex;
+    pthread_rwlock_t    idx_lock[RDB_POOL_MAX_IDX];
+#endif
+#ifndef KM
+    // RDB_LOCKFREE stack head. pointer in the low bits, ABA tag on top
+    uint64_t        lf_head;
+    // RDB_MAGAZINE: tells this pool's magazines from a dropped one's
+    uint64_t        lf_gen;
+    // live snapshots, and records / async flushes held back for them
+    int             snap_refs;
+    void            *limbo;
+    void            *snap_jobs;
+    // rdb_mmap_pool: the file mapping, NULL for heap pools
+    void            *mmap;
+    // rdb_wal_open: write-ahead log, NULL if none
+    void            *wal;
+    // rdb_capture_start: operation trace, NULL if none
+    void            *capture;
+#endif
+    // user record size, pointer packs included, see rdb_pool_record_size()
+    size_t          record_size;
     //   rdb_index_data_t**  index_data;             ///< index data master containder - dynamic
 #ifdef RDB_POOL_COUNTERS
     uint32_t        record_count;
+    uint64_t        string_bytes;   // RDB_KPSTR keys of the records held
+    uint64_t        mem_peak;       // high-water mark, see rdb_pool_mem()
+#endif
+#ifdef RDB_POOL_STATS
+    rdb_idx_stats_t stats[RDB_POOL_MAX_IDX];
+    // rdb_latency_enable: histograms, NULL until enabled
+    void            *lat;
+    // rdb_lock_stats_enable: call sites, and the holder's site and start
+    void            *lock_stats;
+    void            *lock_site;
+    uint64_t        lock_t0;
+    // rdb_hotkeys_enable: per index top-K sketches
+    void            *hot[RDB_POOL_MAX_IDX];
 #endif
 }  rdb_pool_t;
 
+// RDB_TRACE events, see rdb_trace_set(). idx is -1 for whole records
+#define RDB_TRACE_INSERT    1
+#define RDB_TRACE_DELETE    2
+#define RDB_TRACE_GET       3       // rec is NULL on a miss
+#define RDB_TRACE_ROTATE    4       // rec is being inserted / deleted
+#define RDB_TRACE_RESTART   5       // rdb_iterate resumes at rec
+#define RDB_TRACE_UNDO      6       // insert rolled back, idx last reached
+
+typedef void (*rdb_trace_fn_t) (int event, rdb_pool_t *pool, int idx,
+                                void *rec, void *arg);
+
+// rdb_capture_start() trace file: the header, then per call an event and
+// its key bytes. Fixed size keys are copied as is, strings with their NUL.
+// ops are RDB_TRACE_INSERT, _DELETE and _GET, or RDB_CAPTURE_ITERATE
+#define RDB_CAPTURE_MAGIC   0x7244426361703031ULL      // "rDBcap01"
+#define RDB_CAPTURE_ITERATE 16
+
+typedef struct rdb_capture_hdr_s {
+    uint64_t    magic;
+    uint32_t    indexCount;
+    uint32_t    pad;
+    uint32_t    FLAGS[RDB_POOL_MAX_IDX];
+    uint32_t    key_offset[RDB_POOL_MAX_IDX];   // from the record start
+    int32_t     key_size[RDB_POOL_MAX_IDX];     // 0 string, -1 not captured
+} rdb_capture_hdr_t;
+
+typedef struct rdb_capture_ev_s {
+    uint64_t    ns;             // since rdb_capture_start()
+    uint32_t    len;            // key bytes that follow
+    int32_t     result;         // insert: indexes linked, get / delete: found
+    uint32_t    op;
+    int32_t     idx;            // -1: a key per captured index follows
+} rdb_capture_ev_t;
+
+// rdb_batch_t operation types
+#define RDB_BATCH_INSERT    1
+#define RDB_BATCH_DELETE    2
+#define RDB_BATCH_MOVE      3
+
+typedef struct rdb_batch_op_s {
+    int             op;     // RDB_BATCH_*
+    int             idx;    // lookup index (delete / move)
+    void            *data;  // record (insert) or lookup key
+    rdb_pool_t      *dst;   // destination pool (move)
+    void            *rec;   // record affected, set by rdb_batch_commit
+} rdb_batch_op_t;
+
+#ifndef KM
+// Per thread reduce context for rdb_iterate_parallel
+typedef struct rdb_reduce_s {
+    void            *(*init) (void *user);      // new thread local context
+    void            (*combine) (void *user, void *local);
+    void            *user;
+} rdb_reduce_t;
+#endif
+
+#ifndef KM
+// Point in time view of a pool, see rdb_snapshot()
+typedef struct rdb_snapshot_s {
+    rdb_pool_t      *pool;
+    int             refs;
+    uint32_t        count;                      // records in index 0
+    uint32_t        len[RDB_POOL_MAX_IDX];      // records per index
+    void            **recs[RDB_POOL_MAX_IDX];   // per index, in index order
+} rdb_snapshot_t;
+#endif
+
+typedef struct rdb_batch_s {
+    rdb_pool_t      *pool;
+    rdb_batch_op_t  *ops;
+    int             count;
+    int             size;
+} rdb_batch_t;
 
-extern char   	*rdb_error_string;
+
+// rdb_errno values, set (per thread) with rdb_error_string
+#define RDB_E_OK            0
+#define RDB_E_ERROR         1       // see rdb_error_string
+#define RDB_E_DUPLICATE     2       // key already in the index
+#define RDB_E_NOMEM         3
+#define RDB_E_NOTFOUND      4
+#define RDB_E_IO            5
+
+#ifdef KM
+extern const char   *rdb_error_string;
+extern int          rdb_errno;
+#else
+extern __thread const char  *rdb_error_string;
+extern __thread int         rdb_errno;
+#endif
 void        rdb_init(void);
 int         rdb_error_value (int rv, char *err);
 void        rdb_error (char *err);
+int         rdb_error_code (int rv, int code, const char *err);
+const char *rdb_strerror (int code);
 rdb_pool_t *rdb_find_pool_by_name (char *poolName);
 rdb_pool_t *rdb_add_pool (char *poolName, int indexCount, int key_offset,
                 int FLAGS, void *compare_fn);
@@ -248,6 +488,12 @@ rdb_pool_t *rdb_register_um_pool (char *poolName,
 	            int idxCount, int key_offset, int FLAGS, void *fn);
 void        rdb_clean(int);
 void        rdb_gc(void);
+rdb_ctx_t  *rdb_ctx_new (void);
+void        rdb_ctx_free (rdb_ctx_t *ctx);
+void        rdb_ctx_gc (rdb_ctx_t *ctx);
+rdb_pool_t *rdb_ctx_register_um_pool (rdb_ctx_t *ctx, char *poolName,
+	            int idxCount, int key_offset, int FLAGS, void *fn);
+rdb_pool_t *rdb_ctx_find_pool_by_name (rdb_ctx_t *ctx, char *poolName);
 int         rdb_register_um_idx (rdb_pool_t *pool, int idx, int key_offset,
                 int FLAGS, void *compare_fn);
 int         rdb_lock(rdb_pool_t *pool, const char *parent); 
@@ -266,9 +512,77 @@ void       *rdb_delete_const (rdb_pool_t *pool, int idx, __intmax_t value);
 void       *rdb_move_const (rdb_pool_t *dst_pool, rdb_pool_t *src_pool, int idx, __intmax_t value);
 void       *rdb_move (rdb_pool_t *dst_pool, rdb_pool_t *src_pool, int idx, void *data);
 int         rdb_move2 (rdb_pool_t *dst_pool, rdb_pool_t *src_pool, int idx, void *data);
+int         rdb_batch_init (rdb_batch_t *batch, rdb_pool_t *pool);
+int         rdb_batch_insert (rdb_batch_t *batch, void *data);
+int         rdb_batch_delete (rdb_batch_t *batch, int idx, void *data);
+int         rdb_batch_move (rdb_batch_t *batch, rdb_pool_t *dst, int idx, void *data);
+int         rdb_batch_commit (rdb_batch_t *batch);
+void        rdb_batch_reset (rdb_batch_t *batch);
+void        rdb_batch_free (rdb_batch_t *batch);
 void        rdb_drop_pool (rdb_pool_t *pool);
 void        rdb_print_pools(void *fp);
 char       *rdb_print_pool_stats (char *buf, int max_len);
+int         rdb_pool_stats (rdb_pool_t *pool, rdb_pool_stats_t *stats);
+int         rdb_analyze (rdb_pool_t *pool, int idx, rdb_analyze_t *report);
+int         rdb_pool_record_size (rdb_pool_t *pool, size_t record_size);
+int         rdb_pool_mem (rdb_pool_t *pool, rdb_pool_mem_t *mem);
+void        rdb_pool_mem_reset_peak (rdb_pool_t *pool);
+long        rdb_export (int format, char *buf, size_t len);
+int         rdb_trace_set (rdb_trace_fn_t fn, void *arg);
+int         rdb_lock_stats_enable (rdb_pool_t *pool);
+int         rdb_lock_stats (rdb_pool_t *pool, rdb_lock_site_t *sites, 
+                                                                int max);
+void        rdb_lock_stats_reset (rdb_pool_t *pool);
+int         rdb_hotkeys_enable (rdb_pool_t *pool, int idx, int k, 
+                                                        uint32_t every);
+void        rdb_hotkeys_disable (rdb_pool_t *pool, int idx);
+int         rdb_hotkeys (rdb_pool_t *pool, int idx, rdb_hotkey_t *keys, 
+                                                int max, uint64_t *seen);
+void        rdb_hotkeys_reset (rdb_pool_t *pool, int idx);
+long        rdb_ctx_export (rdb_ctx_t *ctx, int format, char *buf, 
+                                                                size_t len);
+void        rdb_pool_stats_reset (rdb_pool_t *pool);
+int         rdb_latency_enable (rdb_pool_t *pool, uint32_t every);
+void        rdb_latency_disable (rdb_pool_t *pool);
+int         rdb_latency (rdb_pool_t *pool, int op, rdb_latency_t *out);
+void        rdb_latency_reset (rdb_pool_t *pool);
+
+#ifndef KM
+int         rdb_lifo_push (rdb_pool_t *pool, void *data);
+void       *rdb_lifo_pop (rdb_pool_t *pool);
+void        rdb_lifo_mag_flush (rdb_pool_t *pool);
+int         rdb_insert_bulk (rdb_pool_t *pool, void **recs, int count,
+                int nthreads, unsigned char *failed);
+int         rdb_flush_async (rdb_pool_t *pool, void fn (void *, void *),
+                void *fn_data);
+void        rdb_reclaim_set_rate (long records_per_sec);
+void        rdb_reclaim_wait (void);
+rdb_snapshot_t *rdb_snapshot (rdb_pool_t *pool);
+void        rdb_snapshot_ref (rdb_snapshot_t *snap);
+void        rdb_snapshot_release (rdb_snapshot_t *snap);
+void        rdb_snapshot_retire (rdb_pool_t *pool, void *data);
+void       *rdb_snapshot_get (rdb_snapshot_t *snap, int idx, const void *data);
+uint32_t    rdb_snapshot_iterate (rdb_snapshot_t *snap, int idx,
+                int fn (void *, void *), void *fn_data);
+rdb_pool_t *rdb_mmap_pool (const char *path, char *poolName, int indexCount,
+                int key_offset, int FLAGS, void *compare_fn,
+                size_t record_size, size_t capacity);
+void       *rdb_mmap_alloc (rdb_pool_t *pool);
+void        rdb_mmap_free (rdb_pool_t *pool, void *data);
+int         rdb_mmap_close (rdb_pool_t *pool);
+long        rdb_save (rdb_pool_t *pool, int fd);
+long        rdb_load (rdb_pool_t *pool, int fd);
+long        rdb_wal_open (rdb_pool_t *pool, const char *path, int flags);
+int         rdb_wal_commit (rdb_pool_t *pool);
+int         rdb_wal_truncate (rdb_pool_t *pool);
+int         rdb_wal_close (rdb_pool_t *pool);
+int         rdb_capture_start (rdb_pool_t *pool, const char *path);
+int         rdb_capture_stop (rdb_pool_t *pool);
+int         rdb_checkpoint_bg (rdb_pool_t **pools, const char *path);
+int         rdb_checkpoint_wait (int pid, int nohang);
+long        rdb_iterate_parallel (rdb_pool_t *pool, int idx,
+                int fn (void *, void *), rdb_reduce_t *ctx, int nthreads);
+#endif
 
 //void        _rdb_dump (rdb_pool_t *, int index, void *start);
 void        rdb_dump (rdb_pool_t *pool, int index, char *separator);
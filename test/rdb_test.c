@@ -10,6 +10,9 @@
 #include <pthread.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include "rdb.h"
 
 #ifdef fatal
@@ -736,6 +739,351 @@ static int my_dump_one_stop_at_5(void *ptr){
 	return RDB_CB_OK;
 }
 
+#define LF_THREADS 4
+#define LF_RECORDS 1000
+#define LF_LOOPS 100000
+
+// Each worker pops a few records and pushes them back, many times over.
+// No rdb_lock() is taken, the pool is RDB_LOCKFREE.
+static void *lf_worker(void *arg){
+    rdb_pool_t *pool = arg;
+    void *held[8];
+    int i, j, cnt;
+
+    for (i = 0; i < LF_LOOPS; i++) {
+        cnt = 1 + (i & 7);
+        for (j = 0; j < cnt; j++) {
+            if (NULL == (held[j] = rdb_lifo_pop(pool))) break;
+        }
+        while (j > 0) rdb_lifo_push(pool, held[--j]);
+    }
+    rdb_lifo_mag_flush(pool);
+    return NULL;
+}
+
+static void lf_count(void *data, void *arg){
+    (*(int *) arg)++;
+}
+
+// Returns the number of distinct records left in the pool, -1 on a repeat
+static int lf_drain(rdb_pool_t *pool, test_data_one_t *recs, char *seen){
+    test_data_one_t *p;
+    int cnt = 0;
+
+    memset(seen, 0, LF_RECORDS);
+    while ((p = rdb_lifo_pop(pool)) != NULL) {
+        if (seen[p - recs]++) return -1;
+        cnt++;
+    }
+    return cnt;
+}
+
+#define TS_THREADS 4
+#define TS_RECORDS 1000
+
+typedef struct ts_data_s {
+    rdb_bpp_t   pp[2];
+    uint32_t    id;
+    int32_t     neg;
+} ts_data_t;
+
+// RDB_POOL_THREADSAFE pool - none of the workers below use rdb_lock()
+static void *ts_writer(void *arg){
+    ts_data_t *recs = arg;
+    int i;
+
+    for (i = 0; i < TS_RECORDS; i++) {
+        if (rdb_insert(pool7, &recs[i]) != 2) rdb_fatal("insert failed\n");
+    }
+    for (i = 1; i < TS_RECORDS; i += 2) {
+        if (rdb_delete(pool7, 1, &recs[i].neg) != &recs[i])
+            rdb_fatal("delete failed\n");
+    }
+    return NULL;
+}
+
+static void *ts_reader(void *arg){
+    ts_data_t *p;
+    uint32_t id;
+    int32_t neg;
+    int i;
+
+    for (i = 0; i < TS_RECORDS * TS_THREADS * 4; i++) {
+        id = (i * 7919) % (TS_RECORDS * TS_THREADS);
+        neg = -id;
+        if ((p = rdb_get(pool7, 0, &id)) && p->id != id)
+            rdb_fatal("index 0 mismatch\n");
+        if ((p = rdb_get(pool7, 1, &neg)) && p->neg != neg)
+            rdb_fatal("index 1 mismatch\n");
+    }
+    return NULL;
+}
+
+static int ts_check(void *data, void *arg){
+    ts_data_t *p = data;
+    int64_t *last = arg;
+
+    if (p->id & 1 || (int64_t) p->id <= *last) rdb_fatal("order\n");
+    *last = p->id;
+    return RDB_CB_OK;
+}
+
+static int ts_print(void *data, void *arg){
+    info("%u,", ((ts_data_t *) data)->id);
+    return RDB_CB_OK;
+}
+
+static void batch_dump(void){
+    rdb_iterate(pool8, 0, ts_print, NULL, NULL, NULL);
+    info(" ");
+    rdb_iterate(pool8, 1, ts_print, NULL, NULL, NULL);
+    info(" ");
+    rdb_iterate(pool9, 0, ts_print, NULL, NULL, NULL);
+    info(" %u %u\n", pool8->record_count, pool9->record_count);
+}
+
+#define PAR_RECORDS 100000
+
+typedef struct par_sum_s {
+    uint64_t sum;
+    uint64_t count;
+} par_sum_t;
+
+static void *par_init(void *user){
+    return calloc(1, sizeof(par_sum_t));
+}
+
+static void par_combine(void *user, void *local){
+    par_sum_t *total = user, *part = local;
+
+    total->sum += part->sum;
+    total->count += part->count;
+    free(part);
+}
+
+static int par_add(void *data, void *local){
+    par_sum_t *part = local;
+
+    part->sum += ((ts_data_t *) data)->id;
+    part->count++;
+    return RDB_CB_OK;
+}
+
+static int par_stop(void *data, void *local){
+    return (((ts_data_t *) data)->id == PAR_RECORDS / 2) ? 
+                                            RDB_CB_ABORT : RDB_CB_OK;
+}
+
+static int par_delete(void *data, void *local){
+    return (((ts_data_t *) data)->id == PAR_RECORDS / 2) ? 
+                                            RDB_CB_DELETE_NODE : RDB_CB_OK;
+}
+
+#define BULK_RECORDS 10000
+
+static int bulk_check(void *data, void *arg){
+    int64_t *last = arg;        // last key, count
+    int64_t key = ((ts_data_t *) data)->id;
+
+    if (last[2]) key = ((ts_data_t *) data)->neg;
+    if (last[1] && key <= last[0]) rdb_fatal("order\n");
+    last[0] = key;
+    last[1]++;
+    return RDB_CB_OK;
+}
+
+static void reclaim_count(void *data, void *arg){
+    __atomic_fetch_add((long *) arg, 1, __ATOMIC_RELAXED);
+    free(data);
+}
+
+static int snap_writer_stop;
+
+// keeps deleting and re-inserting records, freeing the deleted ones
+static void *snap_writer(void *arg){
+    ts_data_t *rec;
+    uint32_t key = 0;
+
+    while (!__atomic_load_n(&snap_writer_stop, __ATOMIC_RELAXED)) {
+        if ((rec = rdb_delete(pool14, 0, &key)) != NULL)
+            rdb_snapshot_retire(pool14, rec);
+        rec = calloc(1, sizeof(ts_data_t));
+        rec->id = key;
+        rec->neg = -key;
+        if (rdb_insert(pool14, rec) != 2) free(rec);
+        key = (key + 7) % 1000;
+    }
+    return NULL;
+}
+
+// open the mapped test pool, with its second index
+static rdb_pool_t *mmap_open(const char *path, char *name, size_t size){
+    rdb_pool_t *pool;
+
+    pool = rdb_mmap_pool(path, name, 2, 0, RDB_KUINT32 | RDB_KASC | RDB_BTREE,
+                        NULL, size, 10000);
+    if (pool && rdb_register_um_idx(pool, 1, sizeof(uint32_t),
+                        RDB_KINT32 | RDB_KASC | RDB_BTREE, NULL) != 1)
+        rdb_fatal("FAIL");
+    return pool;
+}
+
+static void mmap_check(rdb_pool_t *pool){
+    int64_t check[3];
+    uint32_t key = 5;
+    ts_data_t *rec;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        memset(check, 0, sizeof(check));
+        check[2] = i;
+        rdb_iterate(pool, i, bulk_check, check, NULL, NULL);
+        info("%ld,", (long) check[1]);
+    }
+    rec = rdb_get(pool, 0, &key);
+    info("%u %s\n", pool->record_count, rec && rec->neg == -5 ? "Ok" : "Fail");
+}
+
+// writers on a logged RDB_WAL_SYNC pool, sharing fdatasync calls
+#define WAL_RECORDS 250
+static void *wal_writer(void *arg){
+    uint32_t base = (uintptr_t) arg, key;
+    ts_data_t *rec;
+    int i;
+
+    for (i = 0; i < WAL_RECORDS; i++) {
+        rec = calloc(1, sizeof(ts_data_t));
+        rec->id = base + i;
+        rec->neg = -rec->id;
+        if (rdb_insert(pool16, rec) != 2) rdb_fatal("insert failed\n");
+    }
+    for (key = base + 1; key < base + WAL_RECORDS; key += 2)
+        free(rdb_delete(pool16, 0, &key));
+    return NULL;
+}
+
+// looks tenant pools up while they are registered and dropped
+#define REG_POOLS 5000
+static int reg_stop;
+static void *reg_reader(void *arg){
+    long *found = arg;
+    char name[32];
+    int i = 0;
+
+    while (!__atomic_load_n(&reg_stop, __ATOMIC_RELAXED)) {
+        snprintf(name, sizeof(name), "tenant_%d", i);
+        // the handle is not ours to use, it may be dropped any time
+        if (rdb_find_pool_by_name(name)) (*found)++;
+        i = (i + 7) % REG_POOLS;
+    }
+    return NULL;
+}
+
+// a service with its own rDB instance, same pool names as the others
+static void *ctx_service(void *arg){
+    rdb_ctx_t *ctx = arg;
+    rdb_pool_t *pool;
+    ts_data_t *rec;
+    char name[32];
+    int i;
+
+    for (i = 0; i < 200; i++) {
+        snprintf(name, sizeof(name), "tenant_%d", i);
+        pool = rdb_ctx_register_um_pool(ctx, name, 1, 0,
+                            RDB_KUINT32 | RDB_KASC | RDB_BTREE, NULL);
+        if (pool == NULL) rdb_fatal("register failed\n");
+        rec = calloc(1, sizeof(ts_data_t));
+        rec->id = i;
+        rdb_insert(pool, rec);
+    }
+    for (i = 0; i < 200; i++) {
+        snprintf(name, sizeof(name), "tenant_%d", i);
+        pool = rdb_ctx_find_pool_by_name(ctx, name);
+        if (pool == NULL || pool->ctx != ctx || 
+                ((ts_data_t *) pool->root[0])->id != (uint32_t) i)
+            rdb_fatal("lookup failed\n");
+        rdb_flush(pool, NULL, NULL);
+        if (i & 1) {
+            pool->drop = 1;
+        }
+    }
+    rdb_ctx_gc(ctx);
+    return NULL;
+}
+
+// every fifth insert is a duplicate, its error stays with this thread
+static void *err_writer(void *arg){
+    ts_data_t *recs = arg;
+    long dup = 0;
+    int i;
+
+    for (i = 0; i < TS_RECORDS; i++) {
+        if (rdb_insert(pool7, &recs[i]) == 2)
+            continue;
+        if (rdb_errno != RDB_E_DUPLICATE || rdb_error_string == NULL)
+            rdb_fatal("wrong error\n");
+        dup++;
+    }
+    return (void *) dup;
+}
+
+// inserts an array of records while the main thread keeps analyzing
+static void *an_writer(void *arg){
+    ts_data_t *recs = arg;
+    int i;
+
+    for (i = 0; i < 1023; i++) {
+        if (rdb_insert(pool7, &recs[i]) != 2) rdb_fatal("insert failed\n");
+    }
+    return NULL;
+}
+
+// RDB_TRACE events seen, by type
+static long tr_events[RDB_TRACE_UNDO + 1];
+
+static void tr_count(int event, rdb_pool_t *pool, int idx, void *rec,
+                                                            void *arg){
+    if (arg != &tr_events || pool != pool16) rdb_fatal("bad event\n");
+    tr_events[event]++;
+}
+
+static int tr_drop_odd(void *data, void *arg){
+    return (((ts_data_t *) data)->id & 1) ? RDB_CB_DELETE_NODE : RDB_CB_OK;
+}
+
+// two call sites taking the same caller side lock
+static void *lk_worker(void *arg){
+    ts_data_t *recs = arg;
+    const char *site = (recs[0].id & 1) ? "lk_odd" : "lk_even";
+    int i;
+
+    for (i = 0; i < 1000; i++) {
+        rdb_lock(pool16, site);
+        if (rdb_insert(pool16, &recs[i]) != 1) rdb_fatal("insert failed\n");
+        rdb_unlock(pool16, site);
+        rdb_lock(pool16, __FUNCTION__);
+        rdb_delete(pool16, 0, &recs[i].id);
+        rdb_unlock(pool16, __FUNCTION__);
+    }
+    return NULL;
+}
+
+// records of test 29 live in an array
+static void cap_keep(void *data, void *arg){
+}
+
+// lookups skewed towards key 5, half of them
+static void *hk_worker(void *arg){
+    uint32_t key;
+    int i;
+
+    for (i = 0; i < 10000; i++) {
+        key = (i & 1) ? 5 : i % 1000;
+        rdb_get(pool16, 0, &key);
+    }
+    return NULL;
+}
+
 int main(int argc, char *argv[]) {
 
     int rc;
@@ -1191,6 +1539,1467 @@ int main(int argc, char *argv[]) {
 
         info("Ok\n");
 
+    } else if (test == 7) {
+
+        // lock-free LIFO pools, with and without per-thread magazines
+        test_data_one_t *recs;
+        pthread_t th[LF_THREADS];
+        char seen[LF_RECORDS];
+        int i, j;
+
+        rdb_init();
+
+        pool5 = rdb_register_um_pool("lf_bad_pool", 1, 0,
+                            RDB_KFIFO | RDB_NO_IDX | RDB_BTREE | RDB_LOCKFREE,
+                            NULL);
+        if (pool5 == NULL) info("%s\n", rdb_error_string);
+
+        pool5 = rdb_register_um_pool("lf_pool", 1, 0,
+                            RDB_KLIFO | RDB_NO_IDX | RDB_BTREE | RDB_LOCKFREE,
+                            NULL);
+        pool6 = rdb_register_um_pool("lf_mag_pool", 1, 0,
+                            RDB_KLIFO | RDB_NO_IDX | RDB_BTREE | RDB_LOCKFREE |
+                            RDB_MAGAZINE, NULL);
+        if (pool5 == NULL || pool6 == NULL) rdb_fatal("FAIL");
+
+        recs = calloc(LF_RECORDS, sizeof(test_data_one_t));
+        if (recs == NULL) rdb_fatal("FAIL");
+        for (i = 0; i < LF_RECORDS; i++) recs[i].ui32 = i;
+
+        // Stack order, through both the native and the generic calls
+        for (i = 1; i <= 5; i++) rdb_insert(pool5, &recs[i]);
+        while ((one_ptd = rdb_delete(pool5, 0, NULL)) != NULL)
+            info("%d,", one_ptd->ui32);
+        info("\n");
+        for (i = 1; i <= 5; i++) rdb_lifo_push(pool6, &recs[i]);
+        while ((one_ptd = rdb_lifo_pop(pool6)) != NULL)
+            info("%d,", one_ptd->ui32);
+        info("\n");
+
+        for (j = 0; j < 2; j++) {
+            rdb_pool_t *pool = j ? pool6 : pool5;
+
+            for (i = 0; i < LF_RECORDS; i++) rdb_lifo_push(pool, &recs[i]);
+            rdb_lifo_mag_flush(pool);
+            for (i = 0; i < LF_THREADS; i++)
+                pthread_create(&th[i], NULL, lf_worker, pool);
+            for (i = 0; i < LF_THREADS; i++)
+                pthread_join(th[i], NULL);
+            i = lf_drain(pool, recs, seen);
+            info("%s %d %u\n", pool->name, i, pool->record_count);
+        }
+
+        // records are part of recs[], count them instead of freeing
+        i = 0;
+        rdb_lifo_push(pool6, &recs[0]);
+        rdb_lifo_push(pool6, &recs[1]);
+        rdb_flush(pool6, lf_count, &i);
+        info("%d %s\n", i, NULL == rdb_lifo_pop(pool6) ? "Ok" : "Fail");
+        free(recs);
+        rdb_clean(0);
+
+    } else if (test == 8) {
+
+        // internally locked pool, concurrent writers and readers
+        ts_data_t *recs;
+        pthread_t th[TS_THREADS * 2];
+        int64_t last = -1;
+        int i;
+
+        rdb_init();
+        pool7 = rdb_register_um_pool("ts_pool", 2, 0,
+                            RDB_KUINT32 | RDB_KASC | RDB_BTREE |
+                            RDB_POOL_THREADSAFE, NULL);
+        if (pool7 == NULL) rdb_fatal("FAIL");
+        if (rdb_register_um_idx(pool7, 1, sizeof(uint32_t),
+                            RDB_KINT32 | RDB_KASC | RDB_BTREE, NULL) != 1)
+            rdb_fatal("FAIL");
+
+        recs = calloc(TS_RECORDS * TS_THREADS, sizeof(ts_data_t));
+        if (recs == NULL) rdb_fatal("FAIL");
+        for (i = 0; i < TS_RECORDS * TS_THREADS; i++) {
+            recs[i].id = i;
+            recs[i].neg = -i;
+        }
+
+        for (i = 0; i < TS_THREADS; i++) {
+            pthread_create(&th[i], NULL, ts_writer, &recs[i * TS_RECORDS]);
+            pthread_create(&th[TS_THREADS + i], NULL, ts_reader, NULL);
+        }
+        for (i = 0; i < TS_THREADS * 2; i++)
+            pthread_join(th[i], NULL);
+
+        rdb_iterate(pool7, 0, ts_check, &last, NULL, NULL);
+        info("%s %u %ld\n", pool7->name, pool7->record_count, (long) last);
+        free(recs);
+        rdb_clean(0);
+
+    } else if (test == 9) {
+
+        // batches: apply in one pass, roll back completely on failure
+        static const int order[] = {5, 2, 7, 0, 3, 6, 1, 4};
+        ts_data_t recs[12];
+        rdb_batch_t batch;
+        uint32_t keys[] = {3, 5, 2, 6, 42};
+        rdb_pool_t *list;
+        int i;
+
+        rdb_init();
+        pool8 = rdb_register_um_pool("batch_pool", 2, 0,
+                            RDB_KUINT32 | RDB_KASC | RDB_BTREE, NULL);
+        pool9 = rdb_register_um_pool("batch_dst", 2, 0,
+                            RDB_KUINT32 | RDB_KASC | RDB_BTREE, NULL);
+        if (pool8 == NULL || pool9 == NULL) rdb_fatal("FAIL");
+        rdb_register_um_idx(pool8, 1, sizeof(uint32_t),
+                            RDB_KINT32 | RDB_KASC | RDB_BTREE, NULL);
+        rdb_register_um_idx(pool9, 1, sizeof(uint32_t),
+                            RDB_KINT32 | RDB_KASC | RDB_BTREE, NULL);
+
+        memset(recs, 0, sizeof(recs));
+        for (i = 0; i < 12; i++) {
+            recs[i].id = (i < 10) ? i : 4;      // 10 and 11 duplicate 4
+            recs[i].neg = -recs[i].id;
+        }
+
+        rdb_batch_init(&batch, pool8);
+        for (i = 0; i < 8; i++) rdb_batch_insert(&batch, &recs[order[i]]);
+        info("%d\n", rdb_batch_commit(&batch));
+        batch_dump();
+
+        rdb_batch_reset(&batch);
+        rdb_batch_delete(&batch, 0, &keys[0]);
+        rdb_batch_move(&batch, pool9, 0, &keys[1]);
+        rdb_batch_insert(&batch, &recs[8]);
+        info("%d\n", rdb_batch_commit(&batch));
+        info("%u %u\n", batch.ops[0].rec == &recs[3], 
+                            batch.ops[1].rec == &recs[5]);
+        batch_dump();
+
+        // duplicate key fails the last operation, everything is undone
+        rdb_batch_reset(&batch);
+        rdb_batch_insert(&batch, &recs[9]);
+        rdb_batch_delete(&batch, 0, &keys[2]);
+        rdb_batch_move(&batch, pool9, 0, &keys[3]);
+        rdb_batch_insert(&batch, &recs[10]);
+        i = rdb_batch_commit(&batch);
+        info("%d %s\n", i, rdb_error_string);
+        batch_dump();
+
+        // missing delete target
+        rdb_batch_reset(&batch);
+        rdb_batch_insert(&batch, &recs[9]);
+        rdb_batch_delete(&batch, 0, &keys[4]);
+        i = rdb_batch_commit(&batch);
+        info("%d %s\n", i, rdb_error_string);
+        batch_dump();
+        rdb_batch_free(&batch);
+
+        // list lookups on an index above 0 walk that index's links
+        list = rdb_register_um_pool("batch_list", 2, 0,
+                            RDB_KUINT32 | RDB_KASC | RDB_BTREE, NULL);
+        if (list == NULL) rdb_fatal("FAIL");
+        rdb_register_um_idx(list, 1, 0, RDB_KFIFO | RDB_NO_IDX | RDB_BTREE,
+                            NULL);
+        memset(recs, 0, sizeof(recs));
+        for (i = 0; i < 4; i++) {
+            recs[i].id = i;
+            rdb_insert(list, &recs[i]);
+        }
+        rdb_batch_init(&batch, list);
+        rdb_batch_delete(&batch, 1, NULL);
+        rdb_batch_delete(&batch, 1, NULL);
+        i = rdb_batch_commit(&batch);
+        info("%d %u %u ", i, batch.ops[0].rec == &recs[0],
+                            batch.ops[1].rec == &recs[1]);
+        rdb_iterate(list, 1, ts_print, NULL, NULL, NULL);
+        info(" %u\n", list->record_count);
+
+        rdb_batch_free(&batch);
+        rdb_clean(0);
+
+    } else if (test == 10) {
+
+        // parallel iteration, per thread sums folded into one
+        ts_data_t *recs;
+        par_sum_t total;
+        rdb_reduce_t ctx = { par_init, par_combine, &total };
+        long visited;
+        int i, t;
+
+        rdb_init();
+        pool10 = rdb_register_um_pool("par_pool", 2, 0,
+                            RDB_KUINT32 | RDB_KASC | RDB_BTREE, NULL);
+        if (pool10 == NULL) rdb_fatal("FAIL");
+        rdb_register_um_idx(pool10, 1, 0, RDB_KFIFO | RDB_NO_IDX | RDB_BTREE,
+                            NULL);
+
+        recs = calloc(PAR_RECORDS, sizeof(ts_data_t));
+        if (recs == NULL) rdb_fatal("FAIL");
+        for (i = 0; i < PAR_RECORDS; i++) {
+            recs[i].id = i;
+            rdb_insert(pool10, &recs[i]);
+        }
+
+        for (t = 1; t <= 8; t *= 2) {
+            memset(&total, 0, sizeof(total));
+            visited = rdb_iterate_parallel(pool10, 0, par_add, &ctx, t);
+            info("%d: %ld %lu %lu\n", t, visited, (unsigned long) total.count,
+                            (unsigned long) total.sum);
+        }
+
+        // list index, walked by the caller
+        memset(&total, 0, sizeof(total));
+        visited = rdb_iterate_parallel(pool10, 1, par_add, &ctx, 4);
+        info("list: %ld %lu\n", visited, (unsigned long) total.sum);
+
+        visited = rdb_iterate_parallel(pool10, 0, par_stop, NULL, 4);
+        info("abort %s\n", (visited > 0 && visited < PAR_RECORDS) ? 
+                            "Ok" : "Fail");
+
+        // callbacks are read only, the error reaches the caller
+        visited = rdb_iterate_parallel(pool10, 0, par_delete, NULL, 4);
+        info("%ld %s\n", visited, rdb_error_string);
+
+        free(recs);
+        rdb_clean(0);
+
+    } else if (test == 11) {
+
+        // bulk ingest, one thread per index
+        ts_data_t *recs;
+        void **ptrs;
+        unsigned char failed[BULK_RECORDS + 2];
+        int64_t check[3];
+        int i, t, rc;
+
+        recs = calloc(BULK_RECORDS + 2, sizeof(ts_data_t));
+        ptrs = calloc(BULK_RECORDS + 2, sizeof(void *));
+        if (recs == NULL || ptrs == NULL) rdb_fatal("FAIL");
+
+        for (t = 0; t <= 2; t++) {
+            rdb_init();
+            pool11 = rdb_register_um_pool("bulk_pool", 2, 0,
+                                RDB_KUINT32 | RDB_KASC | RDB_BTREE, NULL);
+            if (pool11 == NULL) rdb_fatal("FAIL");
+            rdb_register_um_idx(pool11, 1, sizeof(uint32_t),
+                                RDB_KINT32 | RDB_KASC | RDB_BTREE, NULL);
+
+            memset(recs, 0, sizeof(ts_data_t) * (BULK_RECORDS + 2));
+            for (i = 0; i < BULK_RECORDS + 2; i++) {
+                recs[i].id = (i * 7919) % BULK_RECORDS;
+                recs[i].neg = -recs[i].id;
+                ptrs[i] = &recs[i];
+            }
+            // one duplicate per index
+            recs[BULK_RECORDS].id = BULK_RECORDS;
+            recs[BULK_RECORDS + 1].neg = -BULK_RECORDS - 1;
+            recs[BULK_RECORDS + 1].id = 5;
+
+            rc = rdb_insert_bulk(pool11, ptrs, BULK_RECORDS + 2, t, failed);
+            info("%d: %d %u %d %d\n", t, rc, pool11->record_count,
+                                failed[BULK_RECORDS], failed[BULK_RECORDS + 1]);
+            for (i = 0; i < 2; i++) {
+                memset(check, 0, sizeof(check));
+                check[2] = i;
+                rdb_iterate(pool11, i, bulk_check, check, NULL, NULL);
+                info("%ld,", (long) check[1]);
+            }
+            info("\n");
+            rdb_clean(0);
+        }
+
+        // r2 loses index 0 to r1, r3 loses index 1 only to r2
+        rdb_init();
+        pool11 = rdb_register_um_pool("bulk_pool", 2, 0,
+                            RDB_KUINT32 | RDB_KASC | RDB_BTREE, NULL);
+        if (pool11 == NULL) rdb_fatal("FAIL");
+        rdb_register_um_idx(pool11, 1, sizeof(uint32_t),
+                            RDB_KINT32 | RDB_KASC | RDB_BTREE, NULL);
+        memset(recs, 0, sizeof(ts_data_t) * 3);
+        recs[0].id = 1; recs[0].neg = 10;
+        recs[1].id = 1; recs[1].neg = 20;
+        recs[2].id = 2; recs[2].neg = 20;
+        rc = rdb_insert_bulk(pool11, ptrs, 3, 0, failed);
+        t = 20;
+        info("retry: %d %d %d %d %s\n", rc, failed[0], failed[1], failed[2],
+                            rdb_get(pool11, 1, &t) == &recs[2] ? "Ok" : "Fail");
+        rdb_clean(0);
+        free(ptrs);
+        free(recs);
+
+    } else if (test == 12) {
+
+        // background flush, the pool is empty and usable on return
+        ts_data_t *rec;
+        long reclaimed = 0;
+        uint32_t key = 7;
+        int i;
+
+        rdb_init();
+        pool12 = rdb_register_um_pool("async_pool", 2, 0,
+                            RDB_KUINT32 | RDB_KASC | RDB_BTREE, NULL);
+        pool13 = rdb_register_um_pool("async_fifo", 1, 0,
+                            RDB_KFIFO | RDB_NO_IDX | RDB_BTREE, NULL);
+        if (pool12 == NULL || pool13 == NULL) rdb_fatal("FAIL");
+        rdb_register_um_idx(pool12, 1, sizeof(uint32_t),
+                            RDB_KINT32 | RDB_KASC | RDB_BTREE, NULL);
+
+        for (i = 0; i < 10000; i++) {
+            rec = calloc(1, sizeof(ts_data_t));
+            rec->id = i;
+            rec->neg = -i;
+            rdb_insert(pool12, rec);
+            rdb_insert(pool13, calloc(1, sizeof(ts_data_t)));
+        }
+
+        rdb_flush_async(pool12, reclaim_count, &reclaimed);
+        info("%u %s\n", pool12->record_count, 
+                            rdb_get(pool12, 0, &key) ? "Fail" : "Ok");
+        rec = calloc(1, sizeof(ts_data_t));
+        rec->id = key;
+        i = rdb_insert(pool12, rec);
+        info("%d %s\n", i, rdb_get(pool12, 0, &key) == rec ? "Ok" : "Fail");
+
+        // courtesy free, rate limited
+        rdb_reclaim_set_rate(1000000);
+        rdb_flush_async(pool13, NULL, NULL);
+        rdb_flush_async(pool12, reclaim_count, &reclaimed);
+        rdb_reclaim_wait();
+        info("%ld %u %u\n", reclaimed, pool12->record_count, 
+                            pool13->record_count);
+        rdb_clean(0);
+
+    } else if (test == 13) {
+
+        // snapshots stay intact while the pool changes under them
+        rdb_snapshot_t *snap, *snap2;
+        ts_data_t *rec;
+        pthread_t th;
+        int64_t check[3];
+        long reclaimed = 0;
+        uint32_t key;
+        int i;
+
+        rdb_init();
+        pool14 = rdb_register_um_pool("snap_pool", 2, 0,
+                            RDB_KUINT32 | RDB_KASC | RDB_BTREE |
+                            RDB_POOL_THREADSAFE, NULL);
+        if (pool14 == NULL) rdb_fatal("FAIL");
+        rdb_register_um_idx(pool14, 1, sizeof(uint32_t),
+                            RDB_KINT32 | RDB_KASC | RDB_BTREE, NULL);
+        for (i = 0; i < 1000; i++) {
+            rec = calloc(1, sizeof(ts_data_t));
+            rec->id = i;
+            rec->neg = -i;
+            rdb_insert(pool14, rec);
+        }
+
+        snap = rdb_snapshot(pool14);
+        memset(check, 0, sizeof(check));
+        check[2] = 1;
+        for (key = 0; key < 1000; key += 2)
+            rdb_snapshot_retire(pool14, rdb_delete(pool14, 0, &key));
+        key = 10;
+        rec = rdb_snapshot_get(snap, 0, &key);
+        info("%u %u %u %s %s\n", snap->count, pool14->record_count,
+                            rdb_snapshot_iterate(snap, 1, bulk_check, check),
+                            rec && rec->id == 10 ? "Ok" : "Fail",
+                            rdb_get(pool14, 0, &key) ? "Fail" : "Ok");
+        snap2 = rdb_snapshot(pool14);
+        rdb_snapshot_release(snap);
+        memset(check, 0, sizeof(check));
+        rdb_snapshot_iterate(snap2, 0, bulk_check, check);
+        info("%ld %ld\n", (long) check[1], (long) check[0]);
+
+        // an async flush waits for the snapshot
+        rdb_flush_async(pool14, reclaim_count, &reclaimed);
+        rdb_reclaim_wait();
+        memset(check, 0, sizeof(check));
+        rdb_snapshot_iterate(snap2, 0, bulk_check, check);
+        info("%ld %ld %ld\n", reclaimed, (long) check[1], (long) check[0]);
+        rdb_snapshot_release(snap2);
+        rdb_reclaim_wait();
+        info("%ld\n", reclaimed);
+
+        // readers scan snapshots while a writer keeps going
+        for (i = 0; i < 1000; i++) {
+            rec = calloc(1, sizeof(ts_data_t));
+            rec->id = i;
+            rec->neg = -i;
+            rdb_insert(pool14, rec);
+        }
+        pthread_create(&th, NULL, snap_writer, NULL);
+        for (i = 0; i < 200; i++) {
+            snap = rdb_snapshot(pool14);
+            memset(check, 0, sizeof(check));
+            if (rdb_snapshot_iterate(snap, 0, bulk_check, check) != 
+                                                        snap->len[0])
+                rdb_fatal("FAIL");
+            memset(check, 0, sizeof(check));
+            check[2] = 1;
+            if (rdb_snapshot_iterate(snap, 1, bulk_check, check) !=
+                                                        snap->len[0])
+                rdb_fatal("FAIL");
+            rdb_snapshot_release(snap);
+        }
+        __atomic_store_n(&snap_writer_stop, 1, __ATOMIC_RELAXED);
+        pthread_join(th, NULL);
+        info("Ok\n");
+
+        // a re-key waits for the last snapshot
+        rec = calloc(1, sizeof(ts_data_t));
+        rec->id = 5000;
+        rec->neg = -5000;
+        rdb_insert(pool14, rec);
+        snap = rdb_snapshot(pool14);
+        i = rdb_delete_one(pool14, 0, rec);
+        key = 5000;
+        info("%d %s ", i, rdb_snapshot_get(snap, 0, &key) == rec ? 
+                            "Ok" : "Fail");
+        rdb_snapshot_release(snap);
+        rdb_delete_one(pool14, 0, rec);
+        rec->id = 5001;
+        rdb_insert_one(pool14, 0, rec);
+        key = 5001;
+        info("%s\n", rdb_get(pool14, 0, &key) == rec ? "Ok" : "Fail");
+
+        // and outlives its pool
+        snap = rdb_snapshot(pool14);
+        rdb_flush(pool14, NULL, NULL);
+        rdb_clean(0);
+        memset(check, 0, sizeof(check));
+        info("%s\n", rdb_snapshot_iterate(snap, 0, bulk_check, check) ==
+                            snap->len[0] ? "Ok" : "Fail");
+        rdb_snapshot_release(snap);
+
+    } else if (test == 14) {
+
+        // memory mapped pool, reopened in place and at a new address
+        char path[64];
+        ts_data_t *rec;
+        uint64_t base;
+        void *blocker;
+        FILE *fp;
+        uint32_t key;
+        int i;
+
+        snprintf(path, sizeof(path), "/tmp/rdb_test_mmap.%d", (int) getpid());
+        unlink(path);
+        rdb_init();
+
+        pool15 = mmap_open(path, "mmap_pool", sizeof(ts_data_t));
+        if (pool15 == NULL) rdb_fatal("FAIL");
+        for (i = 0; i < 1000; i++) {
+            rec = rdb_mmap_alloc(pool15);
+            rec->id = i;
+            rec->neg = -i;
+            rdb_insert(pool15, rec);
+        }
+        for (key = 1; key < 1000; key += 10)
+            rdb_mmap_free(pool15, rdb_delete(pool15, 0, &key));
+        mmap_check(pool15);
+
+        // a second opener sees a pool that is in use
+        if (mmap_open(path, "mmap_pool2", sizeof(ts_data_t)) == NULL)
+            info("%s\n", rdb_error_string);
+        info("%d\n", rdb_mmap_close(pool15));
+
+        pool15 = mmap_open(path, "mmap_pool", sizeof(ts_data_t));
+        if (pool15 == NULL) rdb_fatal("FAIL");
+        mmap_check(pool15);
+        rdb_mmap_close(pool15);
+
+        // take the saved address, the reopen has to rebase
+        fp = fopen(path, "r");
+        if (fp == NULL || fseek(fp, 16, SEEK_SET) || 
+                fread(&base, sizeof(base), 1, fp) != 1)
+            rdb_fatal("FAIL");
+        fclose(fp);
+        blocker = mmap((void *) (uintptr_t) base, 4096, PROT_READ, 
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+        pool15 = mmap_open(path, "mmap_pool", sizeof(ts_data_t));
+        if (pool15 == NULL) rdb_fatal("FAIL");
+        info("%s ", (uintptr_t) pool15->root[0] < base || 
+                            (uintptr_t) pool15->root[0] > base + (1 << 20) ?
+                            "moved" : "same");
+        mmap_check(pool15);
+        // freed slots are reused before new ones
+        for (key = 1; key < 1000; key += 10) {
+            rec = rdb_mmap_alloc(pool15);
+            rec->id = key;
+            rec->neg = -key;
+            rdb_insert(pool15, rec);
+        }
+        mmap_check(pool15);
+        rdb_mmap_close(pool15);
+        munmap(blocker, 4096);
+
+        if (mmap_open(path, "mmap_pool", sizeof(ts_data_t) + 8) == NULL)
+            info("%s\n", rdb_error_string);
+        pool15 = mmap_open(path, "mmap_pool", sizeof(ts_data_t));
+        mmap_check(pool15);
+        rdb_clean(0);
+
+        // rdb_clean closed the file, it opens clean
+        rdb_init();
+        pool15 = mmap_open(path, "mmap_pool", sizeof(ts_data_t));
+        if (pool15 == NULL) rdb_fatal("FAIL");
+        mmap_check(pool15);
+        rdb_mmap_close(pool15);
+        unlink(path);
+        rdb_clean(0);
+
+    } else if (test == 15) {
+
+        // save a pool and load it back, trees built from the sorted stream
+        ts_data_t *rec;
+        FILE *fp;
+        long rc;
+        uint32_t key;
+        int i, j;
+
+        fp = tmpfile();
+        if (fp == NULL) rdb_fatal("FAIL");
+        rdb_init();
+        pool16 = rdb_register_um_pool("save_pool", 2, 0,
+                            RDB_KUINT32 | RDB_KASC | RDB_BTREE, NULL);
+        rdb_register_um_idx(pool16, 1, sizeof(uint32_t),
+                            RDB_KINT32 | RDB_KASC | RDB_BTREE, NULL);
+        pool15 = rdb_register_um_pool("save_fifo", 1, 0,
+                            RDB_KFIFO | RDB_NO_IDX | RDB_BTREE, NULL);
+        if (pool16 == NULL || pool15 == NULL) rdb_fatal("FAIL");
+        info("%ld\n", rdb_save(pool16, fileno(fp)));
+        rdb_pool_record_size(pool16, sizeof(ts_data_t));
+        rdb_pool_record_size(pool15, sizeof(ts_data_t));
+
+        for (i = 0; i < 5000; i++) {
+            rec = calloc(1, sizeof(ts_data_t));
+            rec->id = (i * 7919) % 5000;
+            rec->neg = -rec->id;
+            rdb_insert(pool16, rec);
+            rec = calloc(1, sizeof(ts_data_t));
+            rec->id = i;
+            rdb_insert(pool15, rec);
+        }
+        info("%ld ", rdb_save(pool16, fileno(fp)));
+        info("%ld\n", rdb_save(pool15, fileno(fp)));
+        rc = rdb_load(pool16, fileno(fp));
+        info("%ld %s\n", rc, rdb_error_string);
+        rdb_flush(pool16, NULL, NULL);
+        rdb_flush(pool15, NULL, NULL);
+
+        lseek(fileno(fp), 0, SEEK_SET);
+        info("%ld\n", rdb_load(pool16, fileno(fp)));
+        info("%ld ", rdb_load(pool16, fileno(fp)));
+        info("%ld ", rdb_load(pool15, fileno(fp)));
+        mmap_check(pool16);
+        // the lists keep their order
+        for (i = 0; i < 3; i++) {
+            rec = rdb_delete(pool15, 0, NULL);
+            info("%u,", rec->id);
+            free(rec);
+        }
+        info(" %u\n", pool15->record_count);
+
+        // built trees take inserts and deletes as usual
+        for (key = 0; key < 5000; key += 2)
+            free(rdb_delete(pool16, 0, &key));
+        for (j = 5000; j < 6000; j++) {
+            rec = calloc(1, sizeof(ts_data_t));
+            rec->id = j;
+            rec->neg = -j;
+            rdb_insert(pool16, rec);
+        }
+        mmap_check(pool16);
+        rdb_flush(pool16, NULL, NULL);
+        rdb_flush(pool15, NULL, NULL);
+        fclose(fp);
+
+        // a stack pops in the same order after a round trip
+        fp = tmpfile();
+        if (fp == NULL) rdb_fatal("FAIL");
+        pool15 = rdb_register_um_pool("save_lifo", 1, 0,
+                            RDB_KLIFO | RDB_NO_IDX | RDB_BTREE, NULL);
+        if (pool15 == NULL) rdb_fatal("FAIL");
+        rdb_pool_record_size(pool15, sizeof(ts_data_t));
+        for (i = 0; i < 5; i++) {
+            rec = calloc(1, sizeof(ts_data_t));
+            rec->id = i;
+            rdb_insert(pool15, rec);
+        }
+        rdb_save(pool15, fileno(fp));
+        rdb_flush(pool15, NULL, NULL);
+        lseek(fileno(fp), 0, SEEK_SET);
+        info("%ld ", rdb_load(pool15, fileno(fp)));
+        while ((rec = rdb_delete(pool15, 0, NULL)) != NULL) {
+            info("%u,", rec->id);
+            free(rec);
+        }
+        info("\n");
+        fclose(fp);
+        rdb_clean(0);
+
+    } else if (test == 16) {
+
+        // write-ahead log: replay into fresh pools, torn tail cut off
+        pthread_t th[4];
+        rdb_batch_t batch;
+        ts_data_t *rec;
+        uint32_t keys[] = {0};
+        int32_t neg = -2;
+        char path[64];
+        struct stat st;
+        off_t size;
+        int64_t last;
+        long rc;
+        int fd, i;
+
+        snprintf(path, sizeof(path), "/tmp/rdb_test_wal.%d", (int) getpid());
+        unlink(path);
+        rdb_init();
+        pool16 = rdb_register_um_pool("wal_pool", 2, 0,
+                            RDB_KUINT32 | RDB_KASC | RDB_BTREE |
+                            RDB_POOL_THREADSAFE, NULL);
+        rdb_register_um_idx(pool16, 1, sizeof(uint32_t),
+                            RDB_KINT32 | RDB_KASC | RDB_BTREE, NULL);
+        for (i = 0; i < 3; i++) {
+            rdb_pool_t *pool = rdb_register_um_pool(i == 0 ? "wal_1" :
+                            i == 1 ? "wal_2" : "wal_3", 2, 0,
+                            RDB_KUINT32 | RDB_KASC | RDB_BTREE, NULL);
+            if (pool == NULL) rdb_fatal("FAIL");
+            rdb_register_um_idx(pool, 1, sizeof(uint32_t),
+                            RDB_KINT32 | RDB_KASC | RDB_BTREE, NULL);
+            rdb_pool_record_size(pool, sizeof(ts_data_t));
+            if (i == 0) pool15 = pool;
+            else if (i == 1) pool14 = pool;
+            else pool13 = pool;
+        }
+        if (pool16 == NULL) rdb_fatal("FAIL");
+        rc = rdb_wal_open(pool16, path, 0);
+        info("%ld %s\n", rc, rdb_error_string);
+        rdb_pool_record_size(pool16, sizeof(ts_data_t));
+        rc = rdb_wal_open(pool16, "/nonexistent/rdb_test.wal", 0);
+        info("%ld %s ", rc, rdb_strerror(rdb_errno));
+        info("%ld\n", rdb_wal_open(pool16, path, RDB_WAL_SYNC));
+
+        // logged and then flushed
+        for (i = 0; i < 100; i++) {
+            rec = calloc(1, sizeof(ts_data_t));
+            rec->id = 10000 + i;
+            rec->neg = -rec->id;
+            rdb_insert(pool16, rec);
+        }
+        rdb_flush(pool16, NULL, NULL);
+        for (i = 0; i < 4; i++)
+            pthread_create(&th[i], NULL, wal_writer,
+                            (void *) (uintptr_t) (i * WAL_RECORDS));
+        for (i = 0; i < 4; i++)
+            pthread_join(th[i], NULL);
+        rdb_batch_init(&batch, pool16);
+        rdb_batch_delete(&batch, 0, &keys[0]);
+        rdb_batch_delete(&batch, 1, &neg);
+        if (rdb_batch_commit(&batch) != 2) rdb_fatal("FAIL");
+        free(batch.ops[0].rec);
+        free(batch.ops[1].rec);
+        rdb_batch_free(&batch);
+        info("%u %d\n", pool16->record_count, rdb_wal_close(pool16));
+
+        // replay into an empty pool
+        info("%ld ", rdb_wal_open(pool15, path, 0));
+        last = -1;
+        rdb_iterate(pool15, 0, ts_check, &last, NULL, NULL);
+        info("%u %ld\n", pool15->record_count, (long) last);
+        rdb_wal_close(pool15);
+
+        // a torn entry at the end is dropped
+        stat(path, &st);
+        size = st.st_size;
+        fd = open(path, O_WRONLY | O_APPEND);
+        if (fd < 0 || write(fd, "\x18\0\0\0garbage", 11) != 11)
+            rdb_fatal("FAIL");
+        close(fd);
+        info("%ld ", rdb_wal_open(pool14, path, 0));
+        stat(path, &st);
+        info("%u %s\n", pool14->record_count, 
+                            st.st_size == size ? "Ok" : "Fail");
+
+        // after a checkpoint the log starts over
+        rdb_wal_truncate(pool14);
+        rec = calloc(1, sizeof(ts_data_t));
+        rec->id = 7;
+        rdb_insert(pool14, rec);
+        rdb_wal_close(pool14);
+        rc = rdb_wal_open(pool13, path, 0);
+        info("%ld %u\n", rc, pool13->record_count);
+        rdb_wal_close(pool13);
+
+        // re-keys through rdb_delete_one / rdb_insert_one replay as well
+        unlink(path);
+        rdb_flush(pool14, NULL, NULL);
+        rdb_flush(pool13, NULL, NULL);
+        rdb_wal_open(pool14, path, 0);
+        for (i = 1; i <= 3; i += 2) {
+            rec = calloc(1, sizeof(ts_data_t));
+            rec->id = i;
+            rec->neg = -i;
+            rdb_insert(pool14, rec);
+            rdb_delete_one(pool14, 0, rec);
+            rec->id = i + 1;
+            rdb_insert_one(pool14, 0, rec);
+        }
+        keys[0] = 2;
+        free(rdb_delete(pool14, 0, &keys[0]));
+        rdb_wal_close(pool14);
+        rc = rdb_wal_open(pool13, path, 0);
+        keys[0] = 4;
+        neg = -3;
+        rec = rdb_get(pool13, 0, &keys[0]);
+        info("%ld %s ", rc, rec && rec->neg == -3 &&
+                            rdb_get(pool13, 1, &neg) == rec ? "Ok" : "Fail");
+        keys[0] = 2;
+        info("%u %s\n", pool13->record_count,
+                            rdb_get(pool13, 0, &keys[0]) ? "Fail" : "Ok");
+        rdb_wal_close(pool13);
+
+        // dropping a pool commits what its log still holds
+        unlink(path);
+        rdb_flush(pool14, NULL, NULL);
+        rdb_flush(pool13, NULL, NULL);
+        rdb_wal_open(pool14, path, 0);
+        rec = calloc(1, sizeof(ts_data_t));
+        rec->id = 9;
+        rdb_insert(pool14, rec);
+        rdb_drop_pool(pool14);
+        free(rec);
+        rc = rdb_wal_open(pool13, path, 0);
+        info("%ld %u\n", rc, pool13->record_count);
+        rdb_wal_close(pool13);
+
+        unlink(path);
+        rdb_flush(pool16, NULL, NULL);
+        rdb_flush(pool15, NULL, NULL);
+        rdb_flush(pool13, NULL, NULL);
+        rdb_clean(0);
+
+    } else if (test == 17) {
+
+        // forked checkpoint: the pools as of the fork, while they change
+        rdb_pool_t *list[3];
+        ts_data_t *rec;
+        uint32_t key;
+        char path[64];
+        long rc;
+        int fd, pid, i;
+
+        snprintf(path, sizeof(path), "/tmp/rdb_test_ckpt.%d", (int) getpid());
+        rdb_init();
+        pool16 = rdb_register_um_pool("ckpt_pool", 2, 0,
+                            RDB_KUINT32 | RDB_KASC | RDB_BTREE |
+                            RDB_POOL_THREADSAFE, NULL);
+        rdb_register_um_idx(pool16, 1, sizeof(uint32_t),
+                            RDB_KINT32 | RDB_KASC | RDB_BTREE, NULL);
+        pool15 = rdb_register_um_pool("ckpt_fifo", 1, 0,
+                            RDB_KFIFO | RDB_NO_IDX | RDB_BTREE, NULL);
+        pool14 = rdb_register_um_pool("ckpt_load", 2, 0,
+                            RDB_KUINT32 | RDB_KASC | RDB_BTREE |
+                            RDB_POOL_THREADSAFE, NULL);
+        rdb_register_um_idx(pool14, 1, sizeof(uint32_t),
+                            RDB_KINT32 | RDB_KASC | RDB_BTREE, NULL);
+        pool13 = rdb_register_um_pool("ckpt_load_fifo", 1, 0,
+                            RDB_KFIFO | RDB_NO_IDX | RDB_BTREE, NULL);
+        if (!pool16 || !pool15 || !pool14 || !pool13) rdb_fatal("FAIL");
+        list[0] = pool16;
+        list[1] = pool15;
+        list[2] = NULL;
+        pid = rdb_checkpoint_bg(list, path);
+        info("%d %s\n", pid, rdb_error_string);
+        rdb_pool_record_size(pool16, sizeof(ts_data_t));
+        rdb_pool_record_size(pool15, sizeof(ts_data_t));
+        rdb_pool_record_size(pool14, sizeof(ts_data_t));
+        rdb_pool_record_size(pool13, sizeof(ts_data_t));
+
+        for (i = 0; i < 3000; i++) {
+            rec = calloc(1, sizeof(ts_data_t));
+            rec->id = i;
+            rec->neg = -i;
+            rdb_insert(pool16, rec);
+        }
+        for (i = 0; i < 100; i++) {
+            rec = calloc(1, sizeof(ts_data_t));
+            rec->id = i;
+            rdb_insert(pool15, rec);
+        }
+        pid = rdb_checkpoint_bg(list, path);
+        if (pid <= 0) rdb_fatal("FAIL");
+        // the parent keeps going
+        for (key = 0; key < 3000; key += 3)
+            free(rdb_delete(pool16, 0, &key));
+        for (i = 3000; i < 4000; i++) {
+            rec = calloc(1, sizeof(ts_data_t));
+            rec->id = i;
+            rec->neg = -i;
+            rdb_insert(pool16, rec);
+        }
+        free(rdb_delete(pool15, 0, NULL));
+        info("%d %u %u\n", rdb_checkpoint_wait(pid, 0), pool16->record_count,
+                            pool15->record_count);
+
+        fd = open(path, O_RDONLY);
+        rc = rdb_load(pool14, fd);
+        info("%ld ", rc);
+        rc = rdb_load(pool13, fd);
+        info("%ld ", rc);
+        close(fd);
+        mmap_check(pool14);
+        rec = rdb_get(pool13, 0, NULL);
+        key = 3;
+        info("%u %s\n", rec ? rec->id : 0,
+            rdb_get(pool14, 0, &key) && !rdb_get(pool16, 0, &key) ? "Ok" : "Fail");
+        unlink(path);
+
+        // failures show up when the child is reaped
+        pid = rdb_checkpoint_bg(list, "/nonexistent/rdb_ckpt");
+        rc = rdb_checkpoint_wait(pid, 0);
+        info("%ld %s\n", rc, rdb_error_string);
+
+        rdb_flush(pool16, NULL, NULL);
+        rdb_flush(pool15, NULL, NULL);
+        rdb_flush(pool14, NULL, NULL);
+        rdb_flush(pool13, NULL, NULL);
+        rdb_clean(0);
+
+    } else if (test == 18) {
+
+        // pool registry: hashed names, lookups racing registration and drop
+        static rdb_pool_t *pools[REG_POOLS];
+        pthread_t th[4];
+        long found[4] = {0};
+        char name[32];
+        int i, n = 0;
+
+        rdb_init();
+        for (i = 0; i < 4; i++)
+            pthread_create(&th[i], NULL, reg_reader, &found[i]);
+        for (i = 0; i < REG_POOLS; i++) {
+            snprintf(name, sizeof(name), "tenant_%d", i);
+            pools[i] = rdb_register_um_pool(name, 1, 0,
+                            RDB_KUINT32 | RDB_KASC | RDB_BTREE, NULL);
+            if (pools[i] == NULL) rdb_fatal("FAIL");
+        }
+        for (i = 0; i < REG_POOLS; i += 2)
+            rdb_drop_pool(pools[i]);
+        __atomic_store_n(&reg_stop, 1, __ATOMIC_RELAXED);
+        for (i = 0; i < 4; i++)
+            pthread_join(th[i], NULL);
+
+        for (i = 0; i < REG_POOLS; i++) {
+            snprintf(name, sizeof(name), "tenant_%d", i);
+            if (rdb_find_pool_by_name(name) == ((i & 1) ? pools[i] : NULL))
+                n++;
+        }
+        info("%d ", n);
+        info("%s ", rdb_register_um_pool("tenant_1", 1, 0,
+                            RDB_KUINT32 | RDB_KASC | RDB_BTREE, NULL) ?
+                            "Fail" : rdb_error_string);
+        pools[0] = rdb_register_um_pool("tenant_0", 1, 0,
+                            RDB_KUINT32 | RDB_KASC | RDB_BTREE, NULL);
+        info("%s\n", pools[0] && rdb_find_pool_by_name("tenant_0") == pools[0]
+                            ? "Ok" : "Fail");
+        rdb_clean(0);
+
+    } else if (test == 19) {
+
+        // independent rDB instances, side by side with the default one
+        rdb_ctx_t *ctx[4];
+        pthread_t th[4];
+        int i, n = 0;
+
+        rdb_init();
+        pool16 = rdb_register_um_pool("tenant_1", 1, 0,
+                            RDB_KUINT32 | RDB_KASC | RDB_BTREE, NULL);
+        for (i = 0; i < 4; i++) {
+            ctx[i] = rdb_ctx_new();
+            if (ctx[i] == NULL) rdb_fatal("FAIL");
+            pthread_create(&th[i], NULL, ctx_service, ctx[i]);
+        }
+        for (i = 0; i < 4; i++)
+            pthread_join(th[i], NULL);
+
+        for (i = 0; i < 4; i++)
+            if (rdb_ctx_find_pool_by_name(ctx[i], "tenant_1") == NULL &&
+                    rdb_ctx_find_pool_by_name(ctx[i], "tenant_2") != NULL)
+                n++;
+        info("%d %s ", n, rdb_find_pool_by_name("tenant_1") == pool16 &&
+                            !rdb_find_pool_by_name("tenant_2") ? "Ok" : "Fail");
+        info("%s\n", rdb_ctx_register_um_pool(ctx[0], "tenant_2", 1, 0,
+                            RDB_KUINT32 | RDB_KASC | RDB_BTREE, NULL) ?
+                            "Fail" : rdb_error_string);
+        for (i = 0; i < 4; i++)
+            rdb_ctx_free(ctx[i]);
+        info("%s\n", rdb_find_pool_by_name("tenant_1") == pool16 ? 
+                            "Ok" : "Fail");
+        rdb_clean(0);
+
+    } else if (test == 20) {
+
+        // errors are per thread codes, reported without locks
+        ts_data_t *recs;
+        pthread_t th[TS_THREADS];
+        void *dup;
+        long total = 0;
+        int i;
+
+        rdb_init();
+        pool7 = rdb_register_um_pool("err_pool", 2, 0,
+                            RDB_KUINT32 | RDB_KASC | RDB_BTREE |
+                            RDB_POOL_THREADSAFE, NULL);
+        rdb_register_um_idx(pool7, 1, sizeof(uint32_t),
+                            RDB_KINT32 | RDB_KASC | RDB_BTREE, NULL);
+        recs = calloc(TS_RECORDS * TS_THREADS, sizeof(ts_data_t));
+        if (pool7 == NULL || recs == NULL) rdb_fatal("FAIL");
+        for (i = 0; i < TS_RECORDS * TS_THREADS; i++) {
+            recs[i].id = (i % 5 == 4) ? i - 1 : i;
+            recs[i].neg = -i;
+        }
+        for (i = 0; i < TS_THREADS; i++)
+            pthread_create(&th[i], NULL, err_writer, &recs[i * TS_RECORDS]);
+        for (i = 0; i < TS_THREADS; i++) {
+            pthread_join(th[i], &dup);
+            total += (long) dup;
+        }
+        info("%ld %u %d %s\n", total, pool7->record_count, rdb_errno,
+                            rdb_strerror(rdb_errno));
+        rdb_insert(pool7, &recs[4]);
+        info("%d %s: %s\n", rdb_errno, rdb_strerror(rdb_errno),
+                            rdb_error_string);
+        free(recs);
+        rdb_clean(0);
+
+    } else if (test == 21) {
+
+        // per index counters and tree shape
+        rdb_pool_stats_t st;
+        ts_data_t *rec;
+        uint32_t key;
+        int32_t neg;
+        int i;
+
+        rdb_init();
+        pool16 = rdb_register_um_pool("stats_pool", 2, 0,
+                            RDB_KUINT32 | RDB_KASC | RDB_BTREE, NULL);
+        rdb_register_um_idx(pool16, 1, sizeof(uint32_t),
+                            RDB_KINT32 | RDB_KASC | RDB_BTREE, NULL);
+        if (pool16 == NULL) rdb_fatal("FAIL");
+        for (i = 0; i < 1023; i++) {
+            rec = calloc(1, sizeof(ts_data_t));
+            rec->id = i;
+            rec->neg = -i;
+            rdb_insert(pool16, rec);
+        }
+        for (key = 0; key < 2000; key += 2)
+            rdb_get(pool16, 0, &key);
+        for (neg = 0; neg > -100; neg--)
+            free(rdb_delete(pool16, 1, &neg));
+        key = 5000;
+        rdb_delete(pool16, 0, &key);
+
+        rdb_pool_stats(pool16, &st);
+        for (i = 0; i < st.indexCount; i++)
+            info("%d: %lu %lu %lu %lu %s %s %u %.2f\n", i,
+                (unsigned long) st.idx[i].inserts,
+                (unsigned long) st.idx[i].gets,
+                (unsigned long) st.idx[i].misses,
+                (unsigned long) st.idx[i].deletes,
+                st.idx[i].compares > st.idx[i].inserts ? "cmp" : "-",
+                st.idx[i].rotations ? "rot" : "-",
+                st.idx[i].max_depth, st.idx[i].avg_depth);
+        rdb_pool_stats_reset(pool16);
+        rdb_pool_stats(pool16, &st);
+        info("%u %lu %lu\n", st.record_count, (unsigned long) st.idx[0].gets,
+                            (unsigned long) st.idx[1].compares);
+        rdb_flush(pool16, NULL, NULL);
+        rdb_clean(0);
+
+    } else if (test == 22) {
+
+        // latency histograms, every call then one in four
+        rdb_latency_t lt;
+        par_sum_t sum = { 0, 0 };
+        ts_data_t *rec;
+        uint32_t key;
+        int i, op;
+
+        rdb_init();
+        pool16 = rdb_register_um_pool("lat_pool", 1, sizeof(rdb_bpp_t),
+                            RDB_KUINT32 | RDB_KASC | RDB_BTREE, NULL);
+        if (pool16 == NULL) rdb_fatal("FAIL");
+        rdb_latency(pool16, RDB_LAT_GET, &lt);
+        info("%lu\n", (unsigned long) lt.count);
+        if (rdb_latency_enable(pool16, 1) == -1) rdb_fatal("FAIL");
+        for (i = 0; i < 1000; i++) {
+            rec = calloc(1, sizeof(ts_data_t));
+            rec->id = i;
+            rdb_insert(pool16, rec);
+        }
+        for (key = 0; key < 1000; key++)
+            rdb_get(pool16, 0, &key);
+        for (key = 0; key < 10; key++)
+            free(rdb_delete(pool16, 0, &key));
+        rdb_iterate(pool16, 0, par_add, &sum, NULL, NULL);
+        for (op = 0; op < RDB_LAT_OPS; op++) {
+            rdb_latency(pool16, op, &lt);
+            info("%lu %s ", (unsigned long) lt.count,
+                    (lt.p50 > 0 && lt.p50 <= lt.p99 && lt.p99 <= lt.p999 &&
+                     lt.p999 <= lt.max) ? "Ok" : "Bad");
+        }
+        rdb_latency_reset(pool16);
+        rdb_latency_enable(pool16, 4);
+        for (key = 0; key < 1000; key++)
+            rdb_get(pool16, 0, &key);
+        rdb_latency_disable(pool16);
+        for (key = 0; key < 1000; key++)
+            rdb_get(pool16, 0, &key);
+        rdb_latency(pool16, RDB_LAT_GET, &lt);
+        info("%lu %lu\n", (unsigned long) lt.count,
+                            (unsigned long) sum.count);
+        rdb_flush(pool16, NULL, NULL);
+        rdb_clean(0);
+
+    } else if (test == 23) {
+
+        // tree shape, measured while a writer is inserting
+        rdb_analyze_t an;
+        ts_data_t *recs;
+        pthread_t th;
+        int i;
+
+        rdb_init();
+        pool7 = rdb_register_um_pool("analyze_pool", 2, 0,
+                            RDB_KUINT32 | RDB_KASC | RDB_BTREE |
+                            RDB_POOL_THREADSAFE, NULL);
+        if (pool7 == NULL) rdb_fatal("FAIL");
+        if (rdb_register_um_idx(pool7, 1, 0,
+                            RDB_KFIFO | RDB_NO_IDX | RDB_BTREE, NULL) != 1)
+            rdb_fatal("FAIL");
+        recs = calloc(1023, sizeof(ts_data_t));
+        if (recs == NULL) rdb_fatal("FAIL");
+        for (i = 0; i < 1023; i++)
+            recs[i].id = i;
+
+        pthread_create(&th, NULL, an_writer, recs);
+        do {
+            if (rdb_analyze(pool7, 0, &an) == -1) rdb_fatal("FAIL");
+            if (an.unbalanced || (an.nodes && an.links != an.nodes - 1))
+                rdb_fatal("torn tree\n");
+        } while (an.nodes < 1023);
+        pthread_join(th, NULL);
+
+        info("%lu %u %u %lu %lu %.2f %.2f %lu %lu %lu %lu %s\n",
+                (unsigned long) an.nodes, an.height, an.min_height,
+                (unsigned long) an.level[0], (unsigned long) an.level[9],
+                an.avg_path, an.avg_miss_path,
+                (unsigned long) an.balance[0], (unsigned long) an.balance[1],
+                (unsigned long) an.balance[2], (unsigned long) an.links,
+                an.same_line <= an.same_page && an.same_page <= an.links ?
+                                                            "Ok" : "Bad");
+        rdb_analyze(pool7, 1, &an);
+        info("%lu %u %lu %s\n", (unsigned long) an.nodes, an.height,
+                (unsigned long) an.links, an.same_page > an.links / 2 ?
+                                                            "Ok" : "Bad");
+        if (rdb_analyze(pool7, 2, &an) != -1) rdb_fatal("FAIL");
+        free(recs);
+        rdb_clean(0);
+
+    } else if (test == 24) {
+
+        // memory accounting, RDB_KPSTR strings included
+        typedef struct {
+            rdb_bpp_t   pp[2];
+            uint32_t    id;
+            char        *name;
+        } mem_data_t;
+        mem_data_t *rec, r;
+        rdb_pool_mem_t mem;
+        char name[16];
+        uint32_t key;
+        int i;
+
+        rdb_init();
+        pool16 = rdb_register_um_pool("mem_pool", 2, 0,
+                            RDB_KUINT32 | RDB_KASC | RDB_BTREE, NULL);
+        if (pool16 == NULL) rdb_fatal("FAIL");
+        rdb_register_um_idx(pool16, 1, (void *) &r.name - (void *) &r.id,
+                            RDB_KPSTR | RDB_KASC | RDB_BTREE, NULL);
+        for (i = 0; i < 100; i++) {
+            rec = calloc(1, sizeof(mem_data_t));
+            rec->id = i;
+            sprintf(name, "n%d", i);
+            rec->name = strdup(name);
+            rdb_insert(pool16, rec);
+        }
+        rdb_pool_mem(pool16, &mem);
+        info("%lu %lu %lu %lu %lu\n", (unsigned long) mem.records,
+                (unsigned long) mem.record_bytes,
+                (unsigned long) mem.index_bytes,
+                (unsigned long) mem.string_bytes,
+                (unsigned long) (mem.total - mem.pool_bytes));
+        rdb_pool_record_size(pool16, sizeof(mem_data_t));
+        for (key = 0; key < 50; key++) {
+            rec = rdb_delete(pool16, 0, &key);
+            free(rec->name);
+            free(rec);
+        }
+        rdb_pool_mem(pool16, &mem);
+        info("%lu %lu %lu %lu %lu\n", (unsigned long) mem.records,
+                (unsigned long) mem.record_bytes,
+                (unsigned long) mem.string_bytes,
+                (unsigned long) (mem.total - mem.pool_bytes),
+                (unsigned long) mem.peak);
+        rdb_pool_mem_reset_peak(pool16);
+        rdb_flush(pool16, NULL, NULL);
+        rdb_pool_mem(pool16, &mem);
+        info("%lu %lu %lu %s\n", (unsigned long) mem.records,
+                (unsigned long) mem.string_bytes, (unsigned long) mem.peak,
+                mem.pool_bytes >= sizeof(rdb_pool_t) ? "Ok" : "Bad");
+
+        // a re-key charges the new string
+        rec = calloc(1, sizeof(mem_data_t));
+        rec->id = 7;
+        rec->name = strdup("ab");
+        rdb_insert(pool16, rec);
+        rdb_delete_one(pool16, 1, rec);
+        free(rec->name);
+        rec->name = strdup("abcdef");
+        rdb_insert_one(pool16, 1, rec);
+        rdb_pool_mem(pool16, &mem);
+        info("%lu ", (unsigned long) mem.string_bytes);
+        key = 7;
+        rec = rdb_delete(pool16, 0, &key);
+        free(rec->name);
+        free(rec);
+        rdb_pool_mem(pool16, &mem);
+        info("%lu\n", (unsigned long) mem.string_bytes);
+        rdb_clean(0);
+
+    } else if (test == 25) {
+
+        // JSON / Prometheus export, scraped while a writer is busy
+        ts_data_t *recs, *rec;
+        pthread_t th;
+        char *buf;
+        long len, n;
+        int i;
+
+        rdb_init();
+        pool7 = rdb_register_um_pool("export_pool", 2, 0,
+                            RDB_KUINT32 | RDB_KASC | RDB_BTREE |
+                            RDB_POOL_THREADSAFE, NULL);
+        pool16 = rdb_register_um_pool("we\"ird", 1, sizeof(rdb_bpp_t),
+                            RDB_KUINT32 | RDB_KASC | RDB_BTREE, NULL);
+        if (pool7 == NULL || pool16 == NULL) rdb_fatal("FAIL");
+        if (rdb_register_um_idx(pool7, 1, 0,
+                            RDB_KFIFO | RDB_NO_IDX | RDB_BTREE, NULL) != 1)
+            rdb_fatal("FAIL");
+        rdb_latency_enable(pool16, 1);
+        for (i = 0; i < 10; i++) {
+            rec = calloc(1, sizeof(ts_data_t));
+            rec->id = i;
+            rdb_insert(pool16, rec);
+        }
+        recs = calloc(1023, sizeof(ts_data_t));
+        if (recs == NULL) rdb_fatal("FAIL");
+        for (i = 0; i < 1023; i++)
+            recs[i].id = i;
+
+        pthread_create(&th, NULL, an_writer, recs);
+        for (i = 0; i < 50; i++) {
+            len = rdb_export(RDB_EXPORT_PROM, NULL, 0);
+            buf = malloc(len + 1);
+            if (rdb_export(RDB_EXPORT_PROM, buf, len + 1) > len + 64)
+                rdb_fatal("FAIL");
+            free(buf);
+        }
+        pthread_join(th, NULL);
+
+        len = rdb_export(RDB_EXPORT_JSON, NULL, 0);
+        buf = malloc(len + 1);
+        n = rdb_export(RDB_EXPORT_JSON, buf, len + 1);
+        info("%s %s %s %s\n", n == len && buf[len] == 0 ? "Ok" : "Bad",
+                strstr(buf, "{\"name\":\"we\\\"ird\",\"indexes\":1,"
+                            "\"records\":10,") ? "Ok" : "Bad",
+                strstr(buf, "\"name\":\"export_pool\",\"indexes\":2,"
+                            "\"records\":1023,") ? "Ok" : "Bad",
+                strstr(buf, "\"latency_ns\":{\"insert\":{\"count\":10,")
+                            ? "Ok" : "Bad");
+        free(buf);
+        buf = malloc(16);
+        info("%s\n", rdb_export(RDB_EXPORT_PROM, buf, 16) > 16 &&
+                strcmp(buf, "# TYPE rdb_pool") == 0 ? "Ok" : "Bad");
+        free(buf);
+        len = rdb_export(RDB_EXPORT_PROM, NULL, 0);
+        buf = malloc(len + 1);
+        rdb_export(RDB_EXPORT_PROM, buf, len + 1);
+        info("%s %s %s\n",
+                strstr(buf, "\nrdb_pool_records{pool=\"export_pool\"} 1023\n")
+                            ? "Ok" : "Bad",
+                strstr(buf, "\nrdb_index_inserts_total{pool=\"we\\\"ird\","
+                            "index=\"0\"} 10\n") ? "Ok" : "Bad",
+                strstr(buf, "\nrdb_latency_nanoseconds_count"
+                            "{pool=\"we\\\"ird\",op=\"insert\"} 10\n") ?
+                            "Ok" : "Bad");
+        free(buf);
+        rdb_flush(pool16, NULL, NULL);
+        free(recs);
+        rdb_clean(0);
+
+    } else if (test == 26) {
+
+        // tracepoint callback
+        ts_data_t *rec;
+        uint32_t key;
+        int32_t neg;
+        int i;
+
+        rdb_init();
+        pool16 = rdb_register_um_pool("trace_pool", 2, 0,
+                            RDB_KUINT32 | RDB_KASC | RDB_BTREE, NULL);
+        rdb_register_um_idx(pool16, 1, sizeof(uint32_t),
+                            RDB_KINT32 | RDB_KASC | RDB_BTREE, NULL);
+        if (pool16 == NULL) rdb_fatal("FAIL");
+        if (rdb_trace_set(tr_count, &tr_events) == -1) rdb_fatal("FAIL");
+        for (i = 0; i < 100; i++) {
+            rec = calloc(1, sizeof(ts_data_t));
+            rec->id = i;
+            rec->neg = -i;
+            rdb_insert(pool16, rec);
+        }
+        rec = calloc(1, sizeof(ts_data_t));
+        rec->id = 1000;                 // index 1 duplicate, undone
+        if (rdb_insert(pool16, rec) != 0) rdb_fatal("FAIL");
+        free(rec);
+        for (key = 90; key < 105; key++)
+            rdb_get(pool16, 0, &key);
+        for (neg = 0; neg > -10; neg--)
+            free(rdb_delete(pool16, 1, &neg));
+        rdb_iterate(pool16, 0, tr_drop_odd, NULL, NULL, NULL);
+        info("%ld %ld %ld %s %s %ld\n", tr_events[RDB_TRACE_INSERT],
+                tr_events[RDB_TRACE_DELETE], tr_events[RDB_TRACE_GET],
+                tr_events[RDB_TRACE_ROTATE] ? "rot" : "-",
+                tr_events[RDB_TRACE_RESTART] ? "restart" : "-",
+                tr_events[RDB_TRACE_UNDO]);
+        rdb_trace_set(NULL, NULL);
+        key = 50;
+        rdb_get(pool16, 0, &key);
+        info("%ld\n", tr_events[RDB_TRACE_GET]);
+        rdb_flush(pool16, NULL, NULL);
+        rdb_clean(0);
+
+    } else if (test == 27) {
+
+        // rdb_lock() statistics per call site
+        rdb_lock_site_t sites[4];
+        ts_data_t *recs;
+        pthread_t th[4];
+        uint64_t acquired = 0, contended = 0;
+        int i, n, ok = 1;
+
+        rdb_init();
+        pool16 = rdb_register_um_pool("lock_pool", 1, sizeof(rdb_bpp_t),
+                            RDB_KUINT32 | RDB_KASC | RDB_BTREE, NULL);
+        if (pool16 == NULL) rdb_fatal("FAIL");
+        rdb_lock(pool16, "before");
+        rdb_unlock(pool16, "before");
+        if (rdb_lock_stats_enable(pool16) == -1) rdb_fatal("FAIL");
+        recs = calloc(4000, sizeof(ts_data_t));
+        for (i = 0; i < 4000; i++)
+            recs[i].id = (i / 1000) | ((i % 1000) << 2);
+        for (i = 0; i < 4; i++)
+            pthread_create(&th[i], NULL, lk_worker, &recs[i * 1000]);
+        for (i = 0; i < 4; i++)
+            pthread_join(th[i], NULL);
+
+        n = rdb_lock_stats(pool16, sites, 4);
+        for (i = 0; i < n; i++) {
+            info("%s %lu\n", sites[i].site, (unsigned long) sites[i].acquired);
+            acquired += sites[i].acquired;
+            contended += sites[i].contended;
+            if (sites[i].wait_max_ns > sites[i].wait_ns ||
+                    sites[i].hold_max_ns > sites[i].hold_ns ||
+                    sites[i].hold_ns == 0 ||
+                    (i && sites[i].wait_ns > sites[i - 1].wait_ns))
+                ok = 0;
+        }
+        info("%d %lu %s %s\n", n, (unsigned long) acquired,
+                contended <= acquired ? "Ok" : "Bad", ok ? "Ok" : "Bad");
+        rdb_lock_stats_reset(pool16);
+        n = rdb_lock_stats(pool16, sites, 1);
+        info("%d %lu\n", n, (unsigned long) sites[0].acquired);
+        free(recs);
+        rdb_clean(0);
+    } else if (test == 28) {
+
+        // hot keys, space-saving sketch over rdb_get / rdb_get_const
+        rdb_hotkey_t hk[4];
+        ts_data_t *recs;
+        pthread_t th[4];
+        uint64_t seen, seen2;
+        uint32_t key, want[3] = { 7, 3, 42 }, hits[3] = { 500, 300, 200 };
+        int i, n, ok = 1;
+
+        rdb_init();
+        pool16 = rdb_register_um_pool("hot_pool", 1, sizeof(rdb_bpp_t),
+                            RDB_KUINT32 | RDB_KASC | RDB_BTREE, NULL);
+        if (pool16 == NULL) rdb_fatal("FAIL");
+        recs = calloc(1000, sizeof(ts_data_t));
+        for (i = 0; i < 1000; i++) {
+            recs[i].id = i;
+            if (rdb_insert(pool16, &recs[i]) != 1) rdb_fatal("FAIL");
+        }
+        if (rdb_hotkeys_enable(pool16, 0, 16, 1) == -1) rdb_fatal("FAIL");
+        for (i = 0; i < 2000; i++) {
+            if (i % 4 == 0) key = 7;
+            else if (i % 20 == 1 || i % 20 == 5 || i % 20 == 9) key = 3;
+            else if (i % 10 == 3) {
+                rdb_get_const(pool16, 0, 42);
+                continue;
+            } else key = 1000 + i;          // misses, each once
+            rdb_get(pool16, 0, &key);
+        }
+        n = rdb_hotkeys(pool16, 0, hk, 3, &seen);
+        for (i = 0; i < n; i++) {
+            memcpy(&key, hk[i].key, sizeof(key));
+            info("%u ", key);
+            if (key != want[i] || hk[i].len != sizeof(key) ||
+                    hk[i].count < hits[i] ||
+                    hk[i].count - hk[i].error > hits[i])
+                ok = 0;
+        }
+        info("%s %lu\n", ok ? "Ok" : "Bad", (unsigned long) seen);
+
+        rdb_hotkeys_reset(pool16, 0);
+        for (i = 0; i < 4; i++)
+            pthread_create(&th[i], NULL, hk_worker, NULL);
+        for (i = 0; i < 4; i++)
+            pthread_join(th[i], NULL);
+        n = rdb_hotkeys(pool16, 0, hk, 1, &seen);
+        memcpy(&key, hk[0].key, sizeof(key));
+        info("%u %s\n", key, 
+                n == 1 && seen > 0 && seen <= 40000 ? "Ok" : "Bad");
+
+        rdb_hotkeys_disable(pool16, 0);
+        rdb_get(pool16, 0, &key);
+        rdb_hotkeys(pool16, 0, hk, 1, &seen2);
+        info("%s %s\n", seen2 == seen ? "Ok" : "Bad",
+                rdb_hotkeys_enable(pool16, 0, 0, 1) == -1 ? "Ok" : "Bad");
+        free(recs);
+        rdb_clean(0);
+
+    } else if (test == 29) {
+
+        // operation capture: every call, its keys and result in the file
+        rdb_capture_hdr_t hdr;
+        rdb_capture_ev_t ev;
+        ts_data_t *recs, dup;
+        char path[64], key[16];
+        long count[RDB_CAPTURE_ITERATE + 1] = { 0 }, bad = 0;
+        FILE *fp;
+        int i;
+
+        snprintf(path, sizeof(path), "/tmp/rdb_test_capture.%d",
+                                                        (int) getpid());
+        rdb_init();
+        pool16 = rdb_register_um_pool("capture_pool", 2, 0,
+                            RDB_KUINT32 | RDB_KASC | RDB_BTREE |
+                            RDB_POOL_THREADSAFE, NULL);
+        rdb_register_um_idx(pool16, 1, sizeof(uint32_t),
+                            RDB_KINT32 | RDB_KASC | RDB_BTREE, NULL);
+        if (rdb_capture_start(pool16, path) == -1) rdb_fatal("FAIL");
+        recs = calloc(100, sizeof(ts_data_t));
+        for (i = 0; i < 100; i++) {
+            recs[i].id = i;
+            recs[i].neg = -i;
+            rdb_insert(pool16, &recs[i]);
+        }
+        memset(&dup, 0, sizeof(dup));
+        dup.id = 20;
+        dup.neg = 1;
+        rdb_insert(pool16, &dup);
+        for (i = 0; i < 50; i++)
+            rdb_get(pool16, 0, &recs[i].id);
+        rdb_get_const(pool16, 1, 1000);
+        for (i = 0; i < 10; i++)
+            rdb_delete(pool16, 1, &recs[i].neg);
+        rdb_iterate(pool16, 0, tr_drop_odd, NULL, cap_keep, NULL);
+        if (rdb_capture_stop(pool16) == -1) rdb_fatal("FAIL");
+        rdb_get(pool16, 0, &recs[20].id);
+
+        fp = fopen(path, "rb");
+        if (fp == NULL || fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+                hdr.magic != RDB_CAPTURE_MAGIC || hdr.indexCount != 2 ||
+                hdr.key_size[0] != 4 || hdr.key_size[1] != 4)
+            rdb_fatal("FAIL");
+        while (fread(&ev, sizeof(ev), 1, fp) == 1) {
+            if (ev.op > RDB_CAPTURE_ITERATE || ev.len > sizeof(key) ||
+                    fread(key, 1, ev.len, fp) != ev.len)
+                rdb_fatal("FAIL");
+            count[ev.op]++;
+            if (ev.len != (ev.idx < 0 ? 8 : ev.op == RDB_CAPTURE_ITERATE ?
+                                                                    0 : 4))
+                bad++;
+            if (ev.op == RDB_TRACE_INSERT &&
+                    ev.result != (memcmp(key, &dup.id, 8) ? 2 : 0))
+                bad++;
+            if (ev.op == RDB_TRACE_GET &&
+                    ev.result != (ev.idx == 0 ? 1 : 0))
+                bad++;
+            if (ev.op == RDB_TRACE_DELETE && ev.result != 1)
+                bad++;
+        }
+        fclose(fp);
+        info("%ld %ld %ld %ld %s\n", count[RDB_TRACE_INSERT],
+                count[RDB_TRACE_GET], count[RDB_TRACE_DELETE],
+                count[RDB_CAPTURE_ITERATE], bad ? "Bad" : "Ok");
+        unlink(path);
+        rdb_iterate(pool16, 0, tr_drop_odd, NULL, cap_keep, NULL);
+        rdb_iterate(pool16, 0, NULL, NULL, cap_keep, NULL);
+        free(recs);
+        rdb_clean(0);
+
+    } else if (test == 30) {
+
+        // a trace for the rdb_replay test, which must get every result again
+        ts_data_t *recs;
+        uint32_t key;
+        int i;
+
+        rdb_init();
+        pool16 = rdb_register_um_pool("replay_pool", 2, 0,
+                            RDB_KUINT32 | RDB_KASC | RDB_BTREE |
+                            RDB_POOL_THREADSAFE, NULL);
+        rdb_register_um_idx(pool16, 1, sizeof(uint32_t),
+                            RDB_KINT32 | RDB_KASC | RDB_BTREE, NULL);
+        if (rdb_capture_start(pool16, "rdb_test_replay.trace") == -1)
+            rdb_fatal("FAIL");
+        recs = calloc(200, sizeof(ts_data_t));
+        for (i = 0; i < 200; i++) {
+            recs[i].id = (i * 37) % 150;            // the last 50 refused
+            recs[i].neg = -i;
+            rdb_insert(pool16, &recs[i]);
+        }
+        for (key = 0; key < 300; key += 3)
+            rdb_get(pool16, 0, &key);
+        for (i = 0; i < 300; i += 7)
+            rdb_get_const(pool16, 1, -i);
+        for (key = 0; key < 300; key += 5)
+            rdb_delete(pool16, 0, &key);
+        rdb_iterate(pool16, 0, tr_drop_odd, NULL, cap_keep, NULL);
+        for (key = 0; key < 150; key++)
+            rdb_get(pool16, 0, &key);
+        info("%d\n", rdb_capture_stop(pool16));
+        rdb_iterate(pool16, 0, NULL, NULL, cap_keep, NULL);
+        free(recs);
+        rdb_clean(0);
+
     }
 
 